@@ -0,0 +1,8 @@
+#version 320 es
+precision lowp float;
+
+/* depth only, color writes are masked off */
+void
+main()
+{
+}
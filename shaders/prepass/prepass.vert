@@ -0,0 +1,21 @@
+#version 320 es
+
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec2 aTex;
+layout (location = 4) in mat4 aModel; /* per instance */
+
+layout (std140) uniform ubProjView
+{
+    mat4 uProj;
+    mat4 uView;
+};
+
+out vec2 vTex;
+invariant gl_Position; /* same expression as the shading pass vertex shader */
+
+void
+main()
+{
+    vTex = aTex;
+    gl_Position = uProj * uView * aModel * vec4(aPos, 1.0);
+}
@@ -0,0 +1,14 @@
+#version 320 es
+precision mediump float;
+
+in vec2 vTex;
+
+uniform sampler2D uDiffuseTex;
+uniform float uAlphaCutoff;
+
+void
+main()
+{
+    if (texture(uDiffuseTex, vTex).a < uAlphaCutoff)
+        discard;
+}
@@ -1,11 +1,10 @@
 #version 320 es
 
 layout (location = 0) in vec3 aPos;
-
-uniform mat4 uModel;
+layout (location = 4) in mat4 aModel; /* per instance */
 
 void
 main()
 {
-    gl_Position = uModel * vec4(aPos, 1.0);
+    gl_Position = aModel * vec4(aPos, 1.0);
 }
@@ -0,0 +1,15 @@
+#version 320 es
+
+layout (location = 0) in vec3 aPos;
+layout (location = 4) in mat4 aModel; /* per instance */
+
+uniform mat4 uShadowMatrix; /* projection * view of the face being rendered */
+
+out vec4 gFragPos; /* same name as geometry shader output, reuses cubeMapDepth.frag */
+
+void
+main()
+{
+    gFragPos = aModel * vec4(aPos, 1.0);
+    gl_Position = uShadowMatrix * gFragPos;
+}
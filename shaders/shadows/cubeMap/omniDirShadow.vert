@@ -1,8 +1,11 @@
 #version 320 es
 
-layout (location = 0) in vec3 aPos;
+layout (location = 0) in vec4 aPos; /* packed: w is tangent handedness, 0 or 1 */
 layout (location = 1) in vec2 aTex;
 layout (location = 2) in vec3 aNorm;
+layout (location = 3) in vec4 aTan; /* packed: octahedral xy */
+layout (location = 4) in mat4 aModel; /* per instance */
+layout (location = 8) in mat3 aNormalMatrix;
 
 layout (std140) uniform ubProjView
 {
@@ -10,29 +13,51 @@ layout (std140) uniform ubProjView
     mat4 uView;
 };
 
-uniform mat4 uModel;
-uniform mat3 uNormalMatrix;
 uniform bool uReverseNorms;
+uniform bool uOctNormals; /* packed vertex format */
 
 out vec2 vTex;
+invariant gl_Position; /* depth has to match prepass.vert bit for bit for the GL_EQUAL pass */
 
 out VOut {
     vec3 fragPos;
     vec3 norm;
     vec2 tex;
+    vec4 tan; /* w is the bitangent sign */
 } vOut;
 
+vec3
+octDecode(vec2 e)
+{
+    vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-v.z, 0.0);
+    v.xy += vec2(v.x >= 0.0 ? -t : t, v.y >= 0.0 ? -t : t);
+    return normalize(v);
+}
+
 void
 main()
 {
-    vOut.fragPos = vec3(uModel * vec4(aPos, 1.0));
+    vOut.fragPos = vec3(aModel * vec4(aPos.xyz, 1.0));
+
+    vec3 norm = uOctNormals ? octDecode(aNorm.xy) : aNorm;
+    vec3 tan = uOctNormals ? octDecode(aTan.xy) : aTan.xyz;
+    float handedness = uOctNormals ? aPos.w * 2.0 - 1.0 : aTan.w;
 
     if (uReverseNorms)
-        vOut.norm = uNormalMatrix * (-1.0 * aNorm);
+        vOut.norm = aNormalMatrix * (-1.0 * norm);
     else
-        vOut.norm = uNormalMatrix * aNorm;
+        vOut.norm = aNormalMatrix * norm;
 
     vOut.tex = aTex;
-    
-    gl_Position = uProj * uView * uModel * vec4(aPos, 1.0);
+
+    /* Tangents lie in the surface and follow the model matrix, only normals take the inverse transpose.
+     * Made orthogonal to the normal again here and once more per fragment. A mirroring transform flips the bitangent. */
+    mat3 model = mat3(aModel);
+    vec3 n = normalize(vOut.norm);
+    vec3 t = model * tan;
+    t = normalize(t - n * dot(n, t));
+    vOut.tan = vec4(t, determinant(model) < 0.0 ? -handedness : handedness);
+
+    gl_Position = uProj * uView * aModel * vec4(aPos.xyz, 1.0);
 }
@@ -0,0 +1,204 @@
+#version 320 es
+precision highp float;
+
+in VOut {
+    vec3 fragPos;
+    vec3 norm;
+    vec2 tex;
+    vec4 tan;
+} vIn;
+
+uniform sampler2D uDiffuseTex;
+uniform sampler2D uNormalMap;
+uniform highp samplerCubeShadow uDepthMap;
+uniform highp samplerBuffer uPointLights; /* 2 texels each: pos, radius | color, atlas slot */
+uniform highp usamplerBuffer uClusterRanges; /* offset, count */
+uniform highp usamplerBuffer uClusterIndices;
+uniform highp sampler2DShadow uShadowAtlas;
+
+uniform vec3 uLightPos;
+uniform vec3 uShadowLightPos; /* where uDepthMap was rendered from, lags uLightPos when reprojecting */
+uniform vec3 uLightColor;
+uniform vec3 uViewPos;
+uniform vec3 uViewDir;
+uniform bool uNormalMapping; /* the material has a normal map */
+
+uniform float uFarPlane;
+uniform int uShadowTaps; /* 1 is a single lookup, poisson disk otherwise */
+uniform int uNPointLights;
+uniform vec3 uClusterParams; /* tiles per pixel xy, 1 / log of the slice ratio */
+uniform vec4 uAtlasLights[16]; /* position the tiles were rendered from, far plane */
+uniform vec4 uAtlasRects[16 * 6]; /* per cube face: offset, size */
+uniform float uAlphaCutoff;
+
+out vec4 outColor;
+
+/* prefixes of 4 and 8 stay spread over the disk */
+const vec2 poissonDisk[16] = vec2[](
+    vec2(-0.94201624, -0.39906216), vec2( 0.94558609, -0.76890725), vec2(-0.09418410, -0.92938870), vec2( 0.34495938,  0.29387760),
+    vec2(-0.91588581,  0.45771432), vec2(-0.81544232, -0.87912464), vec2(-0.38277543,  0.27676845), vec2( 0.97484398,  0.75648379),
+    vec2( 0.44323325, -0.97511554), vec2( 0.53742981, -0.47373420), vec2(-0.26496911, -0.41893023), vec2( 0.79197514,  0.19090188),
+    vec2(-0.24188840,  0.99706507), vec2(-0.81409955,  0.91437590), vec2( 0.19984126,  0.78641367), vec2( 0.14383161, -0.14100790)
+);
+
+/* same as lights.hh */
+const int TILES_X = 16;
+const int TILES_Y = 9;
+const int SLICES = 24;
+const float SLICE_NEAR = 0.5;
+
+/* same as shadows.hh */
+const float ATLAS_SIZE = 4096.0;
+
+/* right and up of each cubeMapProjections face, ndc is (dot(d, right), dot(d, up)) / major axis */
+const vec3 FACE_RIGHT[6] = vec3[](
+    vec3(0.0, 0.0, -1.0), vec3(0.0, 0.0, 1.0), vec3(1.0, 0.0, 0.0), vec3(1.0, 0.0, 0.0), vec3(1.0, 0.0, 0.0), vec3(-1.0, 0.0, 0.0)
+);
+const vec3 FACE_UP[6] = vec3[](
+    vec3(0.0, -1.0, 0.0), vec3(0.0, -1.0, 0.0), vec3(0.0, 0.0, 1.0), vec3(0.0, 0.0, -1.0), vec3(0.0, -1.0, 0.0), vec3(0.0, -1.0, 0.0)
+);
+
+/* 1.0 is lit, single hardware compared lookup inside the face's tile */
+float
+atlasShadow(int slot, vec3 fragPos)
+{
+    vec4 light = uAtlasLights[slot];
+    vec3 d = fragPos - light.xyz;
+    vec3 a = abs(d);
+
+    int face;
+    float major;
+    if (a.x >= a.y && a.x >= a.z)
+    {
+        face = d.x > 0.0 ? 0 : 1;
+        major = a.x;
+    }
+    else if (a.y >= a.z)
+    {
+        face = d.y > 0.0 ? 2 : 3;
+        major = a.y;
+    }
+    else
+    {
+        face = d.z > 0.0 ? 4 : 5;
+        major = a.z;
+    }
+
+    vec4 rect = uAtlasRects[slot*6 + face];
+    vec2 ndc = vec2(dot(d, FACE_RIGHT[face]), dot(d, FACE_UP[face])) / major;
+    /* keep the 2x2 footprint off the neighbouring tiles */
+    float texel = 1.0 / ATLAS_SIZE;
+    vec2 uv = clamp(rect.xy + (ndc*0.5 + 0.5) * rect.z, rect.xy + texel, rect.xy + rect.z - texel);
+
+    /* small tiles have big texels */
+    float dist = length(d);
+    float bias = 0.02 + dist * 2.0 / (rect.z * ATLAS_SIZE);
+
+    return texture(uShadowAtlas, vec3(uv, (dist - bias) / light.w));
+}
+
+/* point lights of this fragment's cluster, the ones with an atlas slot are shadowed */
+vec3
+pointLighting(vec3 fragPos, vec3 normal, vec3 viewDir)
+{
+    if (uNPointLights == 0)
+        return vec3(0.0);
+
+    float viewZ = dot(fragPos - uViewPos, uViewDir);
+    int slice = viewZ < SLICE_NEAR ? 0 : min(int(log(viewZ / SLICE_NEAR) * uClusterParams.z) + 1, SLICES - 1);
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * uClusterParams.xy), ivec2(TILES_X - 1, TILES_Y - 1));
+    int cluster = slice*TILES_X*TILES_Y + tile.y*TILES_X + tile.x;
+
+    uvec2 range = texelFetch(uClusterRanges, cluster).xy;
+
+    vec3 sum = vec3(0.0);
+    for (uint i = range.x; i < range.x + range.y; i++)
+    {
+        int l = int(texelFetch(uClusterIndices, int(i)).x);
+        vec4 posRadius = texelFetch(uPointLights, l*2);
+        vec4 colorSlot = texelFetch(uPointLights, l*2 + 1);
+
+        vec3 toLight = posRadius.xyz - fragPos;
+        float d = length(toLight);
+        /* windowed inverse square, reaches 0 at the radius */
+        float w = clamp(1.0 - (d*d) / (posRadius.w*posRadius.w), 0.0, 1.0);
+        float atten = (w*w) / (1.0 + d*d);
+        if (atten <= 0.0)
+            continue;
+
+        if (colorSlot.a >= 0.0)
+            atten *= atlasShadow(int(colorSlot.a), fragPos);
+
+        vec3 lightDir = toLight / max(d, 0.0001);
+        float diff = max(dot(lightDir, normal), 0.0);
+        float spec = pow(max(dot(normal, normalize(lightDir + viewDir)), 0.0), 64.0);
+        sum += (diff + spec) * atten * colorSlot.rgb;
+    }
+
+    return sum;
+}
+
+float
+shadowCalculation(vec3 fragPos)
+{
+    vec3 fragToLight = fragPos - uShadowLightPos;
+    float bias = 0.02;
+    /* the map holds distance / uFarPlane, the hardware compares against the 4th coordinate */
+    float ref = (length(fragToLight) - bias) / uFarPlane;
+
+    if (uShadowTaps <= 1)
+        return 1.0 - texture(uDepthMap, vec4(fragToLight, ref));
+
+    float viewDist = length(uViewPos - fragPos);
+    float diskRadius = (1.0 + (viewDist / uFarPlane)) * 0.10;
+
+    /* disk perpendicular to the lookup direction */
+    vec3 n = normalize(fragToLight);
+    vec3 t = normalize(cross(n, abs(n.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0)));
+    vec3 b = cross(n, t);
+
+    float lit = 0.0;
+    for (int i = 0; i < uShadowTaps; i++)
+    {
+        vec2 o = poissonDisk[i] * diskRadius;
+        lit += texture(uDepthMap, vec4(fragToLight + t*o.x + b*o.y, ref));
+    }
+
+    return 1.0 - lit / float(uShadowTaps);
+}
+
+void
+main()
+{
+    vec4 color = texture(uDiffuseTex, vIn.tex);
+    /* before any shading */
+    if (color.a < uAlphaCutoff)
+        discard;
+
+    vec3 normal = normalize(vIn.norm);
+    if (uNormalMapping)
+    {
+        vec3 t = normalize(vIn.tan.xyz - normal * dot(normal, vIn.tan.xyz));
+        vec3 b = cross(normal, t) * vIn.tan.w;
+        normal = normalize(mat3(t, b, normal) * (texture(uNormalMap, vIn.tex).rgb * 2.0 - 1.0));
+    }
+    vec3 lightColor = uLightColor;
+    /* ambient */
+    vec3 ambient = 0.55 * color.rgb;
+    /* diffuse */
+    vec3 lightDir = normalize(uLightPos - vIn.fragPos);
+    float diff = max(dot(lightDir, normal), 0.0);
+    vec3 diffuse = diff * lightColor;
+    /* specular */
+    vec3 viewDir = normalize(uViewPos - vIn.fragPos);
+    float spec = 0.0;
+    vec3 halfwayDir = normalize(lightDir + viewDir);
+    spec = pow(max(dot(normal, halfwayDir), 0.0), 64.0);
+    vec3 specular = spec * lightColor;
+    /* calculate shadow */
+    float shadow = shadowCalculation(vIn.fragPos);
+    vec3 points = pointLighting(vIn.fragPos, normal, viewDir);
+    vec3 lighting = (ambient + (1.0 - shadow) * (diffuse + specular) + points) * color.rgb;
+
+    outColor = vec4(lighting, color.a);
+}
@@ -0,0 +1,671 @@
+#include "Bvh.hh"
+#include "DefaultAllocator.hh"
+#include "utils.hh"
+
+#include <emmintrin.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+/* traversal stack on the call stack, deeper trees get one from the heap */
+constexpr u32 BVH_STACK_SIZE = 256;
+
+struct Bin
+{
+    v3 min;
+    v3 max;
+    u32 count;
+};
+
+struct Bins
+{
+    Bin a[3][BVH_BINS];
+};
+
+struct Range
+{
+    u32 first;
+    u32 count;
+};
+
+static inline void
+boxEmpty(v3* pMin, v3* pMax)
+{
+    *pMin = {FLT_MAX, FLT_MAX, FLT_MAX};
+    *pMax = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+}
+
+static inline void
+boxGrow(v3* pMin, v3* pMax, const v3& min, const v3& max)
+{
+    for (u32 i = 0; i < 3; i++)
+    {
+        pMin->e[i] = fminf(pMin->e[i], min.e[i]);
+        pMax->e[i] = fmaxf(pMax->e[i], max.e[i]);
+    }
+}
+
+static inline f32
+halfArea(const v3& min, const v3& max)
+{
+    v3 d = max - min;
+    if (d.x < 0.0f)
+        return 0.0f;
+
+    return d.x*d.y + d.y*d.z + d.z*d.x;
+}
+
+static inline f32
+centroid(const BvhItem& it, u32 axis)
+{
+    return (it.min.e[axis] + it.max.e[axis]) * 0.5f;
+}
+
+static inline u32
+binOf(f32 c, f32 cMin, f32 scale)
+{
+    u32 b = u32((c - cMin) * scale);
+    return b >= BVH_BINS ? BVH_BINS - 1 : b;
+}
+
+static void
+binItems(const BvhItem* aItems, const u32* pIdxs, u32 n, const v3& cMin, const v3& scale, Bins* pBins)
+{
+    for (u32 a = 0; a < 3; a++)
+    {
+        for (u32 b = 0; b < BVH_BINS; b++)
+        {
+            boxEmpty(&pBins->a[a][b].min, &pBins->a[a][b].max);
+            pBins->a[a][b].count = 0;
+        }
+    }
+
+    for (u32 i = 0; i < n; i++)
+    {
+        const BvhItem& it = aItems[pIdxs[i]];
+        for (u32 a = 0; a < 3; a++)
+        {
+            Bin& bin = pBins->a[a][binOf(centroid(it, a), cMin.e[a], scale.e[a])];
+            boxGrow(&bin.min, &bin.max, it.min, it.max);
+            bin.count++;
+        }
+    }
+}
+
+static void
+centroidBounds(const BvhItem* aItems, const u32* pIdxs, u32 n, v3* pMin, v3* pMax)
+{
+    boxEmpty(pMin, pMax);
+    for (u32 i = 0; i < n; i++)
+    {
+        const BvhItem& it = aItems[pIdxs[i]];
+        v3 c = (it.min + it.max) * 0.5f;
+        boxGrow(pMin, pMax, c, c);
+    }
+}
+
+struct BinJob
+{
+    const BvhItem* aItems;
+    const u32* pIdxs;
+    u32 n;
+    v3 cMin; /* out of the first pass, in for the second */
+    v3 cMax;
+    v3 scale;
+    bool bBinning;
+    Bins bins;
+};
+
+static int
+BinSubmit(void* p)
+{
+    auto& j = *(BinJob*)p;
+
+    if (j.bBinning)
+        binItems(j.aItems, j.pIdxs, j.n, j.cMin, j.scale, &j.bins);
+    else centroidBounds(j.aItems, j.pIdxs, j.n, &j.cMin, &j.cMax);
+
+    return 0;
+}
+
+/* centroid bounds and bins of a large range, both passes split into one chunk per worker */
+static void
+binParallel(adt::ThreadPool* pTp, const BvhItem* aItems, const u32* pIdxs, u32 n, v3* pCMin, v3* pCMax, Bins* pBins)
+{
+    u32 nJobs = pTp->_threadCount;
+    u32 perJob = (n + nJobs - 1) / nJobs;
+    BinJob* aJobs = (BinJob*)adt::StdAllocator.alloc(nJobs, sizeof(BinJob));
+    adt::TaskGroup group;
+
+    for (u32 i = 0; i < nJobs; i++)
+    {
+        u32 first = i * perJob < n ? i * perJob : n;
+        aJobs[i].aItems = aItems;
+        aJobs[i].pIdxs = pIdxs + first;
+        aJobs[i].n = n - first < perJob ? n - first : perJob;
+        aJobs[i].bBinning = false;
+        pTp->submit(BinSubmit, &aJobs[i], &group);
+    }
+    pTp->wait(&group);
+
+    boxEmpty(pCMin, pCMax);
+    for (u32 i = 0; i < nJobs; i++)
+        if (aJobs[i].n) boxGrow(pCMin, pCMax, aJobs[i].cMin, aJobs[i].cMax);
+
+    v3 scale;
+    for (u32 a = 0; a < 3; a++)
+    {
+        f32 extent = pCMax->e[a] - pCMin->e[a];
+        scale.e[a] = extent > 0.0f ? f32(BVH_BINS) / extent : 0.0f;
+    }
+
+    for (u32 i = 0; i < nJobs; i++)
+    {
+        aJobs[i].cMin = *pCMin;
+        aJobs[i].scale = scale;
+        aJobs[i].bBinning = true;
+        pTp->submit(BinSubmit, &aJobs[i], &group);
+    }
+    pTp->wait(&group);
+
+    *pBins = aJobs[0].bins;
+    for (u32 i = 1; i < nJobs; i++)
+    {
+        for (u32 a = 0; a < 3; a++)
+        {
+            for (u32 b = 0; b < BVH_BINS; b++)
+            {
+                Bin& dst = pBins->a[a][b];
+                const Bin& src = aJobs[i].bins.a[a][b];
+                boxGrow(&dst.min, &dst.max, src.min, src.max);
+                dst.count += src.count;
+            }
+        }
+    }
+
+    adt::StdAllocator.free(aJobs);
+}
+
+/* cheapest SAH split over all axes, median split if every centroid is in one spot */
+static void
+splitRange(Bvh* pSelf, adt::ThreadPool* pTp, Range r, Range* pLeft, Range* pRight)
+{
+    const BvhItem* aItems = pSelf->_aItems.data();
+    u32* pIdxs = pSelf->_aIdxs.data() + r.first;
+
+    v3 cMin, cMax;
+    Bins bins;
+
+    if (pTp && r.count > BVH_PARALLEL_MIN)
+    {
+        binParallel(pTp, aItems, pIdxs, r.count, &cMin, &cMax, &bins);
+    }
+    else
+    {
+        centroidBounds(aItems, pIdxs, r.count, &cMin, &cMax);
+
+        v3 scale;
+        for (u32 a = 0; a < 3; a++)
+        {
+            f32 extent = cMax.e[a] - cMin.e[a];
+            scale.e[a] = extent > 0.0f ? f32(BVH_BINS) / extent : 0.0f;
+        }
+        binItems(aItems, pIdxs, r.count, cMin, scale, &bins);
+    }
+
+    f32 bestCost = FLT_MAX;
+    u32 bestAxis = 0, bestSplit = 0;
+
+    for (u32 a = 0; a < 3; a++)
+    {
+        if (cMax.e[a] <= cMin.e[a])
+            continue;
+
+        f32 aRightArea[BVH_BINS];
+        u32 aRightCount[BVH_BINS];
+        v3 min, max;
+        boxEmpty(&min, &max);
+        u32 count = 0;
+        for (u32 b = BVH_BINS - 1; b > 0; b--)
+        {
+            boxGrow(&min, &max, bins.a[a][b].min, bins.a[a][b].max);
+            count += bins.a[a][b].count;
+            aRightArea[b] = halfArea(min, max);
+            aRightCount[b] = count;
+        }
+
+        boxEmpty(&min, &max);
+        count = 0;
+        for (u32 s = 1; s < BVH_BINS; s++)
+        {
+            boxGrow(&min, &max, bins.a[a][s - 1].min, bins.a[a][s - 1].max);
+            count += bins.a[a][s - 1].count;
+
+            if (count == 0 || aRightCount[s] == 0)
+                continue;
+
+            f32 cost = f32(count) * halfArea(min, max) + f32(aRightCount[s]) * aRightArea[s];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = a;
+                bestSplit = s;
+            }
+        }
+    }
+
+    u32 mid;
+    if (bestCost == FLT_MAX)
+    {
+        mid = r.count / 2;
+    }
+    else
+    {
+        f32 scale = f32(BVH_BINS) / (cMax.e[bestAxis] - cMin.e[bestAxis]);
+        u32 i = 0, j = r.count;
+        while (i < j)
+        {
+            if (binOf(centroid(aItems[pIdxs[i]], bestAxis), cMin.e[bestAxis], scale) < bestSplit)
+            {
+                i++;
+            }
+            else
+            {
+                u32 tmp = pIdxs[i];
+                pIdxs[i] = pIdxs[--j];
+                pIdxs[j] = tmp;
+            }
+        }
+        mid = i;
+    }
+
+    *pLeft = {r.first, mid};
+    *pRight = {r.first + mid, r.count - mid};
+}
+
+static u32
+buildNode(Bvh* pSelf, adt::ThreadPool* pTp, Range r, u32 depth)
+{
+    u32 iNode = pSelf->_aNodes._size;
+    pSelf->_depth = depth > pSelf->_depth ? depth : pSelf->_depth;
+    {
+        BvhNode n;
+        for (u32 i = 0; i < 4; i++)
+        {
+            n.aMinX[i] = n.aMinY[i] = n.aMinZ[i] = FLT_MAX;
+            n.aMaxX[i] = n.aMaxY[i] = n.aMaxZ[i] = -FLT_MAX;
+            n.aChildren[i] = adt::NPOS;
+            n.aCounts[i] = 0;
+        }
+        pSelf->_aNodes.push(n);
+    }
+
+    /* split the biggest range until there are 4 */
+    Range aRanges[4] {r};
+    u32 nRanges = 1;
+    while (nRanges < 4)
+    {
+        u32 pick = adt::NPOS;
+        for (u32 i = 0; i < nRanges; i++)
+            if (aRanges[i].count > BVH_MAX_LEAF_ITEMS && (pick == adt::NPOS || aRanges[i].count > aRanges[pick].count))
+                pick = i;
+
+        if (pick == adt::NPOS)
+            break;
+
+        splitRange(pSelf, pTp, aRanges[pick], &aRanges[pick], &aRanges[nRanges]);
+        nRanges++;
+    }
+
+    for (u32 i = 0; i < nRanges; i++)
+    {
+        v3 min, max;
+        boxEmpty(&min, &max);
+        for (u32 j = 0; j < aRanges[i].count; j++)
+        {
+            const BvhItem& it = pSelf->_aItems[pSelf->_aIdxs[aRanges[i].first + j]];
+            boxGrow(&min, &max, it.min, it.max);
+        }
+
+        u32 child, count;
+        if (aRanges[i].count <= BVH_MAX_LEAF_ITEMS)
+        {
+            child = aRanges[i].first;
+            count = aRanges[i].count;
+        }
+        else
+        {
+            child = buildNode(pSelf, pTp, aRanges[i], depth + 1);
+            count = 0;
+        }
+
+        /* recursion may have moved the array */
+        BvhNode& n = pSelf->_aNodes[iNode];
+        n.aMinX[i] = min.x, n.aMinY[i] = min.y, n.aMinZ[i] = min.z;
+        n.aMaxX[i] = max.x, n.aMaxY[i] = max.y, n.aMaxZ[i] = max.z;
+        n.aChildren[i] = child;
+        n.aCounts[i] = count;
+    }
+
+    return iNode;
+}
+
+void
+Bvh::build(const BvhItem* pItems, u32 nItems, adt::ThreadPool* pTp)
+{
+    _aNodes._size = 0;
+    _depth = 0;
+    _aItems.resize(nItems);
+    _aIdxs.resize(nItems);
+    memcpy(_aItems.data(), pItems, sizeof(BvhItem) * nItems);
+    for (u32 i = 0; i < nItems; i++)
+        _aIdxs[i] = i;
+
+    if (nItems > 0)
+        buildNode(this, pTp, {0, nItems}, 1);
+}
+
+void
+Bvh::refit()
+{
+    for (u32 i = _aNodes._size; i-- > 0; )
+    {
+        BvhNode& n = _aNodes[i];
+
+        for (u32 c = 0; c < 4; c++)
+        {
+            if (n.aChildren[c] == adt::NPOS)
+                continue;
+
+            v3 min, max;
+            boxEmpty(&min, &max);
+
+            if (n.aCounts[c] > 0)
+            {
+                for (u32 j = 0; j < n.aCounts[c]; j++)
+                {
+                    const BvhItem& it = _aItems[_aIdxs[n.aChildren[c] + j]];
+                    boxGrow(&min, &max, it.min, it.max);
+                }
+            }
+            else
+            {
+                /* children come after their parents, so they are refitted already */
+                const BvhNode& ch = _aNodes[n.aChildren[c]];
+                for (u32 j = 0; j < 4; j++)
+                {
+                    if (ch.aChildren[j] == adt::NPOS)
+                        continue;
+
+                    boxGrow(&min, &max, {ch.aMinX[j], ch.aMinY[j], ch.aMinZ[j]}, {ch.aMaxX[j], ch.aMaxY[j], ch.aMaxZ[j]});
+                }
+            }
+
+            n.aMinX[c] = min.x, n.aMinY[c] = min.y, n.aMinZ[c] = min.z;
+            n.aMaxX[c] = max.x, n.aMaxY[c] = max.y, n.aMaxZ[c] = max.z;
+        }
+    }
+}
+
+static inline f32
+rayAABB(const v3& origin, const v3& invDir, const v3& min, const v3& max, f32 tMax)
+{
+    f32 tNear = 0.0f, tFar = tMax;
+    for (u32 a = 0; a < 3; a++)
+    {
+        f32 t0 = (min.e[a] - origin.e[a]) * invDir.e[a];
+        f32 t1 = (max.e[a] - origin.e[a]) * invDir.e[a];
+        tNear = fmaxf(tNear, fminf(t0, t1));
+        tFar = fminf(tFar, fmaxf(t0, t1));
+    }
+
+    return tNear <= tFar ? tNear : tMax;
+}
+
+/* A walk keeps at most 3 siblings per level waiting while it goes down the fourth, so the depth bounds the stack.
+ * Median splits stay shallow, binned sah can get much deeper on skewed scenes. */
+static u32*
+traversalStack(const Bvh* pSelf, u32* aLocal)
+{
+    u32 size = 3 * pSelf->_depth + 1;
+    return size <= BVH_STACK_SIZE ? aLocal : (u32*)adt::StdAllocator.alloc(size, sizeof(u32));
+}
+
+static void
+freeTraversalStack(u32* aStack, u32* aLocal)
+{
+    if (aStack != aLocal)
+        adt::StdAllocator.free(aStack);
+}
+
+BvhHit
+Bvh::raycast(const v3& origin, const v3& dir, f32 tMax, PfnBvhIntersect pfn, void* pCtx) const
+{
+    BvhHit hit {adt::NPOS, tMax};
+    if (_aNodes._size == 0)
+        return hit;
+
+    /* huge instead of inf so a zero distance doesn't turn into nan */
+    v3 invDir;
+    for (u32 a = 0; a < 3; a++)
+        invDir.e[a] = fabsf(dir.e[a]) > 1e-30f ? 1.0f / dir.e[a] : copysignf(1e30f, dir.e[a]);
+
+    const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+    const __m128 ix = _mm_set1_ps(invDir.x), iy = _mm_set1_ps(invDir.y), iz = _mm_set1_ps(invDir.z);
+
+    u32 aLocal[BVH_STACK_SIZE];
+    u32* aStack = traversalStack(this, aLocal);
+    u32 sp = 0;
+    aStack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        const BvhNode& n = _aNodes[aStack[--sp]];
+
+        __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.aMinX), ox), ix);
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.aMaxX), ox), ix);
+        __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.aMinY), oy), iy);
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.aMaxY), oy), iy);
+        __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.aMinZ), oz), iz);
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.aMaxZ), oz), iz);
+
+        __m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_setzero_ps()));
+        __m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(hit.t)));
+        int mask = _mm_movemask_ps(_mm_cmple_ps(tNear, tFar));
+
+        alignas(16) f32 aNear[4];
+        _mm_store_ps(aNear, tNear);
+
+        /* inner children go on the stack farthest first, leaves are tested right away */
+        u32 aInner[4];
+        u32 nInner = 0;
+        for (u32 c = 0; c < 4; c++)
+        {
+            if (!(mask & (1 << c)) || n.aChildren[c] == adt::NPOS)
+                continue;
+
+            if (n.aCounts[c] > 0)
+            {
+                for (u32 j = 0; j < n.aCounts[c]; j++)
+                {
+                    u32 id = _aIdxs[n.aChildren[c] + j];
+                    const BvhItem& it = _aItems[id];
+                    f32 t = pfn ? pfn(pCtx, id, origin, dir, hit.t) : rayAABB(origin, invDir, it.min, it.max, hit.t);
+                    if (t < hit.t)
+                        hit = {id, t};
+                }
+            }
+            else
+            {
+                u32 k = nInner++;
+                while (k > 0 && aNear[aInner[k - 1]] < aNear[c])
+                {
+                    aInner[k] = aInner[k - 1];
+                    k--;
+                }
+                aInner[k] = c;
+            }
+        }
+
+        for (u32 k = 0; k < nInner; k++)
+            aStack[sp++] = n.aChildren[aInner[k]];
+    }
+
+    freeTraversalStack(aStack, aLocal);
+    return hit;
+}
+
+static void
+pushSubtree(const Bvh* pSelf, u32 iNode, adt::Array<u32>* pOut)
+{
+    const BvhNode& n = pSelf->_aNodes[iNode];
+
+    for (u32 c = 0; c < 4; c++)
+    {
+        if (n.aChildren[c] == adt::NPOS)
+            continue;
+
+        if (n.aCounts[c] > 0)
+        {
+            for (u32 j = 0; j < n.aCounts[c]; j++)
+                pOut->push(pSelf->_aIdxs[n.aChildren[c] + j]);
+        }
+        else pushSubtree(pSelf, n.aChildren[c], pOut);
+    }
+}
+
+void
+Bvh::queryFrustum(const Frustum& f, adt::Array<u32>* pOut) const
+{
+    if (_aNodes._size == 0)
+        return;
+
+    u32 aLocal[BVH_STACK_SIZE];
+    u32* aStack = traversalStack(this, aLocal);
+    u32 sp = 0;
+    aStack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        const BvhNode& n = _aNodes[aStack[--sp]];
+
+        /* farthest corner along the normal decides outside, the nearest one fully inside */
+        __m128 outside = _mm_setzero_ps();
+        __m128 partial = _mm_setzero_ps();
+        for (auto& p : f.planes)
+        {
+            __m128 px = _mm_loadu_ps(p.x > 0.0f ? n.aMaxX : n.aMinX);
+            __m128 py = _mm_loadu_ps(p.y > 0.0f ? n.aMaxY : n.aMinY);
+            __m128 pz = _mm_loadu_ps(p.z > 0.0f ? n.aMaxZ : n.aMinZ);
+            __m128 nx = _mm_loadu_ps(p.x > 0.0f ? n.aMinX : n.aMaxX);
+            __m128 ny = _mm_loadu_ps(p.y > 0.0f ? n.aMinY : n.aMaxY);
+            __m128 nz = _mm_loadu_ps(p.z > 0.0f ? n.aMinZ : n.aMaxZ);
+
+            __m128 a = _mm_set1_ps(p.x), b = _mm_set1_ps(p.y), c = _mm_set1_ps(p.z), d = _mm_set1_ps(p.w);
+            __m128 distFar = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, px), _mm_mul_ps(b, py)), _mm_add_ps(_mm_mul_ps(c, pz), d));
+            __m128 distNear = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, nx), _mm_mul_ps(b, ny)), _mm_add_ps(_mm_mul_ps(c, nz), d));
+
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(distFar, _mm_setzero_ps()));
+            partial = _mm_or_ps(partial, _mm_cmplt_ps(distNear, _mm_setzero_ps()));
+        }
+
+        int outsideMask = _mm_movemask_ps(outside);
+        int partialMask = _mm_movemask_ps(partial);
+
+        for (u32 c = 0; c < 4; c++)
+        {
+            if ((outsideMask & (1 << c)) || n.aChildren[c] == adt::NPOS)
+                continue;
+
+            bool bInside = !(partialMask & (1 << c));
+
+            if (n.aCounts[c] > 0)
+            {
+                for (u32 j = 0; j < n.aCounts[c]; j++)
+                {
+                    u32 id = _aIdxs[n.aChildren[c] + j];
+                    if (bInside || frustumAABB(f, _aItems[id].min, _aItems[id].max))
+                        pOut->push(id);
+                }
+            }
+            else if (bInside)
+            {
+                pushSubtree(this, n.aChildren[c], pOut);
+            }
+            else
+            {
+                aStack[sp++] = n.aChildren[c];
+            }
+        }
+    }
+
+    freeTraversalStack(aStack, aLocal);
+}
+
+void
+Bvh::querySphere(const v3& center, f32 radius, adt::Array<u32>* pOut) const
+{
+    if (_aNodes._size == 0)
+        return;
+
+    const __m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+    const __m128 r2 = _mm_set1_ps(radius * radius);
+    const __m128 zero = _mm_setzero_ps();
+    const f32 radius2 = radius * radius;
+
+    u32 aLocal[BVH_STACK_SIZE];
+    u32* aStack = traversalStack(this, aLocal);
+    u32 sp = 0;
+    aStack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        const BvhNode& n = _aNodes[aStack[--sp]];
+
+        /* distance to the closest point of each box */
+        __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(n.aMinX), cx), _mm_sub_ps(cx, _mm_loadu_ps(n.aMaxX))), zero);
+        __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(n.aMinY), cy), _mm_sub_ps(cy, _mm_loadu_ps(n.aMaxY))), zero);
+        __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(n.aMinZ), cz), _mm_sub_ps(cz, _mm_loadu_ps(n.aMaxZ))), zero);
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        int mask = _mm_movemask_ps(_mm_cmple_ps(d2, r2));
+
+        for (u32 c = 0; c < 4; c++)
+        {
+            if (!(mask & (1 << c)) || n.aChildren[c] == adt::NPOS)
+                continue;
+
+            if (n.aCounts[c] > 0)
+            {
+                for (u32 j = 0; j < n.aCounts[c]; j++)
+                {
+                    u32 id = _aIdxs[n.aChildren[c] + j];
+                    const BvhItem& it = _aItems[id];
+
+                    f32 dist2 = 0.0f;
+                    for (u32 a = 0; a < 3; a++)
+                    {
+                        f32 d = fmaxf(fmaxf(it.min.e[a] - center.e[a], center.e[a] - it.max.e[a]), 0.0f);
+                        dist2 += d*d;
+                    }
+
+                    if (dist2 <= radius2)
+                        pOut->push(id);
+                }
+            }
+            else
+            {
+                aStack[sp++] = n.aChildren[c];
+            }
+        }
+    }
+
+    freeTraversalStack(aStack, aLocal);
+}
+
+void
+Bvh::destroy()
+{
+    _aNodes.destroy();
+    _aItems.destroy();
+    _aIdxs.destroy();
+}
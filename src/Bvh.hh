@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Array.hh"
+#include "ThreadPool.hh"
+#include "math.hh"
+
+/* leaves hold at most this many items */
+constexpr u32 BVH_MAX_LEAF_ITEMS = 4;
+/* centroid bins per axis of the SAH sweep */
+constexpr u32 BVH_BINS = 16;
+/* nodes with more items than this bin them across the pool */
+constexpr u32 BVH_PARALLEL_MIN = 1 << 15;
+
+struct BvhItem
+{
+    v3 min;
+    v3 max;
+};
+
+/* 4 wide node, child bounds as struct of arrays so one sse op tests all of them */
+struct BvhNode
+{
+    f32 aMinX[4], aMinY[4], aMinZ[4];
+    f32 aMaxX[4], aMaxY[4], aMaxZ[4];
+    u32 aChildren[4]; /* node index, first entry of _aIdxs for leaves, NPOS if the slot is empty */
+    u32 aCounts[4]; /* items of a leaf child, 0 for inner ones */
+};
+
+struct BvhHit
+{
+    u32 id; /* NPOS on miss */
+    f32 t;
+};
+
+/* exact test of one item, returns the hit distance or tMax if there is none */
+using PfnBvhIntersect = f32 (*)(void* pCtx, u32 id, const v3& origin, const v3& dir, f32 tMax);
+
+/* SAH bvh over item aabbs, item ids are their index in the build array.
+ * Nodes are stored parents first, so refit is one reverse pass. */
+struct Bvh
+{
+    adt::Allocator* _pAlloc {};
+    adt::Array<BvhNode> _aNodes;
+    adt::Array<BvhItem> _aItems; /* by id */
+    adt::Array<u32> _aIdxs; /* ids in leaf order */
+    u32 _depth {}; /* levels of inner nodes, traversal stacks are sized from it */
+
+    Bvh() = default;
+    Bvh(adt::Allocator* p) : _pAlloc(p), _aNodes(p), _aItems(p), _aIdxs(p) {}
+
+    void build(const BvhItem* pItems, u32 nItems, adt::ThreadPool* pTp = nullptr); /* large ranges are binned on pTp's workers */
+    void update(u32 id, const v3& min, const v3& max) { _aItems[id] = {min, max}; }
+    void refit(); /* after update(), topology stays, quality degrades with large motion */
+
+    BvhHit raycast(const v3& origin, const v3& dir, f32 tMax, PfnBvhIntersect pfn = nullptr, void* pCtx = nullptr) const; /* aabb hit if pfn is nullptr */
+    void queryFrustum(const Frustum& f, adt::Array<u32>* pOut) const;
+    void querySphere(const v3& center, f32 radius, adt::Array<u32>* pOut) const;
+
+    void destroy();
+};
@@ -0,0 +1,110 @@
+#include "CmdBuffer.hh"
+
+#include <string.h>
+
+void
+CmdBuffer::append(const CmdBuffer& other)
+{
+    if (other._aCmds._size == 0)
+        return;
+
+    u32 size = _aCmds._size + other._aCmds._size;
+    if (_aCmds._capacity < size)
+        _aCmds.grow(size);
+
+    memcpy(_aCmds.data() + _aCmds._size, other._aCmds._pData, sizeof(Cmd) * other._aCmds._size);
+    _aCmds._size = size;
+}
+
+void
+CmdBuffer::replay() const
+{
+    for (u32 i = 0; i < _aCmds._size; i++)
+    {
+        const Cmd& c = _aCmds[i];
+        switch (c.eType)
+        {
+            case CMD::USE_PROGRAM:
+                glUseProgram(c.program.id);
+                break;
+
+            case CMD::BIND_VAO:
+                glBindVertexArray(c.vao.id);
+                break;
+
+            case CMD::BIND_TEXTURE:
+                glActiveTexture(c.texture.unit);
+                glBindTexture(c.texture.target, c.texture.id);
+                break;
+
+            case CMD::BIND_VERTEX_BUFFER:
+                glBindVertexBuffer(c.vertexBuffer.binding, c.vertexBuffer.id, GLintptr(c.vertexBuffer.offset), GLsizei(c.vertexBuffer.stride));
+                break;
+
+            case CMD::UNIFORM_I:
+                glUniform1i(c.uniformI.loc, c.uniformI.i);
+                break;
+
+            case CMD::UNIFORM_F:
+                glUniform1f(c.uniformF.loc, c.uniformF.f);
+                break;
+
+            case CMD::DRAW_ELEMENTS:
+                if (c.draw.nInstances == 1)
+                {
+                    glDrawElementsBaseVertex(c.draw.mode, GLsizei(c.draw.nIndices), GL_UNSIGNED_INT,
+                                             (void*)(u64(c.draw.firstIndex) * sizeof(u32)), c.draw.baseVertex);
+                }
+                else
+                {
+                    glDrawElementsInstancedBaseVertex(c.draw.mode, GLsizei(c.draw.nIndices), GL_UNSIGNED_INT,
+                                                      (void*)(u64(c.draw.firstIndex) * sizeof(u32)), GLsizei(c.draw.nInstances),
+                                                      c.draw.baseVertex);
+                }
+                break;
+        }
+    }
+}
+
+bool
+CmdBuffer::write(FILE* pf) const
+{
+    for (u32 i = 0; i < _aCmds._size; i++)
+    {
+        const Cmd& c = _aCmds[i];
+        switch (c.eType)
+        {
+            case CMD::USE_PROGRAM:
+                fprintf(pf, "useProgram %u\n", c.program.id);
+                break;
+
+            case CMD::BIND_VAO:
+                fprintf(pf, "bindVao %u\n", c.vao.id);
+                break;
+
+            case CMD::BIND_TEXTURE:
+                fprintf(pf, "bindTexture unit %u target %#x id %u\n", c.texture.unit - GL_TEXTURE0, c.texture.target, c.texture.id);
+                break;
+
+            case CMD::BIND_VERTEX_BUFFER:
+                fprintf(pf, "bindVertexBuffer binding %u id %u offset %u stride %u\n",
+                        c.vertexBuffer.binding, c.vertexBuffer.id, c.vertexBuffer.offset, c.vertexBuffer.stride);
+                break;
+
+            case CMD::UNIFORM_I:
+                fprintf(pf, "uniformI loc %d %d\n", c.uniformI.loc, c.uniformI.i);
+                break;
+
+            case CMD::UNIFORM_F:
+                fprintf(pf, "uniformF loc %d %g\n", c.uniformF.loc, c.uniformF.f);
+                break;
+
+            case CMD::DRAW_ELEMENTS:
+                fprintf(pf, "drawElements mode %#x indices %u first %u baseVertex %d instances %u\n",
+                        c.draw.mode, c.draw.nIndices, c.draw.firstIndex, c.draw.baseVertex, c.draw.nInstances);
+                break;
+        }
+    }
+
+    return !ferror(pf);
+}
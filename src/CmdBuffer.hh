@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "Array.hh"
+#include "gl/gl.hh"
+
+enum class CMD : u8
+{
+    USE_PROGRAM,
+    BIND_VAO,
+    BIND_TEXTURE,
+    BIND_VERTEX_BUFFER, /* range of a buffer at a vao binding point, how draws find their instances */
+    UNIFORM_I,
+    UNIFORM_F,
+    DRAW_ELEMENTS /* u32 indices, base vertex, instanced */
+};
+
+/* One gl call with its arguments. Plain data, uniforms by location, so any thread can record them. */
+struct Cmd
+{
+    enum CMD eType;
+    union
+    {
+        struct { GLuint id; } program;
+        struct { GLuint id; } vao;
+        struct { GLenum unit; GLenum target; GLuint id; } texture;
+        struct { GLuint binding; GLuint id; u32 offset; u32 stride; } vertexBuffer;
+        struct { GLint loc; GLint i; } uniformI;
+        struct { GLint loc; f32 f; } uniformF;
+        struct { GLenum mode; u32 nIndices; u32 firstIndex; s32 baseVertex; u32 nInstances; } draw;
+    };
+};
+
+/* Commands recorded anywhere, e.g. one buffer per worker and object range, and replayed in order on the gl thread.
+ * Names and locations have to stay valid until the replay, nothing is looked up there. */
+struct CmdBuffer
+{
+    adt::Array<Cmd> _aCmds;
+
+    CmdBuffer() = default;
+    CmdBuffer(adt::Allocator* p, u32 prealloc = adt::SIZE_MIN) : _aCmds(p, prealloc) {}
+
+    void useProgram(GLuint id) { push({CMD::USE_PROGRAM, {.program {id}}}); }
+    void bindVao(GLuint id) { push({CMD::BIND_VAO, {.vao {id}}}); }
+    void bindTexture(GLenum unit, GLenum target, GLuint id) { push({CMD::BIND_TEXTURE, {.texture {unit, target, id}}}); }
+    void bindVertexBuffer(GLuint binding, GLuint id, u32 offset, u32 stride) { push({CMD::BIND_VERTEX_BUFFER, {.vertexBuffer {binding, id, offset, stride}}}); }
+    void uniformI(GLint loc, GLint i) { push({CMD::UNIFORM_I, {.uniformI {loc, i}}}); }
+    void uniformF(GLint loc, f32 f) { push({CMD::UNIFORM_F, {.uniformF {loc, f}}}); }
+    void drawElements(GLenum mode, u32 nIndices, u32 firstIndex, s32 baseVertex, u32 nInstances = 1) { push({CMD::DRAW_ELEMENTS, {.draw {mode, nIndices, firstIndex, baseVertex, nInstances}}}); }
+
+    void push(const Cmd& cmd) { _aCmds.push(cmd); }
+    void append(const CmdBuffer& other); /* other's commands after these */
+    void reset() { _aCmds._size = 0; }
+    void replay() const; /* gl thread */
+    bool write(FILE* pf) const; /* one line per command, for captures */
+    void destroy() { _aCmds.destroy(); }
+};
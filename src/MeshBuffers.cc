@@ -0,0 +1,292 @@
+#include "MeshBuffers.hh"
+#include "DefaultAllocator.hh"
+#include "logs.hh"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 48 MiB of vertices and 16 MiB of indices per page */
+constexpr u32 PAGE_VERTICES = 1 << 20;
+constexpr u32 PAGE_INDICES = 1 << 22;
+
+MeshBuffers g_meshBuffers(&adt::StdAllocator);
+
+RangeAllocator::RangeAllocator(adt::Allocator* p, u32 capacity)
+    : _aFree(p), _capacity(capacity), _used(0)
+{
+    _aFree.push({0, capacity});
+}
+
+u32
+RangeAllocator::alloc(u32 size)
+{
+    for (u32 i = 0; i < _aFree._size; i++)
+    {
+        auto& r = _aFree[i];
+        if (r.size >= size)
+        {
+            u32 off = r.offset;
+            r.offset += size;
+            r.size -= size;
+
+            if (r.size == 0)
+            {
+                for (u32 j = i; j + 1 < _aFree._size; j++)
+                    _aFree[j] = _aFree[j + 1];
+                _aFree._size--;
+            }
+
+            _used += size;
+            return off;
+        }
+    }
+
+    return adt::NPOS;
+}
+
+void
+RangeAllocator::free(Range r)
+{
+    /* insert sorted */
+    u32 i = 0;
+    while (i < _aFree._size && _aFree[i].offset < r.offset)
+        i++;
+
+    _aFree.push({});
+    for (u32 j = _aFree._size - 1; j > i; j--)
+        _aFree[j] = _aFree[j - 1];
+    _aFree[i] = r;
+    _used -= r.size;
+
+    /* merge with next, then with previous */
+    if (i + 1 < _aFree._size && _aFree[i].offset + _aFree[i].size == _aFree[i + 1].offset)
+    {
+        _aFree[i].size += _aFree[i + 1].size;
+        for (u32 j = i + 1; j + 1 < _aFree._size; j++)
+            _aFree[j] = _aFree[j + 1];
+        _aFree._size--;
+    }
+    if (i > 0 && _aFree[i - 1].offset + _aFree[i - 1].size == _aFree[i].offset)
+    {
+        _aFree[i - 1].size += _aFree[i].size;
+        for (u32 j = i; j + 1 < _aFree._size; j++)
+            _aFree[j] = _aFree[j + 1];
+        _aFree._size--;
+    }
+}
+
+u32
+RangeAllocator::largestFree() const
+{
+    u32 max = 0;
+    for (u32 i = 0; i < _aFree._size; i++)
+        if (_aFree[i].size > max) max = _aFree[i].size;
+
+    return max;
+}
+
+u32
+MeshBuffers::newPage(enum VERTEX_FORMAT eFormat, u32 minVertices, u32 minIndices)
+{
+    MeshBufferPage p {};
+    p.eFormat = eFormat;
+    u32 nVerts = minVertices > PAGE_VERTICES ? minVertices : PAGE_VERTICES;
+    u32 nInds = minIndices > PAGE_INDICES ? minIndices : PAGE_INDICES;
+    p.vertices = RangeAllocator(_pAlloc, nVerts);
+    p.indices = RangeAllocator(_pAlloc, nInds);
+
+    glGenVertexArrays(1, &p.vao);
+    glBindVertexArray(p.vao);
+
+    glGenBuffers(1, &p.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, p.vbo);
+    glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(nVerts) * vertexSize(eFormat), nullptr, GL_STATIC_DRAW);
+
+    glGenBuffers(1, &p.ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, p.ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, GLsizeiptr(nInds) * sizeof(u32), nullptr, GL_STATIC_DRAW);
+
+    if (eFormat == VERTEX_FORMAT::PACKED)
+    {
+        constexpr GLsizei stride = sizeof(PackedVertex);
+        /* positions (+ tangent handedness in w) */
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 4, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, pos));
+        /* texture coords */
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offsetof(PackedVertex, tex));
+        /* octahedral normals */
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, norm));
+        /* octahedral tangents */
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 2, GL_SHORT, GL_TRUE, stride, (void*)offsetof(PackedVertex, tan));
+    }
+    else
+    {
+        /* positions */
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, pos));
+        /* texture coords */
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tex));
+        /* normals */
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, norm));
+        /* tangents */
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tan));
+    }
+
+    /* instance buffer, there is always something bound so non instanced shaders can use the same vao */
+    if (!_instanceVbo)
+    {
+        Instance iden {};
+        iden.model = m4Iden();
+        iden.normal[0][0] = iden.normal[1][1] = iden.normal[2][2] = 1.0f;
+
+        glGenBuffers(1, &_instanceVbo);
+        glBindBuffer(GL_ARRAY_BUFFER, _instanceVbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(Instance), &iden, GL_STREAM_DRAW);
+        _instanceCap = 1;
+    }
+
+    /* model matrix */
+    for (u32 i = 0; i < 4; i++)
+    {
+        glEnableVertexAttribArray(4 + i);
+        glVertexAttribFormat(4 + i, 4, GL_FLOAT, GL_FALSE, offsetof(Instance, model) + sizeof(v4)*i);
+        glVertexAttribBinding(4 + i, INSTANCE_BINDING);
+    }
+    /* normal matrix */
+    for (u32 i = 0; i < 3; i++)
+    {
+        glEnableVertexAttribArray(8 + i);
+        glVertexAttribFormat(8 + i, 3, GL_FLOAT, GL_FALSE, offsetof(Instance, normal) + sizeof(f32)*3*i);
+        glVertexAttribBinding(8 + i, INSTANCE_BINDING);
+    }
+    glVertexBindingDivisor(INSTANCE_BINDING, 1);
+    glBindVertexBuffer(INSTANCE_BINDING, _instanceVbo, 0, sizeof(Instance));
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    _aPages.push(p);
+    LOG_OK("mesh buffer page %u: vao: %u, format: %d, vertices: %u, indices: %u\n", _aPages._size - 1, p.vao, int(eFormat), nVerts, nInds);
+
+    return _aPages._size - 1;
+}
+
+MeshAlloc
+MeshBuffers::alloc(enum VERTEX_FORMAT eFormat, u32 nVertices, u32 nIndices)
+{
+    MeshAlloc ma {};
+    ma.nVertices = nVertices;
+    ma.nIndices = nIndices;
+
+    for (u32 i = 0; i < _aPages._size; i++)
+    {
+        auto& p = _aPages[i];
+        if (p.eFormat != eFormat || p.vertices.largestFree() < nVertices || p.indices.largestFree() < nIndices)
+            continue;
+
+        ma.page = i;
+        ma.baseVertex = p.vertices.alloc(nVertices);
+        ma.firstIndex = p.indices.alloc(nIndices);
+        return ma;
+    }
+
+    u32 i = newPage(eFormat, nVertices, nIndices);
+    ma.page = i;
+    ma.baseVertex = _aPages[i].vertices.alloc(nVertices);
+    ma.firstIndex = _aPages[i].indices.alloc(nIndices);
+
+    return ma;
+}
+
+void
+MeshBuffers::upload(const MeshAlloc& ma, const void* pVertices, const u32* pIndices)
+{
+    auto& p = _aPages[ma.page];
+    u32 vertSize = vertexSize(p.eFormat);
+
+    glBindBuffer(GL_ARRAY_BUFFER, p.vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, GLintptr(ma.baseVertex) * vertSize, GLsizeiptr(ma.nVertices) * vertSize, pVertices);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    /* element buffer binding is vao state */
+    glBindVertexArray(p.vao);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, GLintptr(ma.firstIndex) * sizeof(u32), GLsizeiptr(ma.nIndices) * sizeof(u32), pIndices);
+    glBindVertexArray(0);
+}
+
+void
+MeshBuffers::uploadInstances(const Instance* pInstances, u32 nInstances)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, _instanceVbo);
+
+    /* grow by doubling, otherwise orphan so the driver doesn't stall on the previous pass */
+    if (nInstances > _instanceCap)
+    {
+        while (_instanceCap < nInstances) _instanceCap *= 2;
+        LOG_OK("instance buffer grown to %u instances (%.2f MiB)\n", _instanceCap, f64(_instanceCap) * sizeof(Instance) / adt::SIZE_1M);
+    }
+    glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(_instanceCap) * sizeof(Instance), nullptr, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, GLsizeiptr(nInstances) * sizeof(Instance), pInstances);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void
+MeshBuffers::bindInstances(u32 firstInstance)
+{
+    glBindVertexBuffer(INSTANCE_BINDING, _instanceVbo, GLintptr(firstInstance) * sizeof(Instance), sizeof(Instance));
+}
+
+void
+MeshBuffers::free(const MeshAlloc& ma)
+{
+    auto& p = _aPages[ma.page];
+    p.vertices.free({ma.baseVertex, ma.nVertices});
+    p.indices.free({ma.firstIndex, ma.nIndices});
+}
+
+void
+MeshBuffers::report() const
+{
+    auto fragmentation = [](const RangeAllocator& a) -> f64 {
+        u32 free = a._capacity - a._used;
+        return free ? 1.0 - f64(a.largestFree()) / f64(free) : 0.0;
+    };
+
+    for (u32 i = 0; i < _aPages._size; i++)
+    {
+        auto& p = _aPages[i];
+        LOG_OK("mesh buffer page %u (%s, %u bytes per vertex):\n"
+               "\tvertices: %u / %u used (%.2f MiB), %u free blocks, largest: %u, fragmentation: %.1f%%\n"
+               "\tindices: %u / %u used (%.2f MiB), %u free blocks, largest: %u, fragmentation: %.1f%%\n",
+               i, p.eFormat == VERTEX_FORMAT::PACKED ? "packed" : "float", vertexSize(p.eFormat),
+               p.vertices._used, p.vertices._capacity, f64(p.vertices._used) * vertexSize(p.eFormat) / adt::SIZE_1M,
+               p.vertices._aFree._size, p.vertices.largestFree(), fragmentation(p.vertices) * 100.0,
+               p.indices._used, p.indices._capacity, f64(p.indices._used) * sizeof(u32) / adt::SIZE_1M,
+               p.indices._aFree._size, p.indices.largestFree(), fragmentation(p.indices) * 100.0);
+    }
+}
+
+void
+MeshBuffers::destroy()
+{
+    for (auto& p : _aPages)
+    {
+        glDeleteVertexArrays(1, &p.vao);
+        glDeleteBuffers(1, &p.vbo);
+        glDeleteBuffers(1, &p.ebo);
+        p.vertices._aFree.destroy();
+        p.indices._aFree.destroy();
+    }
+
+    glDeleteBuffers(1, &_instanceVbo);
+    _instanceVbo = 0;
+    _instanceCap = 0;
+    _aPages.destroy();
+}
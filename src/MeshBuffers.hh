@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Array.hh"
+#include "utils.hh"
+#include "gl/gl.hh"
+#include "math.hh"
+
+/* shared vertex format of every model packed into MeshBuffers */
+struct Vertex
+{
+    v3 pos;
+    v2 tex;
+    v3 norm;
+    v4 tan;
+};
+
+/* optional repacked format, positions are unorm relative to the mesh aabb so they need Mesh::dequant,
+ * pos[3] is tangent handedness (0 is -1, 0xffff is 1), normals and tangents are octahedral */
+struct PackedVertex
+{
+    u16 pos[4];
+    u16 tex[2]; /* half floats */
+    s16 norm[2];
+    s16 tan[2];
+};
+
+enum class VERTEX_FORMAT : int
+{
+    FLOAT, /* Vertex */
+    PACKED /* PackedVertex */
+};
+
+inline u32
+vertexSize(enum VERTEX_FORMAT e)
+{
+    return e == VERTEX_FORMAT::PACKED ? sizeof(PackedVertex) : sizeof(Vertex);
+}
+
+/* per instance attributes read by instanced shaders (locations 4-7 model, 8-10 normal matrix) */
+struct Instance
+{
+    m4 model;
+    f32 normal[3][3];
+};
+
+/* vertex buffer binding point the instance buffer is attached to in every page vao */
+constexpr GLuint INSTANCE_BINDING = 4;
+
+struct Range
+{
+    u32 offset;
+    u32 size;
+};
+
+/* first fit free list over [0, capacity) in elements, neighbours are coalesced on free */
+struct RangeAllocator
+{
+    adt::Array<Range> _aFree; /* sorted by offset */
+    u32 _capacity {};
+    u32 _used {};
+
+    RangeAllocator() = default;
+    RangeAllocator(adt::Allocator* p, u32 capacity);
+
+    u32 alloc(u32 size); /* offset or adt::NPOS */
+    void free(Range r);
+    u32 largestFree() const;
+};
+
+/* where one primitive lives inside MeshBuffers */
+struct MeshAlloc
+{
+    u32 page = adt::NPOS;
+    u32 baseVertex;
+    u32 firstIndex;
+    u32 nVertices;
+    u32 nIndices;
+};
+
+struct MeshBufferPage
+{
+    enum VERTEX_FORMAT eFormat;
+    GLuint vao;
+    GLuint vbo;
+    GLuint ebo;
+    RangeAllocator vertices;
+    RangeAllocator indices;
+};
+
+/* Few big vertex/index buffers with one vao each, every primitive is a sub range drawn with
+ * glDrawElementsBaseVertex, so the whole scene draws with one vao bound.
+ * Not thread safe, uploads only happen on the render thread. */
+struct MeshBuffers
+{
+    adt::Allocator* _pAlloc {};
+    adt::Array<MeshBufferPage> _aPages;
+    GLuint _instanceVbo {}; /* shared by every page */
+    u32 _instanceCap {};
+
+    MeshBuffers() = default;
+    MeshBuffers(adt::Allocator* p) : _pAlloc(p), _aPages(p) {}
+
+    MeshAlloc alloc(enum VERTEX_FORMAT eFormat, u32 nVertices, u32 nIndices);
+    void upload(const MeshAlloc& ma, const void* pVertices, const u32* pIndices); /* vertices in the page format */
+    void free(const MeshAlloc& ma);
+    GLuint vao(const MeshAlloc& ma) const { return _aPages[ma.page].vao; }
+    enum VERTEX_FORMAT format(const MeshAlloc& ma) const { return _aPages[ma.page].eFormat; }
+    void uploadInstances(const Instance* pInstances, u32 nInstances); /* orphans previous contents */
+    void bindInstances(u32 firstInstance); /* for currently bound page vao */
+    void report() const;
+    void destroy();
+
+private:
+    u32 newPage(enum VERTEX_FORMAT eFormat, u32 minVertices, u32 minIndices);
+};
+
+extern MeshBuffers g_meshBuffers;
@@ -1,189 +1,485 @@
+#include <string.h>
+
 #include "Model.hh"
-#include "AtomicArenaAllocator.hh"
+#include "DefaultAllocator.hh"
 #include "frame.hh"
 #include "logs.hh"
 #include "file.hh"
+#include "SceneCache.hh"
 #include "ThreadPool.hh"
+#include "parallel.hh"
 
 void
-Model::load(adt::String path, GLint drawMode, GLint texMode)
+Model::load(AssetLoader loader, adt::String path, GLint drawMode, GLint texMode, enum VERTEX_FORMAT eFormat)
 {
     if (path.endsWith(".gltf"))
-        loadGLTF(path, drawMode, texMode);
+        loadGLTF(loader, path, drawMode, texMode, eFormat);
     else
         LOG_FATAL("trying to load unsupported asset: '%.*s'\n", path._size, path._pData);
 
     _sSavedPath = path;
 }
 
-void
-Model::loadGLTF(adt::String path, GLint drawMode, GLint texMode)
+/* copy `nComponents` floats of each accessor element into `pDest` spaced by `destStride` bytes */
+static void
+copyAccessor(gltf::Asset* pAsset, const gltf::Accessor& acc, u32 nComponents, u8* pDest, u32 destStride)
+{
+    if (acc.componentType != gltf::COMPONENT_TYPE::FLOAT)
+    {
+        adt::String s = gltf::getComponentTypeString(acc.componentType);
+        LOG_WARN("only FLOAT attributes are supported, got: '%.*s'\n", (int)s._size, s._pData);
+        return;
+    }
+
+    auto& bv = pAsset->_aBufferViews[acc.bufferView];
+    u32 elSize = nComponents * sizeof(f32);
+    u32 stride = bv.byteStride ? bv.byteStride : elSize;
+    const u8* pSrc = (u8*)&pAsset->_aBuffers[bv.buffer].aBin[bv.byteOffset + acc.byteOffset];
+
+    for (u32 i = 0; i < acc.count; i++)
+        memcpy(pDest + u64(i)*destStride, pSrc + u64(i)*stride, elSize);
+}
+
+/* widen any index type to u32 */
+static void
+copyIndices(gltf::Asset* pAsset, const gltf::Accessor& acc, u32* pDest)
+{
+    auto& bv = pAsset->_aBufferViews[acc.bufferView];
+    const u8* pSrc = (u8*)&pAsset->_aBuffers[bv.buffer].aBin[bv.byteOffset + acc.byteOffset];
+
+    switch (acc.componentType)
+    {
+        case gltf::COMPONENT_TYPE::UNSIGNED_BYTE:
+            for (u32 i = 0; i < acc.count; i++) pDest[i] = pSrc[i];
+            break;
+
+        case gltf::COMPONENT_TYPE::UNSIGNED_SHORT:
+            for (u32 i = 0; i < acc.count; i++) pDest[i] = ((u16*)pSrc)[i];
+            break;
+
+        case gltf::COMPONENT_TYPE::UNSIGNED_INT:
+            memcpy(pDest, pSrc, acc.count * sizeof(u32));
+            break;
+
+        default:
+            LOG_FATAL("unsupported index type: '%d'\n", int(acc.componentType));
+    }
+}
+
+/* each level halves the previous one, simplifying from the previous level and summing the errors,
+ * stops early once the simplifier gets stuck on locked seams */
+static void
+buildLods(PrimitiveStreams* pOut)
+{
+    auto& out = *pOut;
+    u32 nVertices = out.aVertices._size;
+    u32 nFull = out.aIndices._size;
+
+    out.nLods = 1;
+    out.aLods[0] = {0, nFull, out.after.nTransformed, 0.0f};
+
+    u32* aPrev = (u32*)adt::StdAllocator.alloc(nFull, sizeof(u32));
+    u32* aSimplified = (u32*)adt::StdAllocator.alloc(nFull, sizeof(u32));
+    u32* aClusters = (u32*)adt::StdAllocator.alloc(nFull / 3 + 1, sizeof(u32));
+    memcpy(aPrev, out.aIndices.data(), sizeof(u32) * nFull);
+    u32 nPrev = nFull;
+
+    for (u32 l = 1; l < meshopt::MAX_LODS; l++)
+    {
+        u32 target = ((nFull / 3) >> l) * 3;
+        f32 error = 0.0f;
+        u32 n = meshopt::simplify(&adt::StdAllocator, aSimplified, aPrev, nPrev, out.aVertices.data(), nVertices,
+                                  target, meshopt::SIMPLIFY_MAX_ERROR, &error);
+
+        if (n == 0 || f32(n) > f32(nPrev) * 0.9f)
+            break;
+
+        /* own cache order, fetch order stays the full detail one */
+        meshopt::optimizeVertexCache(&adt::StdAllocator, aPrev, aSimplified, n, nVertices, aClusters);
+        nPrev = n;
+
+        auto& lod = out.aLods[out.nLods++];
+        lod.firstIndex = out.aIndices._size;
+        lod.nIndices = n;
+        lod.nTransformed = meshopt::analyzeVertexCache(&adt::StdAllocator, aPrev, n, nVertices).nTransformed;
+        lod.error = out.aLods[l - 1].error + error;
+
+        for (u32 i = 0; i < n; i++)
+            out.aIndices.push(aPrev[i]);
+    }
+
+    adt::StdAllocator.free(aClusters);
+    adt::StdAllocator.free(aSimplified);
+    adt::StdAllocator.free(aPrev);
+}
+
+/* Positions of lod 0, compacted to the vertices it references. Simplified lods can stick out past the real surface
+ * by up to their error, and an occluder that does would hide things that are visible. */
+static occlusion::Occluder
+makeOccluder(adt::Allocator* pAlloc, const PrimitiveStreams& streams)
 {
-    _asset.load(path);
-    auto& a = _asset;;
+    const meshopt::Lod& lod = streams.aLods[0];
+
+    if (lod.nIndices / 3 > occlusion::OCCLUDER_MAX_TRIANGLES)
+        return {};
+
+    u32 nVertices = streams.aVertices._size;
+    u32* aRemap = (u32*)adt::StdAllocator.alloc(nVertices, sizeof(u32));
+    memset(aRemap, 0xff, sizeof(u32) * nVertices);
 
-    /* load buffers first */
-    adt::Array<GLuint> aBufferMap(_pAlloc);
-    for (u32 i = 0; i < a._aBuffers._size; i++)
+    occlusion::Occluder o {};
+    o.nIndices = lod.nIndices;
+    o.pIndices = (u32*)pAlloc->alloc(lod.nIndices, sizeof(u32));
+    o.pPositions = (v3*)pAlloc->alloc(lod.nIndices, sizeof(v3)); /* upper bound */
+
+    for (u32 i = 0; i < lod.nIndices; i++)
     {
-        mtx_lock(&gl::mtxGlContext);
-        frame::g_app->bindGlContext();
-
-        GLuint b;
-        glGenBuffers(1, &b);
-        glBindBuffer(GL_ARRAY_BUFFER, b);
-        glBufferData(GL_ARRAY_BUFFER, a._aBuffers[i].byteLength, a._aBuffers[i].aBin.data(), drawMode);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        aBufferMap.push(b);
-
-        frame::g_app->unbindGlContext();
-        mtx_unlock(&gl::mtxGlContext);
+        u32 v = streams.aIndices[lod.firstIndex + i];
+        if (aRemap[v] == adt::NPOS)
+        {
+            aRemap[v] = o.nVertices;
+            o.pPositions[o.nVertices++] = streams.aVertices[v].pos;
+        }
+        o.pIndices[i] = aRemap[v];
     }
 
-    adt::AtomicArenaAllocator aAlloc(adt::SIZE_1M * 10);
-    adt::ThreadPool tp(&aAlloc);
-    tp.start();
+    adt::StdAllocator.free(aRemap);
+    return o;
+}
+
+/* convert to the shared vertex format and optimize triangle lists for the post transform cache, overdraw and fetch order */
+static void
+buildStreams(gltf::Asset& a, const gltf::Primitive& primitive, PrimitiveStreams* pOut)
+{
+    auto& out = *pOut;
+
+    u32 accIndIdx = primitive.indices;
+    u32 accPosIdx = primitive.attributes.POSITION;
+    u32 accNormIdx = primitive.attributes.NORMAL;
+    u32 accTexIdx = primitive.attributes.TEXCOORD_0;
+    u32 accTanIdx = primitive.attributes.TANGENT;
+
+    auto& accPos = a._aAccessors[accPosIdx];
+
+    /* non indexed primitives get 0..n-1 indices */
+    u32 nVertices = accPos.count;
+    u32 nIndices = accIndIdx != adt::NPOS ? a._aAccessors[accIndIdx].count : nVertices;
 
-    /* preload texures */
-    adt::Array<Texture> aTex(&aAlloc, a._aImages._size);
-    aTex.resize(a._aImages._size);
+    out.aVertices = adt::Array<Vertex>(&adt::StdAllocator, nVertices + 1);
+    out.aVertices.resize(nVertices);
+    memset(out.aVertices.data(), 0, sizeof(Vertex) * nVertices);
+    out.aIndices = adt::Array<u32>(&adt::StdAllocator, nIndices + 1);
+    out.aIndices.resize(nIndices);
 
-    for (u32 i = 0; i < a._aImages._size; i++)
+    u8* pVerts = (u8*)out.aVertices.data();
+    copyAccessor(&a, accPos, 3, pVerts + offsetof(Vertex, pos), sizeof(Vertex));
+
+    if (accTexIdx != adt::NPOS)
+        copyAccessor(&a, a._aAccessors[accTexIdx], 2, pVerts + offsetof(Vertex, tex), sizeof(Vertex));
+
+    if (accNormIdx != adt::NPOS)
+        copyAccessor(&a, a._aAccessors[accNormIdx], 3, pVerts + offsetof(Vertex, norm), sizeof(Vertex));
+
+    if (accTanIdx != adt::NPOS)
+    {
+        auto& accTan = a._aAccessors[accTanIdx];
+        bool bHandedness = accTan.type == gltf::ACCESSOR_TYPE::VEC4;
+        copyAccessor(&a, accTan, bHandedness ? 4 : 3, pVerts + offsetof(Vertex, tan), sizeof(Vertex));
+        if (!bHandedness)
+            for (auto& v : out.aVertices) v.tan.w = 1.0f;
+    }
+
+    if (accIndIdx != adt::NPOS)
+        copyIndices(&a, a._aAccessors[accIndIdx], out.aIndices.data());
+    else
+        for (u32 i = 0; i < nIndices; i++) out.aIndices[i] = i;
+
+    /* normal maps need tangents, before optimize() so they get remapped with everything else */
+    if (accTanIdx == adt::NPOS && accNormIdx != adt::NPOS && accTexIdx != adt::NPOS && primitive.mode == gltf::PRIMITIVES::TRIANGLES)
+        meshopt::generateTangents(&adt::StdAllocator, out.aVertices.data(), nVertices, out.aIndices.data(), nIndices);
+
+    out.before = meshopt::analyzeVertexCache(&adt::StdAllocator, out.aIndices.data(), nIndices, nVertices);
+
+    if (primitive.mode == gltf::PRIMITIVES::TRIANGLES)
+    {
+        meshopt::optimize(&adt::StdAllocator, out.aVertices.data(), &nVertices, out.aIndices.data(), nIndices);
+        out.aVertices._size = nVertices;
+        out.after = meshopt::analyzeVertexCache(&adt::StdAllocator, out.aIndices.data(), nIndices, nVertices);
+        buildLods(&out);
+
+        out.aClusters = adt::Array<meshopt::Cluster>(&adt::StdAllocator, nIndices / 3 + 1);
+        u32 nClusters = meshopt::buildClusters(&adt::StdAllocator, out.aClusters.data(), out.aIndices.data(), nIndices, out.aVertices.data(), nVertices);
+        out.aClusters.resize(nClusters);
+    }
+    else
+    {
+        out.after = out.before;
+        out.nLods = 1;
+        out.aLods[0] = {0, nIndices, out.after.nTransformed, 0.0f};
+    }
+}
+
+static void
+reportCacheStats(adt::String path, const SceneCache& cache)
+{
+    meshopt::CacheStats before {}, after {};
+    for (u32 i = 0; i < cache._aPrimitives._size; i++)
+    {
+        auto& p = cache._aPrimitives[i];
+        before.nTransformed += p.before.nTransformed;
+        before.nTriangles += p.before.nTriangles;
+        before.nVertices += p.before.nVertices;
+        after.nTransformed += p.after.nTransformed;
+        after.nTriangles += p.after.nTriangles;
+        after.nVertices += p.after.nVertices;
+    }
+
+    LOG_OK("'%.*s': %u primitives, %u triangles, vertex cache (fifo %u):\n"
+           "\tbefore: acmr: %.3f, atvr: %.3f, vs invocations: %u\n"
+           "\tafter:  acmr: %.3f, atvr: %.3f, vs invocations: %u\n",
+           (int)path._size, path._pData, cache._aPrimitives._size, after.nTriangles, meshopt::VCACHE_SIZE,
+           meshopt::acmr(before), meshopt::atvr(before), before.nTransformed,
+           meshopt::acmr(after), meshopt::atvr(after), after.nTransformed);
+}
+
+/* fetch cost is bytes read by the simulated vertex shader invocations of one full draw */
+static void
+reportVertexMemory(adt::String path, const SceneCache& cache, enum VERTEX_FORMAT eFormat)
+{
+    u64 nVertices = 0, nIndices = 0, nTransformed = 0;
+    for (u32 i = 0; i < cache._aPrimitives._size; i++)
+    {
+        auto& p = cache._aPrimitives[i];
+        nVertices += p.aVertices._size;
+        nIndices += p.aIndices._size;
+        nTransformed += p.after.nTransformed;
+    }
+
+    u32 floatSize = vertexSize(VERTEX_FORMAT::FLOAT);
+    u32 usedSize = vertexSize(eFormat);
+    f64 indexMiB = f64(nIndices * sizeof(u32)) / adt::SIZE_1M;
+
+    LOG_OK("'%.*s': vertex format: %s, %llu vertices, index buffer: %.2f MiB\n"
+           "\tvram: float: %.2f MiB, used: %.2f MiB\n"
+           "\tfetch per draw: float: %.2f MiB, used: %.2f MiB\n",
+           (int)path._size, path._pData, eFormat == VERTEX_FORMAT::PACKED ? "packed" : "float", (unsigned long long)nVertices, indexMiB,
+           f64(nVertices * floatSize) / adt::SIZE_1M, f64(nVertices * usedSize) / adt::SIZE_1M,
+           f64(nTransformed * floatSize) / adt::SIZE_1M, f64(nTransformed * usedSize) / adt::SIZE_1M);
+}
+
+/* what the stages of one gltf load share, lives in the load's coroutine frame */
+struct GltfLoad
+{
+    adt::String path;
+    enum VERTEX_FORMAT eFormat;
+    u32 nPrimitives;
+    SceneCache cache;
+    adt::Array<Texture> aTex; /* one per image */
+    adt::Array<adt::String> aTexPaths;
+    adt::Array<DecodedImage> aImages;
+    adt::Array<const gltf::Primitive*> aPrimitives; /* flattened, same order as the cache */
+};
+
+/* Read and parse, then decode every image and build every primitive's streams the cache doesn't have, each a node of the
+ * asset graph. The coroutine waits on joins of its own nodes, what it runs itself is recorded on the graph.
+ * Uploads happen on the render thread one texture per resume, so a big model doesn't stall a whole frame. */
+adt::CoJob
+Model::loadGLTF(AssetLoader loader, adt::String path, [[maybe_unused]] GLint drawMode, GLint texMode, enum VERTEX_FORMAT eFormat)
+{
+    adt::TaskGraph* pGraph = loader.pGraph;
+    f64 t0 = adt::timeNowMS();
+    auto& a = _asset;
+
+    adt::GraphNode* pRead = pGraph->add(pGraph->name("read", path), [&a, path] { a.read(path); });
+    adt::GraphNode* pParse = pGraph->add(pGraph->name("parse", path), [&a] { a.parse(); });
+    pGraph->depend(pParse, pRead);
+    pGraph->start(pRead);
+    pGraph->start(pParse);
+    co_await pGraph->join(pGraph->name("join", path), &pParse, 1, loader.pArena);
+    f64 tParsed = adt::timeNowMS();
+
+    GltfLoad load {};
+    load.path = path;
+    load.eFormat = eFormat;
+
+    u32 nImages = a._aImages._size;
+    load.aTex = adt::Array<Texture>(&adt::StdAllocator, nImages + 1);
+    load.aTexPaths = adt::Array<adt::String>(&adt::StdAllocator, nImages + 1);
+    load.aImages = adt::Array<DecodedImage>(&adt::StdAllocator, nImages + 1);
+    load.aImages.resize(nImages);
+
+    load.nPrimitives = 0;
+    for (auto& mesh : a._aMeshes)
+        load.nPrimitives += mesh.aPrimitives._size;
+
+    load.aPrimitives = adt::Array<const gltf::Primitive*>(&adt::StdAllocator, load.nPrimitives + 1);
+    for (auto& mesh : a._aMeshes)
+        for (auto& primitive : mesh.aPrimitives)
+            load.aPrimitives.push(&primitive);
+
+    adt::Array<adt::GraphNode*> aNodes(&adt::StdAllocator, nImages + load.nPrimitives + 1);
+    for (u32 i = 0; i < nImages; i++)
     {
         auto uri = a._aImages[i].uri;
 
         if (!uri.endsWith(".bmp"))
             LOG_FATAL("trying to load unsupported texture: '%.*s'\n", uri._size, uri._pData);
 
-        struct args
+        adt::String texPath = adt::replacePathSuffix(_pAlloc, path, uri);
+        DecodedImage* pImg = &load.aImages[i];
+        load.aTex.push(Texture(_pAlloc));
+        load.aTexPaths.push(texPath);
+        adt::GraphNode* pDecode = pGraph->add(pGraph->name("decode", texPath), [=] {
+            pImg->arena = adt::ArenaAllocator(adt::SIZE_1M * 5);
+            pImg->img = loadBMP(&pImg->arena, texPath, true);
+        });
+        pGraph->depend(pDecode, pParse);
+        pGraph->start(pDecode);
+        aNodes.push(pDecode);
+    }
+
+    /* vertex and index streams come from the scene cache, or are converted and optimized per primitive */
+    f64 tSpan = pGraph->now();
+    u64 cacheKey = sceneCacheKey(path, a);
+    load.cache = SceneCache(&adt::StdAllocator);
+    bool bCacheHit = load.cache.load(path, cacheKey) && load.cache._aPrimitives._size == load.nPrimitives;
+    adt::GraphNode* pCache = pGraph->record(pGraph->name("cache", path), tSpan);
+
+    if (!bCacheHit)
+    {
+        load.cache.destroy();
+        load.cache = SceneCache(&adt::StdAllocator);
+        load.cache._aPrimitives.resize(load.nPrimitives);
+        memset(load.cache._aPrimitives.data(), 0, sizeof(PrimitiveStreams) * load.nPrimitives);
+        load.cache._key = cacheKey;
+
+        for (u32 i = 0; i < load.nPrimitives; i++)
         {
-            Texture* p;
-            adt::Allocator* pAlloc;
-            adt::String path;
-            TEX_TYPE type;
-            bool flip;
-            GLint texMode;
-        };
+            gltf::Asset* pAsset = &a;
+            const gltf::Primitive* pPrimitive = load.aPrimitives[i];
+            PrimitiveStreams* pStreams = &load.cache._aPrimitives[i];
+            adt::GraphNode* pStreamsNode = pGraph->add(pGraph->name("streams", path), [=] { buildStreams(*pAsset, *pPrimitive, pStreams); });
+            pGraph->depend(pStreamsNode, pCache);
+            pGraph->start(pStreamsNode);
+            aNodes.push(pStreamsNode);
+        }
+    }
 
-        auto* arg = (args*)aAlloc.alloc(1, sizeof(args));
-        *arg = {
-            .p = &aTex[i],
-            .pAlloc = &aAlloc,
-            .path = adt::replacePathSuffix(_pAlloc, path, uri),
-            .type = TEX_TYPE::DIFFUSE,
-            .flip = true,
-            .texMode = texMode
-        };
+    co_await pGraph->join(pGraph->name("join", path), aNodes.data(), aNodes._size, loader.pArena);
+    aNodes.destroy();
+
+    if (!bCacheHit)
+    {
+        u32 nGenerated = 0;
+        for (const gltf::Primitive* pPrimitive : load.aPrimitives)
+        {
+            auto& attr = pPrimitive->attributes;
+            nGenerated += attr.TANGENT == adt::NPOS && attr.NORMAL != adt::NPOS && attr.TEXCOORD_0 != adt::NPOS &&
+                pPrimitive->mode == gltf::PRIMITIVES::TRIANGLES;
+        }
 
-        auto task = [](void* pArgs) -> int {
-            auto a = *(args*)pArgs;
-            *a.p = Texture(a.pAlloc, a.path, a.type, a.flip, a.texMode);
+        LOG_OK("'%.*s': streams built, tangents generated for %u of %u primitives\n",
+               (int)path._size, path._pData, nGenerated, load.nPrimitives);
+        tSpan = pGraph->now();
+        load.cache.save(path);
+        pGraph->record(pGraph->name("cache save", path), tSpan);
+    }
 
-            return 0;
-        };
+    reportCacheStats(path, load.cache);
+    reportVertexMemory(path, load.cache, eFormat);
+    f64 tDecoded = adt::timeNowMS();
 
-        tp.submit(task, arg);
+    co_await loader.pRender->schedule();
+    f64 tQueued = adt::timeNowMS();
+
+    for (u32 i = 0; i < nImages; i++)
+    {
+        tSpan = pGraph->now();
+        load.aTex[i].upload(load.aTexPaths[i], TEX_TYPE::DIFFUSE, &load.aImages[i].img, texMode, GL_NEAREST, GL_NEAREST_MIPMAP_NEAREST);
+        load.aImages[i].arena.freeAll();
+        pGraph->record(pGraph->name("upload", load.aTexPaths[i]), tSpan);
+        co_await loader.pRender->schedule();
     }
 
-    tp.wait();
+    tSpan = pGraph->now();
+    uploadGLTF(&load);
+    _bLoaded = true;
+    pGraph->record(pGraph->name("meshes", path), tSpan);
+
+    LOG_OK("'%.*s': loaded in %.3f ms: read and parse %.3f ms, decode and streams %.3f ms, waited for the render thread %.3f ms, "
+           "uploads over %.3f ms\n",
+           (int)path._size, path._pData, adt::timeNowMS() - t0, tParsed - t0, tDecoded - tParsed, tQueued - tDecoded,
+           adt::timeNowMS() - tQueued);
 
+    loader.pfnLoaded(this);
+}
+
+/* meshes and materials on the render thread, once every texture of this model is uploaded and every primitive's streams are ready */
+void
+Model::uploadGLTF(GltfLoad* pLoad)
+{
+    auto& a = _asset;
+    auto& cache = pLoad->cache;
+    auto& aTex = pLoad->aTex;
+    enum VERTEX_FORMAT eFormat = pLoad->eFormat;
+
+    u32 primitiveIdx = 0;
     for (auto& mesh : a._aMeshes)
     {
         adt::Array<Mesh> aNMeshes(_pAlloc);
 
         for (auto& primitive : mesh.aPrimitives)
         {
-            u32 accIndIdx = primitive.indices;
             u32 accPosIdx = primitive.attributes.POSITION;
-            u32 accNormIdx = primitive.attributes.NORMAL;
-            u32 accTexIdx = primitive.attributes.TEXCOORD_0;
-            u32 accTanIdx = primitive.attributes.TANGENT;
             u32 accMatIdx = primitive.material;
             enum gltf::PRIMITIVES mode = primitive.mode;
 
             auto& accPos = a._aAccessors[accPosIdx];
-            auto& accTex = a._aAccessors[accTexIdx];
-
-            auto& bvPos = a._aBufferViews[accPos.bufferView];
-            auto& bvTex = a._aBufferViews[accTex.bufferView];
+            auto& streams = cache._aPrimitives[primitiveIdx++];
 
             Mesh nMesh {};
 
             nMesh.mode = mode;
-
-            mtx_lock(&gl::mtxGlContext);
-            frame::g_app->bindGlContext();
-
-            glGenVertexArrays(1, &nMesh.meshData.vao);
-            glBindVertexArray(nMesh.meshData.vao);
-
-            if (accIndIdx != adt::NPOS)
+            nMesh.min = accPos.min.VEC3;
+            nMesh.max = accPos.max.VEC3;
+            nMesh.meshData.eboSize = streams.aLods[0].nIndices;
+            nMesh.nLods = streams.nLods;
+            memcpy(nMesh.aLods, streams.aLods, sizeof(nMesh.aLods));
+            nMesh.meshData.alloc = g_meshBuffers.alloc(eFormat, streams.aVertices._size, streams.aIndices._size);
+            nMesh.meshData.vao = g_meshBuffers.vao(nMesh.meshData.alloc);
+
+            if (mode == gltf::PRIMITIVES::TRIANGLES)
+                nMesh.occluder = makeOccluder(_pAlloc, streams);
+
+            if (streams.aClusters._size > 0)
             {
-                auto& accInd = a._aAccessors[accIndIdx];
-                auto& bvInd = a._aBufferViews[accInd.bufferView];
-                nMesh.indType = accInd.componentType;
-                nMesh.meshData.eboSize = accInd.count;
-                nMesh.triangleCount = adt::NPOS;
-
-                /* TODO: figure out how to reuse VBO data for index buffer (possible?) */
-                glGenBuffers(1, &nMesh.meshData.ebo);
-                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, nMesh.meshData.ebo);
-                glBufferData(GL_ELEMENT_ARRAY_BUFFER, bvInd.byteLength,
-                             &a._aBuffers[bvInd.buffer].aBin.data()[bvInd.byteOffset + accInd.byteOffset], drawMode);
+                nMesh.nClusters = streams.aClusters._size;
+                nMesh.pClusters = (meshopt::Cluster*)_pAlloc->alloc(nMesh.nClusters, sizeof(meshopt::Cluster));
+                memcpy(nMesh.pClusters, streams.aClusters.data(), sizeof(meshopt::Cluster) * nMesh.nClusters);
             }
-            else
-            {
-                nMesh.triangleCount = accPos.count;
-            }
-
-            constexpr u32 v3Size = sizeof(v3) / sizeof(f32);
-            constexpr u32 v2Size = sizeof(v2) / sizeof(f32);
 
-            /* if there are different VBO's for positions textures or normals,
-             * given gltf file should be considered harmful, and this will crash ofc */
-            nMesh.meshData.vbo = aBufferMap[bvPos.buffer];
-            glBindBuffer(GL_ARRAY_BUFFER, nMesh.meshData.vbo);
-
-            /* positions */
-            glEnableVertexAttribArray(0);
-            glVertexAttribPointer(0, v3Size, GLenum(accPos.componentType), GL_FALSE,
-                                  bvPos.byteStride, reinterpret_cast<void*>(bvPos.byteOffset + accPos.byteOffset));
-
-            /* texture coords */
-            glEnableVertexAttribArray(1);
-            glVertexAttribPointer(1, v2Size, GLenum(accTex.componentType), GL_FALSE,
-                                  bvTex.byteStride, reinterpret_cast<void*>(bvTex.byteOffset + accTex.byteOffset));
-
-             /*normals */
-            if (accNormIdx != adt::NPOS)
+            if (eFormat == VERTEX_FORMAT::PACKED)
             {
-                auto& accNorm = a._aAccessors[accNormIdx];
-                auto& bvNorm = a._aBufferViews[accNorm.bufferView];
-
-                glEnableVertexAttribArray(2);
-                glVertexAttribPointer(2, v3Size, GLenum(accNorm.componentType), GL_FALSE,
-                                      bvNorm.byteStride, reinterpret_cast<void*>(accNorm.byteOffset + bvNorm.byteOffset));
+                adt::Array<PackedVertex> aPacked(&adt::StdAllocator, streams.aVertices._size + 1);
+                aPacked.resize(streams.aVertices._size);
+                nMesh.dequant = meshopt::quantize(streams.aVertices.data(), streams.aVertices._size, aPacked.data());
+                g_meshBuffers.upload(nMesh.meshData.alloc, aPacked.data(), streams.aIndices.data());
+                aPacked.destroy();
             }
-
-            /* tangents */
-            if (accTanIdx != adt::NPOS)
+            else
             {
-                auto& accTan = a._aAccessors[accTanIdx];
-                auto& bvTan = a._aBufferViews[accTan.bufferView];
-
-                glEnableVertexAttribArray(3);
-                glVertexAttribPointer(3, v3Size, GLenum(accTan.componentType), GL_FALSE,
-                                      bvTan.byteStride, reinterpret_cast<void*>(accTan.byteOffset + bvTan.byteOffset));
+                nMesh.dequant = m4Iden();
+                g_meshBuffers.upload(nMesh.meshData.alloc, streams.aVertices.data(), streams.aIndices.data());
             }
 
-            glBindVertexArray(0);
-            frame::g_app->unbindGlContext();
-            mtx_unlock(&gl::mtxGlContext);
-
             /* load textures */
             if (accMatIdx != adt::NPOS)
             {
                 auto& mat = a._aMaterials[accMatIdx];
+
+                /* no sorted blending, BLEND keeps the old cutoff that hides only the fully transparent parts */
+                nMesh.meshData.materials.bAlphaTested = mat.alphaMode != gltf::ALPHA_MODE::OPAQUE_;
+                nMesh.meshData.materials.alphaCutoff = mat.alphaMode == gltf::ALPHA_MODE::MASK ? f32(mat.alphaCutoff) : 0.1f;
                 u32 baseColorSourceIdx = mat.pbrMetallicRoughness.baseColorTexture.index;
 
                 if (baseColorSourceIdx != adt::NPOS)
@@ -202,7 +498,7 @@ Model::loadGLTF(adt::String path, GLint drawMode, GLint texMode)
                     u32 normTexIdx = a._aTextures[normalSourceIdx].source;
                     if (normTexIdx != adt::NPOS)
                     {
-                        nMesh.meshData.materials.normal = aTex[normalSourceIdx];
+                        nMesh.meshData.materials.normal = aTex[normTexIdx];
                         nMesh.meshData.materials.normal._type = TEX_TYPE::NORMAL;
                     }
                 }
@@ -213,6 +509,8 @@ Model::loadGLTF(adt::String path, GLint drawMode, GLint texMode)
         _aaMeshes.push(aNMeshes);
     }
 
+    cache.destroy();
+
     _aTmIdxs = adt::Array<int>(_pAlloc, sq(_asset._aNodes._size));
     _aTmCounters = adt::Array<int>(_pAlloc, _asset._aNodes._size);
     _aTmIdxs.resize(sq(_asset._aNodes._size));
@@ -230,18 +528,65 @@ Model::loadGLTF(adt::String path, GLint drawMode, GLint texMode)
             _aTmIdxs[at(ch, _aTmCounters[ch]++)] = i; /* give each children it's parent's idx's */
     }
 
-    tp.destroy();
-    aAlloc.freeAll();
+    aTex.destroy();
+    pLoad->aTexPaths.destroy();
+    pLoad->aImages.destroy();
+    pLoad->aPrimitives.destroy();
+}
+
+static void
+countDraw(const Mesh& e, u32 lod = 0, u32 nInstances = 1)
+{
+    frame::g_drawStats.nDraws++;
+    frame::g_drawStats.nInstances += nInstances;
+    frame::g_drawStats.nTriangles += (e.aLods[lod].nIndices / 3) * nInstances;
+    frame::g_drawStats.nTrianglesFull += (e.aLods[0].nIndices / 3) * nInstances;
+    frame::g_drawStats.nVsInvocations += e.aLods[lod].nTransformed * nInstances;
+}
+
+/* lod 0 split into ranges, vs invocations scaled by the surviving share */
+static void
+countClusterDraw(const Mesh& e, u32 nRanges, u32 nIndices)
+{
+    u32 nFull = e.aLods[0].nIndices;
+
+    frame::g_drawStats.nDraws += nRanges;
+    frame::g_drawStats.nInstances++;
+    frame::g_drawStats.nTriangles += nIndices / 3;
+    frame::g_drawStats.nTrianglesFull += nFull / 3;
+    frame::g_drawStats.nVsInvocations += nFull ? u64(e.aLods[0].nTransformed) * nIndices / nFull : 0;
+}
+
+static void*
+lodOffset(const Mesh& e, u32 lod)
+{
+    return (void*)(u64(e.meshData.alloc.firstIndex + e.aLods[lod].firstIndex) * sizeof(u32));
+}
+
+static void
+drawElements(const Mesh& e, u32 lod = 0)
+{
+    glDrawElementsBaseVertex(GLenum(e.mode),
+                             e.aLods[lod].nIndices,
+                             GL_UNSIGNED_INT,
+                             lodOffset(e, lod),
+                             e.meshData.alloc.baseVertex);
 }
 
 void
 Model::draw(enum DRAW flags, Shader* sh, adt::String svUniform, adt::String svUniformM3Norm, const m4& tmGlobal)
 {
+    if (!_bLoaded)
+        return;
+
+    GLuint boundVao = 0;
+
     for (auto& m : _aaMeshes)
     {
         for (auto& e : m)
         {
-            glBindVertexArray(e.meshData.vao);
+            if (boundVao != e.meshData.vao)
+                glBindVertexArray(boundVao = e.meshData.vao);
 
             if (flags & DRAW::DIFF)
                 e.meshData.materials.diffuse.bind(GL_TEXTURE0);
@@ -254,59 +599,143 @@ Model::draw(enum DRAW flags, Shader* sh, adt::String svUniform, adt::String svUn
 
             if (sh)
             {
-                sh->setM4(svUniform, m);
+                sh->setM4(svUniform, m * e.dequant);
                 if (flags & DRAW::APPLY_NM) sh->setM3(svUniformM3Norm, m3Normal(m));
             }
 
-            if (e.triangleCount != adt::NPOS)
-                glDrawArrays(GLenum(e.mode), 0, e.triangleCount);
-            else
-                glDrawElements(GLenum(e.mode),
-                               e.meshData.eboSize,
-                               GLenum(e.indType),
-                               nullptr);
+            drawElements(e);
+
+            countDraw(e);
         }
     }
 }
 
+m4
+Model::nodeTransform(int nodeIdx, const m4& tmGlobal)
+{
+    auto& aNodes = _asset._aNodes;
+    auto& node = aNodes[nodeIdx];
+
+    auto at = [&](int r, int c) -> int {
+        return r*aNodes._size + c;
+    };
+
+    m4 tm = tmGlobal;
+    qt rot = qtIden();
+    for (int j = 0; j < _aTmCounters[nodeIdx]; j++)
+    {
+        /* collect each transformation from parent's map */
+        auto& n = aNodes[ _aTmIdxs[at(nodeIdx, j)] ];
+
+        tm = m4Scale(tm, n.scale);
+        rot *= n.rotation;
+        tm *= n.matrix;
+    }
+    tm = m4Scale(tm, node.scale);
+    tm *= qtRot(rot * node.rotation);
+    tm = m4Translate(tm, node.translation);
+    tm *= node.matrix;
+
+    return tm;
+}
+
+static bool
+isOccluded(const v3& wMin, const v3& wMax, const occlusion::DepthBuffer* pOcclusion)
+{
+    frame::g_drawStats.nOcclusionTests++;
+    if (pOcclusion->isOccluded(wMin, wMax))
+    {
+        frame::g_drawStats.nOccluded++;
+        return true;
+    }
+
+    return false;
+}
+
+static bool
+isCulled(const Mesh& e, const m4& tm, const Frustum* pFrustum, const occlusion::DepthBuffer* pOcclusion = nullptr)
+{
+    if (!pFrustum && !pOcclusion)
+        return false;
+
+    v3 wMin, wMax;
+    aabbTransform(tm, e.min, e.max, &wMin, &wMax);
+    if (pFrustum && !frustumAABB(*pFrustum, wMin, wMax))
+    {
+        frame::g_drawStats.nCulled++;
+        return true;
+    }
+
+    return pOcclusion && isOccluded(wMin, wMax, pOcclusion);
+}
+
+/* coarsest level whose error projects under the threshold from the closest point of the world aabb */
+static u32
+selectLod(const Mesh& e, const m4& tm, const LodSelect* pLod)
+{
+    if (!pLod || e.nLods <= 1)
+        return 0;
+
+    v3 wMin, wMax;
+    aabbTransform(tm, e.min, e.max, &wMin, &wMax);
+
+    v3 closest;
+    for (u32 j = 0; j < 3; j++)
+        closest.e[j] = pLod->eye.e[j] < wMin.e[j] ? wMin.e[j] : (pLod->eye.e[j] > wMax.e[j] ? wMax.e[j] : pLod->eye.e[j]);
+
+    f32 dist = v3Dist(closest, pLod->eye);
+    if (dist <= 0.0f)
+        return 0;
+
+    f32 scale = 0.0f;
+    for (u32 c = 0; c < 3; c++)
+        scale = fmaxf(scale, v3Length(v3(tm.e[c][0], tm.e[c][1], tm.e[c][2])));
+
+    f32 pixelsPerUnit = scale * pLod->projScale / dist;
+    for (u32 l = e.nLods - 1; l > 0; l--)
+        if (e.aLods[l].error * pixelsPerUnit <= pLod->threshold)
+            return l;
+
+    return 0;
+}
+
 void
-Model::drawGraph([[maybe_unused]] adt::Allocator* pFrameAlloc,
+Model::drawGraph(adt::Allocator* pFrameAlloc,
                  enum DRAW flags,
                  Shader* sh,
                  adt::String svUniform,
                  adt::String svUniformM3Norm,
-                 const m4& tmGlobal)
+                 const m4& tmGlobal,
+                 const Frustum* pFrustum)
 {
+    if (!_bLoaded)
+        return;
+
     auto& aNodes = _asset._aNodes;
+    GLuint boundVao = 0;
 
-    auto at = [&](int r, int c) -> int {
-        return r*aNodes._size + c;
-    };
+    /* every transform walks its whole parent chain, get them all on the pool before the gl calls */
+    m4* aTms = (m4*)pFrameAlloc->alloc(aNodes._size, sizeof(m4));
+    adt::parallelFor(&frame::g_tp, 0, aNodes._size, DRAW_GRAPH_TM_GRAIN, [&](u32 begin, u32 end) {
+        for (u32 i = begin; i < end; i++)
+            if (aNodes[i].mesh != adt::NPOS)
+                aTms[i] = nodeTransform(i, tmGlobal);
+    });
 
     for (int i = 0; i < (int)aNodes._size; i++)
     {
         auto& node = aNodes[i];
         if (node.mesh != adt::NPOS)
         {
-            m4 tm = tmGlobal;
-            qt rot = qtIden();
-            for (int j = 0; j < _aTmCounters[i]; j++)
-            {
-                /* collect each transformation from parent's map */
-                auto& n = aNodes[ _aTmIdxs[at(i, j)] ];
-
-                tm = m4Scale(tm, n.scale);
-                rot *= n.rotation;
-                tm *= n.matrix;
-            }
-            tm = m4Scale(tm, node.scale);
-            tm *= qtRot(rot * node.rotation);
-            tm = m4Translate(tm, node.translation);
-            tm *= node.matrix;
+            const m4& tm = aTms[i];
 
             for (auto& e : _aaMeshes[node.mesh])
             {
-                glBindVertexArray(e.meshData.vao);
+                if (isCulled(e, tm, pFrustum))
+                    continue;
+
+                if (boundVao != e.meshData.vao)
+                    glBindVertexArray(boundVao = e.meshData.vao);
 
                 if (flags & DRAW::DIFF)
                     e.meshData.materials.diffuse.bind(GL_TEXTURE0);
@@ -315,22 +744,535 @@ Model::drawGraph([[maybe_unused]] adt::Allocator* pFrameAlloc,
 
                 if (sh)
                 {
-                    sh->setM4(svUniform, tm);
+                    sh->setM4(svUniform, tm * e.dequant);
                     if (flags & DRAW::APPLY_NM) sh->setM3(svUniformM3Norm, m3Normal(tm));
                 }
 
-                if (e.triangleCount != adt::NPOS)
-                    glDrawArrays(GLenum(e.mode), 0, e.triangleCount);
-                else
-                    glDrawElements(GLenum(e.mode),
-                                   e.meshData.eboSize,
-                                   GLenum(e.indType),
-                                   nullptr);
+                drawElements(e);
+
+                countDraw(e);
             }
         }
     }
 }
 
+void
+Model::collectGraph(InstanceBatch* pBatch, const m4& tmGlobal, const Frustum* pFrustum, const LodSelect* pLod, const occlusion::DepthBuffer* pOcclusion)
+{
+    if (!_bLoaded)
+        return;
+
+    auto& aNodes = _asset._aNodes;
+
+    for (int i = 0; i < (int)aNodes._size; i++)
+    {
+        auto& node = aNodes[i];
+        if (node.mesh != adt::NPOS)
+        {
+            m4 tm = nodeTransform(i, tmGlobal);
+
+            for (auto& e : _aaMeshes[node.mesh])
+                if (!isCulled(e, tm, pFrustum, pOcclusion))
+                    pBatch->push(&e, selectLod(e, tm, pLod), tm);
+        }
+    }
+}
+
+void
+Model::collectOccluders(occlusion::DepthBuffer* pDepth, const m4& tmGlobal)
+{
+    if (!_bLoaded)
+        return;
+
+    auto& aNodes = _asset._aNodes;
+
+    for (int i = 0; i < (int)aNodes._size; i++)
+    {
+        auto& node = aNodes[i];
+        if (node.mesh != adt::NPOS)
+        {
+            m4 tm = nodeTransform(i, tmGlobal);
+
+            for (auto& e : _aaMeshes[node.mesh])
+            {
+                /* cut out texels don't occlude, whatever the triangles cover */
+                if (!e.occluder.nIndices || e.meshData.materials.bAlphaTested)
+                    continue;
+
+                v3 wMin, wMax;
+                aabbTransform(tm, e.min, e.max, &wMin, &wMax);
+                if (v3Length(wMax - wMin) >= occlusion::OCCLUDER_MIN_SIZE)
+                    pDepth->addOccluder(tm, e.occluder);
+            }
+        }
+    }
+}
+
+void
+Model::collectEntries(adt::Array<SceneEntry>* pOut, const m4& tmGlobal)
+{
+    if (!_bLoaded)
+        return;
+
+    auto& aNodes = _asset._aNodes;
+
+    for (int i = 0; i < (int)aNodes._size; i++)
+    {
+        auto& node = aNodes[i];
+        if (node.mesh != adt::NPOS)
+        {
+            m4 tm = nodeTransform(i, tmGlobal);
+
+            for (auto& e : _aaMeshes[node.mesh])
+            {
+                v3 wMin, wMax;
+                aabbTransform(tm, e.min, e.max, &wMin, &wMax);
+                pOut->push({&e, tm, wMin, wMax});
+            }
+        }
+    }
+}
+
+void
+collectEntry(InstanceBatch* pBatch, const SceneEntry& en, const LodSelect* pLod, const occlusion::DepthBuffer* pOcclusion)
+{
+    if (pOcclusion && isOccluded(en.min, en.max, pOcclusion))
+        return;
+
+    pBatch->push(en.pMesh, selectLod(*en.pMesh, en.tm, pLod), en.tm);
+}
+
+void
+InstanceBatch::push(Mesh* pMesh, u32 lod, const m4& tm)
+{
+    Instance inst;
+    inst.model = tm * pMesh->dequant;
+
+    if (_flags & DRAW::APPLY_NM)
+        memcpy(inst.normal, m3Normal(tm).e, sizeof(inst.normal));
+    else
+        memset(inst.normal, 0, sizeof(inst.normal));
+
+    _aKeys.push({pMesh, lod, _aInstances._size, 0, adt::NPOS});
+    _aInstances.push(inst);
+    _aTms.push(tm);
+}
+
+struct ClusterCullJob
+{
+    InstanceBatch* pBatch;
+    const ClusterCull* pCull;
+    const u32* pKeys; /* candidates of this job */
+    u32 nKeys;
+    adt::Array<InstanceBatch::Range> aRanges;
+    adt::Array<u32> aCounts; /* ranges per candidate */
+    u32 nClusters;
+    u32 nFrustumCulled;
+    u32 nBackfaceCulled;
+};
+
+/* everything happens in the primitive's space, so only the eye and the planes get transformed */
+static void
+cullClustersOf(ClusterCullJob* pJob, const Mesh& e, const m4& tm)
+{
+    auto& job = *pJob;
+    const ClusterCull& cull = *job.pCull;
+
+    m3 r = m3(tm);
+    v3 t {tm.e[3][0], tm.e[3][1], tm.e[3][2]};
+    m3 inv = m3Inverse(r);
+    v3 d = cull.eye - t;
+    v3 eye {
+        inv.e[0][0]*d.x + inv.e[1][0]*d.y + inv.e[2][0]*d.z,
+        inv.e[0][1]*d.x + inv.e[1][1]*d.y + inv.e[2][1]*d.z,
+        inv.e[0][2]*d.x + inv.e[1][2]*d.y + inv.e[2][2]*d.z
+    };
+
+    v4 aPlanes[6];
+    for (u32 i = 0; i < 6; i++)
+    {
+        const v4& p = cull.frustum.planes[i];
+        v3 n {
+            r.e[0][0]*p.x + r.e[0][1]*p.y + r.e[0][2]*p.z,
+            r.e[1][0]*p.x + r.e[1][1]*p.y + r.e[1][2]*p.z,
+            r.e[2][0]*p.x + r.e[2][1]*p.y + r.e[2][2]*p.z
+        };
+        f32 w = p.x*t.x + p.y*t.y + p.z*t.z + p.w;
+        f32 invLen = 1.0f / v3Length(n);
+        aPlanes[i] = {n.x * invLen, n.y * invLen, n.z * invLen, w * invLen};
+    }
+
+    u32 nRanges = 0;
+    for (u32 i = 0; i < e.nClusters; i++)
+    {
+        const meshopt::Cluster& c = e.pClusters[i];
+        job.nClusters++;
+
+        bool bOutside = false;
+        for (auto& p : aPlanes)
+        {
+            if (p.x*c.center.x + p.y*c.center.y + p.z*c.center.z + p.w < -c.radius)
+            {
+                bOutside = true;
+                break;
+            }
+        }
+        if (bOutside)
+        {
+            job.nFrustumCulled++;
+            continue;
+        }
+
+        v3 toCenter = c.center - eye;
+        if (v3Dot(toCenter, c.coneAxis) >= c.coneCutoff * v3Length(toCenter) + c.radius)
+        {
+            job.nBackfaceCulled++;
+            continue;
+        }
+
+        if (nRanges > 0 && job.aRanges.back().firstIndex + job.aRanges.back().nIndices == c.firstIndex)
+        {
+            job.aRanges.back().nIndices += c.nIndices;
+        }
+        else
+        {
+            job.aRanges.push({c.firstIndex, c.nIndices});
+            nRanges++;
+        }
+    }
+
+    job.aCounts.push(nRanges);
+}
+
+static int
+ClusterCullSubmit(void* p)
+{
+    auto& job = *(ClusterCullJob*)p;
+
+    for (u32 i = 0; i < job.nKeys; i++)
+    {
+        auto& key = job.pBatch->_aKeys[job.pKeys[i]];
+        cullClustersOf(&job, *key.pMesh, job.pBatch->_aTms[key.idx]);
+    }
+
+    return 0;
+}
+
+void
+InstanceBatch::cullClusters(adt::ThreadPool* pTp, const ClusterCull& cull)
+{
+    adt::Array<u32> aCandidates(&adt::StdAllocator, _aKeys._size + 1);
+    for (u32 i = 0; i < _aKeys._size; i++)
+        if (_aKeys[i].lod == 0 && _aKeys[i].pMesh->nClusters > 0)
+            aCandidates.push(i);
+
+    if (aCandidates._size > 0)
+    {
+        u32 nJobs = pTp->_threadCount;
+        u32 perJob = (aCandidates._size + nJobs - 1) / nJobs;
+        ClusterCullJob* aJobs = (ClusterCullJob*)adt::StdAllocator.alloc(nJobs, sizeof(ClusterCullJob));
+        adt::TaskGroup group;
+
+        for (u32 i = 0; i < nJobs; i++)
+        {
+            u32 first = i * perJob;
+            u32 n = first >= aCandidates._size ? 0 : (aCandidates._size - first < perJob ? aCandidates._size - first : perJob);
+
+            aJobs[i] = {this, &cull, aCandidates.data() + first, n,
+                        adt::Array<Range>(&adt::StdAllocator), adt::Array<u32>(&adt::StdAllocator, n + 1), 0, 0, 0};
+            if (n > 0)
+                pTp->submit(ClusterCullSubmit, &aJobs[i], &group);
+        }
+
+        pTp->wait(&group);
+
+        for (u32 i = 0; i < nJobs; i++)
+        {
+            auto& job = aJobs[i];
+            u32 range = 0;
+
+            for (u32 j = 0; j < job.nKeys; j++)
+            {
+                auto& key = _aKeys[job.pKeys[j]];
+                key.firstRange = _aRanges._size;
+                key.nRanges = job.aCounts[j];
+
+                for (u32 k = 0; k < key.nRanges; k++)
+                    _aRanges.push(job.aRanges[range++]);
+            }
+
+            frame::g_drawStats.nClusters += job.nClusters;
+            frame::g_drawStats.nClustersFrustumCulled += job.nFrustumCulled;
+            frame::g_drawStats.nClustersBackfaceCulled += job.nBackfaceCulled;
+
+            job.aRanges.destroy();
+            job.aCounts.destroy();
+        }
+
+        adt::StdAllocator.free(aJobs);
+    }
+
+    aCandidates.destroy();
+}
+
+static int
+compareKeys(const void* l, const void* r)
+{
+    auto& a = *(const InstanceBatch::Key*)l;
+    auto& b = *(const InstanceBatch::Key*)r;
+
+    /* alpha tested after opaque so there's one shader switch, then fewest vao and texture switches,
+     * then keep instances of one primitive together */
+    if (a.pMesh->meshData.materials.bAlphaTested != b.pMesh->meshData.materials.bAlphaTested)
+        return a.pMesh->meshData.materials.bAlphaTested ? 1 : -1;
+    if (a.pMesh->meshData.vao != b.pMesh->meshData.vao)
+        return a.pMesh->meshData.vao < b.pMesh->meshData.vao ? -1 : 1;
+    if (a.pMesh->meshData.materials.diffuse._id != b.pMesh->meshData.materials.diffuse._id)
+        return a.pMesh->meshData.materials.diffuse._id < b.pMesh->meshData.materials.diffuse._id ? -1 : 1;
+    if (a.pMesh != b.pMesh)
+        return a.pMesh < b.pMesh ? -1 : 1;
+    if (a.lod != b.lod)
+        return a.lod < b.lod ? -1 : 1;
+    if ((a.nRanges == adt::NPOS) != (b.nRanges == adt::NPOS))
+        return a.nRanges == adt::NPOS ? -1 : 1;
+
+    return a.idx < b.idx ? -1 : (a.idx > b.idx ? 1 : 0);
+}
+
+BatchProgram
+batchProgram(const Shader* sh)
+{
+    return {
+        .id = sh->id,
+        .uOctNormals = glGetUniformLocation(sh->id, "uOctNormals"),
+        .uNormalMapping = glGetUniformLocation(sh->id, "uNormalMapping"),
+        .uAlphaCutoff = glGetUniformLocation(sh->id, "uAlphaCutoff")
+    };
+}
+
+void
+InstanceBatch::sort()
+{
+    qsort(_aKeys.data(), _aKeys._size, sizeof(Key), compareKeys);
+
+    _aSorted.resize(_aKeys._size);
+    for (u32 i = 0; i < _aKeys._size; i++)
+        _aSorted[i] = _aInstances[_aKeys[i].idx];
+}
+
+void
+InstanceBatch::upload() const
+{
+    if (_aSorted._size > 0)
+        g_meshBuffers.uploadInstances(_aSorted._pData, _aSorted._size);
+}
+
+/* whole lods of one primitive next to each other go out as one instanced draw */
+static bool
+sameInstancedRun(const InstanceBatch::Key& a, const InstanceBatch::Key& b)
+{
+    return a.nRanges == adt::NPOS && b.nRanges == adt::NPOS && a.pMesh == b.pMesh && a.lod == b.lod;
+}
+
+/* sorted keys [first, end), binds are tracked from scratch so ranges can be recorded independently */
+static void
+recordKeys(const InstanceBatch& b, CmdBuffer* pOut, u32 first, u32 end, const BatchProgram& prog, bool bInstanced, const BatchProgram* pAlphaTested)
+{
+    const BatchProgram* pProg = &prog;
+    pOut->useProgram(pProg->id);
+
+    GLuint boundVao = 0;
+    GLuint boundDiff = adt::NPOS;
+    GLuint boundNorm = adt::NPOS;
+    f32 boundCutoff = -1.0f;
+
+    auto bindInstances = [&](u32 firstInstance) {
+        pOut->bindVertexBuffer(INSTANCE_BINDING, g_meshBuffers._instanceVbo, firstInstance * u32(sizeof(Instance)), sizeof(Instance));
+    };
+
+    while (first < end)
+    {
+        const InstanceBatch::Key& key = b._aKeys[first];
+        const Mesh& e = *key.pMesh;
+        u32 lod = key.lod;
+
+        if (pAlphaTested && e.meshData.materials.bAlphaTested)
+        {
+            if (pProg != pAlphaTested)
+            {
+                pProg = pAlphaTested;
+                pOut->useProgram(pProg->id);
+                boundVao = 0; /* uOctNormals */
+                boundNorm = adt::NPOS; /* uNormalMapping */
+            }
+
+            if (boundCutoff != e.meshData.materials.alphaCutoff)
+                pOut->uniformF(pProg->uAlphaCutoff, boundCutoff = e.meshData.materials.alphaCutoff);
+        }
+
+        u32 count = 1;
+        if (key.nRanges == adt::NPOS)
+        {
+            while (first + count < end && sameInstancedRun(key, b._aKeys[first + count]))
+                count++;
+        }
+        else if (key.nRanges == 0)
+        {
+            first++;
+            continue;
+        }
+
+        if (boundVao != e.meshData.vao)
+        {
+            pOut->bindVao(boundVao = e.meshData.vao);
+            pOut->uniformI(pProg->uOctNormals, g_meshBuffers.format(e.meshData.alloc) == VERTEX_FORMAT::PACKED);
+        }
+
+        if ((b._flags & DRAW::DIFF) && boundDiff != e.meshData.materials.diffuse._id)
+        {
+            pOut->bindTexture(GL_TEXTURE0, GL_TEXTURE_2D, e.meshData.materials.diffuse._id);
+            boundDiff = e.meshData.materials.diffuse._id;
+        }
+        if ((b._flags & DRAW::NORM) && boundNorm != e.meshData.materials.normal._id)
+        {
+            /* unit 1 is the shadow cube map */
+            if (e.meshData.materials.normal._id)
+                pOut->bindTexture(GL_TEXTURE6, GL_TEXTURE_2D, e.meshData.materials.normal._id);
+            pOut->uniformI(pProg->uNormalMapping, e.meshData.materials.normal._id != 0);
+            boundNorm = e.meshData.materials.normal._id;
+        }
+
+        if (key.nRanges != adt::NPOS)
+        {
+            u32 nIndices = 0;
+
+            bindInstances(first);
+            for (u32 i = 0; i < key.nRanges; i++)
+            {
+                const InstanceBatch::Range& r = b._aRanges[key.firstRange + i];
+                pOut->drawElements(GLenum(e.mode), r.nIndices, e.meshData.alloc.firstIndex + r.firstIndex, e.meshData.alloc.baseVertex);
+                nIndices += r.nIndices;
+            }
+
+            countClusterDraw(e, key.nRanges, nIndices);
+        }
+        else if (bInstanced)
+        {
+            bindInstances(first);
+            pOut->drawElements(GLenum(e.mode), e.aLods[lod].nIndices, e.meshData.alloc.firstIndex + e.aLods[lod].firstIndex,
+                               e.meshData.alloc.baseVertex, count);
+            countDraw(e, lod, count);
+        }
+        else
+        {
+            for (u32 i = 0; i < count; i++)
+            {
+                bindInstances(first + i);
+                pOut->drawElements(GLenum(e.mode), e.aLods[lod].nIndices, e.meshData.alloc.firstIndex + e.aLods[lod].firstIndex,
+                                   e.meshData.alloc.baseVertex);
+                countDraw(e, lod);
+            }
+        }
+
+        first += count;
+    }
+}
+
+struct BatchRecordJob
+{
+    const InstanceBatch* pBatch;
+    const BatchProgram* pProg;
+    const BatchProgram* pAlphaTested;
+    bool bInstanced;
+    u32 begin;
+    u32 end;
+    CmdBuffer cmds;
+    frame::DrawStats stats;
+};
+
+/* draw stats are counted on whichever thread records, so each job hands its own back */
+static int
+BatchRecordSubmit(void* p)
+{
+    auto& job = *(BatchRecordJob*)p;
+    const auto& aKeys = job.pBatch->_aKeys;
+
+    /* ranges start and end on instanced run boundaries, the same ones on both sides of every split */
+    u32 begin = job.begin, end = job.end;
+    while (begin > 0 && begin < aKeys._size && sameInstancedRun(aKeys[begin - 1], aKeys[begin]))
+        begin++;
+    while (end < aKeys._size && sameInstancedRun(aKeys[end - 1], aKeys[end]))
+        end++;
+
+    frame::DrawStats saved = frame::g_drawStats;
+    frame::g_drawStats = {};
+
+    if (begin < end)
+        recordKeys(*job.pBatch, &job.cmds, begin, end, *job.pProg, job.bInstanced, job.pAlphaTested);
+
+    job.stats = frame::g_drawStats;
+    frame::g_drawStats = saved;
+
+    return 0;
+}
+
+void
+InstanceBatch::record(adt::ThreadPool* pTp, CmdBuffer* pOut, const BatchProgram& prog, bool bInstanced, const BatchProgram* pAlphaTested) const
+{
+    u32 nJobs = pTp ? _aKeys._size / BATCH_RECORD_GRAIN : 1;
+    if (pTp && nJobs > pTp->_threadCount)
+        nJobs = pTp->_threadCount;
+
+    if (nJobs <= 1)
+    {
+        recordKeys(*this, pOut, 0, _aKeys._size, prog, bInstanced, pAlphaTested);
+        return;
+    }
+
+    u32 perJob = (_aKeys._size + nJobs - 1) / nJobs;
+    auto* aJobs = (BatchRecordJob*)adt::StdAllocator.alloc(nJobs, sizeof(BatchRecordJob));
+    adt::TaskGroup group;
+
+    for (u32 i = 0; i < nJobs; i++)
+    {
+        u32 begin = i * perJob < _aKeys._size ? i * perJob : _aKeys._size;
+        u32 end = begin + perJob < _aKeys._size ? begin + perJob : _aKeys._size;
+
+        aJobs[i] = {this, &prog, pAlphaTested, bInstanced, begin, end, CmdBuffer(&adt::StdAllocator, (end - begin) * 4 + 1), {}};
+        pTp->submit(BatchRecordSubmit, &aJobs[i], &group);
+    }
+
+    pTp->wait(&group);
+
+    for (u32 i = 0; i < nJobs; i++)
+    {
+        pOut->append(aJobs[i].cmds);
+        frame::addDrawStats(&frame::g_drawStats, aJobs[i].stats);
+        aJobs[i].cmds.destroy();
+    }
+
+    adt::StdAllocator.free(aJobs);
+}
+
+void
+InstanceBatch::flush(adt::Allocator* pFrameAlloc, Shader* sh, bool bInstanced, Shader* shAlphaTested)
+{
+    if (_aKeys._size == 0)
+        return;
+
+    sort();
+    upload();
+
+    BatchProgram prog = batchProgram(sh);
+    BatchProgram alphaTested {};
+    if (shAlphaTested)
+        alphaTested = batchProgram(shAlphaTested);
+
+    CmdBuffer cmds(pFrameAlloc, _aKeys._size * 4 + 1);
+    record(nullptr, &cmds, prog, bInstanced, shAlphaTested ? &alphaTested : nullptr);
+    cmds.replay();
+}
+
 Ubo::Ubo(u32 size, GLint drawMode)
 {
     createBuffer(size, drawMode);
@@ -2,17 +2,27 @@
 
 #include <limits.h>
 
+#include "CmdBuffer.hh"
 #include "gltf/gltf.hh"
 #include "math.hh"
+#include "MeshBuffers.hh"
+#include "meshopt.hh"
+#include "occlusion.hh"
+#include "ThreadPool.hh"
 #include "Shader.hh"
 #include "Texture.hh"
 #include "App.hh"
 
+/* nodes per drawGraph transform chunk, smaller graphs are done inline */
+constexpr u32 DRAW_GRAPH_TM_GRAIN = 64;
+/* fewest sorted keys per InstanceBatch::record() job */
+constexpr u32 BATCH_RECORD_GRAIN = 256;
+
 enum DRAW : int
 {
     NONE     = 0,
     DIFF     = 1,      /* bind diffuse textures */
-    NORM     = 1 << 1, /* bind normal textures */
+    NORM     = 1 << 1, /* bind normal textures to unit 6, sets uNormalMapping */
     APPLY_TM = 1 << 2, /* apply transformation matrix */
     APPLY_NM = 1 << 3, /* generate and apply normal matrix */
     ALL      = INT_MAX
@@ -54,14 +64,15 @@ struct Materials
 {
     Texture diffuse;
     Texture normal;
+    bool bAlphaTested; /* MASK and BLEND, discards under alphaCutoff so it's not early z safe */
+    f32 alphaCutoff;
 };
 
 struct MeshData
 {
-    GLuint vao;
-    GLuint vbo;
-    GLuint ebo;
+    GLuint vao; /* vao of the MeshBuffers page */
     GLuint eboSize;
+    MeshAlloc alloc;
 
     Materials materials;
 };
@@ -70,33 +81,131 @@ struct Mesh
 {
     MeshData meshData;
 
-    enum gltf::COMPONENT_TYPE indType;
     enum gltf::PRIMITIVES mode;
-    u32 triangleCount;
+    u32 nLods;
+    meshopt::Lod aLods[meshopt::MAX_LODS]; /* index ranges inside meshData.alloc */
+    m4 dequant; /* maps packed positions back, folded into the model matrix */
+    occlusion::Occluder occluder; /* nIndices == 0 if it's too heavy to occlude */
+    meshopt::Cluster* pClusters; /* lod 0 split for per cluster culling */
+    u32 nClusters;
+
+    /* local space bounds from POSITION accessor */
+    v3 min;
+    v3 max;
+};
+
+struct InstanceBatch;
+
+/* one primitive placed in the world, what the scene bvh is built over */
+struct SceneEntry
+{
+    Mesh* pMesh;
+    m4 tm;
+    v3 min; /* world space aabb */
+    v3 max;
+};
+
+/* where lods are picked from, see selectLod() */
+struct LodSelect
+{
+    v3 eye;
+    f32 projScale; /* pixels per unit at distance 1: viewport height / (2 * tan(fov / 2)) */
+    f32 threshold; /* max projected error in pixels */
+};
+
+/* per cluster frustum and backface culling of the lit pass, see InstanceBatch::cullClusters() */
+struct ClusterCull
+{
+    v3 eye;
+    Frustum frustum;
 };
 
+struct GltfLoad;
+
 struct Model
 {
     adt::Allocator* _pAlloc;
     adt::String _sSavedPath;
     adt::Array<adt::Array<Mesh>> _aaMeshes;
     gltf::Asset _asset;
+    bool _bLoaded = false; /* set on the render thread once everything is uploaded, nothing is drawn or collected before */
 
     Model(adt::Allocator* p) : _pAlloc(p), _aaMeshes(p), _asset(p), _aTmIdxs(p), _aTmCounters(p) {}
 
-    void load(adt::String path, GLint drawMode, GLint texMode);
+    void load(AssetLoader loader, adt::String path, GLint drawMode, GLint texMode, enum VERTEX_FORMAT eFormat = VERTEX_FORMAT::FLOAT); /* returns right away, see _bLoaded */
     void loadOBJ(adt::String path, GLint drawMode, GLint texMode);
-    void loadGLTF(adt::String path, GLint drawMode, GLint texMode);
+    adt::CoJob loadGLTF(AssetLoader loader, adt::String path, GLint drawMode, GLint texMode, enum VERTEX_FORMAT eFormat);
     void draw(enum DRAW flags, Shader* sh = nullptr, adt::String svUniform = "", adt::String svUniformM3Norm = "", const m4& tmGlobal = m4Iden());
-    void drawGraph(adt::Allocator* pFrameAlloc, enum DRAW flags, Shader* sh, adt::String svUniform, adt::String svUniformM3Norm, const m4& tmGlobal);
+    void drawGraph(adt::Allocator* pFrameAlloc, enum DRAW flags, Shader* sh, adt::String svUniform, adt::String svUniformM3Norm, const m4& tmGlobal, const Frustum* pFrustum = nullptr);
+    void collectGraph(InstanceBatch* pBatch, const m4& tmGlobal, const Frustum* pFrustum = nullptr, const LodSelect* pLod = nullptr,
+                      const occlusion::DepthBuffer* pOcclusion = nullptr); /* push visible primitives instead of drawing */
+    void collectOccluders(occlusion::DepthBuffer* pDepth, const m4& tmGlobal); /* safe alongside collectGraph() on another thread */
+    void collectEntries(adt::Array<SceneEntry>* pOut, const m4& tmGlobal); /* every primitive, no culling */
 
 private:
     void parseOBJ(adt::String path, GLint drawMode, GLint texMode);
+    void uploadGLTF(GltfLoad* pLoad);
+    m4 nodeTransform(int nodeIdx, const m4& tmGlobal);
 
     adt::Array<int> _aTmIdxs; /* parents map */
     adt::Array<int> _aTmCounters; /* map's sizes */
 };
 
+/* the uniforms InstanceBatch::record() sets, looked up on the gl thread so recording needs no gl */
+struct BatchProgram
+{
+    GLuint id;
+    GLint uOctNormals;
+    GLint uNormalMapping;
+    GLint uAlphaCutoff;
+};
+
+BatchProgram batchProgram(const Shader* sh); /* gl thread */
+
+/* Per pass list of primitives with their transforms. Sorted by page/material/primitive, the matrices go into
+ * the MeshBuffers instance buffer and there's one instanced draw per primitive, so shaders have to read
+ * aModel/aNormalMatrix attributes instead of uniforms.
+ * Everything up to the gl calls can run off the gl thread: sort(), then record() into command buffers,
+ * which the gl thread replays after upload(). flush() does it all in place. */
+struct InstanceBatch
+{
+    struct Key
+    {
+        Mesh* pMesh;
+        u32 lod;
+        u32 idx; /* into _aInstances */
+        u32 firstRange; /* into _aRanges */
+        u32 nRanges; /* NPOS: whole lod, drawn instanced with its neighbours */
+    };
+
+    /* surviving clusters, adjacent ones merged */
+    struct Range
+    {
+        u32 firstIndex; /* relative to the primitive's first index */
+        u32 nIndices;
+    };
+
+    adt::Array<Key> _aKeys;
+    adt::Array<Instance> _aInstances;
+    adt::Array<m4> _aTms; /* without dequant, clusters live in this space */
+    adt::Array<Range> _aRanges;
+    adt::Array<Instance> _aSorted; /* _aInstances in draw order, after sort() */
+    enum DRAW _flags;
+
+    InstanceBatch(adt::Allocator* pFrameAlloc, enum DRAW flags)
+        : _aKeys(pFrameAlloc), _aInstances(pFrameAlloc), _aTms(pFrameAlloc), _aRanges(pFrameAlloc), _aSorted(pFrameAlloc), _flags(flags) {}
+
+    void push(Mesh* pMesh, u32 lod, const m4& tm);
+    void cullClusters(adt::ThreadPool* pTp, const ClusterCull& cull); /* splits lod 0 keys into visible cluster ranges, on pTp's workers */
+    void sort(); /* keys into draw order, no gl */
+    /* Appends the draws to pOut, split into key ranges recorded in parallel on pTp (nullptr: the calling thread).
+     * prog gets uOctNormals per page, one draw per instance if !bInstanced.
+     * Alpha tested primitives go last, switching to pAlphaTested (which gets uAlphaCutoff) if there is one. */
+    void record(adt::ThreadPool* pTp, CmdBuffer* pOut, const BatchProgram& prog, bool bInstanced = true, const BatchProgram* pAlphaTested = nullptr) const;
+    void upload() const; /* the sorted instances, gl thread, before replaying what was recorded */
+    void flush(adt::Allocator* pFrameAlloc, Shader* sh, bool bInstanced = true, Shader* shAlphaTested = nullptr); /* all of the above, then replay */
+};
+
 struct Quad
 {
     GLuint _vao;
@@ -112,22 +221,8 @@ struct Quad
     }
 };
 
-struct ModelLoadArg
-{
-    Model* p;
-    adt::String path;
-    GLint drawMode;
-    GLint texMode;
-};
-
-inline int
-ModelSubmit(void* p)
-{
-    auto a = *(ModelLoadArg*)p;
-    a.p->load(a.path, a.drawMode, a.texMode);
-    return 0;
-};
-
+void collectEntry(InstanceBatch* pBatch, const SceneEntry& en, const LodSelect* pLod = nullptr,
+                  const occlusion::DepthBuffer* pOcclusion = nullptr); /* frustum culling is up to the caller */
 Quad makeQuad(GLint drawMode);
 // Model getPlane(GLint drawMode = GL_STATIC_DRAW);
 // Model getCube(GLint drawMode = GL_STATIC_DRAW);
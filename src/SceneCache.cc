@@ -0,0 +1,177 @@
+#include "SceneCache.hh"
+#include "DefaultAllocator.hh"
+#include "file.hh"
+#include "hash.hh"
+#include "logs.hh"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+constexpr u32 SCENE_CACHE_MAGIC = 0x434e4353; /* "SCNC" */
+
+struct SceneCacheHeader
+{
+    u32 magic;
+    u32 version;
+    u64 key;
+    u32 nPrimitives;
+};
+
+struct PrimitiveHeader
+{
+    u32 nVertices;
+    u32 nIndices;
+    meshopt::CacheStats before;
+    meshopt::CacheStats after;
+    u32 nLods;
+    meshopt::Lod aLods[meshopt::MAX_LODS];
+    u32 nClusters;
+};
+
+static void
+cachePath(adt::String gltfPath, char* pBuff, u32 size)
+{
+    snprintf(pBuff, size, "%s/%016llx.bin", SCENE_CACHE_DIR, (unsigned long long)adt::hashFNV(gltfPath._pData, gltfPath._size));
+}
+
+static u64
+hashFileStat(u64 key, adt::String path)
+{
+    char aBuff[512] {};
+    snprintf(aBuff, sizeof(aBuff), "%.*s", (int)path._size, path._pData);
+
+    struct stat st {};
+    if (stat(aBuff, &st) != 0)
+        return key;
+
+    u64 aStat[2] {u64(st.st_size), u64(st.st_mtime)};
+    return (key ^ adt::hashFNV((char*)aStat, sizeof(aStat))) * 0x100000001B3;
+}
+
+u64
+sceneCacheKey(adt::String gltfPath, const gltf::Asset& asset)
+{
+    u64 key = adt::hashFNV(gltfPath._pData, gltfPath._size) ^ SCENE_CACHE_VERSION;
+    key = hashFileStat(key, gltfPath);
+
+    for (u32 i = 0; i < asset._aBuffers._size; i++)
+    {
+        auto path = adt::replacePathSuffix(&adt::StdAllocator, gltfPath, asset._aBuffers[i].uri);
+        key = hashFileStat(key, path);
+        adt::StdAllocator.free(path._pData);
+    }
+
+    return key;
+}
+
+bool
+SceneCache::load(adt::String gltfPath, u64 key)
+{
+    char aPath[256] {};
+    cachePath(gltfPath, aPath, sizeof(aPath));
+
+    FILE* pf = fopen(aPath, "rb");
+    if (!pf)
+        return false;
+
+    SceneCacheHeader h {};
+    bool bOk = fread(&h, sizeof(h), 1, pf) == 1 &&
+               h.magic == SCENE_CACHE_MAGIC &&
+               h.version == SCENE_CACHE_VERSION &&
+               h.key == key;
+
+    if (bOk)
+    {
+        _aPrimitives.resize(h.nPrimitives);
+        memset(_aPrimitives.data(), 0, sizeof(PrimitiveStreams) * h.nPrimitives);
+
+        for (u32 i = 0; i < h.nPrimitives && bOk; i++)
+        {
+            PrimitiveHeader ph {};
+            if (fread(&ph, sizeof(ph), 1, pf) != 1)
+            {
+                bOk = false;
+                break;
+            }
+
+            auto& p = _aPrimitives[i];
+            p.before = ph.before;
+            p.after = ph.after;
+            p.nLods = ph.nLods;
+            memcpy(p.aLods, ph.aLods, sizeof(p.aLods));
+            p.aVertices = adt::Array<Vertex>(_pAlloc, ph.nVertices + 1);
+            p.aIndices = adt::Array<u32>(_pAlloc, ph.nIndices + 1);
+            p.aClusters = adt::Array<meshopt::Cluster>(_pAlloc, ph.nClusters + 1);
+            p.aVertices.resize(ph.nVertices);
+            p.aIndices.resize(ph.nIndices);
+            p.aClusters.resize(ph.nClusters);
+
+            bOk = fread(p.aVertices.data(), sizeof(Vertex), ph.nVertices, pf) == ph.nVertices &&
+                  fread(p.aIndices.data(), sizeof(u32), ph.nIndices, pf) == ph.nIndices &&
+                  fread(p.aClusters.data(), sizeof(meshopt::Cluster), ph.nClusters, pf) == ph.nClusters;
+        }
+    }
+
+    fclose(pf);
+
+    if (!bOk)
+    {
+        LOG_WARN("scene cache '%s' for '%.*s' is stale, rebuilding\n", aPath, (int)gltfPath._size, gltfPath._pData);
+        destroy();
+        _aPrimitives = adt::Array<PrimitiveStreams>(_pAlloc);
+        return false;
+    }
+
+    _key = key;
+    LOG_OK("scene cache hit: '%.*s' (%s)\n", (int)gltfPath._size, gltfPath._pData, aPath);
+
+    return true;
+}
+
+void
+SceneCache::save(adt::String gltfPath)
+{
+    char aPath[256] {};
+    char aTmpPath[272] {};
+    cachePath(gltfPath, aPath, sizeof(aPath));
+    snprintf(aTmpPath, sizeof(aTmpPath), "%s.tmp", aPath);
+
+    mkdir(SCENE_CACHE_DIR, 0755);
+
+    FILE* pf = fopen(aTmpPath, "wb");
+    if (!pf)
+    {
+        LOG_WARN("failed to write scene cache: '%s'\n", aTmpPath);
+        return;
+    }
+
+    SceneCacheHeader h {SCENE_CACHE_MAGIC, SCENE_CACHE_VERSION, _key, _aPrimitives._size};
+    fwrite(&h, sizeof(h), 1, pf);
+
+    for (auto& p : _aPrimitives)
+    {
+        PrimitiveHeader ph {p.aVertices._size, p.aIndices._size, p.before, p.after, p.nLods, {}, p.aClusters._size};
+        memcpy(ph.aLods, p.aLods, sizeof(ph.aLods));
+        fwrite(&ph, sizeof(ph), 1, pf);
+        fwrite(p.aVertices.data(), sizeof(Vertex), p.aVertices._size, pf);
+        fwrite(p.aIndices.data(), sizeof(u32), p.aIndices._size, pf);
+        fwrite(p.aClusters.data(), sizeof(meshopt::Cluster), p.aClusters._size, pf);
+    }
+
+    fclose(pf);
+
+    /* never leave a half written file under the real name */
+    if (rename(aTmpPath, aPath) != 0)
+        LOG_WARN("failed to write scene cache: '%s'\n", aPath);
+    else LOG_OK("scene cache saved: '%.*s' (%s)\n", (int)gltfPath._size, gltfPath._pData, aPath);
+}
+
+void
+SceneCache::destroy()
+{
+    for (auto& p : _aPrimitives)
+        p.destroy();
+
+    _aPrimitives.destroy();
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "MeshBuffers.hh"
+#include "gltf/gltf.hh"
+#include "meshopt.hh"
+
+/* bump on any change to the processing passes or to the file layout */
+constexpr u32 SCENE_CACHE_VERSION = 4;
+constexpr const char* SCENE_CACHE_DIR = "cache";
+
+/* load time processed streams of one primitive */
+struct PrimitiveStreams
+{
+    adt::Array<Vertex> aVertices;
+    adt::Array<u32> aIndices; /* every lod one after another */
+    meshopt::CacheStats before; /* as exported */
+    meshopt::CacheStats after;
+    u32 nLods;
+    meshopt::Lod aLods[meshopt::MAX_LODS];
+    adt::Array<meshopt::Cluster> aClusters; /* over lod 0 */
+
+    void
+    destroy()
+    {
+        if (aVertices._pAlloc) aVertices.destroy();
+        if (aIndices._pAlloc) aIndices.destroy();
+        if (aClusters._pAlloc) aClusters.destroy();
+    }
+};
+
+/* Processed streams of every primitive of one glTF asset (in mesh, then primitive order),
+ * saved to SCENE_CACHE_DIR so the optimization passes only rerun when the source files change. */
+struct SceneCache
+{
+    adt::Allocator* _pAlloc {};
+    adt::Array<PrimitiveStreams> _aPrimitives;
+    u64 _key {};
+
+    SceneCache() = default;
+    SceneCache(adt::Allocator* p) : _pAlloc(p), _aPrimitives(p) {}
+
+    bool load(adt::String gltfPath, u64 key); /* false if missing or stale */
+    void save(adt::String gltfPath);
+    void destroy();
+};
+
+/* changes whenever the .gltf or any of its buffer files change */
+u64 sceneCacheKey(adt::String gltfPath, const gltf::Asset& asset);
@@ -232,6 +232,14 @@ Shader::setV3(adt::String name, const v3& v)
     glUniform3fv(ul, 1, (GLfloat*)v.e);
 }
 
+void
+Shader::setV4Array(adt::String name, const v4* pVs, u32 count)
+{
+    GLint ul;
+    ul = glGetUniformLocation(this->id, name.data());
+    glUniform4fv(ul, count, (GLfloat*)pVs);
+}
+
 void
 Shader::setI(adt::String name, const GLint i)
 {
@@ -23,6 +23,7 @@ struct Shader
     void setM3(adt::String name, const m3& m);
     void setM4(adt::String name, const m4& m);
     void setV3(adt::String name, const v3& v);
+    void setV4Array(adt::String name, const v4* pVs, u32 count);
     void setI(adt::String name, const GLint i);
     void setF(adt::String name, const f32 f);
     void queryActiveUniforms();
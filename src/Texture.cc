@@ -5,6 +5,7 @@
 #include "Texture.hh"
 #include "frame.hh"
 #include "logs.hh"
+#include "parallel.hh"
 #include "parser/Binary.hh"
 
 /* Bitmap file format
@@ -44,15 +45,7 @@ Texture::load(adt::String path, TEX_TYPE type, bool flip, GLint texMode, GLint m
 
     adt::ArenaAllocator aAlloc(adt::SIZE_1M * 5);
     TextureData img = loadBMP(&aAlloc, path, flip);
-
-    _texPath = path;
-    _type = type;
-
-    adt::Array<u8> pixels = img.aData;
-
-    setTexture(pixels.data(), texMode, img.format, img.width, img.height, magFilter, minFilter);
-    _width = img.width;
-    _height = img.height;
+    upload(path, type, &img, texMode, magFilter, minFilter);
 
 #ifdef TEXTURE
     LOG(OK, "%.*s: id: %d, texMode: %d\n", (int)path.size, path.pData, id, format);
@@ -61,6 +54,17 @@ Texture::load(adt::String path, TEX_TYPE type, bool flip, GLint texMode, GLint m
     aAlloc.freeAll();
 }
 
+void
+Texture::upload(adt::String path, TEX_TYPE type, TextureData* pImg, GLint texMode, GLint magFilter, GLint minFilter)
+{
+    _texPath = path;
+    _type = type;
+
+    setTexture(pImg->aData.data(), texMode, pImg->format, pImg->width, pImg->height, magFilter, minFilter);
+    _width = pImg->width;
+    _height = pImg->height;
+}
+
 void
 Texture::bind(GLint glTexture)
 {
@@ -71,9 +75,6 @@ Texture::bind(GLint glTexture)
 void
 Texture::setTexture(u8* pData, GLint texMode, GLint format, GLsizei width, GLsizei height, GLint magFilter, GLint minFilter)
 {
-    mtx_lock(&gl::mtxGlContext);
-    frame::g_app->bindGlContext();
-
     glGenTextures(1, &_id);
     glBindTexture(GL_TEXTURE_2D, _id);
     /* set the texture wrapping parameters */
@@ -90,9 +91,6 @@ Texture::setTexture(u8* pData, GLint texMode, GLint format, GLsizei width, GLsiz
     /* load image, create texture and generate mipmaps */
     glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, pData);
     glGenerateMipmap(GL_TEXTURE_2D);
-
-    frame::g_app->unbindGlContext();
-    mtx_unlock(&gl::mtxGlContext);
 }
 
 CubeMapProjections::CubeMapProjections(const m4 proj, const v3 pos)
@@ -149,24 +147,26 @@ makeShadowMap(const int width, const int height)
 }
 
 CubeMap
-makeCubeShadowMap(const int width, const int height)
+makeCubeShadowMap(const int width, const int height, GLenum internalFormat)
 {
     GLuint depthCubeMap;
     glGenTextures(1, &depthCubeMap);
     glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubeMap);
 
+    GLenum type = internalFormat == GL_DEPTH_COMPONENT16 ? GL_UNSIGNED_SHORT : GL_FLOAT;
     for (GLuint i = 0; i < 6; i++)
         glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                     0, GL_DEPTH_COMPONENT, width, height,
-                     0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+                     0, internalFormat, width, height,
+                     0, GL_DEPTH_COMPONENT, type, nullptr);
 
+    /* linear filtering with the compare mode makes every samplerCubeShadow lookup a 2x2 pcf */
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
 
     GLuint fbo;
     glGenFramebuffers(1, &fbo);
@@ -184,10 +184,20 @@ makeCubeShadowMap(const int width, const int height)
     return {fbo, depthCubeMap, width, height};
 }
 
+void
+decodeSkyBox(adt::TaskGraph* pGraph, adt::Allocator* pArena, adt::String sFaces[6], adt::GraphValue<TextureData>* aOut[6])
+{
+    for (u32 i = 0; i < 6; i++)
+    {
+        adt::String path = sFaces[i];
+        aOut[i] = pGraph->add<TextureData>(pGraph->name("decode", path), [=](TextureData* pOut) { *pOut = loadBMP(pArena, path, true); });
+        pGraph->start(aOut[i]);
+    }
+}
+
 CubeMap
-makeSkyBox(adt::String sFaces[6])
+makeSkyBox(adt::GraphValue<TextureData>* const aFaces[6])
 {
-    adt::ArenaAllocator alloc(adt::SIZE_1M * 6);
     CubeMap cmNew {};
 
     glGenTextures(1, &cmNew.tex);
@@ -195,7 +205,7 @@ makeSkyBox(adt::String sFaces[6])
 
     for (u32 i = 0; i < 6; i++)
     {
-        TextureData tex = loadBMP(&alloc, sFaces[i], true);
+        TextureData& tex = aFaces[i]->value;
         glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
                      0, tex.format, tex.width, tex.height,
                      0, tex.format, GL_UNSIGNED_BYTE, tex.aData.data());
@@ -207,8 +217,6 @@ makeSkyBox(adt::String sFaces[6])
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 
-    alloc.freeAll();
-
     return cmNew;
 }
 
@@ -282,12 +290,12 @@ loadBMP(adt::Allocator* pAlloc, adt::String path, bool flip)
     {
         default:
         case GL_RGB:
-            flipCpyBGRtoRGBA(pixels.data(), (u8*)(&p[p.start]), width, height, flip);
+            flipCpyBGRtoRGBA(pixels.data(), (u8*)(&p[p.start]), width, height, flip, &frame::g_tp);
             format = GL_RGBA;
             break;
 
         case GL_RGBA:
-            flipCpyBGRAtoRGBA(pixels.data(), (u8*)(&p[p.start]), width, height, flip);
+            flipCpyBGRAtoRGBA(pixels.data(), (u8*)(&p[p.start]), width, height, flip, &frame::g_tp);
             break;
     }
 
@@ -318,65 +326,74 @@ swapRedBlueBits(u32 col)
     return (col & 0xff'00'ff'00) | (r >> (4*4)) | (b << (4*4));
 };
 
-void
-flipCpyBGRAtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip)
+/* rows per parallelFor chunk, about FLIP_CPY_GRAIN_PIXELS each */
+static u32
+flipCpyGrain(int width)
 {
-    int f = vertFlip ? -(height - 1) : 0;
-    int inc = vertFlip ? 2 : 0;
+    return FLIP_CPY_GRAIN_PIXELS / width > 0 ? FLIP_CPY_GRAIN_PIXELS / width : 1;
+}
 
+void
+flipCpyBGRAtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip, adt::ThreadPool* pTp)
+{
     u32* d = (u32*)(dest);
     u32* s = (u32*)(src);
 
-    for (int y = 0; y < height; y++, f += inc)
-    {
-        for (int x = 0; x < width; x += 4)
+    auto rows = [=](u32 yBegin, u32 yEnd) {
+        for (int y = yBegin; y < (int)yEnd; y++)
         {
-            __m128i pack = _mm_loadu_si128((__m128i*)(&s[y*width + x]));
-            __m128i redBits = _mm_and_si128(pack, _mm_set1_epi32(0x00'ff'00'00));
-            __m128i blueBits = _mm_and_si128(pack, _mm_set1_epi32(0x00'00'00'ff));
-            pack = _mm_and_si128(pack, _mm_set1_epi32(0xff'00'ff'00));
-
-            /* https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html#techs=SSE_ALL&ig_expand=3975,627,305,2929,627&cats=Shift */
-            redBits = _mm_bsrli_si128(redBits, 2); /* shift 2 because: 'dst[127:0] := a[127:0] << (tmp*8)' */
-            blueBits = _mm_bslli_si128(blueBits, 2);
-
-            pack = _mm_or_si128(_mm_or_si128(pack, redBits), blueBits);
-            _mm_storeu_si128((__m128i*)(&d[(y-f)*width + x]), pack);
+            int yDest = vertFlip ? height - 1 - y : y;
+            for (int x = 0; x < width; x += 4)
+            {
+                __m128i pack = _mm_loadu_si128((__m128i*)(&s[y*width + x]));
+                __m128i redBits = _mm_and_si128(pack, _mm_set1_epi32(0x00'ff'00'00));
+                __m128i blueBits = _mm_and_si128(pack, _mm_set1_epi32(0x00'00'00'ff));
+                pack = _mm_and_si128(pack, _mm_set1_epi32(0xff'00'ff'00));
+
+                /* https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html#techs=SSE_ALL&ig_expand=3975,627,305,2929,627&cats=Shift */
+                redBits = _mm_bsrli_si128(redBits, 2); /* shift 2 because: 'dst[127:0] := a[127:0] << (tmp*8)' */
+                blueBits = _mm_bslli_si128(blueBits, 2);
+
+                pack = _mm_or_si128(_mm_or_si128(pack, redBits), blueBits);
+                _mm_storeu_si128((__m128i*)(&d[yDest*width + x]), pack);
+            }
         }
-    }
+    };
+
+    if (pTp) adt::parallelFor(pTp, 0, height, flipCpyGrain(width), rows);
+    else rows(0, height);
 };
 
 void
-flipCpyBGRtoRGB(u8* dest, u8* src, int width, int height, bool vertFlip)
+flipCpyBGRtoRGB(u8* dest, u8* src, int width, int height, bool vertFlip, adt::ThreadPool* pTp)
 {
-    int f = vertFlip ? -(height - 1) : 0;
-    int inc = vertFlip ? 2 : 0;
-
     constexpr int nComponents = 3;
-    width = width * nComponents;
+    int rowSize = width * nComponents;
 
     auto at = [=](int x, int y, int z) -> int {
-        return y*width + x + z;
+        return y*rowSize + x + z;
     };
 
-    for (int y = 0; y < height; y++)
-    {
-        for (int x = 0; x < width; x += nComponents)
+    auto rows = [=](u32 yBegin, u32 yEnd) {
+        for (int y = yBegin; y < (int)yEnd; y++)
         {
-            dest[at(x, y-f, 0)] = src[at(x, y, 2)];
-            dest[at(x, y-f, 1)] = src[at(x, y, 1)];
-            dest[at(x, y-f, 2)] = src[at(x, y, 0)];
+            int yDest = vertFlip ? height - 1 - y : y;
+            for (int x = 0; x < rowSize; x += nComponents)
+            {
+                dest[at(x, yDest, 0)] = src[at(x, y, 2)];
+                dest[at(x, yDest, 1)] = src[at(x, y, 1)];
+                dest[at(x, yDest, 2)] = src[at(x, y, 0)];
+            }
         }
-        f += inc;
-    }
+    };
+
+    if (pTp) adt::parallelFor(pTp, 0, height, flipCpyGrain(width), rows);
+    else rows(0, height);
 };
 
 void
-flipCpyBGRtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip)
+flipCpyBGRtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip, adt::ThreadPool* pTp)
 {
-    int f = vertFlip ? -(height - 1) : 0;
-    int inc = vertFlip ? 2 : 0;
-
     constexpr int rgbComp = 3;
     constexpr int rgbaComp = 4;
 
@@ -387,15 +404,20 @@ flipCpyBGRtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip)
         return y*width + x + z;
     };
 
-    for (int y = 0; y < height; y++)
-    {
-        for (int xSrc = 0, xDest = 0; xSrc < rgbWidth; xSrc += rgbComp, xDest += rgbaComp)
+    auto rows = [=](u32 yBegin, u32 yEnd) {
+        for (int y = yBegin; y < (int)yEnd; y++)
         {
-            dest[at(rgbaWidth, xDest, y-f, 0)] = src[at(rgbWidth, xSrc, y, 2)];
-            dest[at(rgbaWidth, xDest, y-f, 1)] = src[at(rgbWidth, xSrc, y, 1)];
-            dest[at(rgbaWidth, xDest, y-f, 2)] = src[at(rgbWidth, xSrc, y, 0)];
-            dest[at(rgbaWidth, xDest, y-f, 3)] = 0xff;
+            int yDest = vertFlip ? height - 1 - y : y;
+            for (int xSrc = 0, xDest = 0; xSrc < rgbWidth; xSrc += rgbComp, xDest += rgbaComp)
+            {
+                dest[at(rgbaWidth, xDest, yDest, 0)] = src[at(rgbWidth, xSrc, y, 2)];
+                dest[at(rgbaWidth, xDest, yDest, 1)] = src[at(rgbWidth, xSrc, y, 1)];
+                dest[at(rgbaWidth, xDest, yDest, 2)] = src[at(rgbWidth, xSrc, y, 0)];
+                dest[at(rgbaWidth, xDest, yDest, 3)] = 0xff;
+            }
         }
-        f += inc;
-    }
+    };
+
+    if (pTp) adt::parallelFor(pTp, 0, height, flipCpyGrain(width), rows);
+    else rows(0, height);
 };
@@ -1,12 +1,19 @@
 #pragma once
 
 #include "Allocator.hh"
+#include "ArenaAllocator.hh"
 #include "Array.hh"
 #include "String.hh"
+#include "TaskGraph.hh"
+#include "coro.hh"
+#include "ThreadPool.hh"
 #include "gl/gl.hh"
 #include "math.hh"
 #include "ultratypes.h"
 
+/* texels per chunk when the bmp conversions are split over a pool */
+constexpr int FLIP_CPY_GRAIN_PIXELS = 1 << 15;
+
 enum TEX_TYPE : int
 {
     DIFFUSE = 0,
@@ -22,6 +29,23 @@ struct TextureData
     GLint format;
 };
 
+/* decoded on the pool, the pixels live in the arena until the upload frees it */
+struct DecodedImage
+{
+    adt::ArenaAllocator arena;
+    TextureData img;
+};
+
+/* What the load coroutines run on: cpu stages on pTp, gl calls on whichever thread pumps pRender */
+struct AssetLoader
+{
+    adt::ThreadPool* pTp;
+    adt::ResumeQueue* pRender;
+    adt::Allocator* pArena; /* thread safe, futures of the graph joins */
+    void (*pfnLoaded)(void* pAsset); /* on the render thread, once the asset can be drawn */
+    adt::TaskGraph* pGraph; /* pool stages run as its nodes, the rest is recorded on it */
+};
+
 struct Texture
 {
     adt::Allocator* _pAlloc;
@@ -38,31 +62,13 @@ struct Texture
     }
 
     void load(adt::String path, TEX_TYPE type, bool flip, GLint texMode, GLint magFilter, GLint minFilter);
+    void upload(adt::String path, TEX_TYPE type, TextureData* pImg, GLint texMode, GLint magFilter, GLint minFilter); /* already decoded */
     void bind(GLint glTexture);
 
 private:
     void setTexture(u8* data, GLint texMode, GLint format, GLsizei width, GLsizei height, GLint magFilter, GLint minFilter);
 };
 
-struct TexLoadArg
-{
-    Texture* self;
-    adt::String path;
-    TEX_TYPE type;
-    bool flip;
-    GLint texMode;
-    GLint magFilter;
-    GLint minFilter;
-};
-
-inline int
-TextureSubmit(void* p)
-{
-    auto a = *(TexLoadArg*)p;
-    a.self->load(a.path, a.type, a.flip, a.texMode, a.magFilter, a.minFilter);
-    return 0;
-}
-
 struct ShadowMap
 {
     GLuint fbo;
@@ -85,9 +91,12 @@ struct CubeMapProjections
 };
 
 ShadowMap makeShadowMap(const int width, const int height);
-CubeMap makeCubeShadowMap(const int width, const int height);
-CubeMap makeSkyBox(adt::String sFaces[6]);
+CubeMap makeCubeShadowMap(const int width, const int height, GLenum internalFormat = GL_DEPTH_COMPONENT32F); /* or GL_DEPTH_COMPONENT16 */
+/* one started graph node per face, image data comes from pArena, which has to be safe to use from the pool */
+void decodeSkyBox(adt::TaskGraph* pGraph, adt::Allocator* pArena, adt::String sFaces[6], adt::GraphValue<TextureData>* aOut[6]);
+CubeMap makeSkyBox(adt::GraphValue<TextureData>* const aFaces[6]); /* once every face's node is done */
 TextureData loadBMP(adt::Allocator* pAlloc, adt::String path, bool flip);
-void flipCpyBGRAtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip);
-void flipCpyBGRtoRGB(u8* dest, u8* src, int width, int height, bool vertFlip);
-void flipCpyBGRtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip);
+/* rows are split over pTp when it's given */
+void flipCpyBGRAtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip, adt::ThreadPool* pTp = nullptr);
+void flipCpyBGRtoRGB(u8* dest, u8* src, int width, int height, bool vertFlip, adt::ThreadPool* pTp = nullptr);
+void flipCpyBGRtoRGBA(u8* dest, u8* src, int width, int height, bool vertFlip, adt::ThreadPool* pTp = nullptr);
@@ -0,0 +1,272 @@
+#pragma once
+
+#include <new>
+#include <type_traits>
+
+#include "ThreadPool.hh"
+
+namespace adt
+{
+
+/* someone to tell once a future resolves, pushed onto its state's list */
+struct FutureLink
+{
+    FutureLink* pNext;
+    void (*pfnNotify)(void* pOwner);
+    void* pOwner;
+};
+
+/* Completion of one task: waiters park on the group like on any other, links are notified on the resolving thread.
+ * States live in the arena they were made with and are never destructed, so results should own nothing that needs it
+ * (or be freed by whoever consumes them), and the arena has to be safe to allocate from several threads. */
+struct FutureStateBase
+{
+    static inline FutureLink s_resolved {}; /* replaces the link list once resolved */
+
+    ThreadPool* pTp;
+    Allocator* pArena;
+    TaskGroup group; /* 1 until resolved */
+    std::atomic<FutureLink*> pLinks;
+
+    void init(ThreadPool* _pTp, Allocator* _pArena);
+    bool ready() const { return group.done(); }
+    void link(FutureLink* pLink); /* notified right away if already resolved */
+    void resolve();
+};
+
+inline void
+FutureStateBase::init(ThreadPool* _pTp, Allocator* _pArena)
+{
+    pTp = _pTp;
+    pArena = _pArena;
+    group._state.store(0, std::memory_order_relaxed);
+    group.enter();
+    pLinks.store(nullptr, std::memory_order_relaxed);
+}
+
+inline void
+FutureStateBase::link(FutureLink* pLink)
+{
+    FutureLink* pHead = pLinks.load(std::memory_order_acquire);
+    do
+    {
+        if (pHead == &s_resolved)
+        {
+            pLink->pfnNotify(pLink->pOwner);
+            return;
+        }
+        pLink->pNext = pHead;
+    }
+    while (!pLinks.compare_exchange_weak(pHead, pLink, std::memory_order_acq_rel, std::memory_order_acquire));
+}
+
+/* Nothing of the state is touched past leave(), a notified coroutine may run to its end and free the arena right away.
+ * The links are still safe to walk, they belong to continuations that haven't been told yet. */
+inline void
+FutureStateBase::resolve()
+{
+    FutureLink* pLink = pLinks.exchange(&s_resolved, std::memory_order_acq_rel);
+    group.leave();
+
+    while (pLink)
+    {
+        FutureLink* pNext = pLink->pNext;
+        pLink->pfnNotify(pLink->pOwner);
+        pLink = pNext;
+    }
+}
+
+template<typename T>
+struct FutureState : FutureStateBase
+{
+    T value;
+};
+
+template<>
+struct FutureState<void> : FutureStateBase {};
+
+/* runs fn with args and keeps what it returns */
+template<typename T, typename F, typename ...ARGS>
+inline void
+futureSet(FutureState<T>* pState, F& fn, ARGS... args)
+{
+    if constexpr (std::is_void_v<T>)
+        fn(args...);
+    else pState->value = fn(args...);
+}
+
+/* what fn returns when it's given the result of a Future<T>: fn(T* pValue), or fn() for Future<void> */
+template<typename T, typename F>
+struct FutureThenResult
+{
+    using Type = std::invoke_result_t<F, T*>;
+};
+
+template<typename F>
+struct FutureThenResult<void, F>
+{
+    using Type = std::invoke_result_t<F>;
+};
+
+/* allocates a state with room for the task that resolves it, members other than the base and the value are up to the caller */
+template<typename S>
+inline S*
+futureAlloc(ThreadPool* pTp, Allocator* pArena)
+{
+    auto* pState = (S*)pArena->alloc(1, sizeof(S));
+    pState->init(pTp, pArena);
+    if constexpr (requires { pState->value; })
+        new (&pState->value) decltype(pState->value) {};
+
+    return pState;
+}
+
+template<typename T>
+struct Future
+{
+    FutureState<T>* _pState {};
+
+    bool ready() const { return _pState->ready(); }
+    void wait() const; /* helps the pool until this one is resolved, from anywhere */
+    std::add_lvalue_reference_t<T> get() const; /* wait() and the result */
+    template<typename F> Future<typename FutureThenResult<T, F>::Type> then(F fn) const; /* fn(T* pValue) on the pool once resolved */
+};
+
+template<typename T, typename F>
+struct AsyncTask : FutureState<T>
+{
+    F fn;
+
+    static int
+    run(void* p)
+    {
+        auto* s = (AsyncTask*)p;
+        futureSet(s, s->fn);
+        s->resolve();
+
+        return 0;
+    }
+};
+
+/* fn() on the pool, its result in a future allocated from pArena */
+template<typename F>
+inline Future<std::invoke_result_t<F>>
+async(ThreadPool* pTp, Allocator* pArena, F fn)
+{
+    using Task = AsyncTask<std::invoke_result_t<F>, F>;
+    auto* pTask = futureAlloc<Task>(pTp, pArena);
+    new (&pTask->fn) F(fn);
+    pTp->submit(Task::run, pTask);
+
+    return {pTask};
+}
+
+template<typename T, typename U, typename F>
+struct ThenTask : FutureState<U>
+{
+    FutureLink link;
+    FutureState<T>* pPrev;
+    F fn;
+
+    /* on the thread that resolved pPrev, the continuation itself still goes through the pool */
+    static void notify(void* p) { ((ThenTask*)p)->pTp->submit(run, p); }
+
+    static int
+    run(void* p)
+    {
+        auto* s = (ThenTask*)p;
+        if constexpr (std::is_void_v<T>)
+            futureSet(s, s->fn);
+        else futureSet(s, s->fn, &s->pPrev->value);
+        s->resolve();
+
+        return 0;
+    }
+};
+
+template<typename T>
+inline void
+Future<T>::wait() const
+{
+    if (!_pState->ready())
+        _pState->pTp->wait(&_pState->group);
+}
+
+template<typename T>
+inline std::add_lvalue_reference_t<T>
+Future<T>::get() const
+{
+    wait();
+    if constexpr (!std::is_void_v<T>)
+        return _pState->value;
+}
+
+template<typename T>
+template<typename F>
+inline Future<typename FutureThenResult<T, F>::Type>
+Future<T>::then(F fn) const
+{
+    using Task = ThenTask<T, typename FutureThenResult<T, F>::Type, F>;
+    auto* pTask = futureAlloc<Task>(_pState->pTp, _pState->pArena);
+    new (&pTask->fn) F(fn);
+    pTask->pPrev = _pState;
+    pTask->link = {nullptr, Task::notify, pTask};
+    _pState->link(&pTask->link);
+
+    return {pTask};
+}
+
+/* resolved inline by whichever input resolves last, nothing runs on the pool for it */
+struct WhenAllState : FutureState<void>
+{
+    std::atomic<u32> nLeft;
+    FutureLink* aLinks;
+
+    static void
+    notify(void* p)
+    {
+        auto* s = (WhenAllState*)p;
+        if (s->nLeft.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            s->resolve();
+    }
+};
+
+inline Future<void>
+whenAll(ThreadPool* pTp, Allocator* pArena, FutureStateBase** ppStates, u32 n)
+{
+    auto* pAll = futureAlloc<WhenAllState>(pTp, pArena);
+    pAll->aLinks = (FutureLink*)pArena->alloc(n > 0 ? n : 1, sizeof(FutureLink));
+
+    /* one extra count so nothing resolves before every link is in */
+    pAll->nLeft.store(n + 1, std::memory_order_relaxed);
+    for (u32 i = 0; i < n; i++)
+    {
+        pAll->aLinks[i] = {nullptr, WhenAllState::notify, pAll};
+        ppStates[i]->link(&pAll->aLinks[i]);
+    }
+    WhenAllState::notify(pAll);
+
+    return {pAll};
+}
+
+/* resolves once all n futures have, their results stay where they are */
+template<typename T>
+inline Future<void>
+whenAll(ThreadPool* pTp, Allocator* pArena, const Future<T>* pFutures, u32 n)
+{
+    auto** ppStates = (FutureStateBase**)pArena->alloc(n > 0 ? n : 1, sizeof(FutureStateBase*));
+    for (u32 i = 0; i < n; i++)
+        ppStates[i] = pFutures[i]._pState;
+
+    return whenAll(pTp, pArena, ppStates, n);
+}
+
+template<typename ...TS>
+inline Future<void>
+whenAll(ThreadPool* pTp, Allocator* pArena, const Future<TS>&... futures)
+{
+    FutureStateBase* aStates[] {futures._pState...};
+    return whenAll(pTp, pArena, aStates, sizeof...(TS));
+}
+
+} /* namespace adt */
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+
+#include "Allocator.hh"
+#include "utils.hh"
+
+namespace adt
+{
+
+/* Bounded multi producer multi consumer ring (Vyukov), every cell carries a sequence number
+ * that says whether it's ready for the next push or the next pop. Size has to be a power of two.
+ * Producers only contend on _enqPos and consumers on _deqPos, each aligned to a cache line of its own,
+ * which also pads the whole queue to full lines so nothing next to it shares one either. */
+template<typename T>
+struct MpmcQueue
+{
+    struct Cell
+    {
+        std::atomic<u64> seq;
+        T val;
+    };
+
+    Allocator* _pAlloc;
+    Cell* _pCells;
+    u64 _mask;
+    alignas(CACHE_LINE) std::atomic<u64> _enqPos;
+    alignas(CACHE_LINE) std::atomic<u64> _deqPos;
+
+    void init(Allocator* p, u32 size);
+    bool push(const T& val); /* false if full */
+    bool pop(T* pVal); /* false if empty */
+    u32 pushBatch(const T* pVals, u32 n); /* claims up to n consecutive cells at once, returns how many went in */
+    u32 popBatch(T* pVals, u32 n); /* up to n, oldest first, returns how many came out */
+    bool empty() const { return _enqPos.load(std::memory_order_relaxed) == _deqPos.load(std::memory_order_relaxed); }
+    void destroy() { _pAlloc->free(_pCells); }
+};
+
+template<typename T>
+inline void
+MpmcQueue<T>::init(Allocator* p, u32 size)
+{
+    assert((size & (size - 1)) == 0 && "size has to be a power of two");
+
+    _pAlloc = p;
+    _pCells = (Cell*)p->alloc(size, sizeof(Cell));
+    _mask = size - 1;
+    for (u32 i = 0; i < size; i++)
+        _pCells[i].seq.store(i, std::memory_order_relaxed);
+
+    _enqPos.store(0, std::memory_order_relaxed);
+    _deqPos.store(0, std::memory_order_relaxed);
+}
+
+template<typename T>
+inline bool
+MpmcQueue<T>::push(const T& val)
+{
+    u64 pos = _enqPos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Cell& c = _pCells[pos & _mask];
+        u64 seq = c.seq.load(std::memory_order_acquire);
+        s64 diff = s64(seq) - s64(pos);
+
+        if (diff == 0)
+        {
+            if (_enqPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                c.val = val;
+                c.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = _enqPos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template<typename T>
+inline bool
+MpmcQueue<T>::pop(T* pVal)
+{
+    u64 pos = _deqPos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        Cell& c = _pCells[pos & _mask];
+        u64 seq = c.seq.load(std::memory_order_acquire);
+        s64 diff = s64(seq) - s64(pos + 1);
+
+        if (diff == 0)
+        {
+            if (_deqPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                *pVal = c.val;
+                c.seq.store(pos + _mask + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0)
+        {
+            return false;
+        }
+        else
+        {
+            pos = _deqPos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/* A cell whose sequence is exactly its position stays free for that position until whoever claims it writes,
+ * so counting the free run first and claiming all of it with one cas is safe. */
+template<typename T>
+inline u32
+MpmcQueue<T>::pushBatch(const T* pVals, u32 n)
+{
+    if (n == 0)
+        return 0;
+
+    u64 pos = _enqPos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        u32 nFree = 0;
+        while (nFree < n && nFree <= _mask && _pCells[(pos + nFree) & _mask].seq.load(std::memory_order_acquire) == pos + nFree)
+            nFree++;
+
+        if (nFree == 0)
+        {
+            s64 diff = s64(_pCells[pos & _mask].seq.load(std::memory_order_acquire)) - s64(pos);
+            if (diff < 0)
+                return 0;
+
+            pos = _enqPos.load(std::memory_order_relaxed);
+            continue;
+        }
+
+        if (_enqPos.compare_exchange_weak(pos, pos + nFree, std::memory_order_relaxed))
+        {
+            for (u32 i = 0; i < nFree; i++)
+            {
+                Cell& c = _pCells[(pos + i) & _mask];
+                c.val = pVals[i];
+                c.seq.store(pos + i + 1, std::memory_order_release);
+            }
+
+            return nFree;
+        }
+    }
+}
+
+template<typename T>
+inline u32
+MpmcQueue<T>::popBatch(T* pVals, u32 n)
+{
+    if (n == 0)
+        return 0;
+
+    u64 pos = _deqPos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        u32 nFull = 0;
+        while (nFull < n && nFull <= _mask && _pCells[(pos + nFull) & _mask].seq.load(std::memory_order_acquire) == pos + nFull + 1)
+            nFull++;
+
+        if (nFull == 0)
+        {
+            s64 diff = s64(_pCells[pos & _mask].seq.load(std::memory_order_acquire)) - s64(pos + 1);
+            if (diff < 0)
+                return 0;
+
+            pos = _deqPos.load(std::memory_order_relaxed);
+            continue;
+        }
+
+        if (_deqPos.compare_exchange_weak(pos, pos + nFull, std::memory_order_relaxed))
+        {
+            for (u32 i = 0; i < nFull; i++)
+            {
+                Cell& c = _pCells[(pos + i) & _mask];
+                pVals[i] = c.val;
+                c.seq.store(pos + i + _mask + 1, std::memory_order_release);
+            }
+
+            return nFull;
+        }
+    }
+}
+
+} /* namespace adt */
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <assert.h>
+#include <atomic>
+
+#include "Allocator.hh"
+#include "utils.hh"
+
+namespace adt
+{
+
+/* Bounded single producer single consumer ring. Each side owns one aligned cache line with its own position and a cached copy
+ * of the other side's, which it only reloads when the ring looks full (or empty), so most calls touch no shared line.
+ * Size has to be a power of two. */
+template<typename T>
+struct SpscRing
+{
+    Allocator* _pAlloc;
+    T* _pData;
+    u64 _mask;
+    alignas(CACHE_LINE) std::atomic<u64> _tail; /* producer's */
+    u64 _headCache;
+    alignas(CACHE_LINE) std::atomic<u64> _head; /* consumer's */
+    u64 _tailCache;
+
+    void init(Allocator* p, u32 size);
+    bool push(const T& val); /* producer, false if full */
+    bool pop(T* pVal); /* consumer, false if empty */
+    u32 pushBatch(const T* pVals, u32 n); /* producer, returns how many went in */
+    u32 popBatch(T* pVals, u32 n); /* consumer, returns how many came out */
+    bool empty() const { return _tail.load(std::memory_order_relaxed) == _head.load(std::memory_order_relaxed); }
+    void destroy() { _pAlloc->free(_pData); }
+};
+
+template<typename T>
+inline void
+SpscRing<T>::init(Allocator* p, u32 size)
+{
+    assert((size & (size - 1)) == 0 && "size has to be a power of two");
+
+    _pAlloc = p;
+    _pData = (T*)p->alloc(size, sizeof(T));
+    _mask = size - 1;
+    _tail.store(0, std::memory_order_relaxed);
+    _headCache = 0;
+    _head.store(0, std::memory_order_relaxed);
+    _tailCache = 0;
+}
+
+template<typename T>
+inline bool
+SpscRing<T>::push(const T& val)
+{
+    return pushBatch(&val, 1) == 1;
+}
+
+template<typename T>
+inline bool
+SpscRing<T>::pop(T* pVal)
+{
+    return popBatch(pVal, 1) == 1;
+}
+
+template<typename T>
+inline u32
+SpscRing<T>::pushBatch(const T* pVals, u32 n)
+{
+    u64 tail = _tail.load(std::memory_order_relaxed);
+    u64 size = _mask + 1;
+
+    if (tail - _headCache + n > size)
+        _headCache = _head.load(std::memory_order_acquire);
+
+    u64 nFree = size - (tail - _headCache);
+    u32 k = n < nFree ? n : u32(nFree);
+    for (u32 i = 0; i < k; i++)
+        _pData[(tail + i) & _mask] = pVals[i];
+
+    if (k > 0)
+        _tail.store(tail + k, std::memory_order_release);
+
+    return k;
+}
+
+template<typename T>
+inline u32
+SpscRing<T>::popBatch(T* pVals, u32 n)
+{
+    u64 head = _head.load(std::memory_order_relaxed);
+
+    if (_tailCache - head < n)
+        _tailCache = _tail.load(std::memory_order_acquire);
+
+    u64 nFull = _tailCache - head;
+    u32 k = n < nFull ? n : u32(nFull);
+    for (u32 i = 0; i < k; i++)
+        pVals[i] = _pData[(head + i) & _mask];
+
+    if (k > 0)
+        _head.store(head + k, std::memory_order_release);
+
+    return k;
+}
+
+} /* namespace adt */
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <new>
+#include <stdio.h>
+#include <string.h>
+
+#include "ArenaAllocator.hh"
+#include "Array.hh"
+#include "Future.hh"
+#include "String.hh"
+#include "ThreadPool.hh"
+#include "logs.hh"
+#include "utils.hh"
+
+namespace adt
+{
+
+struct TaskGraph;
+
+/* One unit of work. It's handed to the pool once every node it depends on is done and start() was called. */
+struct GraphNode
+{
+    void (*pfnRun)(GraphNode* pSelf);
+    TaskGraph* pGraph;
+    String sName;
+    Array<GraphNode*> aSuccessors; /* guarded by the graph mutex until bDone */
+    std::atomic<u32> nWaiting; /* unfinished dependencies, +1 until start() */
+    u32 nDeps;
+    u32 threadIdx; /* ThreadPool::threadIdx() of whoever ran it */
+    f64 tReady; /* last dependency done, ms since the graph was made */
+    f64 tStart;
+    f64 tEnd;
+    bool bStarted;
+    bool bDone;
+};
+
+/* node with an output its dependents can read once it's done */
+template<typename T>
+struct GraphValue : GraphNode
+{
+    T value;
+};
+
+template<typename T, typename F>
+struct GraphTask : GraphValue<T>
+{
+    F fn; /* void fn(T* pOut) */
+
+    static void run(GraphNode* p) { auto* s = (GraphTask*)p; s->fn(&s->value); }
+};
+
+template<typename F>
+struct GraphVoidTask : GraphNode
+{
+    F fn; /* void fn() */
+
+    static void run(GraphNode* p) { ((GraphVoidTask*)p)->fn(); }
+};
+
+/* Nodes can be added from anywhere, including from inside running nodes of the same graph, which is how stages
+ * whose fan out is only known after parsing get scheduled. Nodes, callables and outputs live in the graph's arena
+ * and are never destructed, so they should own nothing that needs it, or free it in a later node.
+ * Coroutines wait on the graph through join(), and what they run themselves goes in with record().
+ * Every node's ready, start and end times are kept for report() and exportTimeline(). */
+struct TaskGraph
+{
+    ThreadPool* _pTp {};
+    ArenaAllocator _arena;
+    mtx_t _mtx; /* arena, node list and edges */
+    Array<GraphNode*> _aNodes;
+    TaskGroup _group;
+    f64 _tBegin = 0.0;
+
+    TaskGraph() = default;
+    TaskGraph(ThreadPool* pTp);
+
+    template<typename T, typename F> GraphValue<T>* add(String sName, F fn); /* void fn(T* pOut), held until start() */
+    template<typename F> GraphNode* add(String sName, F fn); /* void fn(), held until start() */
+    void depend(GraphNode* pNode, GraphNode* pOn); /* pNode runs after pOn, before pNode is started */
+    void start(GraphNode* pNode); /* runs as soon as its dependencies are done */
+    Future<void> join(String sName, GraphNode* const* pNodes, u32 n, Allocator* pArena); /* resolved by a node after all of pNodes */
+    GraphNode* record(String sName, f64 tStart); /* a done node for work that ran outside the graph, from tStart until now */
+    f64 now() const { return timeNowMS() - _tBegin; }
+    String name(const char* ntsStage, String sPath); /* "stage file" in the arena, for the timeline */
+    void wait(); /* helps the pool until every started node is done */
+    void report(String sName);
+    bool exportTimeline(const char* ntsPath); /* chrome://tracing / perfetto json */
+    void destroy();
+
+private:
+    void* allocNode(u64 size, String sName, void (*pfnRun)(GraphNode*));
+    void release(GraphNode* pNode);
+    static int runNode(void* p);
+};
+
+inline
+TaskGraph::TaskGraph(ThreadPool* pTp)
+    : _pTp(pTp), _arena(SIZE_1K * 64), _tBegin(timeNowMS())
+{
+    mtx_init(&_mtx, mtx_plain);
+    _aNodes = Array<GraphNode*>(&_arena, 64);
+}
+
+inline void*
+TaskGraph::allocNode(u64 size, String sName, void (*pfnRun)(GraphNode*))
+{
+    mtx_lock(&_mtx);
+    auto* pNode = (GraphNode*)_arena.alloc(1, size);
+    pNode->aSuccessors = Array<GraphNode*>(&_arena);
+    _aNodes.push(pNode);
+    mtx_unlock(&_mtx);
+
+    pNode->pfnRun = pfnRun;
+    pNode->pGraph = this;
+    pNode->sName = sName;
+    pNode->nWaiting.store(1, std::memory_order_relaxed);
+
+    return pNode;
+}
+
+template<typename T, typename F>
+inline GraphValue<T>*
+TaskGraph::add(String sName, F fn)
+{
+    using Node = GraphTask<T, F>;
+    auto* pNode = (Node*)allocNode(sizeof(Node), sName, Node::run);
+    new (&pNode->value) T {};
+    new (&pNode->fn) F(fn);
+
+    return pNode;
+}
+
+template<typename F>
+inline GraphNode*
+TaskGraph::add(String sName, F fn)
+{
+    using Node = GraphVoidTask<F>;
+    auto* pNode = (Node*)allocNode(sizeof(Node), sName, Node::run);
+    new (&pNode->fn) F(fn);
+
+    return pNode;
+}
+
+inline void
+TaskGraph::depend(GraphNode* pNode, GraphNode* pOn)
+{
+    assert(!pNode->bStarted && "edges into started nodes could arrive after they ran");
+
+    pNode->nDeps++;
+    mtx_lock(&_mtx);
+    if (!pOn->bDone)
+    {
+        pNode->nWaiting.fetch_add(1, std::memory_order_relaxed);
+        pOn->aSuccessors.push(pNode);
+    }
+    mtx_unlock(&_mtx);
+}
+
+inline void
+TaskGraph::start(GraphNode* pNode)
+{
+    pNode->bStarted = true;
+    release(pNode);
+}
+
+/* the future's state comes from pArena, which has to be safe to use from the pool */
+inline Future<void>
+TaskGraph::join(String sName, GraphNode* const* pNodes, u32 n, Allocator* pArena)
+{
+    auto* pState = futureAlloc<FutureState<void>>(_pTp, pArena);
+    GraphNode* pJoin = add(sName, [pState] { pState->resolve(); });
+    for (u32 i = 0; i < n; i++)
+        depend(pJoin, pNodes[i]);
+    start(pJoin);
+
+    return {pState};
+}
+
+/* e.g. a coroutine's stretch on the render thread, on the caller's row, later nodes can depend on it like on any other */
+inline GraphNode*
+TaskGraph::record(String sName, f64 tStart)
+{
+    auto* pNode = (GraphNode*)allocNode(sizeof(GraphNode), sName, nullptr);
+    pNode->nWaiting.store(0, std::memory_order_relaxed);
+    pNode->threadIdx = _pTp->threadIdx();
+    pNode->tReady = pNode->tStart = tStart;
+    pNode->tEnd = now();
+    pNode->bStarted = true;
+
+    mtx_lock(&_mtx);
+    pNode->bDone = true;
+    mtx_unlock(&_mtx);
+
+    return pNode;
+}
+
+inline String
+TaskGraph::name(const char* ntsStage, String sPath)
+{
+    u32 first = sPath._size > 0 ? findLastOf(sPath, '/') + 1 : 0;
+    u32 nStage = strlen(ntsStage);
+    u32 size = nStage + 1 + sPath._size - first;
+
+    mtx_lock(&_mtx);
+    char* pData = (char*)_arena.alloc(size + 1, sizeof(char));
+    mtx_unlock(&_mtx);
+
+    memcpy(pData, ntsStage, nStage);
+    pData[nStage] = ' ';
+    memcpy(pData + nStage + 1, sPath._pData + first, sPath._size - first);
+
+    return {pData, size};
+}
+
+inline void
+TaskGraph::release(GraphNode* pNode)
+{
+    if (pNode->nWaiting.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        pNode->tReady = now();
+        _pTp->submit(runNode, pNode, &_group);
+    }
+}
+
+inline int
+TaskGraph::runNode(void* p)
+{
+    auto* pNode = (GraphNode*)p;
+    TaskGraph* self = pNode->pGraph;
+
+    pNode->threadIdx = self->_pTp->threadIdx();
+    pNode->tStart = self->now();
+    pNode->pfnRun(pNode);
+    pNode->tEnd = self->now();
+
+    /* no edges can be added after this, so the list is safe to walk unlocked */
+    mtx_lock(&self->_mtx);
+    pNode->bDone = true;
+    mtx_unlock(&self->_mtx);
+
+    for (GraphNode* pSucc : pNode->aSuccessors)
+        self->release(pSucc);
+
+    return 0;
+}
+
+inline void
+TaskGraph::wait()
+{
+    _pTp->wait(&_group);
+}
+
+/* wall time against summed node time, how long ready nodes sat in the queues, and the single longest node */
+inline void
+TaskGraph::report(String sName)
+{
+    f64 wall = 0.0, busy = 0.0, queued = 0.0;
+    const GraphNode* pLongest = nullptr;
+    for (GraphNode* pNode : _aNodes)
+    {
+        if (!pNode->bDone)
+            continue;
+
+        wall = pNode->tEnd > wall ? pNode->tEnd : wall;
+        busy += pNode->tEnd - pNode->tStart;
+        queued += pNode->tStart - pNode->tReady;
+        if (!pLongest || pNode->tEnd - pNode->tStart > pLongest->tEnd - pLongest->tStart)
+            pLongest = pNode;
+    }
+
+    LOG_OK("graph '%.*s': %u nodes, %.3f ms wall, %.3f ms of work (%.2f busy workers avg), %.3f ms queued in total\n",
+           (int)sName._size, sName._pData, _aNodes._size, wall, busy, wall > 0.0 ? busy / wall : 0.0, queued);
+    if (pLongest)
+    {
+        LOG_OK("    longest node: '%.*s' %.3f ms\n",
+               (int)pLongest->sName._size, pLongest->sName._pData, pLongest->tEnd - pLongest->tStart);
+    }
+}
+
+/* one complete event per node on its worker's row, plus a flow arrow per edge from the end of the dependency */
+inline bool
+TaskGraph::exportTimeline(const char* ntsPath)
+{
+    FILE* pf = fopen(ntsPath, "wb");
+    if (!pf)
+    {
+        LOG_WARN("failed to write timeline: '%s'\n", ntsPath);
+        return false;
+    }
+
+    fprintf(pf, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(pf, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"outside the pool\"}}", _pTp->_threadCount);
+
+    u32 flowId = 0;
+    for (GraphNode* pNode : _aNodes)
+    {
+        if (!pNode->bDone)
+            continue;
+
+        /* names are paths or identifiers, quotes and backslashes are the only things to escape */
+        fprintf(pf, ",\n{\"name\":\"");
+        for (u32 i = 0; i < pNode->sName._size; i++)
+        {
+            char c = pNode->sName._pData[i];
+            if (c == '"' || c == '\\')
+                fputc('\\', pf);
+            fputc(c, pf);
+        }
+        fprintf(pf, "\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"deps\":%u,\"queuedMs\":%.3f}}",
+                pNode->threadIdx, pNode->tStart * 1000.0, (pNode->tEnd - pNode->tStart) * 1000.0, pNode->nDeps,
+                pNode->tStart - pNode->tReady);
+
+        for (GraphNode* pSucc : pNode->aSuccessors)
+        {
+            if (!pSucc->bDone)
+                continue;
+
+            fprintf(pf, ",\n{\"name\":\"dep\",\"ph\":\"s\",\"id\":%u,\"pid\":0,\"tid\":%u,\"ts\":%.3f}",
+                    flowId, pNode->threadIdx, pNode->tEnd * 1000.0);
+            fprintf(pf, ",\n{\"name\":\"dep\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%u,\"pid\":0,\"tid\":%u,\"ts\":%.3f}",
+                    flowId, pSucc->threadIdx, pSucc->tStart * 1000.0);
+            flowId++;
+        }
+    }
+
+    fprintf(pf, "\n]}\n");
+    fclose(pf);
+
+    return true;
+}
+
+inline void
+TaskGraph::destroy()
+{
+    _arena.freeAll();
+    mtx_destroy(&_mtx);
+}
+
+} /* namespace adt */
@@ -1,129 +1,380 @@
 #pragma once
 
+#include <assert.h>
 #include <atomic>
 #include <threads.h>
 
-#include "Queue.hh"
+#include "Allocator.hh"
+#include "MpmcQueue.hh"
+#include "futex.hh"
+#include "topology.hh"
 
-#ifdef __linux__
-    #include <sys/sysinfo.h>
-    #define getLogicalCoresCount() get_nprocs()
-#elif _WIN32
-    #include <windows.h>
-    #include <sysinfoapi.h>
+namespace adt
+{
 
-inline DWORD
-getLogicalCoresCountWIN32()
+/* per worker, tasks that don't fit go to the injection queue */
+constexpr u32 THREAD_POOL_DEQUE_SIZE = 1 << 12;
+/* submits from outside the pool, tasks that don't fit run inline */
+constexpr u32 THREAD_POOL_INJECT_SIZE = 1 << 12;
+/* rounds over every queue an idle worker makes before parking */
+constexpr u32 THREAD_POOL_SPIN = 1 << 8;
+
+/* Tasks submitted with a group can be waited on together, from inside other tasks too.
+ * Lives on the stack of whoever waits, submits into it from running tasks are fine as long as the task itself belongs to it. */
+struct TaskGroup
 {
-    SYSTEM_INFO info;
-    GetSystemInfo(&info);
-    return info.dwNumberOfProcessors;
-}
+    static constexpr u32 WAITING = 1u << 31; /* someone may be parked on _state */
 
-    #define getLogicalCoresCount() getLogicalCoresCountWIN32()
-#else
-    #define getLogicalCoresCount() 4
-#endif
+    std::atomic<u32> _state {}; /* pending tasks | WAITING */
 
-namespace adt
+    bool done() const { return (_state.load(std::memory_order_acquire) & ~WAITING) == 0; }
+    void enter() { _state.fetch_add(1, std::memory_order_relaxed); }
+    void leave();
+};
+
+inline void
+TaskGroup::leave()
 {
+    /* the waiter can return and drop the group right after the decrement, only its address is used past that */
+    u32 prev = _state.fetch_sub(1, std::memory_order_seq_cst);
+    if (prev == (WAITING | 1))
+        futexWake(&_state, true);
+}
 
 struct TaskNode
 {
     thrd_start_t pfn;
     void* pArgs;
+    TaskGroup* pGroup;
+};
+
+/* Chase-Lev work stealing deque (Le et al. 2013, C11 version) with a fixed power of two size.
+ * The owner pushes and pops at the bottom, thieves take from the top. */
+struct WorkDeque
+{
+    /* thieves may read a slot the owner is overwriting, the cas on _top throws such reads away */
+    struct Slot
+    {
+        std::atomic<thrd_start_t> pfn;
+        std::atomic<void*> pArgs;
+        std::atomic<TaskGroup*> pGroup;
+    };
+
+    std::atomic<s64> _top;
+    u8 _pad0[CACHE_LINE - sizeof(std::atomic<s64>)];
+    std::atomic<s64> _bottom;
+    u8 _pad1[CACHE_LINE - sizeof(std::atomic<s64>)];
+    Slot* _pSlots;
+    s64 _mask;
+
+    void init(Allocator* p, u32 size);
+    bool push(TaskNode task); /* owner, false if full */
+    bool pop(TaskNode* pTask); /* owner */
+    bool steal(TaskNode* pTask); /* any thread, false if empty or another thread won */
+    bool empty() const { return _bottom.load(std::memory_order_relaxed) <= _top.load(std::memory_order_relaxed); }
 };
 
+inline void
+WorkDeque::init(Allocator* p, u32 size)
+{
+    _top.store(0, std::memory_order_relaxed);
+    _bottom.store(0, std::memory_order_relaxed);
+    _pSlots = (Slot*)p->alloc(size, sizeof(Slot));
+    _mask = s64(size) - 1;
+}
+
+inline bool
+WorkDeque::push(TaskNode task)
+{
+    s64 b = _bottom.load(std::memory_order_relaxed);
+    s64 t = _top.load(std::memory_order_acquire);
+    if (b - t > _mask)
+        return false;
+
+    Slot& s = _pSlots[b & _mask];
+    s.pfn.store(task.pfn, std::memory_order_relaxed);
+    s.pArgs.store(task.pArgs, std::memory_order_relaxed);
+    s.pGroup.store(task.pGroup, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _bottom.store(b + 1, std::memory_order_relaxed);
+
+    return true;
+}
+
+inline bool
+WorkDeque::pop(TaskNode* pTask)
+{
+    s64 b = _bottom.load(std::memory_order_relaxed) - 1;
+    _bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    s64 t = _top.load(std::memory_order_relaxed);
+
+    if (t > b)
+    {
+        _bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    Slot& s = _pSlots[b & _mask];
+    *pTask = {s.pfn.load(std::memory_order_relaxed), s.pArgs.load(std::memory_order_relaxed), s.pGroup.load(std::memory_order_relaxed)};
+
+    /* last one, race the thieves for it */
+    bool bOk = true;
+    if (t == b)
+    {
+        bOk = _top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+        _bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    return bOk;
+}
+
+inline bool
+WorkDeque::steal(TaskNode* pTask)
+{
+    s64 t = _top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    s64 b = _bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return false;
+
+    Slot& s = _pSlots[t & _mask];
+    TaskNode task {s.pfn.load(std::memory_order_relaxed), s.pArgs.load(std::memory_order_relaxed), s.pGroup.load(std::memory_order_relaxed)};
+    if (!_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return false;
+
+    *pTask = task;
+    return true;
+}
+
+/* Work stealing pool: each worker runs its own deque lifo, submits from outside go through the injection queue,
+ * idle workers steal from random victims, spin for a while, then park on a futex until the next submit.
+ * Pinned workers try victims behind the same l2 first, then the same l3, then everyone else. */
 struct ThreadPool
 {
+    struct Worker
+    {
+        WorkDeque deque;
+        ThreadPool* pPool;
+        u32 idx;
+        u32 rng; /* victim selection */
+        u32 cpu; /* pinned to, NPOS if not */
+        u32* pVictims; /* every other worker, the ones sharing the l2 first, then the l3 */
+        u32 nNearL2; /* how many of pVictims share the l2 */
+        u32 nNearL3; /* and the l3, those sharing the l2 included */
+    };
+
     Allocator* _pAlloc {};
-    Queue<TaskNode> _qTasks;
     thrd_t* _pThreads {};
+    Worker* _pWorkers {};
+    u32* _pVictims {};
     u32 _threadCount {};
-    cnd_t _cndQ, _cndWait;
-    mtx_t _mtxQ, _mtxWait;
-    std::atomic<int> _activeTaskCount;
-    bool _bDone {};
+    enum AFFINITY _eAffinity {};
+    MpmcQueue<TaskNode> _qInject {};
+    std::atomic<u32> _nPending {}; /* submitted and not yet finished */
+    std::atomic<u32> _nWaiters {}; /* threads parked in wait() */
+    std::atomic<u32> _sleepEpoch {}; /* bumped to wake parked workers */
+    std::atomic<u32> _nSleeping {};
+    std::atomic<bool> _bDone {};
 
     ThreadPool() = default;
     ThreadPool(Allocator* p, u32 _threadCount);
     ThreadPool(Allocator* p);
+    ThreadPool(Allocator* p, const CpuTopology& topo, enum AFFINITY eAffinity); /* NONE is the same as ThreadPool(p) */
 
     void start();
-    bool busy();
-    void submit(thrd_start_t pfnTask, void* pArgs) { submit({pfnTask, pArgs}); }
+    bool busy() const { return _nPending.load(std::memory_order_acquire) > 0; }
+    void submit(thrd_start_t pfnTask, void* pArgs, TaskGroup* pGroup = nullptr) { submit({pfnTask, pArgs, pGroup}); }
     void submit(TaskNode task);
-    void wait();
+    void wait(); /* runs tasks itself until every submitted one is done, not from inside this pool's tasks */
+    void wait(TaskGroup* pGroup); /* runs tasks itself until the group is done, from anywhere */
+    u32 threadIdx() const; /* worker index of the calling thread, _threadCount for threads outside the pool */
     void destroy();
 
 private:
+    bool runOne(Worker* pSelf); /* pSelf is nullptr outside the pool */
+    bool hasWork() const;
+    bool help(u32* pIdle); /* one task or one spin, false once it's time to park */
+    void finish(TaskGroup* pGroup);
     void stop();
-    static int loop(void* _self);
+    static int loop(void* pWorker);
 };
 
+/* worker the current thread belongs to, nullptr on threads outside of any pool */
+inline thread_local ThreadPool::Worker* g_pThisWorker = nullptr;
+
 inline
 ThreadPool::ThreadPool(Allocator* p, u32 _threadCount)
-    : _pAlloc(p), _qTasks(p, _threadCount), _threadCount(_threadCount), _activeTaskCount(0), _bDone(false)
+    : _pAlloc(p), _threadCount(_threadCount)
 {
     _pThreads = (thrd_t*)p->alloc(_threadCount, sizeof(thrd_t));
-    cnd_init(&_cndQ);
-    mtx_init(&_mtxQ, mtx_plain);
-    cnd_init(&_cndWait);
-    mtx_init(&_mtxWait, mtx_plain);
+    _pWorkers = (Worker*)p->alloc(_threadCount, sizeof(Worker));
+    _pVictims = (u32*)p->alloc(_threadCount * _threadCount + 1, sizeof(u32));
+    for (u32 i = 0; i < _threadCount; i++)
+    {
+        Worker& w = _pWorkers[i];
+        w.deque.init(p, THREAD_POOL_DEQUE_SIZE);
+        w.pPool = this;
+        w.idx = i;
+        w.rng = 0x9e3779b9u * (i + 1);
+        w.cpu = NPOS;
+        w.pVictims = _pVictims + i * _threadCount;
+        w.nNearL2 = w.nNearL3 = 0;
+
+        for (u32 j = 0, n = 0; j < _threadCount; j++)
+            if (j != i)
+                w.pVictims[n++] = j;
+    }
+
+    _qInject.init(p, THREAD_POOL_INJECT_SIZE);
 }
 
 inline
 ThreadPool::ThreadPool(Allocator* p)
     : ThreadPool(p, getLogicalCoresCount()) {}
 
+inline
+ThreadPool::ThreadPool(Allocator* p, const CpuTopology& topo, enum AFFINITY eAffinity)
+    : ThreadPool(p, eAffinity == AFFINITY::NONE ? u32(getLogicalCoresCount()) : topo.placeWorkers(eAffinity, nullptr))
+{
+    _eAffinity = eAffinity;
+    if (eAffinity == AFFINITY::NONE)
+        return;
+
+    u32 aIdxs[TOPOLOGY_MAX_CPUS];
+    topo.placeWorkers(eAffinity, aIdxs);
+
+    /* victims by tier: 0 shares the l2, 1 the l3, 2 neither */
+    for (u32 i = 0; i < _threadCount; i++)
+    {
+        Worker& w = _pWorkers[i];
+        const CpuInfo& self = topo.aCpus[aIdxs[i]];
+        w.cpu = self.id;
+
+        u32 n = 0;
+        for (u32 tier = 0; tier < 3; tier++)
+        {
+            for (u32 j = 0; j < _threadCount; j++)
+            {
+                const CpuInfo& other = topo.aCpus[aIdxs[j]];
+                u32 t = other.l2 == self.l2 ? 0 : (other.l3 == self.l3 ? 1 : 2);
+                if (j != i && t == tier)
+                    w.pVictims[n++] = j;
+            }
+
+            if (tier == 0)
+                w.nNearL2 = n;
+            else if (tier == 1)
+                w.nNearL3 = n;
+        }
+    }
+}
+
 inline void
 ThreadPool::start()
 {
-    for (size_t i = 0; i < _threadCount; i++)
-        thrd_create(&_pThreads[i], ThreadPool::loop, this);
+    for (u32 i = 0; i < _threadCount; i++)
+        thrd_create(&_pThreads[i], ThreadPool::loop, &_pWorkers[i]);
 }
 
-inline bool
-ThreadPool::busy()
+inline void
+ThreadPool::finish(TaskGroup* pGroup)
 {
-    mtx_lock(&_mtxQ);
-    bool ret = !_qTasks.empty() || _activeTaskCount > 0;
-    mtx_unlock(&_mtxQ);
+    if (pGroup)
+        pGroup->leave();
 
-    return ret;
+    if (_nPending.fetch_sub(1, std::memory_order_seq_cst) == 1 && _nWaiters.load(std::memory_order_seq_cst) > 0)
+        futexWake(&_nPending, true);
 }
 
-inline int
-ThreadPool::loop(void* p)
+inline bool
+ThreadPool::runOne(Worker* pSelf)
 {
-    auto* self = (ThreadPool*)p;
+    TaskNode task;
+    bool bFound = (pSelf && pSelf->deque.pop(&task)) || _qInject.pop(&task);
 
-    while (!self->_bDone)
+    if (!bFound && _threadCount > 0)
     {
-        TaskNode task;
+        u32 rng = pSelf ? pSelf->rng : u32(u64(&task) >> 4);
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        if (pSelf)
+            pSelf->rng = rng;
+
+        if (pSelf)
         {
-            mtx_lock(&self->_mtxQ);
-
-            while (!(!self->_qTasks.empty() || self->_bDone))
-                cnd_wait(&self->_cndQ, &self->_mtxQ);
-
-            if (self->_bDone)
+            /* nearest tier first, each one from a random start */
+            u32 aEnds[3] {pSelf->nNearL2, pSelf->nNearL3, _threadCount - 1};
+            for (u32 t = 0, begin = 0; t < 3 && !bFound; begin = aEnds[t++])
             {
-                mtx_unlock(&self->_mtxQ);
-                return thrd_success;
+                u32 n = aEnds[t] - begin;
+                for (u32 i = 0; i < n && !bFound; i++)
+                    bFound = _pWorkers[pSelf->pVictims[begin + (rng + i) % n]].deque.steal(&task);
             }
+        }
+        else
+        {
+            for (u32 i = 0, first = rng % _threadCount; i < _threadCount && !bFound; i++)
+                bFound = _pWorkers[(first + i) % _threadCount].deque.steal(&task);
+        }
+    }
 
-            task = *self->_qTasks.popFront();
-            self->_activeTaskCount++; /* increment before unlocking mtxQ to avoid 0 tasks and 0 q possibility */
+    if (!bFound)
+        return false;
 
-            mtx_unlock(&self->_mtxQ);
-        }
+    task.pfn(task.pArgs);
+    finish(task.pGroup);
 
-        task.pfn(task.pArgs);
-        self->_activeTaskCount--;
+    return true;
+}
+
+inline bool
+ThreadPool::hasWork() const
+{
+    if (!_qInject.empty())
+        return true;
+
+    for (u32 i = 0; i < _threadCount; i++)
+        if (!_pWorkers[i].deque.empty())
+            return true;
+
+    return false;
+}
+
+inline int
+ThreadPool::loop(void* p)
+{
+    auto* pSelf = (Worker*)p;
+    ThreadPool* self = pSelf->pPool;
+    g_pThisWorker = pSelf;
+
+    if (pSelf->cpu != NPOS)
+        pinThisThread(pSelf->cpu);
+
+    u32 nIdle = 0;
+    while (!self->_bDone.load(std::memory_order_relaxed))
+    {
+        if (self->runOne(pSelf))
+        {
+            nIdle = 0;
+            continue;
+        }
 
-        if (!self->busy())
-            cnd_signal(&self->_cndWait);
+        if (++nIdle < THREAD_POOL_SPIN)
+        {
+            cpuRelax();
+            continue;
+        }
+        nIdle = 0;
+
+        /* submit() bumps the epoch after pushing if anyone sleeps, so either we see its task here or the futex won't sleep */
+        u32 epoch = self->_sleepEpoch.load(std::memory_order_seq_cst);
+        self->_nSleeping.fetch_add(1, std::memory_order_seq_cst);
+        if (!self->hasWork() && !self->_bDone.load(std::memory_order_seq_cst))
+            futexWait(&self->_sleepEpoch, epoch);
+        self->_nSleeping.fetch_sub(1, std::memory_order_relaxed);
     }
 
     return thrd_success;
@@ -132,29 +383,99 @@ ThreadPool::loop(void* p)
 inline void
 ThreadPool::submit(TaskNode task)
 {
-    mtx_lock(&_mtxQ);
-    _qTasks.pushBack(task);
-    mtx_unlock(&_mtxQ);
+    _nPending.fetch_add(1, std::memory_order_seq_cst);
+    if (task.pGroup)
+        task.pGroup->enter();
+
+    Worker* pSelf = g_pThisWorker;
+    bool bQueued = (pSelf && pSelf->pPool == this && pSelf->deque.push(task)) || _qInject.push(task);
+    if (!bQueued)
+    {
+        /* everything is full, the caller does it */
+        task.pfn(task.pArgs);
+        finish(task.pGroup);
+        return;
+    }
 
-    cnd_signal(&_cndQ);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_nSleeping.load(std::memory_order_seq_cst) > 0)
+    {
+        _sleepEpoch.fetch_add(1, std::memory_order_seq_cst);
+        futexWake(&_sleepEpoch, false);
+    }
 }
 
 inline void
 ThreadPool::wait()
 {
+    assert(!(g_pThisWorker && g_pThisWorker->pPool == this) && "wait() from inside a task would wait for itself");
+
+    u32 nIdle = 0;
     while (busy())
     {
-        mtx_lock(&_mtxWait);
-        cnd_wait(&_cndWait, &_mtxWait);
-        mtx_unlock(&_mtxWait);
+        if (help(&nIdle))
+            continue;
+
+        /* the last finish() wakes us if it sees a waiter, otherwise we see its decrement here */
+        _nWaiters.fetch_add(1, std::memory_order_seq_cst);
+        u32 nPending = _nPending.load(std::memory_order_seq_cst);
+        if (nPending > 0)
+            futexWait(&_nPending, nPending);
+        _nWaiters.fetch_sub(1, std::memory_order_relaxed);
     }
 }
 
+inline bool
+ThreadPool::help(u32* pIdle)
+{
+    Worker* pSelf = g_pThisWorker && g_pThisWorker->pPool == this ? g_pThisWorker : nullptr;
+    if (runOne(pSelf))
+    {
+        *pIdle = 0;
+        return true;
+    }
+
+    if (++*pIdle < THREAD_POOL_SPIN)
+    {
+        cpuRelax();
+        return true;
+    }
+
+    *pIdle = 0;
+    return false;
+}
+
+inline void
+ThreadPool::wait(TaskGroup* pGroup)
+{
+    u32 nIdle = 0;
+    while (!pGroup->done())
+    {
+        if (help(&nIdle))
+            continue;
+
+        /* the last finish() sees WAITING and wakes us, or the state has changed and the futex won't sleep */
+        u32 state = pGroup->_state.fetch_or(TaskGroup::WAITING, std::memory_order_seq_cst) | TaskGroup::WAITING;
+        if (state != TaskGroup::WAITING)
+            futexWait(&pGroup->_state, state);
+    }
+
+    u32 expected = TaskGroup::WAITING;
+    pGroup->_state.compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+}
+
+inline u32
+ThreadPool::threadIdx() const
+{
+    return g_pThisWorker && g_pThisWorker->pPool == this ? g_pThisWorker->idx : _threadCount;
+}
+
 inline void
 ThreadPool::stop()
 {
-    _bDone = true;
-    cnd_broadcast(&_cndQ);
+    _bDone.store(true, std::memory_order_seq_cst);
+    _sleepEpoch.fetch_add(1, std::memory_order_seq_cst);
+    futexWake(&_sleepEpoch, true);
     for (u32 i = 0; i < _threadCount; i++)
         thrd_join(_pThreads[i], nullptr);
 }
@@ -164,12 +485,12 @@ ThreadPool::destroy()
 {
     stop();
 
+    for (u32 i = 0; i < _threadCount; i++)
+        _pAlloc->free(_pWorkers[i].deque._pSlots);
+    _pAlloc->free(_pVictims);
+    _pAlloc->free(_pWorkers);
     _pAlloc->free(_pThreads);
-    _qTasks.destroy();
-    cnd_destroy(&_cndQ);
-    mtx_destroy(&_mtxQ);
-    cnd_destroy(&_cndWait);
-    mtx_destroy(&_mtxWait);
+    _qInject.destroy();
 }
 
 } /* namespace adt */
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <coroutine>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Array.hh"
+#include "Future.hh"
+#include "ThreadPool.hh"
+#include "utils.hh"
+
+namespace adt
+{
+
+/* Eager fire and forget coroutine: runs on the caller up to its first suspension and frees itself once it returns.
+ * Whoever needs to know when it's done has to count that themselves. */
+struct CoJob
+{
+    struct promise_type
+    {
+        CoJob get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+    };
+};
+
+inline int
+coResume(void* pHandle)
+{
+    std::coroutine_handle<>::from_address(pHandle).resume();
+    return 0;
+}
+
+/* co_await resumeOn(pTp) continues on one of the pool's workers.
+ * Nothing of the awaiter is touched after it's handed over, the coroutine may already be running by then */
+struct ResumeOn
+{
+    ThreadPool* pTp;
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> h) { pTp->submit(coResume, h.address()); }
+    void await_resume() const {}
+};
+
+inline ResumeOn
+resumeOn(ThreadPool* pTp)
+{
+    return {pTp};
+}
+
+/* co_await on a Future<T> gives its result, the coroutine goes on on the pool rather than inside the task that resolved it.
+ * The pool is taken while suspending, notify() runs while resolve() walks its links and mustn't read the state. */
+template<typename T>
+struct FutureAwaiter
+{
+    Future<T> future;
+    FutureLink link;
+    void* pHandle;
+    ThreadPool* pTp;
+
+    bool await_ready() const { return future.ready(); }
+
+    void
+    await_suspend(std::coroutine_handle<> h)
+    {
+        pHandle = h.address();
+        pTp = future._pState->pTp;
+        link = {nullptr, notify, this};
+        future._pState->link(&link);
+    }
+
+    std::add_lvalue_reference_t<T> await_resume() const { return future.get(); }
+
+    static void
+    notify(void* p)
+    {
+        auto* s = (FutureAwaiter*)p;
+        s->pTp->submit(coResume, s->pHandle);
+    }
+};
+
+template<typename T>
+inline FutureAwaiter<T>
+operator co_await(Future<T> future)
+{
+    return {future, {}, nullptr, nullptr};
+}
+
+/* Coroutines waiting to go on on one particular thread, which drains the queue with pump(), e.g. the gl thread once per frame.
+ * Anyone can queue, only that thread pumps. */
+struct ResumeQueue
+{
+    struct Awaiter
+    {
+        ResumeQueue* pSelf;
+
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> h) { pSelf->push(h.address()); }
+        void await_resume() const {}
+    };
+
+    mtx_t _mtx;
+    Array<void*> _aQueued; /* guarded by _mtx */
+    Array<void*> _aRunnable; /* pump()'s own, what the last budget didn't cover stays at the front */
+
+    ResumeQueue() = default;
+    ResumeQueue(Allocator* p);
+
+    Awaiter schedule() { return {this}; } /* co_await q.schedule() */
+    void push(void* pHandle);
+    u32 pump(f64 budgetMs); /* resumes oldest first, at least one, until the budget runs out; returns how many */
+    void destroy();
+};
+
+inline
+ResumeQueue::ResumeQueue(Allocator* p)
+    : _aQueued(p), _aRunnable(p)
+{
+    mtx_init(&_mtx, mtx_plain);
+}
+
+inline void
+ResumeQueue::push(void* pHandle)
+{
+    mtx_lock(&_mtx);
+    _aQueued.push(pHandle);
+    mtx_unlock(&_mtx);
+}
+
+/* coroutines that queue themselves again while being pumped go on next time */
+inline u32
+ResumeQueue::pump(f64 budgetMs)
+{
+    mtx_lock(&_mtx);
+    for (void* pHandle : _aQueued)
+        _aRunnable.push(pHandle);
+    _aQueued._size = 0;
+    mtx_unlock(&_mtx);
+
+    f64 t0 = timeNowMS();
+    u32 n = 0;
+    while (n < _aRunnable._size)
+    {
+        std::coroutine_handle<>::from_address(_aRunnable[n++]).resume();
+        if (timeNowMS() - t0 >= budgetMs)
+            break;
+    }
+
+    memmove(_aRunnable.data(), _aRunnable.data() + n, sizeof(void*) * (_aRunnable._size - n));
+    _aRunnable._size -= n;
+
+    return n;
+}
+
+inline void
+ResumeQueue::destroy()
+{
+    _aQueued.destroy();
+    _aRunnable.destroy();
+    mtx_destroy(&_mtx);
+}
+
+} /* namespace adt */
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <limits.h>
+#include <threads.h>
+
+#include "ultratypes.h"
+
+#ifdef __linux__
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#elif _WIN32
+    #include <windows.h>
+    #include <synchapi.h> /* Synchronization.lib */
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #include <immintrin.h>
+#endif
+
+namespace adt
+{
+
+/* sleeps while *p == val, spurious wakeups are possible */
+inline void
+futexWait(std::atomic<u32>* p, u32 val)
+{
+#ifdef __linux__
+    syscall(SYS_futex, (u32*)p, FUTEX_WAIT_PRIVATE, val, nullptr, nullptr, 0);
+#elif _WIN32
+    WaitOnAddress((volatile void*)p, &val, sizeof(u32), INFINITE);
+#else
+    if (p->load(std::memory_order_relaxed) == val)
+        thrd_yield();
+#endif
+}
+
+inline void
+futexWake(std::atomic<u32>* p, bool bAll)
+{
+#ifdef __linux__
+    syscall(SYS_futex, (u32*)p, FUTEX_WAKE_PRIVATE, bAll ? INT_MAX : 1, nullptr, nullptr, 0);
+#elif _WIN32
+    if (bAll)
+        WakeByAddressAll((void*)p);
+    else
+        WakeByAddressSingle((void*)p);
+#else
+    (void)p;
+    (void)bAll;
+#endif
+}
+
+/* spin loop hint */
+inline void
+cpuRelax()
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    thrd_yield();
+#endif
+}
+
+} /* namespace adt */
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "ThreadPool.hh"
+
+namespace adt
+{
+
+/* grain 0 picks one that gives each worker about this many chunks, so stealing can even out uneven ones */
+constexpr u32 PARALLEL_CHUNKS_PER_WORKER = 8;
+/* same for parallelReduce, but fixed so the result can't depend on the worker count */
+constexpr u32 PARALLEL_REDUCE_CHUNKS = 256;
+
+inline u32
+parallelGrain(const ThreadPool* pTp, u32 n, u32 grain)
+{
+    if (grain > 0)
+        return grain;
+
+    u32 nChunks = (pTp->_threadCount > 0 ? pTp->_threadCount : 1) * PARALLEL_CHUNKS_PER_WORKER;
+    return n / nChunks > 0 ? n / nChunks : 1;
+}
+
+template<typename F>
+struct ParallelForRange
+{
+    ThreadPool* pTp;
+    const F* pFn;
+    u32 begin;
+    u32 end;
+    u32 grain;
+};
+
+template<typename F> inline int parallelForTask(void* p);
+
+/* Keeps halving its range, handing the upper halves to the pool, and runs what's left itself.
+ * The halves live in this frame, it doesn't return before they're done. */
+template<typename F>
+inline void
+parallelForSplit(const ParallelForRange<F>& r)
+{
+    ParallelForRange<F> aUpper[32]; /* u32 ranges can't halve more than that */
+    TaskGroup group;
+    u32 nUpper = 0;
+    u32 end = r.end;
+
+    while (end - r.begin > r.grain)
+    {
+        u32 mid = r.begin + (end - r.begin) / 2;
+        aUpper[nUpper] = {r.pTp, r.pFn, mid, end, r.grain};
+        r.pTp->submit(parallelForTask<F>, &aUpper[nUpper], &group);
+        nUpper++;
+        end = mid;
+    }
+
+    (*r.pFn)(r.begin, end);
+
+    if (nUpper > 0)
+        r.pTp->wait(&group);
+}
+
+template<typename F>
+inline int
+parallelForTask(void* p)
+{
+    parallelForSplit(*(ParallelForRange<F>*)p);
+    return 0;
+}
+
+/* fn(u32 begin, u32 end) over chunks of [begin, end) no larger than grain (0 picks one), returns when all are done.
+ * Nothing is allocated, chunk boundaries depend only on the range and the grain. Works from inside pool tasks too. */
+template<typename F>
+inline void
+parallelFor(ThreadPool* pTp, u32 begin, u32 end, u32 grain, const F& fn)
+{
+    if (begin >= end)
+        return;
+
+    grain = parallelGrain(pTp, end - begin, grain);
+    if (pTp->_threadCount == 0 || end - begin <= grain)
+    {
+        fn(begin, end);
+        return;
+    }
+
+    parallelForSplit(ParallelForRange<F> {pTp, &fn, begin, end, grain});
+}
+
+template<typename T, typename F, typename R>
+struct ParallelReduceRange
+{
+    ThreadPool* pTp;
+    const F* pFn;
+    const R* pCombine;
+    u32 begin;
+    u32 end;
+    u32 grain;
+    T result;
+};
+
+template<typename T, typename F, typename R> inline int parallelReduceTask(void* p);
+
+/* the upper half goes to the pool, combine(lower, upper) always sees the same tree for the same range and grain */
+template<typename T, typename F, typename R>
+inline T
+parallelReduceSplit(ThreadPool* pTp, const F& fn, const R& combine, u32 begin, u32 end, u32 grain)
+{
+    if (end - begin <= grain)
+        return fn(begin, end);
+
+    u32 mid = begin + (end - begin) / 2;
+    ParallelReduceRange<T, F, R> upper {pTp, &fn, &combine, mid, end, grain, {}};
+    TaskGroup group;
+    pTp->submit(parallelReduceTask<T, F, R>, &upper, &group);
+
+    T lower = parallelReduceSplit<T>(pTp, fn, combine, begin, mid, grain);
+    pTp->wait(&group);
+
+    return combine(lower, upper.result);
+}
+
+template<typename T, typename F, typename R>
+inline int
+parallelReduceTask(void* p)
+{
+    auto* r = (ParallelReduceRange<T, F, R>*)p;
+    r->result = parallelReduceSplit<T>(r->pTp, *r->pFn, *r->pCombine, r->begin, r->end, r->grain);
+    return 0;
+}
+
+/* T fn(u32 begin, u32 end) per chunk, T combine(T lower, T upper) up a fixed binary tree, identity for an empty range.
+ * The tree depends only on the range and the grain, never on the workers, so float sums come out bit identical every time. */
+template<typename T, typename F, typename R>
+inline T
+parallelReduce(ThreadPool* pTp, u32 begin, u32 end, u32 grain, T identity, const F& fn, const R& combine)
+{
+    if (begin >= end)
+        return identity;
+
+    if (grain == 0)
+        grain = (end - begin) / PARALLEL_REDUCE_CHUNKS > 0 ? (end - begin) / PARALLEL_REDUCE_CHUNKS : 1;
+
+    return parallelReduceSplit<T>(pTp, fn, combine, begin, end, grain);
+}
+
+} /* namespace adt */
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "String.hh"
+#include "utils.hh"
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+    #include <sys/sysinfo.h>
+    #define getLogicalCoresCount() get_nprocs()
+#elif _WIN32
+    #include <windows.h>
+    #include <sysinfoapi.h>
+
+inline DWORD
+getLogicalCoresCountWIN32()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+    #define getLogicalCoresCount() getLogicalCoresCountWIN32()
+#else
+    #define getLogicalCoresCount() 4
+#endif
+
+namespace adt
+{
+
+/* cpus past this are left out */
+constexpr u32 TOPOLOGY_MAX_CPUS = 256;
+
+/* where pool workers go */
+enum class AFFINITY : int
+{
+    NONE, /* one per logical cpu, unpinned, the os places them */
+    LOGICAL, /* one pinned to each logical cpu */
+    PHYSICAL, /* one per physical core, pinned to its first hardware thread */
+    RESERVE_RENDER, /* render thread pinned to the first core, workers on every logical cpu of the others */
+    ESIZE
+};
+
+/* One logical cpu the process may run on. Cores, packages and caches are dense indices,
+ * two cpus with the same l2 share that cache. */
+struct CpuInfo
+{
+    u32 id; /* what the os calls it */
+    u32 core;
+    u32 package;
+    u32 l2;
+    u32 l3;
+    u32 smt; /* 0 for the first hardware thread of its core */
+};
+
+/* Read from sysfs on linux. Elsewhere every logical cpu counts as its own core with its own l2, all on one l3. */
+struct CpuTopology
+{
+    CpuInfo aCpus[TOPOLOGY_MAX_CPUS];
+    u32 nCpus;
+    u32 nCores;
+    u32 nPackages;
+    u32 nL2;
+    u32 nL3;
+
+    void read();
+    u32 placeWorkers(enum AFFINITY e, u32* aIdxs) const; /* indices into aCpus to pin workers to, aIdxs can be nullptr to count */
+    u32 renderCpu(enum AFFINITY e) const; /* what the render thread gets pinned to, NPOS if nothing */
+
+private:
+    void readFallback();
+};
+
+/* first number in a sysfs file, a plain value or the start of a cpu list like "0-3,8-11" */
+inline u32
+readSysfsU32(const char* ntsPath)
+{
+    FILE* pf = fopen(ntsPath, "r");
+    if (!pf)
+        return NPOS;
+
+    unsigned val;
+    int n = fscanf(pf, "%u", &val);
+    fclose(pf);
+
+    return n == 1 ? val : NPOS;
+}
+
+/* sparse os ids to 0, 1, 2 ... in order of first appearance */
+inline u32
+topologyGroup(u32* aMap, u32* pCount, u32 key)
+{
+    key = key < TOPOLOGY_MAX_CPUS ? key : TOPOLOGY_MAX_CPUS - 1;
+    if (aMap[key] == NPOS)
+        aMap[key] = (*pCount)++;
+
+    return aMap[key];
+}
+
+inline void
+CpuTopology::readFallback()
+{
+    u32 n = getLogicalCoresCount();
+    nCpus = n < TOPOLOGY_MAX_CPUS ? n : TOPOLOGY_MAX_CPUS;
+    nCores = nL2 = nCpus;
+    nPackages = nL3 = 1;
+    for (u32 i = 0; i < nCpus; i++)
+        aCpus[i] = {i, i, 0, i, 0, 0};
+}
+
+inline void
+CpuTopology::read()
+{
+    nCpus = nCores = nPackages = nL2 = nL3 = 0;
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        readFallback();
+        return;
+    }
+
+    u32 aCoreMap[TOPOLOGY_MAX_CPUS], aPackageMap[TOPOLOGY_MAX_CPUS], aL2Map[TOPOLOGY_MAX_CPUS], aL3Map[TOPOLOGY_MAX_CPUS];
+    for (u32 i = 0; i < TOPOLOGY_MAX_CPUS; i++)
+        aCoreMap[i] = aPackageMap[i] = aL2Map[i] = aL3Map[i] = NPOS;
+
+    char ntsPath[128];
+    for (u32 cpu = 0; cpu < TOPOLOGY_MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+
+        /* cores and caches are keyed by the first cpu in their sibling lists, core_id repeats across packages */
+        snprintf(ntsPath, sizeof(ntsPath), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+        u32 coreKey = readSysfsU32(ntsPath);
+        snprintf(ntsPath, sizeof(ntsPath), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+        u32 packageKey = readSysfsU32(ntsPath);
+
+        coreKey = coreKey == NPOS ? cpu : coreKey;
+        packageKey = packageKey == NPOS ? 0 : packageKey;
+        u32 l2Key = NPOS, l3Key = NPOS;
+
+        for (u32 idx = 0;; idx++)
+        {
+            snprintf(ntsPath, sizeof(ntsPath), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", cpu, idx);
+            u32 level = readSysfsU32(ntsPath);
+            if (level == NPOS)
+                break;
+            if (level != 2 && level != 3)
+                continue;
+
+            snprintf(ntsPath, sizeof(ntsPath), "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list", cpu, idx);
+            u32 key = readSysfsU32(ntsPath);
+            if (level == 2)
+                l2Key = key;
+            else l3Key = key;
+        }
+
+        /* no l2 listed means private to the core, no l3 means the package is all there is in common */
+        CpuInfo c {};
+        c.id = cpu;
+        c.core = topologyGroup(aCoreMap, &nCores, coreKey);
+        c.package = topologyGroup(aPackageMap, &nPackages, packageKey);
+        c.l2 = topologyGroup(aL2Map, &nL2, l2Key == NPOS ? coreKey : l2Key);
+        c.l3 = topologyGroup(aL3Map, &nL3, l3Key == NPOS ? packageKey : l3Key);
+
+        /* siblings outside the affinity mask don't count, so every core keeps a thread 0 */
+        for (u32 i = 0; i < nCpus; i++)
+            c.smt += aCpus[i].core == c.core;
+
+        aCpus[nCpus++] = c;
+    }
+
+    if (nCpus == 0)
+        readFallback();
+#else
+    readFallback();
+#endif
+}
+
+inline u32
+CpuTopology::renderCpu(enum AFFINITY e) const
+{
+    return e == AFFINITY::RESERVE_RENDER && nCores > 1 ? aCpus[0].id : NPOS;
+}
+
+inline u32
+CpuTopology::placeWorkers(enum AFFINITY e, u32* aIdxs) const
+{
+    u32 reservedCore = renderCpu(e) != NPOS ? aCpus[0].core : NPOS;
+    u32 n = 0;
+
+    for (u32 i = 0; i < nCpus; i++)
+    {
+        bool bTake = false;
+        switch (e)
+        {
+            case AFFINITY::LOGICAL: bTake = true; break;
+            case AFFINITY::PHYSICAL: bTake = aCpus[i].smt == 0; break;
+            case AFFINITY::RESERVE_RENDER: bTake = aCpus[i].core != reservedCore; break;
+            default: break;
+        }
+
+        if (bTake)
+        {
+            if (aIdxs)
+                aIdxs[n] = i;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+/* pins the calling thread to one logical cpu, false if the os refused */
+inline bool
+pinThisThread(u32 cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif _WIN32
+    return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << cpu) != 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+/* lets the calling thread run on every cpu of the topology again */
+inline bool
+unpinThisThread(const CpuTopology& topo)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (u32 i = 0; i < topo.nCpus; i++)
+        CPU_SET(topo.aCpus[i].id, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif _WIN32
+    DWORD_PTR mask = 0;
+    for (u32 i = 0; i < topo.nCpus; i++)
+        if (topo.aCpus[i].id < 64)
+            mask |= DWORD_PTR(1) << topo.aCpus[i].id;
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+#else
+    (void)topo;
+    return false;
+#endif
+}
+
+inline String
+affinityToString(enum AFFINITY e)
+{
+    const char* ss[] {
+        "none", "logical", "physical", "reserve render"
+    };
+
+    return ss[int(e)];
+}
+
+} /* namespace adt */
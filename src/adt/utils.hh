@@ -18,6 +18,7 @@ namespace adt
 
 constexpr u32 NPOS = static_cast<u32>(-1U);
 constexpr u64 NPOS64 = static_cast<u64>(-1UL);
+constexpr u32 CACHE_LINE = 64;
 
 template<typename A, typename B>
 constexpr A&
@@ -0,0 +1,450 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+#include <threads.h>
+
+#include "AtomicArenaAllocator.hh"
+#include "DefaultAllocator.hh"
+#include "Future.hh"
+#include "MpmcQueue.hh"
+#include "Queue.hh"
+#include "SpscRing.hh"
+#include "Texture.hh"
+#include "ThreadPool.hh"
+#include "bench.hh"
+#include "logs.hh"
+#include "math.hh"
+#include "parallel.hh"
+
+namespace bench
+{
+
+/* thread pool benchmark: tiny jobs are spawned from inside roots so they go through the workers' own deques,
+ * large ones are submitted from outside and spin for about LARGE_JOB_ITERS iterations of math each */
+constexpr u32 TP_BENCH_ROOTS = 64;
+constexpr u32 TP_BENCH_TINY_PER_ROOT = 2048;
+constexpr u32 TP_BENCH_LARGE = 4096;
+constexpr u32 TP_BENCH_LARGE_JOB_ITERS = 4000;
+constexpr u32 TP_BENCH_REPEATS = 5;
+/* and chains of async plus CHAIN_LEN thens, all joined with one whenAll */
+constexpr u32 TP_BENCH_CHAINS = 1 << 12;
+constexpr u32 TP_BENCH_CHAIN_LEN = 8;
+
+/* parallelFor benchmark: bmp conversion of one large image, and model to clip matrices of a big batch */
+constexpr int PF_BENCH_IMAGE_SIZE = 4096;
+constexpr u32 PF_BENCH_MATRICES = 1 << 20;
+
+/* queue benchmark: u64s from producer to consumer threads through rings of BENCH_SIZE slots, against a mutex around adt::Queue */
+constexpr u32 QUEUE_BENCH_ITEMS = 1 << 22;
+constexpr u32 QUEUE_BENCH_SIZE = 1 << 12;
+constexpr u32 QUEUE_BENCH_BATCH = 32;
+constexpr u32 QUEUE_BENCH_REPEATS = 3;
+
+struct TpBenchRoot
+{
+    adt::ThreadPool* pTp;
+    std::atomic<u64>* pSum;
+};
+
+static int
+TpBenchTiny(void* pArg)
+{
+    auto* pSum = (std::atomic<u64>*)pArg;
+    pSum->fetch_add(1, std::memory_order_relaxed);
+    return 0;
+}
+
+static int
+TpBenchRootSubmit(void* pArg)
+{
+    auto* a = (TpBenchRoot*)pArg;
+    for (u32 i = 0; i < TP_BENCH_TINY_PER_ROOT; i++)
+        a->pTp->submit(TpBenchTiny, a->pSum);
+
+    return 0;
+}
+
+static int
+TpBenchLarge(void* pArg)
+{
+    auto* pOut = (f32*)pArg;
+    f32 x = *pOut;
+    for (u32 i = 0; i < TP_BENCH_LARGE_JOB_ITERS; i++)
+        x = sinf(x) + 1.0f;
+    *pOut = x;
+
+    return 0;
+}
+
+/* 1, 2, 4 ... workers, always ending on every core */
+static u32
+nextBenchThreadCount(u32 n, u32 nCores)
+{
+    return n * 2 < nCores ? n * 2 : nCores;
+}
+
+/* tasks per second for tiny and large jobs and future continuations from one worker up to every logical core,
+ * best of TP_BENCH_REPEATS each */
+void
+runThreadPoolBenchmark()
+{
+    u32 nCores = getLogicalCoresCount();
+    f32* aLargeOut = (f32*)adt::StdAllocator.alloc(TP_BENCH_LARGE, sizeof(f32));
+    auto* aChains = (adt::Future<u64>*)adt::StdAllocator.alloc(TP_BENCH_CHAINS, sizeof(adt::Future<u64>));
+    adt::AtomicArenaAllocator futureArena(adt::SIZE_1M * 4);
+    f64 tinyBase = 0.0, largeBase = 0.0, thenBase = 0.0;
+
+    LOG_OK("thread pool benchmark: %u tiny jobs from %u roots, %u large jobs, %u logical cores\n",
+           TP_BENCH_ROOTS * TP_BENCH_TINY_PER_ROOT, TP_BENCH_ROOTS, TP_BENCH_LARGE, nCores);
+
+    for (u32 nThreads = 1;; nThreads = nextBenchThreadCount(nThreads, nCores))
+    {
+        adt::ThreadPool tp(&adt::StdAllocator, nThreads);
+        tp.start();
+
+        f64 tinyMs = DBL_MAX, largeMs = DBL_MAX, thenMs = DBL_MAX;
+        for (u32 r = 0; r < TP_BENCH_REPEATS; r++)
+        {
+            std::atomic<u64> sum {0};
+            TpBenchRoot root {&tp, &sum};
+
+            f64 t0 = adt::timeNowMS();
+            for (u32 i = 0; i < TP_BENCH_ROOTS; i++)
+                tp.submit(TpBenchRootSubmit, &root);
+            tp.wait();
+            tinyMs = fmin(tinyMs, adt::timeNowMS() - t0);
+            assert(sum.load() == u64(TP_BENCH_ROOTS) * TP_BENCH_TINY_PER_ROOT);
+
+            for (u32 i = 0; i < TP_BENCH_LARGE; i++)
+                aLargeOut[i] = f32(i);
+
+            t0 = adt::timeNowMS();
+            for (u32 i = 0; i < TP_BENCH_LARGE; i++)
+                tp.submit(TpBenchLarge, &aLargeOut[i]);
+            tp.wait();
+            largeMs = fmin(largeMs, adt::timeNowMS() - t0);
+
+            futureArena.reset();
+            t0 = adt::timeNowMS();
+            for (u32 i = 0; i < TP_BENCH_CHAINS; i++)
+            {
+                aChains[i] = adt::async(&tp, &futureArena, [=] { return u64(i); });
+                for (u32 j = 0; j < TP_BENCH_CHAIN_LEN; j++)
+                    aChains[i] = aChains[i].then([](u64* p) { return *p + 1; });
+            }
+            adt::whenAll(&tp, &futureArena, aChains, TP_BENCH_CHAINS).wait();
+            thenMs = fmin(thenMs, adt::timeNowMS() - t0);
+            assert(aChains[TP_BENCH_CHAINS - 1].get() == TP_BENCH_CHAINS - 1 + TP_BENCH_CHAIN_LEN);
+        }
+
+        tp.destroy();
+
+        f64 tinyRate = f64(TP_BENCH_ROOTS * (TP_BENCH_TINY_PER_ROOT + 1)) / tinyMs / 1000.0;
+        f64 largeRate = f64(TP_BENCH_LARGE) / largeMs;
+        f64 thenRate = f64(TP_BENCH_CHAINS * (TP_BENCH_CHAIN_LEN + 1)) / thenMs / 1000.0;
+        if (nThreads == 1)
+            tinyBase = tinyRate, largeBase = largeRate, thenBase = thenRate;
+
+        LOG_OK("    %2u workers: tiny %.2f Mtasks/s (x%.2f), large %.1f Ktasks/s, %.1f us each (x%.2f), futures %.2f Mtasks/s (x%.2f)\n",
+               nThreads, tinyRate, tinyRate / tinyBase, largeRate, largeMs * 1000.0 * nThreads / TP_BENCH_LARGE, largeRate / largeBase,
+               thenRate, thenRate / thenBase);
+
+        if (nThreads == nCores)
+            break;
+    }
+
+    futureArena.freeAll();
+    adt::StdAllocator.free(aChains);
+    adt::StdAllocator.free(aLargeOut);
+}
+
+/* bmp conversions and a matrix batch on parallelFor, plus a parallelReduce over the result that should come out bit identical
+ * for every worker count */
+void
+runParallelForBenchmark()
+{
+    u32 nCores = getLogicalCoresCount();
+    u32 nPixels = PF_BENCH_IMAGE_SIZE * PF_BENCH_IMAGE_SIZE;
+    u8* pSrc = (u8*)adt::StdAllocator.alloc(nPixels, 4);
+    u8* pDest = (u8*)adt::StdAllocator.alloc(nPixels, 4);
+    m4* aModels = (m4*)adt::StdAllocator.alloc(PF_BENCH_MATRICES, sizeof(m4));
+    m4* aOut = (m4*)adt::StdAllocator.alloc(PF_BENCH_MATRICES, sizeof(m4));
+
+    u32 rng = 7;
+    for (u32 i = 0; i < nPixels * 4; i++)
+        pSrc[i] = u8(randomF(&rng, 0.0f, 255.0f));
+    for (u32 i = 0; i < PF_BENCH_MATRICES; i++)
+    {
+        v3 pos {randomF(&rng, -15.0f, 15.0f), randomF(&rng, 0.0f, 10.0f), randomF(&rng, -10.0f, 10.0f)};
+        aModels[i] = m4Translate(m4RotY(m4Iden(), randomF(&rng, 0.0f, 2.0f * f32(PI))), pos);
+    }
+    m4 viewProj = m4Pers(toRad(90.0f), 16.0f / 9.0f, 0.01f, 100.0f) * m4LookAt({0.0f, 1.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 1.0f, 0.0f});
+
+    LOG_OK("parallelFor benchmark: %dx%d bmp conversions, %u matrices, %u logical cores\n",
+           PF_BENCH_IMAGE_SIZE, PF_BENCH_IMAGE_SIZE, PF_BENCH_MATRICES, nCores);
+
+    f64 bgraBase = 0.0, bgrBase = 0.0, matBase = 0.0;
+    for (u32 nThreads = 1;; nThreads = nextBenchThreadCount(nThreads, nCores))
+    {
+        adt::ThreadPool tp(&adt::StdAllocator, nThreads);
+        tp.start();
+
+        f64 bgraMs = DBL_MAX, bgrMs = DBL_MAX, matMs = DBL_MAX;
+        f32 sum = 0.0f;
+        for (u32 r = 0; r < TP_BENCH_REPEATS; r++)
+        {
+            f64 t0 = adt::timeNowMS();
+            flipCpyBGRAtoRGBA(pDest, pSrc, PF_BENCH_IMAGE_SIZE, PF_BENCH_IMAGE_SIZE, true, &tp);
+            bgraMs = fmin(bgraMs, adt::timeNowMS() - t0);
+
+            t0 = adt::timeNowMS();
+            flipCpyBGRtoRGBA(pDest, pSrc, PF_BENCH_IMAGE_SIZE, PF_BENCH_IMAGE_SIZE, true, &tp);
+            bgrMs = fmin(bgrMs, adt::timeNowMS() - t0);
+
+            t0 = adt::timeNowMS();
+            adt::parallelFor(&tp, 0, PF_BENCH_MATRICES, 0, [&](u32 begin, u32 end) {
+                for (u32 i = begin; i < end; i++)
+                    aOut[i] = viewProj * aModels[i];
+            });
+            matMs = fmin(matMs, adt::timeNowMS() - t0);
+
+            sum = adt::parallelReduce(&tp, 0, PF_BENCH_MATRICES, 0, 0.0f,
+                [&](u32 begin, u32 end) {
+                    f32 s = 0.0f;
+                    for (u32 i = begin; i < end; i++)
+                        s += aOut[i].e[3][2];
+                    return s;
+                },
+                [](f32 l, f32 u) { return l + u; });
+        }
+
+        tp.destroy();
+
+        f64 bgraRate = f64(nPixels) / bgraMs / 1000.0;
+        f64 bgrRate = f64(nPixels) / bgrMs / 1000.0;
+        f64 matRate = f64(PF_BENCH_MATRICES) / matMs / 1000.0;
+        if (nThreads == 1)
+            bgraBase = bgraRate, bgrBase = bgrRate, matBase = matRate;
+
+        u32 sumBits;
+        memcpy(&sumBits, &sum, sizeof(sumBits));
+        LOG_OK("    %2u workers: bgra %.0f Mpix/s (x%.2f), bgr %.0f Mpix/s (x%.2f), m4 %.1f M/s (x%.2f), reduce %08x\n",
+               nThreads, bgraRate, bgraRate / bgraBase, bgrRate, bgrRate / bgrBase, matRate, matRate / matBase, sumBits);
+
+        if (nThreads == nCores)
+            break;
+    }
+
+    adt::StdAllocator.free(aOut);
+    adt::StdAllocator.free(aModels);
+    adt::StdAllocator.free(pDest);
+    adt::StdAllocator.free(pSrc);
+}
+
+/* the baseline, capped at the same size as the rings so a full queue makes producers wait too */
+struct LockedQueue
+{
+    adt::Queue<u64> q;
+    mtx_t mtx;
+
+    void
+    init(adt::Allocator* p, u32 size)
+    {
+        q = adt::Queue<u64>(p, size);
+        mtx_init(&mtx, mtx_plain);
+    }
+
+    bool push(const u64& val) { return pushBatch(&val, 1) == 1; }
+    bool pop(u64* pVal) { return popBatch(pVal, 1) == 1; }
+
+    u32
+    pushBatch(const u64* pVals, u32 n)
+    {
+        mtx_lock(&mtx);
+        u32 k = 0;
+        for (; k < n && q._size < q._capacity; k++)
+            q.pushBack(pVals[k]);
+        mtx_unlock(&mtx);
+
+        return k;
+    }
+
+    u32
+    popBatch(u64* pVals, u32 n)
+    {
+        mtx_lock(&mtx);
+        u32 k = 0;
+        for (; k < n && !q.empty(); k++)
+            pVals[k] = *q.popFront();
+        mtx_unlock(&mtx);
+
+        return k;
+    }
+
+    void
+    destroy()
+    {
+        mtx_destroy(&mtx);
+        q.destroy();
+    }
+};
+
+template<typename Q>
+struct QueueBenchArg
+{
+    Q* pQ;
+    std::atomic<bool>* pGo;
+    u64 first; /* producers push first .. first + n */
+    u32 n; /* consumers pop n and sum them */
+    u32 batch;
+    u64 sum;
+};
+
+template<typename Q>
+static int
+QueueBenchProducer(void* pArg)
+{
+    auto* a = (QueueBenchArg<Q>*)pArg;
+    u64 aVals[QUEUE_BENCH_BATCH];
+
+    while (!a->pGo->load(std::memory_order_acquire))
+        ;
+
+    for (u32 i = 0; i < a->n;)
+    {
+        u32 n = a->batch < a->n - i ? a->batch : a->n - i;
+        for (u32 j = 0; j < n; j++)
+            aVals[j] = a->first + i + j;
+
+        u32 k = n == 1 ? u32(a->pQ->push(aVals[0])) : a->pQ->pushBatch(aVals, n);
+        if (k == 0)
+            thrd_yield();
+        i += k;
+    }
+
+    return 0;
+}
+
+template<typename Q>
+static int
+QueueBenchConsumer(void* pArg)
+{
+    auto* a = (QueueBenchArg<Q>*)pArg;
+    u64 aVals[QUEUE_BENCH_BATCH];
+    u64 sum = 0;
+
+    while (!a->pGo->load(std::memory_order_acquire))
+        ;
+
+    for (u32 i = 0; i < a->n;)
+    {
+        u32 n = a->batch < a->n - i ? a->batch : a->n - i;
+        u32 k = n == 1 ? u32(a->pQ->pop(&aVals[0])) : a->pQ->popBatch(aVals, n);
+        if (k == 0)
+            thrd_yield();
+
+        for (u32 j = 0; j < k; j++)
+            sum += aVals[j];
+        i += k;
+    }
+
+    a->sum = sum;
+    return 0;
+}
+
+/* best of QUEUE_BENCH_REPEATS in ms, pQ has to be initialized and empty */
+template<typename Q>
+static f64
+runQueueBench(Q* pQ, u32 nProducers, u32 nConsumers, u32 batch)
+{
+    u32 nThreads = nProducers + nConsumers;
+    auto* aArgs = (QueueBenchArg<Q>*)adt::StdAllocator.alloc(nThreads, sizeof(QueueBenchArg<Q>));
+    auto* aThreads = (thrd_t*)adt::StdAllocator.alloc(nThreads, sizeof(thrd_t));
+    f64 best = DBL_MAX;
+
+    for (u32 r = 0; r < QUEUE_BENCH_REPEATS; r++)
+    {
+        std::atomic<bool> bGo {false};
+
+        for (u32 i = 0; i < nProducers; i++)
+        {
+            u32 n = QUEUE_BENCH_ITEMS / nProducers, rem = QUEUE_BENCH_ITEMS % nProducers;
+            aArgs[i] = {pQ, &bGo, i == 0 ? 0 : u64(n) * i + rem, i == 0 ? n + rem : n, batch, 0};
+            thrd_create(&aThreads[i], QueueBenchProducer<Q>, &aArgs[i]);
+        }
+        for (u32 i = 0; i < nConsumers; i++)
+        {
+            u32 n = QUEUE_BENCH_ITEMS / nConsumers;
+            aArgs[nProducers + i] = {pQ, &bGo, 0, i == 0 ? n + QUEUE_BENCH_ITEMS % nConsumers : n, batch, 0};
+            thrd_create(&aThreads[nProducers + i], QueueBenchConsumer<Q>, &aArgs[nProducers + i]);
+        }
+
+        f64 t0 = adt::timeNowMS();
+        bGo.store(true, std::memory_order_release);
+        for (u32 i = 0; i < nThreads; i++)
+            thrd_join(aThreads[i], nullptr);
+        best = fmin(best, adt::timeNowMS() - t0);
+
+        u64 sum = 0;
+        for (u32 i = 0; i < nConsumers; i++)
+            sum += aArgs[nProducers + i].sum;
+        if (sum != u64(QUEUE_BENCH_ITEMS) * (QUEUE_BENCH_ITEMS - 1) / 2)
+            LOG_WARN("queue benchmark: consumers summed %llu, expected %llu\n",
+                     (unsigned long long)sum, (unsigned long long)(u64(QUEUE_BENCH_ITEMS) * (QUEUE_BENCH_ITEMS - 1) / 2));
+    }
+
+    adt::StdAllocator.free(aThreads);
+    adt::StdAllocator.free(aArgs);
+
+    return best;
+}
+
+template<typename Q>
+static f64
+queueBenchRate(u32 nProducers, u32 nConsumers, u32 batch)
+{
+    Q q;
+    q.init(&adt::StdAllocator, QUEUE_BENCH_SIZE);
+    f64 ms = runQueueBench(&q, nProducers, nConsumers, batch);
+    q.destroy();
+
+    return f64(QUEUE_BENCH_ITEMS) / ms / 1000.0;
+}
+
+/* Mops/s through the mutex queue and the lock free rings, half producers and half consumers from 2 threads up to every
+ * logical core, then spsc against the rest with one of each */
+void
+runQueueBenchmark()
+{
+    u32 nCores = getLogicalCoresCount();
+
+    LOG_OK("queue benchmark: %u u64s through %u slots, batches of %u, %u logical cores\n",
+           QUEUE_BENCH_ITEMS, QUEUE_BENCH_SIZE, QUEUE_BENCH_BATCH, nCores);
+
+    for (u32 nThreads = 2;; nThreads = nextBenchThreadCount(nThreads, nCores))
+    {
+        u32 nProducers = nThreads / 2;
+        u32 nConsumers = nThreads - nProducers;
+
+        f64 mutexRate = queueBenchRate<LockedQueue>(nProducers, nConsumers, 1);
+        f64 mpmcRate = queueBenchRate<adt::MpmcQueue<u64>>(nProducers, nConsumers, 1);
+        f64 mpmcBatchRate = queueBenchRate<adt::MpmcQueue<u64>>(nProducers, nConsumers, QUEUE_BENCH_BATCH);
+
+        LOG_OK("    %2u threads (%uP/%uC): mutex %.1f Mops/s, mpmc %.1f (x%.2f), mpmc batched %.1f (x%.2f)\n",
+               nThreads, nProducers, nConsumers, mutexRate, mpmcRate, mpmcRate / mutexRate, mpmcBatchRate, mpmcBatchRate / mutexRate);
+
+        if (nThreads >= nCores)
+            break;
+    }
+
+    f64 mutexRate = queueBenchRate<LockedQueue>(1, 1, 1);
+    f64 mpmcRate = queueBenchRate<adt::MpmcQueue<u64>>(1, 1, 1);
+    f64 spscRate = queueBenchRate<adt::SpscRing<u64>>(1, 1, 1);
+    f64 spscBatchRate = queueBenchRate<adt::SpscRing<u64>>(1, 1, QUEUE_BENCH_BATCH);
+
+    LOG_OK("     2 threads (1P/1C): mutex %.1f Mops/s, mpmc %.1f (x%.2f), spsc %.1f (x%.2f), spsc batched %.1f (x%.2f)\n",
+           mutexRate, mpmcRate, mpmcRate / mutexRate, spscRate, spscRate / mutexRate, spscBatchRate, spscBatchRate / mutexRate);
+}
+
+} /* namespace bench */
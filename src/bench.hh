@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ultratypes.h"
+
+namespace frame { struct DrawStats; }
+
+/* benchmarks that log what they measured, the run*() ones block until they're done */
+namespace bench
+{
+
+/* xorshift32, the same data on every run */
+inline u32
+random(u32* pState)
+{
+    u32 x = *pState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *pState = x;
+}
+
+inline f32
+randomF(u32* pState, f32 min, f32 max)
+{
+    return min + (max - min) * f32(random(pState) >> 8) / f32(1 << 24);
+}
+
+/* bench.cc, adt threading microbenchmarks */
+void runThreadPoolBenchmark();
+void runParallelForBenchmark();
+void runQueueBenchmark();
+
+/* sceneBench.cc, over the loaded scene */
+void runBvhBenchmark();
+void startPathBenchmark(); /* the camera follows a fixed path through sponza, main loop calls the two below every frame */
+void updatePathBenchmark(); /* before the view is updated */
+void accumulatePathBenchmark(const frame::DrawStats& s, const frame::DrawStats& shadow); /* once the frame is drawn, shadow is the part of s spent on casters */
+
+} /* namespace bench */
@@ -1,5 +1,6 @@
 #include <math.h>
 
+#include "bench.hh"
 #include "controls.hh"
 #include "frame.hh"
 #include "logs.hh"
@@ -81,6 +82,118 @@ procKeysOnce(App* app, u32 key, u32 pressed)
             if (pressed) app->toggleVSync();
             break;
 
+        case KEY_G:
+            if (pressed) frame::toggleShadowPath();
+            break;
+
+        case KEY_B:
+            if (pressed) frame::startShadowBenchmark();
+            break;
+
+        case KEY_L:
+            if (pressed) frame::toggleLightAnimation();
+            break;
+
+        case KEY_N:
+            if (pressed) frame::toggleBackpackSpinning();
+            break;
+
+        case KEY_J:
+            if (pressed) frame::toggleInstancing();
+            break;
+
+        case KEY_K:
+            if (pressed) frame::toggleStressScene();
+            break;
+
+        case KEY_H:
+            if (pressed) frame::toggleLods();
+            break;
+
+        case KEY_Y:
+            if (pressed) frame::toggleOcclusionCulling();
+            break;
+
+        case KEY_U:
+            if (pressed) frame::startPathBenchmark();
+            break;
+
+        case KEY_T:
+            if (pressed) frame::toggleClusterCulling();
+            break;
+
+        case KEY_E:
+            if (pressed) frame::pickEntry();
+            break;
+
+        case KEY_M:
+            if (pressed) bench::runBvhBenchmark();
+            break;
+
+        case KEY_1:
+            if (pressed) frame::toggleDepthPrepass();
+            break;
+
+        case KEY_2:
+            if (pressed) frame::startPrepassBenchmark();
+            break;
+
+        case KEY_3:
+            if (pressed) frame::cycleShadowFilter();
+            break;
+
+        case KEY_4:
+            if (pressed) frame::toggleShadowDepthFormat();
+            break;
+
+        case KEY_5:
+            if (pressed) frame::cyclePointLights();
+            break;
+
+        case KEY_6:
+            if (pressed) frame::startLightBenchmark();
+            break;
+
+        case KEY_7:
+            if (pressed) frame::togglePointLightShadows();
+            break;
+
+        case KEY_8:
+            if (pressed) frame::toggleNormalMapping();
+            break;
+
+        case KEY_9:
+            if (pressed) frame::startNormalMapBenchmark();
+            break;
+
+        case KEY_0:
+            if (pressed) bench::runThreadPoolBenchmark();
+            break;
+
+        case KEY_MINUS:
+            if (pressed) bench::runParallelForBenchmark();
+            break;
+
+        case KEY_EQUAL:
+            if (pressed) frame::togglePipelining();
+            break;
+
+        case KEY_F1:
+            if (pressed) frame::captureLitPass();
+            break;
+
+        case KEY_F2:
+            if (pressed) bench::runQueueBenchmark();
+            break;
+
+        case KEY_F3:
+            if (pressed) frame::cycleAffinity();
+            break;
+
+        case KEY_F4:
+            if (pressed) frame::startTopologyBenchmark();
+            break;
+
         default:
             break;
     }
@@ -1,17 +1,30 @@
+#include <new>
+
 #include "AllocatorPool.hh"
 #include "ArenaAllocator.hh"
+#include "AtomicArenaAllocator.hh"
+#include "DefaultAllocator.hh"
 #include "Model.hh"
 #include "Shader.hh"
 #include "Text.hh"
 #include "ThreadPool.hh"
+#include "bench.hh"
 #include "colors.hh"
+#include "file.hh"
 #include "frame.hh"
+#include "logs.hh"
+#include "lights.hh"
 #include "math.hh"
+#include "packet.hh"
+#include "parallel.hh"
+#include "scene.hh"
+#include "shadows.hh"
 
 namespace frame
 {
 
 static void mainLoop(App* pApp);
+static void buildSceneBvh();
 
 App* g_app;
 
@@ -19,9 +32,129 @@ f32 g_fov = 90.0f;
 f32 g_uiWidth = 192.0f;
 f32 g_uiHeight = (g_uiWidth * 9.0f) / 16.0f;
 
+thread_local DrawStats g_drawStats {};
+adt::ThreadPool g_tp(&adt::StdAllocator);
+
+static adt::CpuTopology s_topology;
+
 static f64 s_prevTime;
 static int s_fpsCount = 0;
-static char s_fpsStrBuff[40] {};
+static char s_fpsStrBuff[512] {};
+static DrawStats s_lastDrawStats {};
+static DrawStats s_lastShadowDrawStats {}; /* part of s_lastDrawStats spent on shadow casters */
+static u32 s_aShadowUpdates[3] {}; /* per second, indexed by shadows::UPDATE */
+
+static f64 s_lightTime = 0.0;
+static bool s_bLightPaused = false;
+static f32 s_backpackAngle = 0.0f;
+static bool s_bBackpackSpinning = false;
+static bool s_bInstancing = true;
+static bool s_bLods = true;
+
+/* max projected simplification error in pixels of the shadow passes, coarser than the lit pass */
+constexpr f32 SHADOW_LOD_THRESHOLD = 4.0f;
+
+/* vertex format of the lit scene, FLOAT_VERTICES build option keeps the raw float streams for comparison */
+#ifdef FLOAT_VERTICES
+static const enum VERTEX_FORMAT s_eSceneVertexFormat = VERTEX_FORMAT::FLOAT;
+#else
+static const enum VERTEX_FORMAT s_eSceneVertexFormat = VERTEX_FORMAT::PACKED;
+#endif
+static bool s_bStressScene = false;
+static bool s_bOcclusion = true;
+static bool s_bClusters = true;
+static bool s_bDepthPrepass = true;
+static bool s_bNormalMapping = true;
+
+adt::Array<SceneEntry> g_aEntries(&adt::StdAllocator);
+u32 g_nStaticEntries = 0;
+Bvh g_bvh(&adt::StdAllocator);
+static f32 s_bvhBackpackAngle = 0.0f; /* the dynamic entries were refitted at this angle */
+
+/* how many of the point lights are lit, cycled through the counts */
+static const u32 s_aPointLightCounts[] {0, 128, 256, 1024, 4096};
+static u32 s_pointLightCountIdx = 2;
+static u32 s_nPointLights = 256;
+
+/* the most important lights in view get cube faces in one shared depth texture */
+static shadows::Atlas s_shadowAtlas(&adt::StdAllocator);
+static bool s_bPointLightShadows = true;
+
+/* lit pass cost per light count, assignment is cpu time summed over the slice jobs */
+constexpr u32 LIGHT_BENCH_FRAMES = 60; /* per count */
+static const u32 s_aLightBenchCounts[] {0, 128, 512, 1024, 2048, 4096};
+static struct
+{
+    u32 nFrames;
+    u32 step;
+    f64 assignMs;
+    f64 litMs;
+    u32 maxClusterLights;
+    bool bRunning;
+} s_lightBench {};
+
+/* load coroutines continue here for their gl calls, drained at the start of every frame for about this long */
+constexpr f64 ASSET_UPLOAD_BUDGET_MS = 3.0;
+static adt::ResumeQueue s_assetUploads(&adt::StdAllocator);
+static adt::AtomicArenaAllocator s_assetArena(adt::SIZE_1K * 64); /* futures the load coroutines wait on */
+static u32 s_nAssetsLoading = 0;
+static adt::TaskGraph s_assetGraph; /* every load stage, written to ASSET_TIMELINE_PATH once the scene is in */
+constexpr const char* ASSET_TIMELINE_PATH = "asset-timeline.json";
+static u32 s_nLoadingFrames = 0; /* drawn before the scene was complete */
+static f64 s_tStartMS = 0.0; /* when run() was called */
+static bool s_bFirstFrameShown = false;
+
+static FramePacket s_aFramePackets[FRAME_PACKETS];
+static u32 s_framePacketIdx = 0; /* next one to build */
+static FramePacket* s_pFrameReady = nullptr; /* built, not drawn yet */
+static bool s_bPipelining = true;
+static f64 s_lastBuildMs = 0.0;
+static f64 s_lastSubmitMs = 0.0; /* render thread, gl calls of the last frame up to the fps counter */
+
+/* the next drawn packet's lit pass commands go here as text */
+constexpr const char* LIT_PASS_CAPTURE_PATH = "litPass.cmds";
+static bool s_bCaptureLitPass = false;
+
+constexpr v3 BACKPACK_POS {0.0f, 0.5f, 0.0f};
+constexpr f32 SHADOW_NEAR_PLANE = 0.01f;
+constexpr f32 SHADOW_FAR_PLANE = 25.0f;
+
+/* alternates forward and pre-pass lit passes, then keeps the faster one */
+constexpr u32 PREPASS_BENCH_FRAMES = 120; /* per mode */
+static struct
+{
+    u32 nFrames;
+    u32 nBuilt; /* frame packets built for it, picks their mode */
+    f64 aTimes[2]; /* forward, pre-pass */
+    bool bRunning;
+} s_prepassBench {};
+
+/* alternates lit passes without and with normal maps (load time tangents), best run on the backpack stress grid */
+constexpr u32 NORMAL_MAP_BENCH_FRAMES = 120; /* per mode */
+static struct
+{
+    u32 nFrames;
+    u32 nBuilt; /* frame packets built for it, picks their mode */
+    f64 aTimes[2]; /* off, on */
+    bool bRunning;
+} s_normalMapBench {};
+
+/* every affinity policy in turn: the texture decodes of a scene load once, then FRAMES frames after a short warmup */
+constexpr u32 TOPOLOGY_BENCH_FRAMES = 240; /* per policy */
+constexpr u32 TOPOLOGY_BENCH_WARMUP = 8;
+static struct
+{
+    u32 nFrames; /* under the current policy, the first one switches the pool and loads */
+    int policy;
+    u32 nTextures;
+    u32 aWorkers[int(adt::AFFINITY::ESIZE)];
+    f64 aLoadMs[int(adt::AFFINITY::ESIZE)];
+    f64 aFrameMs[int(adt::AFFINITY::ESIZE)];
+    f64 aBuildMs[int(adt::AFFINITY::ESIZE)];
+    f64 aMaxBuildMs[int(adt::AFFINITY::ESIZE)];
+    enum adt::AFFINITY eRestore;
+    bool bRunning;
+} s_topologyBench {};
 
 controls::PlayerControls g_player({0.0f, 1.0f, 1.0f}, 4.0, 0.07);
 
@@ -30,13 +163,15 @@ static adt::AllocatorPool<adt::ArenaAllocator, ASSET_MAX_COUNT> s_apAssets;
 static Shader s_shTex;
 static Shader s_shBitMap;
 static Shader s_shColor;
-static Shader s_shCubeDepth;
-static Shader s_shOmniDirShadow;
+static Shader s_shOmniDirShadow; /* no discard, early z safe */
+static Shader s_shOmniDirShadowAlphaTest;
+static Shader s_shPrepass;
+static Shader s_shPrepassAlphaTest;
 static Shader s_shSkyBox;
 
 static Model s_mSphere(s_apAssets.get(adt::SIZE_1M));
-static Model s_mSponza(s_apAssets.get(adt::SIZE_8M * 2));
-static Model s_mBackpack(s_apAssets.get(adt::SIZE_8M));
+Model g_mSponza(s_apAssets.get(adt::SIZE_8M * 2));
+Model g_mBackpack(s_apAssets.get(adt::SIZE_8M));
 static Model s_mCube(s_apAssets.get(adt::SIZE_1M));
 
 static Texture s_tAsciiMap(s_apAssets.get(adt::SIZE_1M));
@@ -44,11 +179,68 @@ static Texture s_tAsciiMap(s_apAssets.get(adt::SIZE_1M));
 static Text s_textFPS;
 static Text s_textTest;
 
-static CubeMap s_cmCubeMap;
+static shadows::OmniDir s_omniDirShadow;
 static CubeMap s_cmSkyBox;
 
 static Ubo s_uboProjView;
 
+/* faces are decoded on the pool, the cube map goes up on the render thread */
+static adt::CoJob
+loadSkyBox(AssetLoader loader)
+{
+    adt::String aFaces[6] {
+        "test-assets/skybox/right.bmp",
+        "test-assets/skybox/left.bmp",
+        "test-assets/skybox/top.bmp",
+        "test-assets/skybox/bottom.bmp",
+        "test-assets/skybox/front.bmp",
+        "test-assets/skybox/back.bmp"
+    };
+
+    adt::TaskGraph* pGraph = loader.pGraph;
+    adt::AtomicArenaAllocator arena(adt::SIZE_1M * 6);
+    adt::GraphValue<TextureData>* aDecoded[6];
+    decodeSkyBox(pGraph, &arena, aFaces, aDecoded);
+
+    adt::GraphNode* aNodes[6];
+    for (u32 i = 0; i < 6; i++)
+        aNodes[i] = aDecoded[i];
+    co_await pGraph->join(pGraph->name("join", "skybox"), aNodes, 6, loader.pArena);
+
+    co_await loader.pRender->schedule();
+    f64 t = pGraph->now();
+    s_cmSkyBox = makeSkyBox(aDecoded);
+    pGraph->record(pGraph->name("upload", "skybox"), t);
+    arena.freeAll();
+
+    loader.pfnLoaded(&s_cmSkyBox);
+}
+
+/* On the render thread as each asset becomes drawable, the bvh is rebuilt over whatever scene models are in by then
+ * and the cached shadow cube is redrawn with them, it may have been drawn with the light paused over an empty scene.
+ * The shadow path benchmark waits for the whole scene, an empty one would pick the path for good. */
+static void
+onAssetLoaded(void* pAsset)
+{
+    if (pAsset == &g_mSponza || pAsset == &g_mBackpack)
+    {
+        buildSceneBvh();
+        s_omniDirShadow.invalidateStatic();
+        s_omniDirShadow.invalidateDynamic();
+    }
+
+    if (--s_nAssetsLoading == 0)
+    {
+        LOG_OK("full scene %.3f ms after start, %u frames drawn while loading\n", adt::timeNowMS() - s_tStartMS, s_nLoadingFrames);
+        g_meshBuffers.report();
+        s_assetGraph.wait(); /* the last joins may still be wrapping up on the pool */
+        s_assetGraph.report("assets");
+        if (s_assetGraph.exportTimeline(ASSET_TIMELINE_PATH))
+            LOG_OK("asset timeline written to '%s'\n", ASSET_TIMELINE_PATH);
+        s_omniDirShadow.startBenchmark();
+    }
+}
+
 void
 prepareDraw(App* pApp)
 {
@@ -71,8 +263,10 @@ prepareDraw(App* pApp)
     s_shTex.loadShaders("shaders/simpleTex.vert", "shaders/simpleTex.frag");
     s_shColor.loadShaders("shaders/simpleUB.vert", "shaders/simple.frag");
     s_shBitMap.loadShaders("shaders/font/font.vert", "shaders/font/font.frag");
-    s_shCubeDepth.loadShaders("shaders/shadows/cubeMap/cubeMapDepth.vert", "shaders/shadows/cubeMap/cubeMapDepth.geom", "shaders/shadows/cubeMap/cubeMapDepth.frag");
     s_shOmniDirShadow.loadShaders("shaders/shadows/cubeMap/omniDirShadow.vert", "shaders/shadows/cubeMap/omniDirShadow.frag");
+    s_shOmniDirShadowAlphaTest.loadShaders("shaders/shadows/cubeMap/omniDirShadow.vert", "shaders/shadows/cubeMap/omniDirShadowAlphaTest.frag");
+    s_shPrepass.loadShaders("shaders/prepass/prepass.vert", "shaders/prepass/prepass.frag");
+    s_shPrepassAlphaTest.loadShaders("shaders/prepass/prepass.vert", "shaders/prepass/prepassAlphaTest.frag");
     s_shSkyBox.loadShaders("shaders/skybox.vert", "shaders/skybox.frag");
 
     s_shTex.use();
@@ -84,58 +278,67 @@ prepareDraw(App* pApp)
     s_shOmniDirShadow.use();
     s_shOmniDirShadow.setI("uDiffuseTexture", 0);
     s_shOmniDirShadow.setI("uDepthMap", 1);
+    s_shOmniDirShadow.setI("uPointLights", 2);
+    s_shOmniDirShadow.setI("uClusterRanges", 3);
+    s_shOmniDirShadow.setI("uClusterIndices", 4);
+    s_shOmniDirShadow.setI("uShadowAtlas", 5);
+    s_shOmniDirShadow.setI("uNormalMap", 6);
+
+    s_shOmniDirShadowAlphaTest.use();
+    s_shOmniDirShadowAlphaTest.setI("uDiffuseTex", 0);
+    s_shOmniDirShadowAlphaTest.setI("uDepthMap", 1);
+    s_shOmniDirShadowAlphaTest.setI("uPointLights", 2);
+    s_shOmniDirShadowAlphaTest.setI("uClusterRanges", 3);
+    s_shOmniDirShadowAlphaTest.setI("uClusterIndices", 4);
+    s_shOmniDirShadowAlphaTest.setI("uShadowAtlas", 5);
+    s_shOmniDirShadowAlphaTest.setI("uNormalMap", 6);
+
+    s_shPrepassAlphaTest.use();
+    s_shPrepassAlphaTest.setI("uDiffuseTex", 0);
 
     s_shSkyBox.use();
     s_shSkyBox.setI("uSkyBox", 0);
 
+    initFrameBuilds(&s_shOmniDirShadow, &s_shOmniDirShadowAlphaTest, &s_shPrepass, &s_shPrepassAlphaTest);
+
     s_uboProjView.createBuffer(sizeof(m4) * 2, GL_DYNAMIC_DRAW);
     s_uboProjView.bindShader(&s_shTex, "ubProjView", 0);
     s_uboProjView.bindShader(&s_shColor, "ubProjView", 0);
     s_uboProjView.bindShader(&s_shOmniDirShadow, "ubProjView", 0);
+    s_uboProjView.bindShader(&s_shOmniDirShadowAlphaTest, "ubProjView", 0);
+    s_uboProjView.bindShader(&s_shPrepass, "ubProjView", 0);
+    s_uboProjView.bindShader(&s_shPrepassAlphaTest, "ubProjView", 0);
     s_uboProjView.bindShader(&s_shSkyBox, "ubProjView", 0);
 
-    s_cmCubeMap = makeCubeShadowMap(1024, 1024);
-
-    adt::String skyboxImgs[6] {
-        "test-assets/skybox/right.bmp",
-        "test-assets/skybox/left.bmp",
-        "test-assets/skybox/top.bmp",
-        "test-assets/skybox/bottom.bmp",
-        "test-assets/skybox/front.bmp",
-        "test-assets/skybox/back.bmp"
-    };
+    s_omniDirShadow.init(1024, 1024);
+    for (auto& p : s_aFramePackets)
+    {
+        p.arena = adt::ArenaAllocator(adt::SIZE_8M);
+        p.grid = lights::ClusterGrid(&adt::StdAllocator);
+        p.grid.init();
+    }
+    s_shadowAtlas.init();
 
-    s_cmSkyBox = makeSkyBox(skyboxImgs);
+    s_topology.read();
+    LOG_OK("cpu topology: %u logical cpus, %u cores, %u packages, %u l2 and %u l3 groups\n",
+           s_topology.nCpus, s_topology.nCores, s_topology.nPackages, s_topology.nL2, s_topology.nL3);
+    g_tp.start();
 
     s_textFPS = Text("", adt::size(s_fpsStrBuff), 0, 0, GL_DYNAMIC_DRAW);
     s_textTest = Text("", 256, 0, 0, GL_DYNAMIC_DRAW);
 
-    adt::ArenaAllocator allocScope(adt::SIZE_1K);
-    adt::ThreadPool tp(&allocScope);
-    tp.start();
-
-    /* unbind before creating threads */
-    pApp->unbindGlContext();
-
-    TexLoadArg bitMap {&s_tAsciiMap, "test-assets/bitmapFont2.bmp", TEX_TYPE::DIFFUSE, false, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST_MIPMAP_NEAREST};
+    /* the fps counter needs it from the first frame and it's tiny */
+    s_tAsciiMap.load("test-assets/bitmapFont2.bmp", TEX_TYPE::DIFFUSE, false, GL_CLAMP_TO_EDGE, GL_NEAREST, GL_NEAREST_MIPMAP_NEAREST);
 
-    ModelLoadArg sphere {&s_mSphere, "test-assets/models/icosphere/gltf/untitled.gltf", GL_STATIC_DRAW, GL_MIRRORED_REPEAT};
-    ModelLoadArg sponza {&s_mSponza, "test-assets/models/Sponza/Sponza.gltf", GL_STATIC_DRAW, GL_MIRRORED_REPEAT};
-    ModelLoadArg backpack {&s_mBackpack, "test-assets/models/backpack/scene.gltf", GL_STATIC_DRAW, GL_MIRRORED_REPEAT};
-    ModelLoadArg cube {&s_mCube, "test-assets/models/cube/gltf/cube.gltf", GL_STATIC_DRAW, GL_MIRRORED_REPEAT};
-
-    tp.submit(TextureSubmit, &bitMap);
-    tp.submit(ModelSubmit, &sphere);
-    tp.submit(ModelSubmit, &sponza);
-    tp.submit(ModelSubmit, &backpack);
-    tp.submit(ModelSubmit, &cube);
-
-    tp.wait();
-    /* restore context after assets are loaded */
-    pApp->bindGlContext();
-
-    tp.destroy();
-    allocScope.freeAll();
+    /* everything else streams in while frames are being drawn, each shows up in onAssetLoaded() */
+    new (&s_assetGraph) adt::TaskGraph(&g_tp); /* in place, its node list lives in its own arena */
+    AssetLoader loader {&g_tp, &s_assetUploads, &s_assetArena, onAssetLoaded, &s_assetGraph};
+    s_nAssetsLoading = 5;
+    loadSkyBox(loader);
+    s_mSphere.load(loader, "test-assets/models/icosphere/gltf/untitled.gltf", GL_STATIC_DRAW, GL_MIRRORED_REPEAT);
+    s_mCube.load(loader, "test-assets/models/cube/gltf/cube.gltf", GL_STATIC_DRAW, GL_MIRRORED_REPEAT);
+    g_mBackpack.load(loader, "test-assets/models/backpack/scene.gltf", GL_STATIC_DRAW, GL_MIRRORED_REPEAT, s_eSceneVertexFormat);
+    g_mSponza.load(loader, "test-assets/models/Sponza/Sponza.gltf", GL_STATIC_DRAW, GL_MIRRORED_REPEAT, s_eSceneVertexFormat);
 
     pApp->setSwapInterval(1);
     pApp->toggleFullscreen();
@@ -151,6 +354,7 @@ run(App* pApp)
     pApp->setCursorImage("default");
 
     s_prevTime = adt::timeNowS();
+    s_tStartMS = adt::timeNowMS();
 
     prepareDraw(pApp);
     g_player.updateDeltaTime(); /* reset delta time before drawing */
@@ -160,7 +364,7 @@ run(App* pApp)
 }
 
 void
-renderFPSCounter(adt::Allocator* pAlloc)
+renderFPSCounter(adt::Allocator* pAlloc, const FramePacket* pPacket)
 {
     m4 proj = m4Ortho(0.0f, g_uiWidth, 0.0f, g_uiHeight, -1.0f, 1.0f);
     s_shBitMap.use();
@@ -171,7 +375,33 @@ renderFPSCounter(adt::Allocator* pAlloc)
     if (_currTime >= s_prevTime + 1.0)
     {
         memset(s_fpsStrBuff, 0, adt::size(s_fpsStrBuff));
-        snprintf(s_fpsStrBuff, adt::size(s_fpsStrBuff), "FPS: %u\nFrame time: %.3f ms", s_fpsCount, g_player._deltaTime);
+        adt::String sPath = shadows::pathToString(s_omniDirShadow._ePath);
+        adt::String sFilter = shadows::filterToString(s_omniDirShadow._eFilter);
+        adt::String sDepth = shadows::depthFormatToString(s_omniDirShadow._eDepthFormat);
+        snprintf(s_fpsStrBuff, adt::size(s_fpsStrBuff),
+                 "FPS: %u\nFrame time: %.3f ms\nShadows: %.*s%s, %.*s, depth %.*s (%.1f MB)\nShadow updates: %u full, %u dyn, %u cached\nDraws: %u (%s, pre-pass %s), instances: %u, culled: %u, occluded: %u/%u\n"
+                 "Triangles (lods %s): lit %u/%u, shadow %u/%u, vs invocations: %.2fM\n"
+                 "Clusters (%s): %u, frustum culled %u, backface culled %u\nPoint lights: %u%s, max per cluster %u, shadowed %u (%u faces, %.1f MB)\n"
+                 "Frame packets: %s, build %.3f ms (pool), submit %.3f ms (render thread)",
+                 s_fpsCount, g_player._deltaTime,
+                 (int)sPath._size, sPath._pData, s_omniDirShadow._bench.bRunning ? " (benchmark)" : "",
+                 (int)sFilter._size, sFilter._pData, (int)sDepth._size, sDepth._pData, f64(s_omniDirShadow.memoryUsage()) / f64(adt::SIZE_1M),
+                 s_aShadowUpdates[int(shadows::UPDATE::FULL)], s_aShadowUpdates[int(shadows::UPDATE::DYNAMIC)], s_aShadowUpdates[int(shadows::UPDATE::NONE)],
+                 s_lastDrawStats.nDraws, s_bInstancing ? "instanced" : "not instanced",
+                 s_prepassBench.bRunning ? "benchmark" : (s_bDepthPrepass ? "on" : "off"),
+                 s_lastDrawStats.nInstances, s_lastDrawStats.nCulled, s_lastDrawStats.nOccluded, s_lastDrawStats.nOcclusionTests,
+                 s_bLods ? "on" : "off",
+                 s_lastDrawStats.nTriangles - s_lastShadowDrawStats.nTriangles,
+                 s_lastDrawStats.nTrianglesFull - s_lastShadowDrawStats.nTrianglesFull,
+                 s_lastShadowDrawStats.nTriangles, s_lastShadowDrawStats.nTrianglesFull,
+                 f64(s_lastDrawStats.nVsInvocations) / 1000000.0,
+                 s_bClusters ? "on" : "off", s_lastDrawStats.nClusters,
+                 s_lastDrawStats.nClustersFrustumCulled, s_lastDrawStats.nClustersBackfaceCulled,
+                 pPacket->grid._nLights, s_lightBench.bRunning ? " (benchmark)" : "", pPacket->grid.maxClusterLights(),
+                 s_shadowAtlas.nShadowed(), s_shadowAtlas._nFacesUpdated, f64(s_shadowAtlas.memoryUsage()) / f64(adt::SIZE_1M),
+                 s_bPipelining ? "pipelined" : "sequential", s_lastBuildMs, s_lastSubmitMs);
+
+        memset(s_aShadowUpdates, 0, sizeof(s_aShadowUpdates));
 
         s_fpsCount = 0;
         s_prevTime = _currTime;
@@ -200,9 +430,9 @@ renderFPSCounter(adt::Allocator* pAlloc)
 }
 
 void
-renderSkyBox()
+renderSkyBox(const m4& viewWorld)
 {
-    m4 view = m3(g_player._view); /* remove translation */
+    m4 view = m3(viewWorld); /* remove translation */
 
     glDisable(GL_CULL_FACE);
     glDepthMask(GL_FALSE);
@@ -216,19 +446,662 @@ renderSkyBox()
     glEnable(GL_CULL_FACE);
 }
 
-void
-renderScene(adt::Allocator* pAlloc, Shader* sh)
+m4
+backpackTransform(v3 pos, f32 angle)
 {
     m4 m = m4Iden();
-    s_mSponza.drawGraph(pAlloc, DRAW::ALL ^ DRAW::NORM, sh, "uModel", "uNormalMatrix", m);
-
-    m = m4Iden();
-    m *= m4Translate(m, {0, 0.5, 0});
+    m *= m4Translate(m, pos);
     m *= m4Scale(m, 0.002f);
-    m = m4RotY(m, toRad(90));
-    s_mBackpack.drawGraph(pAlloc, DRAW::ALL ^ DRAW::NORM, sh, "uModel", "uNormalMatrix", m);
+    m = m4RotY(m, toRad(90) + angle);
+
+    return m;
+}
+
+static void
+buildSceneBvh()
+{
+    g_aEntries._size = 0;
+    g_mSponza.collectEntries(&g_aEntries, m4Iden());
+    g_nStaticEntries = g_aEntries._size;
+    g_mBackpack.collectEntries(&g_aEntries, backpackTransform(BACKPACK_POS, s_backpackAngle));
+    s_bvhBackpackAngle = s_backpackAngle;
+
+    adt::Array<BvhItem> aItems(&adt::StdAllocator, g_aEntries._size);
+    for (auto& en : g_aEntries)
+        aItems.push({en.min, en.max});
+
+    f64 t0 = adt::timeNowMS();
+    g_bvh.build(aItems.data(), aItems._size, &g_tp);
+    LOG_OK("scene bvh: %u entries (%u static), %u nodes, built in %.3f ms\n",
+           g_aEntries._size, g_nStaticEntries, g_bvh._aNodes._size, adt::timeNowMS() - t0);
+
+    aItems.destroy();
+}
+
+/* the backpack moved, its entries keep their ids so refitting is enough */
+static void
+refitDynamicEntries()
+{
+    g_aEntries._size = g_nStaticEntries;
+    g_mBackpack.collectEntries(&g_aEntries, backpackTransform(BACKPACK_POS, s_backpackAngle));
+    s_bvhBackpackAngle = s_backpackAngle;
+
+    for (u32 i = g_nStaticEntries; i < g_aEntries._size; i++)
+        g_bvh.update(i, g_aEntries[i].min, g_aEntries[i].max);
+
+    g_bvh.refit();
+}
+
+/* everything of the requested casters that didn't make it into aIds counts as culled */
+void
+collectScene(InstanceBatch* pBatch, const adt::Array<u32>& aIds, const LodSelect* pLod, const occlusion::DepthBuffer* pOcclusion, enum shadows::CASTERS eCasters)
+{
+    u32 nEntries = 0;
+    if (eCasters & shadows::CASTERS::STATIC)
+        nEntries += g_nStaticEntries;
+    if (eCasters & shadows::CASTERS::DYNAMIC)
+        nEntries += g_aEntries._size - g_nStaticEntries;
+
+    u32 nVisible = 0;
+    for (u32 i = 0; i < aIds._size; i++)
+    {
+        u32 id = aIds[i];
+        if (!(eCasters & (id < g_nStaticEntries ? shadows::CASTERS::STATIC : shadows::CASTERS::DYNAMIC)))
+            continue;
+
+        collectEntry(pBatch, g_aEntries[id], pLod, pOcclusion);
+        nVisible++;
+    }
+
+    g_drawStats.nCulled += nEntries - nVisible;
+}
+
+/* shadow casters, depth only */
+void
+renderScene(adt::Allocator* pAlloc, Shader* sh, const Frustum* pFrustum, enum shadows::CASTERS eCasters)
+{
+    /* every cube face has a 90 degree fov */
+    LodSelect lod {
+        .eye = s_omniDirShadow.shadowLightPos(),
+        .projScale = f32(s_omniDirShadow._final.cubeMap.width) / 2.0f,
+        .threshold = SHADOW_LOD_THRESHOLD
+    };
+
+    /* the single pass path renders all faces at once, so only the light range bounds it */
+    adt::Array<u32> aIds(pAlloc, g_aEntries._size);
+    if (pFrustum)
+        g_bvh.queryFrustum(*pFrustum, &aIds);
+    else g_bvh.querySphere(s_omniDirShadow.shadowLightPos(), SHADOW_FAR_PLANE, &aIds);
+
+    InstanceBatch batch(pAlloc, DRAW::NONE);
+    collectScene(&batch, aIds, s_bLods ? &lod : nullptr, nullptr, eCasters);
+    batch.flush(pAlloc, sh, s_bInstancing);
+}
+
+/* atlas tile casters, bounded by the face frustum which ends at the light radius */
+static void
+renderPointLightCasters(adt::Allocator* pAlloc, Shader* sh, const Frustum* pFrustum, enum shadows::CASTERS eCasters)
+{
+    LodSelect lod {
+        .eye = s_shadowAtlas._pRendering->pos,
+        .projScale = f32(s_shadowAtlas._pRendering->aFaces[0].size) / 2.0f,
+        .threshold = SHADOW_LOD_THRESHOLD
+    };
+
+    adt::Array<u32> aIds(pAlloc, g_aEntries._size);
+    g_bvh.queryFrustum(*pFrustum, &aIds);
+
+    InstanceBatch batch(pAlloc, DRAW::NONE);
+    collectScene(&batch, aIds, s_bLods ? &lod : nullptr, nullptr, eCasters);
+    batch.flush(pAlloc, sh, s_bInstancing);
+}
+
+static void
+drawLitBatch(FramePacket* p)
+{
+    bool bBench = s_prepassBench.bRunning && p->bPrepassBench;
+    f64 t0 = 0.0;
+    if (bBench)
+    {
+        glFinish(); /* don't measure previous work */
+        t0 = adt::timeNowMS();
+    }
+
+    p->pLitBatch->upload();
+
+    if (p->bPrepass)
+    {
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        p->aLitCmds[0].replay();
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+        p->aLitCmds[1].replay();
+        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_LESS);
+    }
+    else p->aLitCmds[0].replay();
+
+    if (bBench)
+    {
+        glFinish();
+        s_prepassBench.aTimes[p->bPrepass] += adt::timeNowMS() - t0;
+
+        if (++s_prepassBench.nFrames >= PREPASS_BENCH_FRAMES * 2)
+        {
+            s_prepassBench.bRunning = false;
+
+            f64 forward = s_prepassBench.aTimes[0] / PREPASS_BENCH_FRAMES;
+            f64 prepass = s_prepassBench.aTimes[1] / PREPASS_BENCH_FRAMES;
+            s_bDepthPrepass = prepass < forward;
+            LOG_OK("lit pass: forward: %.3f ms, depth pre-pass: %.3f ms, using '%s'\n",
+                   forward, prepass, s_bDepthPrepass ? "depth pre-pass" : "forward");
+        }
+    }
+}
+
+static void
+writeLitPassCapture(const FramePacket* p)
+{
+    FILE* pf = fopen(LIT_PASS_CAPTURE_PATH, "wb");
+    if (!pf)
+    {
+        LOG_WARN("failed to write lit pass capture: '%s'\n", LIT_PASS_CAPTURE_PATH);
+        return;
+    }
+
+    u32 nCmds = 0;
+    for (u32 i = 0; i < (p->bPrepass ? 2u : 1u); i++)
+    {
+        fprintf(pf, "# %s, %u instances\n", !p->bPrepass ? "forward" : (i == 0 ? "depth pre-pass" : "shading"), p->pLitBatch->_aSorted._size);
+        p->aLitCmds[i].write(pf);
+        nCmds += p->aLitCmds[i]._aCmds._size;
+    }
+    fclose(pf);
+
+    LOG_OK("lit pass capture: %u commands (%u bytes) in '%s'\n", nCmds, nCmds * u32(sizeof(Cmd)), LIT_PASS_CAPTURE_PATH);
+}
+
+void
+toggleShadowPath()
+{
+    s_omniDirShadow.togglePath();
+    adt::String s = shadows::pathToString(s_omniDirShadow._ePath);
+    LOG_OK("shadow path: '%.*s'\n", (int)s._size, s._pData);
+}
+
+void
+cycleShadowFilter()
+{
+    s_omniDirShadow.cycleFilter();
+    adt::String s = shadows::filterToString(s_omniDirShadow._eFilter);
+    LOG_OK("shadow filter: '%.*s' (%u taps)\n", (int)s._size, s._pData, shadows::filterTaps(s_omniDirShadow._eFilter));
+}
+
+void
+toggleShadowDepthFormat()
+{
+    s_omniDirShadow.toggleDepthFormat();
+    adt::String s = shadows::depthFormatToString(s_omniDirShadow._eDepthFormat);
+    LOG_OK("shadow depth format: '%.*s', %u bytes for both maps\n", (int)s._size, s._pData, s_omniDirShadow.memoryUsage());
+}
+
+void
+startShadowBenchmark()
+{
+    s_omniDirShadow.startBenchmark();
+}
+
+void
+toggleLightAnimation()
+{
+    s_bLightPaused = !s_bLightPaused;
+    LOG_OK("light paused: %d\n", s_bLightPaused);
+}
+
+void
+toggleBackpackSpinning()
+{
+    s_bBackpackSpinning = !s_bBackpackSpinning;
+    LOG_OK("backpack spinning: %d\n", s_bBackpackSpinning);
+}
+
+void
+toggleInstancing()
+{
+    s_bInstancing = !s_bInstancing;
+    LOG_OK("instancing: %d\n", s_bInstancing);
+}
+
+void
+toggleLods()
+{
+    s_bLods = !s_bLods;
+    s_omniDirShadow.invalidateStatic();
+    LOG_OK("lods: %d\n", s_bLods);
+}
+
+void
+toggleOcclusionCulling()
+{
+    s_bOcclusion = !s_bOcclusion;
+    LOG_OK("occlusion culling: %d\n", s_bOcclusion);
+}
+
+void
+startPathBenchmark()
+{
+    bench::startPathBenchmark();
+    LOG_OK("camera path benchmark started (occlusion: %d, clusters: %d, lods: %d)\n", s_bOcclusion, s_bClusters, s_bLods);
+}
+
+void
+toggleClusterCulling()
+{
+    s_bClusters = !s_bClusters;
+    LOG_OK("cluster culling: %d\n", s_bClusters);
+}
+
+void
+pickEntry()
+{
+    BvhHit hit = g_bvh.raycast(g_player._pos, g_player._front, 1000.0f);
+    if (hit.id == adt::NPOS)
+    {
+        LOG_OK("pick: nothing\n");
+        return;
+    }
+
+    const SceneEntry& en = g_aEntries[hit.id];
+    LOG_OK("pick: entry %u (%s) at %.3f, %u triangles, %u clusters, bounds [%.2f, %.2f, %.2f] .. [%.2f, %.2f, %.2f]\n",
+           hit.id, hit.id < g_nStaticEntries ? "sponza" : "backpack", hit.t,
+           en.pMesh->aLods[0].nIndices / 3, en.pMesh->nClusters,
+           en.min.x, en.min.y, en.min.z, en.max.x, en.max.y, en.max.z);
+}
+
+/* Only between frames with nothing loading, tasks and coroutines in flight hold on to the old workers.
+ * The render thread gets pinned too when the policy reserves a core for it. */
+static void
+restartPool(enum adt::AFFINITY eAffinity)
+{
+    g_tp.wait();
+    g_tp.destroy();
+    new (&g_tp) adt::ThreadPool(&adt::StdAllocator, s_topology, eAffinity);
+    g_tp.start();
+
+    u32 renderCpu = s_topology.renderCpu(eAffinity);
+    if (renderCpu != adt::NPOS)
+        adt::pinThisThread(renderCpu);
+    else adt::unpinThisThread(s_topology);
+}
+
+void
+cycleAffinity()
+{
+    if (s_nAssetsLoading > 0 || s_topologyBench.bRunning)
+    {
+        LOG_WARN("thread affinity: can't switch while loading or benchmarking\n");
+        return;
+    }
+
+    auto e = adt::AFFINITY((int(g_tp._eAffinity) + 1) % int(adt::AFFINITY::ESIZE));
+    restartPool(e);
+
+    adt::String s = adt::affinityToString(e);
+    LOG_OK("thread affinity: '%.*s', %u workers, render thread on cpu %d\n",
+           (int)s._size, s._pData, g_tp._threadCount, int(s_topology.renderCpu(e)));
+}
+
+static int
+TopologyBenchDecode(void* pArg)
+{
+    auto* pPath = (adt::String*)pArg;
+    adt::ArenaAllocator arena(adt::SIZE_1M * 5);
+    loadBMP(&arena, *pPath, true);
+    arena.freeAll();
+
+    return 0;
+}
+
+/* the pool side of loading sponza and the backpack, every texture decoded at once */
+static f64
+timeSceneTextureDecodes()
+{
+    struct
+    {
+        Model* pModel;
+        const char* ntsPath;
+    } aModels[] {
+        {&g_mSponza, "test-assets/models/Sponza/Sponza.gltf"},
+        {&g_mBackpack, "test-assets/models/backpack/scene.gltf"},
+    };
+
+    adt::ArenaAllocator arena(adt::SIZE_1K * 64);
+    adt::Array<adt::String> aPaths(&arena, 128);
+    for (auto& m : aModels)
+        for (auto& img : m.pModel->_asset._aImages)
+            aPaths.push(adt::replacePathSuffix(&arena, m.ntsPath, img.uri));
+
+    adt::TaskGroup group;
+    f64 t0 = adt::timeNowMS();
+    for (auto& path : aPaths)
+        g_tp.submit(TopologyBenchDecode, &path, &group);
+    g_tp.wait(&group);
+    f64 ms = adt::timeNowMS() - t0;
+
+    s_topologyBench.nTextures = aPaths._size;
+    arena.freeAll();
+
+    return ms;
+}
+
+static void
+updateTopologyBenchmark()
+{
+    auto& b = s_topologyBench;
+    int i = b.policy;
+
+    if (b.nFrames == 0)
+    {
+        restartPool(adt::AFFINITY(i));
+        b.aWorkers[i] = g_tp._threadCount;
+        b.aLoadMs[i] = timeSceneTextureDecodes();
+    }
+    else if (b.nFrames > TOPOLOGY_BENCH_WARMUP)
+    {
+        /* what the last frame took, its packet was built on this pool */
+        b.aFrameMs[i] += g_player._deltaTime * 1000.0;
+        b.aBuildMs[i] += s_lastBuildMs;
+        b.aMaxBuildMs[i] = fmax(b.aMaxBuildMs[i], s_lastBuildMs);
+    }
+
+    if (++b.nFrames <= TOPOLOGY_BENCH_WARMUP + TOPOLOGY_BENCH_FRAMES)
+        return;
+
+    b.nFrames = 0;
+    if (++b.policy < int(adt::AFFINITY::ESIZE))
+        return;
+
+    b.bRunning = false;
+    restartPool(b.eRestore);
+
+    LOG_OK("cpu topology benchmark (%u frames per policy, load decodes %u textures):\n", TOPOLOGY_BENCH_FRAMES, b.nTextures);
+    for (int j = 0; j < int(adt::AFFINITY::ESIZE); j++)
+    {
+        adt::String s = adt::affinityToString(adt::AFFINITY(j));
+        LOG_OK("    %-14.*s %2u workers: load %.3f ms, frame %.3f ms, build %.3f ms (worst %.3f ms)\n",
+               (int)s._size, s._pData, b.aWorkers[j], b.aLoadMs[j], b.aFrameMs[j] / TOPOLOGY_BENCH_FRAMES,
+               b.aBuildMs[j] / TOPOLOGY_BENCH_FRAMES, b.aMaxBuildMs[j]);
+    }
+}
+
+void
+startTopologyBenchmark()
+{
+    if (s_nAssetsLoading > 0)
+    {
+        LOG_WARN("cpu topology benchmark: wait for the scene to load\n");
+        return;
+    }
+
+    s_topologyBench = {};
+    s_topologyBench.eRestore = g_tp._eAffinity;
+    s_topologyBench.bRunning = true;
+    LOG_OK("cpu topology benchmark started (pipelining: %d)\n", s_bPipelining);
+}
+
+void
+captureLitPass()
+{
+    s_bCaptureLitPass = true;
+}
+
+void
+toggleDepthPrepass()
+{
+    s_prepassBench.bRunning = false;
+    s_bDepthPrepass = !s_bDepthPrepass;
+    LOG_OK("depth pre-pass: %d\n", s_bDepthPrepass);
+}
+
+void
+startPrepassBenchmark()
+{
+    s_prepassBench = {};
+    s_prepassBench.bRunning = true;
+}
+
+/* render thread, the tiles the packet asked for are drawn and their slots handed to the lit pass */
+static void
+updatePointLightShadows(adt::Allocator* pAlloc, FramePacket* p)
+{
+    s_shadowAtlas.update(pAlloc, p->aShadowReqs, p->nShadowReqs, renderPointLightCasters);
+
+    for (u32 i = 0; i < p->nShadowReqs; i++)
+    {
+        int slot = s_shadowAtlas.slotIndex(p->aShadowReqs[i].id);
+        p->aPointLights[p->aShadowReqs[i].id].shadow = f32(slot);
+    }
+}
+
+void
+togglePointLightShadows()
+{
+    s_bPointLightShadows = !s_bPointLightShadows;
+    LOG_OK("point light shadows: %d\n", s_bPointLightShadows);
+}
+
+void
+cyclePointLights()
+{
+    s_lightBench.bRunning = false;
+    s_pointLightCountIdx = (s_pointLightCountIdx + 1) % adt::size(s_aPointLightCounts);
+    s_nPointLights = s_aPointLightCounts[s_pointLightCountIdx];
+    LOG_OK("point lights: %u\n", s_nPointLights);
+}
+
+void
+startLightBenchmark()
+{
+    s_lightBench = {};
+    s_lightBench.bRunning = true;
+    LOG_OK("light benchmark started\n");
+}
+
+/* packets built for the previous step can still come through once, they don't count */
+static void
+accumulateLightBenchmark(const FramePacket* p, f64 litMs)
+{
+    auto& b = s_lightBench;
+    if (p->nPointLights != s_aLightBenchCounts[b.step])
+        return;
+
+    b.assignMs += p->grid.assignTime();
+    b.litMs += litMs;
+    u32 maxLights = p->grid.maxClusterLights();
+    b.maxClusterLights = maxLights > b.maxClusterLights ? maxLights : b.maxClusterLights;
+
+    if (++b.nFrames >= LIGHT_BENCH_FRAMES)
+    {
+        LOG_OK("lights: %u, assign: %.3f ms (cpu), lit pass: %.3f ms, max per cluster: %u\n",
+               s_aLightBenchCounts[b.step], b.assignMs / LIGHT_BENCH_FRAMES, b.litMs / LIGHT_BENCH_FRAMES, b.maxClusterLights);
+
+        u32 step = b.step + 1;
+        b = {};
+        b.step = step;
+        b.bRunning = step < adt::size(s_aLightBenchCounts);
+    }
+}
+
+void
+toggleNormalMapping()
+{
+    s_normalMapBench.bRunning = false;
+    s_bNormalMapping = !s_bNormalMapping;
+    LOG_OK("normal mapping: %d\n", s_bNormalMapping);
+}
+
+void
+startNormalMapBenchmark()
+{
+    s_normalMapBench = {};
+    s_normalMapBench.bRunning = true;
+    LOG_OK("normal mapping benchmark started (stress scene: %d)\n", s_bStressScene);
+}
+
+static void
+accumulateNormalMapBenchmark(bool bNormalMapping, f64 litMs)
+{
+    auto& b = s_normalMapBench;
+    b.aTimes[bNormalMapping] += litMs;
+
+    if (++b.nFrames >= NORMAL_MAP_BENCH_FRAMES * 2)
+    {
+        b.bRunning = false;
+        LOG_OK("lit pass: without normal maps: %.3f ms, with normal maps: %.3f ms\n",
+               b.aTimes[0] / NORMAL_MAP_BENCH_FRAMES, b.aTimes[1] / NORMAL_MAP_BENCH_FRAMES);
+    }
+}
+
+void
+toggleStressScene()
+{
+    s_bStressScene = !s_bStressScene;
+    LOG_OK("stress scene: %d (%d backpacks)\n", s_bStressScene, STRESS_ROWS * STRESS_COLS);
+}
+
+void
+togglePipelining()
+{
+    s_bPipelining = !s_bPipelining;
+    LOG_OK("frame pipelining: %d\n", s_bPipelining);
+}
+
+void
+addDrawStats(DrawStats* pTo, const DrawStats& s)
+{
+    pTo->nDraws += s.nDraws;
+    pTo->nCulled += s.nCulled;
+    pTo->nInstances += s.nInstances;
+    pTo->nTriangles += s.nTriangles;
+    pTo->nTrianglesFull += s.nTrianglesFull;
+    pTo->nOcclusionTests += s.nOcclusionTests;
+    pTo->nOccluded += s.nOccluded;
+    pTo->nClusters += s.nClusters;
+    pTo->nClustersFrustumCulled += s.nClustersFrustumCulled;
+    pTo->nClustersBackfaceCulled += s.nClustersBackfaceCulled;
+    pTo->nVsInvocations += s.nVsInvocations;
+}
+
+/* main thread, between builds: everything the build reads from the simulation is copied */
+static void
+startFramePacket(App* pApp, FramePacket* p)
+{
+    p->lightTime = s_lightTime;
+    p->backpackAngle = s_backpackAngle;
+    p->nPointLights = s_lightBench.bRunning ? s_aLightBenchCounts[s_lightBench.step] : s_nPointLights;
+
+    p->bOcclusion = s_bOcclusion;
+    p->bClusters = s_bClusters;
+    p->bLods = s_bLods;
+    p->bStressScene = s_bStressScene;
+    p->bNormalMapBench = s_normalMapBench.bRunning;
+    p->bNormalMapping = p->bNormalMapBench ? s_normalMapBench.nBuilt++ % 2 : s_bNormalMapping;
+    p->bPointLightShadows = s_bPointLightShadows;
+    p->bInstancing = s_bInstancing;
+    p->bPrepassBench = s_prepassBench.bRunning;
+    p->bPrepass = p->bPrepassBench ? s_prepassBench.nBuilt++ % 2 : s_bDepthPrepass;
+
+    submitFramePacket(pApp, p);
+}
+
+/* render thread, gl only, the packet's build is done */
+static void
+renderFramePacket(FramePacket* p, adt::Allocator* pAlloc)
+{
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    /* copy both proj and view in one go */
+    s_uboProjView.bufferData(&p->proj, 0, sizeof(m4) * 2);
+
+    constexpr v3 lightColor(colors::whiteSmoke);
+
+    /* render scene to depth cubemap */
+    s_omniDirShadow.render(pAlloc, p->lightPos, SHADOW_NEAR_PLANE, SHADOW_FAR_PLANE, renderScene);
+    s_aShadowUpdates[int(s_omniDirShadow._cache.eLastUpdate)]++;
+
+    updatePointLightShadows(pAlloc, p);
+    s_lastShadowDrawStats = g_drawStats;
+
+    /* reset viewport */
+    glViewport(0, 0, p->width, p->height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    /* draw skybox prior to everything else */
+    renderSkyBox(p->view);
+
+    /*render scene as normal using the generated depth map */
+    p->grid.upload(p->aPointLights);
+    p->grid.bind(GL_TEXTURE2);
+    s_shadowAtlas.bind(GL_TEXTURE5);
+    for (Shader* sh : {&s_shOmniDirShadowAlphaTest, &s_shOmniDirShadow})
+    {
+        sh->use();
+        sh->setV3("uLightPos", p->lightPos);
+        sh->setV3("uShadowLightPos", s_omniDirShadow.shadowLightPos());
+        sh->setV3("uLightColor", lightColor);
+        sh->setV3("uViewPos", p->pos);
+        sh->setV3("uViewDir", p->front);
+        sh->setF("uFarPlane", SHADOW_FAR_PLANE);
+        sh->setI("uShadowTaps", shadows::filterTaps(s_omniDirShadow._eFilter));
+        sh->setI("uNormalMapping", false); /* the batch sets it per material when it binds normal maps */
+        p->grid.setUniforms(sh, p->width, p->height);
+        s_shadowAtlas.setUniforms(sh);
+    }
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, s_omniDirShadow.tex());
+
+    {
+        bool bTimed = s_lightBench.bRunning || s_normalMapBench.bRunning;
+        f64 t0 = 0.0;
+        if (bTimed)
+        {
+            glFinish();
+            t0 = adt::timeNowMS();
+        }
+
+        drawLitBatch(p);
+        if (s_bCaptureLitPass)
+        {
+            s_bCaptureLitPass = false;
+            writeLitPassCapture(p);
+        }
+
+        if (bTimed)
+        {
+            glFinish();
+            f64 litMs = adt::timeNowMS() - t0;
+            if (s_lightBench.bRunning)
+                accumulateLightBenchmark(p, litMs);
+            if (s_normalMapBench.bRunning && p->bNormalMapBench)
+                accumulateNormalMapBenchmark(p->bNormalMapping, litMs);
+        }
+
+        addDrawStats(&g_drawStats, p->stats);
+        bench::accumulatePathBenchmark(g_drawStats, s_lastShadowDrawStats);
+    }
+
+    s_shColor.use();
+    m4 m = m4Translate(m4Iden(), p->lightPos);
+    m = m4Scale(m, 0.07f);
+    s_shColor.setV3("uColor", lightColor);
+    s_mSphere.drawGraph(pAlloc, DRAW::APPLY_TM, &s_shColor, "uModel", "", m);
 }
 
+/* Pipelined, frame N is drawn while the pool builds N+1 and the build keeps going through the swap,
+ * the main thread only waits for it at the top of the next frame's simulation.
+ * Input, asset arrival, animation and bvh refits all happen at that point, when no build is running. */
 static void
 mainLoop(App* pApp)
 {
@@ -237,80 +1110,95 @@ mainLoop(App* pApp)
     while (pApp->_bRunning)
     {
         {
+            g_drawStats = {};
+
             g_player.updateDeltaTime();
             g_player.procMouse();
             g_player.procKeys(pApp);
 
             pApp->procEvents();
 
-            f32 aspect = f32(pApp->_wWidth) / f32(pApp->_wHeight);
-            constexpr f32 shadowAspect = 1024.0f / 1024.0f;
+            s_assetUploads.pump(ASSET_UPLOAD_BUDGET_MS);
+
+            bench::updatePathBenchmark();
 
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            if (s_topologyBench.bRunning)
+                updateTopologyBenchmark();
+
+            f32 aspect = f32(pApp->_wWidth) / f32(pApp->_wHeight);
 
             g_player.updateProj(toRad(g_fov), aspect, 0.01f, 100.0f);
             g_player.updateView();
-            /* copy both proj and view in one go */
-            s_uboProjView.bufferData(&g_player, 0, sizeof(m4) * 2);
-
-            v3 lightPos {cosf((f32)g_player._currTime) * 6.0f, 3.0f, sinf((f32)g_player._currTime) * 1.1f};
-            constexpr v3 lightColor(colors::whiteSmoke);
-            constexpr f32 nearPlane = 0.01f, farPlane = 25.0f;
-            m4 shadowProj = m4Pers(toRad(90), shadowAspect, nearPlane, farPlane);
-            CubeMapProjections tmShadows(shadowProj, lightPos);
-
-            /* render scene to depth cubemap */
-            glViewport(0, 0, s_cmCubeMap.width, s_cmCubeMap.height);
-            glBindFramebuffer(GL_FRAMEBUFFER, s_cmCubeMap.fbo);
-            glClear(GL_DEPTH_BUFFER_BIT);
-
-            s_shCubeDepth.use();
-            for (u32 i = 0; i < adt::size(tmShadows._tms); i++)
+
+            if (!s_bLightPaused)
+                s_lightTime += g_player._deltaTime;
+
+            if (s_bBackpackSpinning)
+            {
+                s_backpackAngle += f32(g_player._deltaTime);
+                s_omniDirShadow.invalidateDynamic();
+            }
+
+            if (s_backpackAngle != s_bvhBackpackAngle)
+                refitDynamicEntries();
+
+            FramePacket* pBuild = &s_aFramePackets[s_framePacketIdx];
+            if (s_bPipelining && !s_pFrameReady)
             {
-                char buff[30] {};
-                snprintf(buff, sizeof(buff), "uShadowMatrices[%d]", i);
-                s_shCubeDepth.setM4(buff, tmShadows[i]);
+                /* filling the pipeline, the first frame is built in place */
+                startFramePacket(pApp, pBuild);
+                g_tp.wait(&pBuild->group);
+                s_pFrameReady = pBuild;
+                s_framePacketIdx = (s_framePacketIdx + 1) % FRAME_PACKETS;
+                pBuild = &s_aFramePackets[s_framePacketIdx];
             }
-            s_shCubeDepth.setV3("uLightPos", lightPos);
-            s_shCubeDepth.setF("uFarPlane", farPlane);
-            glActiveTexture(GL_TEXTURE1);
-            glCullFace(GL_FRONT);
-            renderScene(&allocFrame, &s_shCubeDepth);
-            glCullFace(GL_BACK);
-
-            /* reset viewport */
-            glBindFramebuffer(GL_FRAMEBUFFER, 0);
-            glViewport(0, 0, pApp->_wWidth, pApp->_wHeight);
-            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-            /* draw skybox prior to everything else */
-            renderSkyBox();
-
-            /*render scene as normal using the generated depth map */
-            s_shOmniDirShadow.use();
-            s_shOmniDirShadow.setV3("uLightPos", lightPos);
-            s_shOmniDirShadow.setV3("uLightColor", lightColor);
-            s_shOmniDirShadow.setV3("uViewPos", g_player._pos);
-            s_shOmniDirShadow.setF("uFarPlane", farPlane);
-            glActiveTexture(GL_TEXTURE1);
-            glBindTexture(GL_TEXTURE_CUBE_MAP, s_cmCubeMap.tex);
-            renderScene(&allocFrame, &s_shOmniDirShadow);
-
-            s_shColor.use();
-            m4 m = m4Translate(m4Iden(), lightPos);
-            m = m4Scale(m, 0.07f);
-            s_shColor.setV3("uColor", lightColor);
-            s_mSphere.drawGraph(&allocFrame, DRAW::APPLY_TM, &s_shColor, "uModel", "", m);
-
-            renderFPSCounter(&allocFrame);
+
+            startFramePacket(pApp, pBuild);
+
+            FramePacket* pDraw = pBuild;
+            if (s_bPipelining)
+                pDraw = s_pFrameReady;
+            else g_tp.wait(&pBuild->group);
+
+            f64 t0 = adt::timeNowMS();
+            renderFramePacket(pDraw, &allocFrame);
+
+            s_lastDrawStats = g_drawStats;
+            s_lastBuildMs = pDraw->buildMs;
+            s_lastSubmitMs = adt::timeNowMS() - t0;
+            renderFPSCounter(&allocFrame, pDraw);
+
+            allocFrame.reset();
+            pApp->swapBuffers();
+
+            g_tp.wait(&pBuild->group);
+            s_pFrameReady = s_bPipelining ? pBuild : nullptr;
+            s_framePacketIdx = (s_framePacketIdx + 1) % FRAME_PACKETS;
         }
 
-        allocFrame.reset();
-        pApp->swapBuffers();
+        if (!s_bFirstFrameShown)
+        {
+            s_bFirstFrameShown = true;
+            LOG_OK("first frame %.3f ms after start, %u assets still loading\n", adt::timeNowMS() - s_tStartMS, s_nAssetsLoading);
+        }
+        if (s_nAssetsLoading > 0)
+            s_nLoadingFrames++;
 
         s_fpsCount++;
     }
 
+    /* let the loads still on the pool get to the queue, whatever waits there for the render thread is dropped */
+    g_tp.wait();
+    s_assetUploads.destroy();
+    s_assetArena.freeAll();
+    s_assetGraph.destroy();
+
+    for (auto& p : s_aFramePackets)
+    {
+        p.grid.destroy();
+        p.arena.freeAll();
+    }
+
     allocFrame.freeAll();
     s_apAssets.freeAll();
 }
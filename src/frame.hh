@@ -1,6 +1,7 @@
 #pragma once
 
 #include "App.hh"
+#include "ThreadPool.hh"
 #include "controls.hh"
 
 namespace frame
@@ -8,12 +9,56 @@ namespace frame
 
 constexpr u32 ASSET_MAX_COUNT = 512;
 
+/* reset every frame, shown with the fps counter */
+struct DrawStats
+{
+    u32 nDraws;
+    u32 nCulled;
+    u32 nInstances;
+    u32 nTriangles;
+    u32 nTrianglesFull; /* what lod 0 everywhere would have drawn */
+    u32 nOcclusionTests;
+    u32 nOccluded;
+    u32 nClusters; /* tested */
+    u32 nClustersFrustumCulled;
+    u32 nClustersBackfaceCulled;
+    u64 nVsInvocations; /* software estimate from the simulated post transform cache */
+};
+
+void addDrawStats(DrawStats* pTo, const DrawStats& s);
+
 extern App* g_app;
 extern controls::PlayerControls g_player;
 extern f32 g_fov;
 extern f32 g_uiWidth;
 extern f32 g_uiHeight;
+extern thread_local DrawStats g_drawStats; /* per thread, frame packet builds keep their own and hand them over */
+extern adt::ThreadPool g_tp; /* one unpinned worker per logical core until an affinity policy is picked, everything submits here, nested waits help instead of blocking */
 
 void run(App* pApp);
+void toggleShadowPath();
+void startShadowBenchmark();
+void cycleShadowFilter();
+void toggleShadowDepthFormat();
+void toggleLightAnimation();
+void toggleBackpackSpinning();
+void toggleInstancing();
+void toggleStressScene();
+void toggleLods();
+void toggleOcclusionCulling();
+void startPathBenchmark();
+void toggleClusterCulling();
+void pickEntry();
+void toggleDepthPrepass();
+void startPrepassBenchmark();
+void cyclePointLights();
+void startLightBenchmark();
+void togglePointLightShadows();
+void toggleNormalMapping();
+void startNormalMapBenchmark();
+void togglePipelining();
+void captureLitPass();
+void cycleAffinity();
+void startTopologyBenchmark();
 
 } /* namespace frame */
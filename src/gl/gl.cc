@@ -5,7 +5,6 @@ namespace gl
 {
 
 GLenum lastErrorCode = 0;
-mtx_t mtxGlContext;
 
 #ifdef DEBUG
 
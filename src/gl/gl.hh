@@ -51,7 +51,6 @@ namespace gl
 {
 
 extern GLenum lastErrorCode;
-extern mtx_t mtxGlContext;
 
 void debugCallback(GLenum source,
                    GLenum type,
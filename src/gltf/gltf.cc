@@ -26,7 +26,10 @@ enum class HASH_CODES : u64
     VEC3 = adt::hashFNV("VEC3"),
     VEC4 = adt::hashFNV("VEC4"),
     MAT3 = adt::hashFNV("MAT3"),
-    MAT4 = adt::hashFNV("MAT4")
+    MAT4 = adt::hashFNV("MAT4"),
+    OPAQUE_ = adt::hashFNV("OPAQUE"),
+    MASK = adt::hashFNV("MASK"),
+    BLEND = adt::hashFNV("BLEND")
 };
 
 #ifdef GLTF
@@ -78,6 +81,21 @@ stringToAccessorType(adt::String sv)
     }
 }
 
+inline enum ALPHA_MODE
+stringToAlphaMode(adt::String sv)
+{
+    switch (adt::hashFNV(sv))
+    {
+        default:
+        case (u64)(HASH_CODES::OPAQUE_):
+            return ALPHA_MODE::OPAQUE_;
+        case (u64)(HASH_CODES::MASK):
+            return ALPHA_MODE::MASK;
+        case (u64)(HASH_CODES::BLEND):
+            return ALPHA_MODE::BLEND;
+    }
+}
+
 inline union Type
 assignUnionType(json::Object* obj, u32 n)
 {
@@ -132,8 +150,20 @@ accessorTypeToUnionType(enum ACCESSOR_TYPE t, json::Object* obj)
 
 void
 Asset::load(adt::String path)
+{
+    read(path);
+    parse();
+}
+
+void
+Asset::read(adt::String path)
 {
     _parser.load(path);
+}
+
+void
+Asset::parse()
+{
     _parser.parse();
 
     processJSONObjs();
@@ -454,11 +484,25 @@ Asset::processMaterials()
             normTexInfo.index = json::getLong(pIndex);
         }
 
+        auto pAlphaMode = json::searchObject(obj, "alphaMode");
+        auto pAlphaCutoff = json::searchObject(obj, "alphaCutoff");
+
+        f64 alphaCutoff = 0.5;
+        if (pAlphaCutoff)
+        {
+            if (pAlphaCutoff->tagVal.tag == json::TAG::LONG)
+                alphaCutoff = f64(json::getLong(pAlphaCutoff));
+            else
+                alphaCutoff = json::getDouble(pAlphaCutoff);
+        }
+
         _aMaterials.push({
             .pbrMetallicRoughness {
                 .baseColorTexture = texInfo,
             },
-            .normalTexture = normTexInfo
+            .normalTexture = normTexInfo,
+            .alphaMode = pAlphaMode ? stringToAlphaMode(json::getString(pAlphaMode)) : ALPHA_MODE::OPAQUE_,
+            .alphaCutoff = alphaCutoff
         });
     }
 }
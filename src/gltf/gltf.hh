@@ -193,10 +193,19 @@ struct PbrMetallicRoughness
     TextureInfo baseColorTexture;
 };
 
+enum class ALPHA_MODE
+{
+    OPAQUE_, /* (OPAQUE is a wingdi.h macro) The rendered output is fully opaque and any alpha value is ignored. */
+    MASK, /* The rendered output is either fully opaque or fully transparent depending on the alpha value and the specified alpha cutoff value. */
+    BLEND /* The rendered output is combined with the background using the normal painting operation. */
+};
+
 struct Material
 {
     PbrMetallicRoughness pbrMetallicRoughness;
     NormalTextureInfo normalTexture;
+    enum ALPHA_MODE alphaMode = ALPHA_MODE::OPAQUE_;
+    f64 alphaCutoff = 0.5; /* Only used in MASK mode. */
 };
 
 struct Asset
@@ -221,7 +230,9 @@ struct Asset
     Asset(adt::Allocator* p, adt::String path)
         : Asset(p) { this->load(path); }
 
-    void load(adt::String path);
+    void load(adt::String path); /* read() and parse() */
+    void read(adt::String path); /* just the json text, buffers are read by parse() */
+    void parse();
 private:
     struct {
         json::Object* scene;
@@ -0,0 +1,301 @@
+#include "lights.hh"
+#include "utils.hh"
+
+#include <emmintrin.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+namespace lights
+{
+
+static inline f32
+sliceNear(u32 slice, f32 sliceRatio)
+{
+    return slice == 0 ? 0.0f : SLICE_NEAR * powf(sliceRatio, f32(slice - 1));
+}
+
+/* view space bounds of every cluster, only changes with the projection */
+static void
+buildSlices(ClusterGrid* pSelf, const m4& proj, f32 far)
+{
+    f32 sliceRatio = powf(far / SLICE_NEAR, 1.0f / f32(SLICES - 1));
+    pSelf->_sliceScale = 1.0f / logf(sliceRatio);
+
+    /* view ray through ndc (x, y) is (x / proj[0][0], y / proj[1][1], -1) */
+    f32 invX = 1.0f / proj.e[0][0];
+    f32 invY = 1.0f / proj.e[1][1];
+
+    for (u32 s = 0; s < SLICES; s++)
+    {
+        Slice& sl = pSelf->_pSlices[s];
+        f32 zNear = sliceNear(s, sliceRatio);
+        f32 zFar = s == SLICES - 1 ? far : sliceNear(s + 1, sliceRatio);
+
+        sl.min = {FLT_MAX, FLT_MAX, -zFar};
+        sl.max = {-FLT_MAX, -FLT_MAX, -zNear};
+
+        for (u32 y = 0; y < TILES_Y; y++)
+        {
+            for (u32 x = 0; x < TILES_X; x++)
+            {
+                f32 x0 = (-1.0f + 2.0f * f32(x) / TILES_X) * invX, x1 = (-1.0f + 2.0f * f32(x + 1) / TILES_X) * invX;
+                f32 y0 = (-1.0f + 2.0f * f32(y) / TILES_Y) * invY, y1 = (-1.0f + 2.0f * f32(y + 1) / TILES_Y) * invY;
+
+                /* corners of the tile at both depths */
+                u32 i = y * TILES_X + x;
+                sl.aMinX[i] = fminf(fminf(x0 * zNear, x0 * zFar), fminf(x1 * zNear, x1 * zFar));
+                sl.aMaxX[i] = fmaxf(fmaxf(x0 * zNear, x0 * zFar), fmaxf(x1 * zNear, x1 * zFar));
+                sl.aMinY[i] = fminf(fminf(y0 * zNear, y0 * zFar), fminf(y1 * zNear, y1 * zFar));
+                sl.aMaxY[i] = fmaxf(fmaxf(y0 * zNear, y0 * zFar), fmaxf(y1 * zNear, y1 * zFar));
+                sl.aMinZ[i] = -zFar;
+                sl.aMaxZ[i] = -zNear;
+
+                sl.min.x = fminf(sl.min.x, sl.aMinX[i]);
+                sl.min.y = fminf(sl.min.y, sl.aMinY[i]);
+                sl.max.x = fmaxf(sl.max.x, sl.aMaxX[i]);
+                sl.max.y = fmaxf(sl.max.y, sl.aMaxY[i]);
+            }
+        }
+    }
+}
+
+static inline bool
+sphereAABB(const v4& s, const v3& min, const v3& max)
+{
+    f32 d2 = 0.0f;
+    for (u32 a = 0; a < 3; a++)
+    {
+        f32 d = fmaxf(fmaxf(min.e[a] - s.e[a], s.e[a] - max.e[a]), 0.0f);
+        d2 += d*d;
+    }
+
+    return d2 <= s.w * s.w;
+}
+
+static int
+assignSlice(void* p)
+{
+    auto& a = *(SliceArg*)p;
+    ClusterGrid* pSelf = a.pSelf;
+    const Slice& sl = pSelf->_pSlices[a.slice];
+    auto& aOut = pSelf->_aSliceIndices[a.slice];
+    ClusterRange* pRanges = pSelf->_pRanges + a.slice * SLICE_CLUSTERS;
+
+    f64 t0 = adt::timeNowMS();
+    aOut._size = 0;
+
+    /* lights touching the slice at all */
+    u16* aCandidates = pSelf->_aSliceCandidates[a.slice].data();
+    u32 nCandidates = 0;
+    for (u32 i = 0; i < pSelf->_nLights; i++)
+        if (sphereAABB(pSelf->_aViewSpheres[i], sl.min, sl.max))
+            aCandidates[nCandidates++] = u16(i);
+
+    const __m128 zero = _mm_setzero_ps();
+
+    /* 4 clusters against each candidate, lists come out cluster by cluster */
+    for (u32 c = 0; c < SLICE_CLUSTERS; c += 4)
+    {
+        __m128 minX = _mm_loadu_ps(sl.aMinX + c), maxX = _mm_loadu_ps(sl.aMaxX + c);
+        __m128 minY = _mm_loadu_ps(sl.aMinY + c), maxY = _mm_loadu_ps(sl.aMaxY + c);
+        __m128 minZ = _mm_loadu_ps(sl.aMinZ + c), maxZ = _mm_loadu_ps(sl.aMaxZ + c);
+
+        u16 aLists[4][MAX_LIGHTS_PER_CLUSTER];
+        u32 aCounts[4] {};
+
+        for (u32 j = 0; j < nCandidates; j++)
+        {
+            const v4& s = pSelf->_aViewSpheres[aCandidates[j]];
+            __m128 cx = _mm_set1_ps(s.x), cy = _mm_set1_ps(s.y), cz = _mm_set1_ps(s.z);
+
+            __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minX, cx), _mm_sub_ps(cx, maxX)), zero);
+            __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minY, cy), _mm_sub_ps(cy, maxY)), zero);
+            __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minZ, cz), _mm_sub_ps(cz, maxZ)), zero);
+            __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            int mask = _mm_movemask_ps(_mm_cmple_ps(d2, _mm_set1_ps(s.w * s.w)));
+
+            for (u32 k = 0; mask; k++, mask >>= 1)
+                if ((mask & 1) && aCounts[k] < MAX_LIGHTS_PER_CLUSTER)
+                    aLists[k][aCounts[k]++] = aCandidates[j];
+        }
+
+        for (u32 k = 0; k < 4; k++)
+        {
+            pRanges[c + k] = {aOut._size, aCounts[k]};
+            for (u32 j = 0; j < aCounts[k]; j++)
+                aOut.push(aLists[k][j]);
+        }
+    }
+
+    pSelf->_aSliceMs[a.slice] = adt::timeNowMS() - t0;
+
+    return 0;
+}
+
+ClusterGrid::ClusterGrid(adt::Allocator* p)
+    : _pAlloc(p), _aIndices(p, N_CLUSTERS), _aViewSpheres(p)
+{
+    _pSlices = (Slice*)p->alloc(SLICES, sizeof(Slice));
+    _pRanges = (ClusterRange*)p->alloc(N_CLUSTERS, sizeof(ClusterRange));
+    for (u32 i = 0; i < SLICES; i++)
+    {
+        _aSliceIndices[i] = adt::Array<u16>(p, SLICE_CLUSTERS);
+        _aSliceCandidates[i] = adt::Array<u16>(p);
+    }
+}
+
+void
+ClusterGrid::init()
+{
+    glGenBuffers(3, _aBuffers);
+    glGenTextures(3, _aTextures);
+
+    const GLenum aFormats[3] {GL_RGBA32F, GL_RG32UI, GL_R16UI};
+    for (u32 i = 0; i < 3; i++)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, _aBuffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, 16, nullptr, GL_DYNAMIC_DRAW);
+        glBindTexture(GL_TEXTURE_BUFFER, _aTextures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, aFormats[i], _aBuffers[i]);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void
+ClusterGrid::submit(adt::ThreadPool* pTp, adt::TaskGroup* pGroup, const m4& proj, const m4& view, f32 far, const PointLight* pLights, u32 nLights)
+{
+    if (memcmp(&proj, &_proj, sizeof(m4)) != 0 || far != _far)
+    {
+        _proj = proj;
+        _far = far;
+        buildSlices(this, proj, far);
+    }
+
+    _nLights = nLights < MAX_LIGHTS ? nLights : MAX_LIGHTS;
+    _aViewSpheres.resize(_nLights);
+    for (auto& a : _aSliceCandidates)
+        a.resize(_nLights);
+
+    auto e = view.e;
+    for (u32 i = 0; i < _nLights; i++)
+    {
+        const v3& p = pLights[i].pos;
+        _aViewSpheres[i] = {
+            e[0][0]*p.x + e[1][0]*p.y + e[2][0]*p.z + e[3][0],
+            e[0][1]*p.x + e[1][1]*p.y + e[2][1]*p.z + e[3][1],
+            e[0][2]*p.x + e[1][2]*p.y + e[2][2]*p.z + e[3][2],
+            pLights[i].radius
+        };
+    }
+
+    for (u32 i = 0; i < SLICES; i++)
+    {
+        _aSliceArgs[i] = {this, i};
+        pTp->submit(assignSlice, &_aSliceArgs[i], pGroup);
+    }
+}
+
+void
+ClusterGrid::compact()
+{
+    u32 total = 0;
+    for (auto& a : _aSliceIndices)
+        total += a._size;
+
+    /* +1, texture buffers can't be empty */
+    if (_aIndices._capacity < total + 1)
+        _aIndices.grow(total + 1);
+    _aIndices._size = total > 0 ? total : 1;
+    _aIndices[0] = 0;
+
+    u32 base = 0;
+    for (u32 s = 0; s < SLICES; s++)
+    {
+        auto& a = _aSliceIndices[s];
+        memcpy(_aIndices.data() + base, a.data(), a._size * sizeof(u16));
+
+        for (u32 c = 0; c < SLICE_CLUSTERS; c++)
+            _pRanges[s * SLICE_CLUSTERS + c].offset += base;
+
+        base += a._size;
+    }
+}
+
+void
+ClusterGrid::upload(const PointLight* pLights)
+{
+    const void* aData[3] {pLights, _pRanges, _aIndices.data()};
+    const u32 aSizes[3] {
+        u32(sizeof(PointLight)) * (_nLights ? _nLights : 1),
+        u32(sizeof(ClusterRange)) * N_CLUSTERS,
+        u32(sizeof(u16)) * _aIndices._size
+    };
+
+    for (u32 i = 0; i < 3; i++)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, _aBuffers[i]);
+        /* orphan, last frame's draws may still read it */
+        glBufferData(GL_TEXTURE_BUFFER, aSizes[i], nullptr, GL_DYNAMIC_DRAW);
+        if (i != 0 || _nLights)
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, aSizes[i], aData[i]);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+void
+ClusterGrid::bind(GLenum firstUnit) const
+{
+    for (u32 i = 0; i < 3; i++)
+    {
+        glActiveTexture(firstUnit + i);
+        glBindTexture(GL_TEXTURE_BUFFER, _aTextures[i]);
+    }
+}
+
+void
+ClusterGrid::setUniforms(Shader* sh, int width, int height) const
+{
+    sh->setI("uNPointLights", _nLights);
+    sh->setV3("uClusterParams", {f32(TILES_X) / f32(width), f32(TILES_Y) / f32(height), _sliceScale});
+}
+
+f64
+ClusterGrid::assignTime() const
+{
+    f64 sum = 0.0;
+    for (f64 t : _aSliceMs)
+        sum += t;
+
+    return sum;
+}
+
+u32
+ClusterGrid::maxClusterLights() const
+{
+    u32 max = 0;
+    for (u32 i = 0; i < N_CLUSTERS; i++)
+        max = _pRanges[i].count > max ? _pRanges[i].count : max;
+
+    return max;
+}
+
+void
+ClusterGrid::destroy()
+{
+    glDeleteTextures(3, _aTextures);
+    glDeleteBuffers(3, _aBuffers);
+
+    _pAlloc->free(_pSlices);
+    _pAlloc->free(_pRanges);
+    for (u32 i = 0; i < SLICES; i++)
+    {
+        _aSliceIndices[i].destroy();
+        _aSliceCandidates[i].destroy();
+    }
+    _aIndices.destroy();
+    _aViewSpheres.destroy();
+}
+
+} /* namespace lights */
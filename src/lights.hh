@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Array.hh"
+#include "Shader.hh"
+#include "ThreadPool.hh"
+#include "math.hh"
+
+namespace lights
+{
+
+/* view space grid of screen tiles times depth slices, the lit shaders hardcode the same numbers */
+constexpr u32 TILES_X = 16;
+constexpr u32 TILES_Y = 9;
+constexpr u32 SLICES = 24;
+constexpr u32 SLICE_CLUSTERS = TILES_X * TILES_Y;
+constexpr u32 N_CLUSTERS = SLICE_CLUSTERS * SLICES;
+
+/* slice 0 is everything closer than this, the rest are spaced exponentially up to the camera far plane */
+constexpr f32 SLICE_NEAR = 0.5f;
+
+constexpr u32 MAX_LIGHTS = 1 << 16; /* indices are u16 */
+constexpr u32 MAX_LIGHTS_PER_CLUSTER = 256; /* the rest is dropped */
+
+/* layout of the uPointLights texture buffer, two rgba32f texels each */
+struct PointLight
+{
+    v3 pos;
+    f32 radius;
+    v3 color;
+    f32 shadow; /* shadows::Atlas slot, -1 if unshadowed */
+};
+
+/* uClusterRanges texel */
+struct ClusterRange
+{
+    u32 offset; /* into uClusterIndices */
+    u32 count;
+};
+
+/* cluster aabbs of one slice, struct of arrays so one sse op tests a light against 4 of them */
+struct Slice
+{
+    f32 aMinX[SLICE_CLUSTERS];
+    f32 aMinY[SLICE_CLUSTERS];
+    f32 aMinZ[SLICE_CLUSTERS];
+    f32 aMaxX[SLICE_CLUSTERS];
+    f32 aMaxY[SLICE_CLUSTERS];
+    f32 aMaxZ[SLICE_CLUSTERS];
+    v3 min; /* whole slice */
+    v3 max;
+};
+
+struct ClusterGrid;
+
+/* argument of one slice job */
+struct SliceArg
+{
+    ClusterGrid* pSelf;
+    u32 slice;
+};
+
+/* Lights are assigned to clusters with one job per slice, each writing only its own index list,
+ * then the lists are concatenated and uploaded into texture buffers.
+ * Each grid keeps its own job arguments and gl buffers, so several can be in flight at once. */
+struct ClusterGrid
+{
+    adt::Allocator* _pAlloc {};
+    Slice* _pSlices {};
+    ClusterRange* _pRanges {}; /* N_CLUSTERS, offsets are slice local until compact() */
+    adt::Array<u16> _aSliceIndices[SLICES];
+    adt::Array<u16> _aSliceCandidates[SLICES]; /* scratch of each job */
+    adt::Array<u16> _aIndices;
+    adt::Array<v4> _aViewSpheres; /* view space position, radius */
+    f64 _aSliceMs[SLICES] {}; /* time each job took */
+    SliceArg _aSliceArgs[SLICES] {};
+    m4 _proj {};
+    f32 _far = 0.0f;
+    f32 _sliceScale = 0.0f; /* 1 / log of the slice ratio */
+    u32 _nLights = 0;
+    GLuint _aBuffers[3] {}; /* lights, ranges, indices */
+    GLuint _aTextures[3] {};
+
+    ClusterGrid() = default;
+    ClusterGrid(adt::Allocator* p);
+
+    void init(); /* gl objects, needs the context */
+    void submit(adt::ThreadPool* pTp, adt::TaskGroup* pGroup, const m4& proj, const m4& view, f32 far, const PointLight* pLights, u32 nLights); /* caller waits on the group */
+    void compact(); /* after the jobs are done, no gl, any thread */
+    void upload(const PointLight* pLights); /* after compact(), on the gl thread */
+    void bind(GLenum firstUnit) const; /* lights, ranges and indices on 3 consecutive units */
+    void setUniforms(Shader* sh, int width, int height) const;
+    f64 assignTime() const; /* summed job times of the last submit() */
+    u32 maxClusterLights() const;
+    void destroy();
+};
+
+} /* namespace lights */
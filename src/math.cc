@@ -484,3 +484,60 @@ operator*=(qt& l, const qt& r)
 {
     return l = l * r;
 }
+
+Frustum
+frustumMake(const m4& m)
+{
+    auto e = m.e;
+    /* rows of column major matrix */
+    v4 r0 {e[0][0], e[1][0], e[2][0], e[3][0]};
+    v4 r1 {e[0][1], e[1][1], e[2][1], e[3][1]};
+    v4 r2 {e[0][2], e[1][2], e[2][2], e[3][2]};
+    v4 r3 {e[0][3], e[1][3], e[2][3], e[3][3]};
+
+    auto add = [](const v4& l, const v4& r) -> v4 { return {l.x + r.x, l.y + r.y, l.z + r.z, l.w + r.w}; };
+    auto sub = [](const v4& l, const v4& r) -> v4 { return {l.x - r.x, l.y - r.y, l.z - r.z, l.w - r.w}; };
+
+    return {{
+        add(r3, r0), sub(r3, r0),
+        add(r3, r1), sub(r3, r1),
+        add(r3, r2), sub(r3, r2)
+    }};
+}
+
+bool
+frustumAABB(const Frustum& f, const v3& min, const v3& max)
+{
+    for (auto& p : f.planes)
+    {
+        /* test the corner furthest along the plane normal */
+        v3 pv {
+            p.x > 0 ? max.x : min.x,
+            p.y > 0 ? max.y : min.y,
+            p.z > 0 ? max.z : min.z
+        };
+
+        if (p.x*pv.x + p.y*pv.y + p.z*pv.z + p.w < 0)
+            return false;
+    }
+
+    return true;
+}
+
+void
+aabbTransform(const m4& m, const v3& min, const v3& max, v3* pMin, v3* pMax)
+{
+    /* transform center and project extents on each axis (Arvo) */
+    auto e = m.e;
+    v3 c = (min + max) * 0.5f;
+    v3 ext = (max - min) * 0.5f;
+
+    for (int i = 0; i < 3; i++)
+    {
+        f32 nc = e[0][i]*c.x + e[1][i]*c.y + e[2][i]*c.z + e[3][i];
+        f32 ne = fabsf(e[0][i])*ext.x + fabsf(e[1][i])*ext.y + fabsf(e[2][i])*ext.z;
+
+        pMin->e[i] = nc - ne;
+        pMax->e[i] = nc + ne;
+    }
+}
@@ -132,6 +132,12 @@ union qt
     constexpr qt(v3 _v, f32 _s) : x(_v.x), y(_v.y), z(_v.z), s(_s) {}
 };
 
+/* 6 clip planes (left, right, bottom, top, near, far), xyz: normal pointing inwards, w: distance */
+struct Frustum
+{
+    v4 planes[6];
+};
+
 #ifdef LOGS
 adt::String m4ToString(adt::Allocator* pAlloc, const m4& m, adt::String prefix);
 adt::String m3ToString(adt::Allocator* pAlloc, const m3& m, adt::String prefix);
@@ -201,3 +207,6 @@ m4 qtRot(const qt& q);
 qt qtConj(const qt& q);
 qt operator*(const qt& l, const qt& r);
 qt operator*=(qt& l, const qt& r);
+Frustum frustumMake(const m4& viewProj); /* extract planes from combined projection * view matrix */
+bool frustumAABB(const Frustum& f, const v3& min, const v3& max); /* false if box is fully outside */
+void aabbTransform(const m4& m, const v3& min, const v3& max, v3* pMin, v3* pMax);
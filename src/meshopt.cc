@@ -0,0 +1,1010 @@
+#include "meshopt.hh"
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace meshopt
+{
+
+/* fifo cache with timestamps: vertex is resident if it was pushed less than VCACHE_SIZE misses ago */
+static inline bool
+cacheMiss(u32* aTimestamps, u32* pTime, u32 v)
+{
+    if (*pTime - aTimestamps[v] > VCACHE_SIZE)
+    {
+        aTimestamps[v] = (*pTime)++;
+        return true;
+    }
+
+    return false;
+}
+
+CacheStats
+analyzeVertexCache(adt::Allocator* pAlloc, const u32* pIndices, u32 nIndices, u32 nVertices)
+{
+    CacheStats s {};
+    s.nTriangles = nIndices / 3;
+
+    u32* aTimestamps = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    memset(aTimestamps, 0, sizeof(u32) * nVertices);
+    u32 time = VCACHE_SIZE + 1;
+
+    for (u32 i = 0; i < nIndices; i++)
+        if (cacheMiss(aTimestamps, &time, pIndices[i]))
+            s.nTransformed++;
+
+    for (u32 i = 0; i < nVertices; i++)
+        if (aTimestamps[i]) s.nVertices++;
+
+    pAlloc->free(aTimestamps);
+
+    return s;
+}
+
+u32
+optimizeVertexCache(adt::Allocator* pAlloc, u32* pDest, const u32* pIndices, u32 nIndices, u32 nVertices, u32* pClusters)
+{
+    u32 nTriangles = nIndices / 3;
+
+    /* vertex -> triangles adjacency */
+    u32* aLive = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    u32* aOffsets = (u32*)pAlloc->alloc(nVertices + 1, sizeof(u32));
+    u32* aAdj = (u32*)pAlloc->alloc(nIndices, sizeof(u32));
+    u32* aTimestamps = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    u32* aDeadEnd = (u32*)pAlloc->alloc(nIndices, sizeof(u32));
+    u8* aEmitted = (u8*)pAlloc->alloc(nTriangles, sizeof(u8));
+
+    memset(aLive, 0, sizeof(u32) * nVertices);
+    memset(aTimestamps, 0, sizeof(u32) * nVertices);
+    memset(aEmitted, 0, nTriangles);
+
+    for (u32 i = 0; i < nIndices; i++)
+        aLive[pIndices[i]]++;
+
+    aOffsets[0] = 0;
+    for (u32 i = 0; i < nVertices; i++)
+        aOffsets[i + 1] = aOffsets[i] + aLive[i];
+
+    /* fill using aTimestamps as cursors, then clear them */
+    for (u32 i = 0; i < nIndices; i++)
+    {
+        u32 v = pIndices[i];
+        aAdj[aOffsets[v] + aTimestamps[v]++] = i / 3;
+    }
+    memset(aTimestamps, 0, sizeof(u32) * nVertices);
+
+    u32 time = VCACHE_SIZE + 1;
+    u32 deadEndTop = 0;
+    u32 cursor = 0; /* input order fallback */
+    u32 nOut = 0;
+    u32 nClusters = 0;
+
+    auto skipDeadEnd = [&]() -> u32 {
+        while (deadEndTop > 0)
+        {
+            u32 d = aDeadEnd[--deadEndTop];
+            if (aLive[d] > 0) return d;
+        }
+        for (; cursor < nVertices; cursor++)
+            if (aLive[cursor] > 0) return cursor;
+
+        return adt::NPOS;
+    };
+
+    u32 fan = skipDeadEnd();
+    if (fan != adt::NPOS)
+        pClusters[nClusters++] = 0;
+
+    while (fan != adt::NPOS)
+    {
+        u32 candidatesStart = deadEndTop;
+
+        for (u32 i = aOffsets[fan]; i < aOffsets[fan + 1]; i++)
+        {
+            u32 t = aAdj[i];
+            if (aEmitted[t]) continue;
+
+            for (u32 j = 0; j < 3; j++)
+            {
+                u32 v = pIndices[t*3 + j];
+                pDest[nOut*3 + j] = v;
+                aDeadEnd[deadEndTop++] = v;
+                aLive[v]--;
+                cacheMiss(aTimestamps, &time, v);
+            }
+
+            aEmitted[t] = 1;
+            nOut++;
+        }
+
+        /* oldest candidate that still stays in the cache after its fan is emitted */
+        u32 next = adt::NPOS;
+        s64 bestPriority = -1;
+        for (u32 i = candidatesStart; i < deadEndTop; i++)
+        {
+            u32 v = aDeadEnd[i];
+            if (aLive[v] == 0) continue;
+
+            s64 priority = 0;
+            if (time - aTimestamps[v] + 2*aLive[v] <= VCACHE_SIZE)
+                priority = time - aTimestamps[v];
+
+            if (priority > bestPriority)
+            {
+                bestPriority = priority;
+                next = v;
+            }
+        }
+
+        if (next == adt::NPOS)
+        {
+            next = skipDeadEnd();
+            if (next != adt::NPOS && nOut < nTriangles)
+                pClusters[nClusters++] = nOut;
+        }
+
+        fan = next;
+    }
+
+    pAlloc->free(aLive);
+    pAlloc->free(aOffsets);
+    pAlloc->free(aAdj);
+    pAlloc->free(aTimestamps);
+    pAlloc->free(aDeadEnd);
+    pAlloc->free(aEmitted);
+
+    return nClusters;
+}
+
+struct OverdrawCluster
+{
+    f32 sortKey;
+    u32 start;
+    u32 end;
+};
+
+static int
+compareClusters(const void* l, const void* r)
+{
+    auto& a = *(const OverdrawCluster*)l;
+    auto& b = *(const OverdrawCluster*)r;
+
+    if (a.sortKey != b.sortKey)
+        return a.sortKey > b.sortKey ? -1 : 1;
+
+    return a.start < b.start ? -1 : (a.start > b.start ? 1 : 0);
+}
+
+void
+optimizeOverdraw(adt::Allocator* pAlloc, u32* pIndices, u32 nIndices, const Vertex* pVertices, u32 nVertices, const u32* pClusters, u32 nClusters)
+{
+    u32 nTriangles = nIndices / 3;
+    if (nTriangles == 0 || nClusters == 0)
+        return;
+
+    u32* aTimestamps = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    u32* aSoft = (u32*)pAlloc->alloc(nTriangles, sizeof(u32));
+    memset(aTimestamps, 0, sizeof(u32) * nVertices);
+    u32 time = VCACHE_SIZE + 1;
+    u32 nSoft = 0;
+
+    auto triangleMisses = [&](u32 t) -> u32 {
+        return u32(cacheMiss(aTimestamps, &time, pIndices[t*3 + 0])) +
+               u32(cacheMiss(aTimestamps, &time, pIndices[t*3 + 1])) +
+               u32(cacheMiss(aTimestamps, &time, pIndices[t*3 + 2]));
+    };
+
+    /* split each hard cluster as soon as it reaches the acmr it had as a whole, the cold cache at
+     * the start of every new cluster is what the threshold pays for */
+    for (u32 c = 0; c < nClusters; c++)
+    {
+        u32 start = pClusters[c];
+        u32 end = c + 1 < nClusters ? pClusters[c + 1] : nTriangles;
+
+        time += VCACHE_SIZE + 1;
+        u32 misses = 0;
+        for (u32 t = start; t < end; t++)
+            misses += triangleMisses(t);
+
+        f32 threshold = OVERDRAW_THRESHOLD * (f32(misses) / f32(end - start));
+
+        aSoft[nSoft++] = start;
+        time += VCACHE_SIZE + 1;
+        u32 runMisses = 0, runTriangles = 0;
+
+        for (u32 t = start; t < end; t++)
+        {
+            runMisses += triangleMisses(t);
+            runTriangles++;
+
+            if (f32(runMisses) / f32(runTriangles) <= threshold)
+            {
+                aSoft[nSoft++] = t + 1;
+                time += VCACHE_SIZE + 1;
+                runMisses = runTriangles = 0;
+            }
+        }
+
+        if (aSoft[nSoft - 1] == end)
+            nSoft--;
+    }
+
+    /* sort clusters by how much they face away from the mesh center, those are likely to occlude the rest */
+    OverdrawCluster* aClusters = (OverdrawCluster*)pAlloc->alloc(nSoft, sizeof(OverdrawCluster));
+
+    auto triangle = [&](u32 t, v3* pCentroid, v3* pNormal) -> void {
+        const v3& p0 = pVertices[pIndices[t*3 + 0]].pos;
+        const v3& p1 = pVertices[pIndices[t*3 + 1]].pos;
+        const v3& p2 = pVertices[pIndices[t*3 + 2]].pos;
+        *pNormal = v3Cross(p1 - p0, p2 - p0); /* length is twice the area */
+        *pCentroid = (p0 + p1 + p2) * (1.0f / 3.0f);
+    };
+
+    v3 meshCentroid {};
+    f32 meshArea = 0.0f;
+    for (u32 t = 0; t < nTriangles; t++)
+    {
+        v3 centroid, normal;
+        triangle(t, &centroid, &normal);
+        f32 area = v3Length(normal);
+        meshCentroid = meshCentroid + centroid * area;
+        meshArea += area;
+    }
+    if (meshArea > 0.0f)
+        meshCentroid = meshCentroid * (1.0f / meshArea);
+
+    for (u32 c = 0; c < nSoft; c++)
+    {
+        OverdrawCluster& cl = aClusters[c];
+        cl.start = aSoft[c];
+        cl.end = c + 1 < nSoft ? aSoft[c + 1] : nTriangles;
+
+        v3 sumCentroid {}, sumNormal {};
+        f32 area = 0.0f;
+        for (u32 t = cl.start; t < cl.end; t++)
+        {
+            v3 centroid, normal;
+            triangle(t, &centroid, &normal);
+            f32 a = v3Length(normal);
+            sumCentroid = sumCentroid + centroid * a;
+            sumNormal = sumNormal + normal;
+            area += a;
+        }
+
+        f32 normalLength = v3Length(sumNormal);
+        if (area > 0.0f && normalLength > 0.0f)
+            cl.sortKey = v3Dot(sumCentroid * (1.0f / area) - meshCentroid, sumNormal * (1.0f / normalLength));
+        else
+            cl.sortKey = 0.0f;
+    }
+
+    qsort(aClusters, nSoft, sizeof(OverdrawCluster), compareClusters);
+
+    u32* aSorted = (u32*)pAlloc->alloc(nIndices, sizeof(u32));
+    u32 nOut = 0;
+    for (u32 c = 0; c < nSoft; c++)
+    {
+        u32 n = (aClusters[c].end - aClusters[c].start) * 3;
+        memcpy(&aSorted[nOut], &pIndices[aClusters[c].start * 3], n * sizeof(u32));
+        nOut += n;
+    }
+    memcpy(pIndices, aSorted, sizeof(u32) * nIndices);
+
+    pAlloc->free(aSorted);
+    pAlloc->free(aClusters);
+    pAlloc->free(aSoft);
+    pAlloc->free(aTimestamps);
+}
+
+u32
+optimizeVertexFetch(adt::Allocator* pAlloc, Vertex* pVertices, u32* pIndices, u32 nIndices, u32 nVertices)
+{
+    u32* aRemap = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    memset(aRemap, 0xff, sizeof(u32) * nVertices);
+
+    u32 next = 0;
+    for (u32 i = 0; i < nIndices; i++)
+    {
+        u32 v = pIndices[i];
+        if (aRemap[v] == adt::NPOS)
+            aRemap[v] = next++;
+
+        pIndices[i] = aRemap[v];
+    }
+
+    Vertex* aCopy = (Vertex*)pAlloc->alloc(nVertices, sizeof(Vertex));
+    memcpy(aCopy, pVertices, sizeof(Vertex) * nVertices);
+
+    for (u32 i = 0; i < nVertices; i++)
+        if (aRemap[i] != adt::NPOS)
+            pVertices[aRemap[i]] = aCopy[i];
+
+    pAlloc->free(aCopy);
+    pAlloc->free(aRemap);
+
+    return next;
+}
+
+/* symmetric 4x4 of the summed squared plane distances, w is the summed weight */
+struct Quadric
+{
+    f32 a00, a11, a22, a10, a20, a21;
+    f32 b0, b1, b2;
+    f32 c;
+    f32 w;
+};
+
+static void
+quadricAdd(Quadric* pQ, const Quadric& r)
+{
+    pQ->a00 += r.a00; pQ->a11 += r.a11; pQ->a22 += r.a22;
+    pQ->a10 += r.a10; pQ->a20 += r.a20; pQ->a21 += r.a21;
+    pQ->b0 += r.b0; pQ->b1 += r.b1; pQ->b2 += r.b2;
+    pQ->c += r.c;
+    pQ->w += r.w;
+}
+
+/* plane n.p + d = 0 */
+static Quadric
+quadricFromPlane(const v3& n, f32 d, f32 w)
+{
+    Quadric q;
+    q.a00 = w*n.x*n.x; q.a11 = w*n.y*n.y; q.a22 = w*n.z*n.z;
+    q.a10 = w*n.y*n.x; q.a20 = w*n.z*n.x; q.a21 = w*n.z*n.y;
+    q.b0 = w*n.x*d; q.b1 = w*n.y*d; q.b2 = w*n.z*d;
+    q.c = w*d*d;
+    q.w = w;
+
+    return q;
+}
+
+/* weighted mean squared distance of `v` to the planes */
+static f32
+quadricError(const Quadric& q, const v3& v)
+{
+    f32 rx = q.b0 + q.a10*v.y;
+    f32 ry = q.b1 + q.a21*v.z;
+    f32 rz = q.b2 + q.a20*v.x;
+    rx *= 2.0f; ry *= 2.0f; rz *= 2.0f;
+    rx += q.a00*v.x; ry += q.a11*v.y; rz += q.a22*v.z;
+
+    f32 r = q.c + v.x*rx + v.y*ry + v.z*rz;
+
+    return q.w > 0.0f ? fabsf(r) / q.w : 0.0f;
+}
+
+enum class VKIND : u8
+{
+    MANIFOLD, /* free to collapse anywhere */
+    BORDER, /* only along open edges */
+    LOCKED /* seams and non manifold, can only be collapsed onto */
+};
+
+constexpr f32 BORDER_WEIGHT = 10.0f;
+
+struct PosKey
+{
+    v3 pos;
+    u32 idx;
+};
+
+static int
+comparePosKeys(const void* l, const void* r)
+{
+    auto& a = *(const PosKey*)l;
+    auto& b = *(const PosKey*)r;
+
+    int c = memcmp(&a.pos, &b.pos, sizeof(v3));
+    if (c != 0) return c;
+
+    return a.idx < b.idx ? -1 : (a.idx > b.idx ? 1 : 0);
+}
+
+static int
+compareU64(const void* l, const void* r)
+{
+    u64 a = *(const u64*)l, b = *(const u64*)r;
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+struct Collapse
+{
+    f32 cost;
+    u32 from; /* canonical */
+    u32 to; /* canonical */
+    u32 toWedge; /* vertex `from` is remapped to */
+};
+
+static int
+compareCollapses(const void* l, const void* r)
+{
+    auto& a = *(const Collapse*)l;
+    auto& b = *(const Collapse*)r;
+
+    if (a.cost != b.cost) return a.cost < b.cost ? -1 : 1;
+    if (a.from != b.from) return a.from < b.from ? -1 : 1;
+
+    return a.to < b.to ? -1 : (a.to > b.to ? 1 : 0);
+}
+
+static inline u64
+edgeKey(u32 a, u32 b)
+{
+    return a < b ? (u64(a) << 32) | b : (u64(b) << 32) | a;
+}
+
+u32
+simplify(adt::Allocator* pAlloc, u32* pDest, const u32* pIndices, u32 nIndices, const Vertex* pVertices, u32 nVertices,
+         u32 targetIndexCount, f32 maxError, f32* pError)
+{
+    memcpy(pDest, pIndices, sizeof(u32) * nIndices);
+    *pError = 0.0f;
+
+    if (nIndices <= targetIndexCount || nVertices == 0)
+        return nIndices;
+
+    u32 nOut = nIndices;
+
+    /* vertices that share a position are wedges of one canonical vertex (the lowest index) */
+    PosKey* aKeys = (PosKey*)pAlloc->alloc(nVertices, sizeof(PosKey));
+    for (u32 i = 0; i < nVertices; i++)
+        aKeys[i] = {pVertices[i].pos, i};
+    qsort(aKeys, nVertices, sizeof(PosKey), comparePosKeys);
+
+    u32* aCanon = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    u32* aWedges = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    memset(aWedges, 0, sizeof(u32) * nVertices);
+    {
+        u32 canon = 0;
+        for (u32 i = 0; i < nVertices; i++)
+        {
+            if (i == 0 || memcmp(&aKeys[i].pos, &aKeys[i - 1].pos, sizeof(v3)) != 0)
+                canon = aKeys[i].idx;
+
+            aCanon[aKeys[i].idx] = canon;
+            aWedges[canon]++;
+        }
+    }
+    pAlloc->free(aKeys);
+
+    /* work in a unit box so errors don't depend on the model scale */
+    v3 min {FLT_MAX, FLT_MAX, FLT_MAX}, max {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (u32 i = 0; i < nVertices; i++)
+    {
+        for (u32 j = 0; j < 3; j++)
+        {
+            if (pVertices[i].pos.e[j] < min.e[j]) min.e[j] = pVertices[i].pos.e[j];
+            if (pVertices[i].pos.e[j] > max.e[j]) max.e[j] = pVertices[i].pos.e[j];
+        }
+    }
+    f32 scale = fmaxf(fmaxf(max.x - min.x, max.y - min.y), max.z - min.z);
+    if (scale <= 0.0f) scale = 1.0f;
+
+    v3* aPos = (v3*)pAlloc->alloc(nVertices, sizeof(v3));
+    for (u32 i = 0; i < nVertices; i++)
+        aPos[i] = (pVertices[i].pos - min) * (1.0f / scale);
+
+    /* classify by counting how many triangles share each edge */
+    u64* aEdges = (u64*)pAlloc->alloc(nIndices, sizeof(u64));
+    for (u32 t = 0; t < nIndices / 3; t++)
+        for (u32 k = 0; k < 3; k++)
+            aEdges[t*3 + k] = edgeKey(aCanon[pIndices[t*3 + k]], aCanon[pIndices[t*3 + (k + 1) % 3]]);
+    qsort(aEdges, nIndices, sizeof(u64), compareU64);
+
+    VKIND* aKind = (VKIND*)pAlloc->alloc(nVertices, sizeof(VKIND));
+    for (u32 i = 0; i < nVertices; i++)
+        aKind[i] = aWedges[i] > 1 ? VKIND::LOCKED : VKIND::MANIFOLD;
+
+    u64* aBorders = (u64*)pAlloc->alloc(nIndices, sizeof(u64)); /* sorted */
+    u32 nBorders = 0;
+    for (u32 i = 0; i < nIndices; )
+    {
+        u32 n = 1;
+        while (i + n < nIndices && aEdges[i + n] == aEdges[i]) n++;
+
+        u32 a = u32(aEdges[i] >> 32), b = u32(aEdges[i] & 0xffffffff);
+        if (n == 1)
+        {
+            aBorders[nBorders++] = aEdges[i];
+            if (aKind[a] == VKIND::MANIFOLD) aKind[a] = VKIND::BORDER;
+            if (aKind[b] == VKIND::MANIFOLD) aKind[b] = VKIND::BORDER;
+        }
+        else if (n > 2)
+        {
+            aKind[a] = aKind[b] = VKIND::LOCKED;
+        }
+
+        i += n;
+    }
+    pAlloc->free(aEdges);
+
+    auto isBorder = [&](u32 a, u32 b) -> bool {
+        u64 key = edgeKey(a, b);
+        return bsearch(&key, aBorders, nBorders, sizeof(u64), compareU64) != nullptr;
+    };
+
+    /* triangle planes weighted by area, borders get a perpendicular plane so they keep their shape */
+    Quadric* aQuadrics = (Quadric*)pAlloc->alloc(nVertices, sizeof(Quadric));
+    memset(aQuadrics, 0, sizeof(Quadric) * nVertices);
+
+    for (u32 t = 0; t < nIndices / 3; t++)
+    {
+        u32 c[3] {aCanon[pIndices[t*3 + 0]], aCanon[pIndices[t*3 + 1]], aCanon[pIndices[t*3 + 2]]};
+        v3 n = v3Cross(aPos[c[1]] - aPos[c[0]], aPos[c[2]] - aPos[c[0]]);
+        f32 area = v3Length(n);
+        if (area <= 0.0f) continue;
+        n = n * (1.0f / area);
+
+        Quadric q = quadricFromPlane(n, -v3Dot(n, aPos[c[0]]), area * 0.5f);
+        for (u32 k = 0; k < 3; k++)
+            quadricAdd(&aQuadrics[c[k]], q);
+
+        for (u32 k = 0; k < 3; k++)
+        {
+            u32 a = c[k], b = c[(k + 1) % 3];
+            if (!isBorder(a, b)) continue;
+
+            v3 edge = aPos[b] - aPos[a];
+            f32 length = v3Length(edge);
+            v3 perp = v3Cross(edge, n);
+            f32 perpLength = v3Length(perp);
+            if (perpLength <= 0.0f) continue;
+            perp = perp * (1.0f / perpLength);
+
+            Quadric qb = quadricFromPlane(perp, -v3Dot(perp, aPos[a]), length * BORDER_WEIGHT);
+            quadricAdd(&aQuadrics[a], qb);
+            quadricAdd(&aQuadrics[b], qb);
+        }
+    }
+
+    auto canCollapse = [&](u32 from, u32 to) -> bool {
+        if (from == to) return false;
+        if (aKind[from] == VKIND::MANIFOLD) return true;
+        if (aKind[from] == VKIND::BORDER) return isBorder(from, to);
+        return false;
+    };
+
+    u32* aRemap = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    u8* aLocked = (u8*)pAlloc->alloc(nVertices, sizeof(u8));
+    u32* aAdjOffsets = (u32*)pAlloc->alloc(nVertices + 1, sizeof(u32));
+    u32* aAdj = (u32*)pAlloc->alloc(nIndices, sizeof(u32));
+    Collapse* aCollapses = (Collapse*)pAlloc->alloc(nIndices * 2, sizeof(Collapse));
+
+    for (u32 i = 0; i < nVertices; i++)
+        aRemap[i] = i;
+
+    auto pos = [&](u32 v) -> const v3& { return aPos[aCanon[aRemap[v]]]; };
+
+    /* moving `from` onto `to` must not turn any remaining triangle around */
+    auto flips = [&](u32 from, u32 to) -> bool {
+        for (u32 i = aAdjOffsets[from]; i < aAdjOffsets[from + 1]; i++)
+        {
+            u32 t = aAdj[i];
+            u32 c[3];
+            for (u32 k = 0; k < 3; k++)
+                c[k] = aCanon[aRemap[pDest[t*3 + k]]];
+
+            if (c[0] == c[1] || c[1] == c[2] || c[2] == c[0]) continue; /* already gone */
+            if (c[0] == to || c[1] == to || c[2] == to) continue; /* goes away with this collapse */
+
+            v3 p[3] {pos(pDest[t*3 + 0]), pos(pDest[t*3 + 1]), pos(pDest[t*3 + 2])};
+            v3 n0 = v3Cross(p[1] - p[0], p[2] - p[0]);
+
+            for (u32 k = 0; k < 3; k++)
+                if (c[k] == from) p[k] = aPos[to];
+
+            v3 n1 = v3Cross(p[1] - p[0], p[2] - p[0]);
+            if (v3Dot(n0, n1) <= 0.0f)
+                return true;
+        }
+
+        return false;
+    };
+
+    f32 maxError2 = maxError * maxError;
+    f32 resultError = 0.0f;
+
+    while (nOut > targetIndexCount)
+    {
+        u32 nTriangles = nOut / 3;
+
+        /* canonical vertex -> triangles */
+        memset(aAdjOffsets, 0, sizeof(u32) * (nVertices + 1));
+        for (u32 i = 0; i < nOut; i++)
+            aAdjOffsets[aCanon[pDest[i]] + 1]++;
+        for (u32 i = 0; i < nVertices; i++)
+            aAdjOffsets[i + 1] += aAdjOffsets[i];
+        for (u32 i = 0; i < nOut; i++)
+            aAdj[aAdjOffsets[aCanon[pDest[i]]]++] = i / 3;
+        /* offsets got shifted by one slot while filling */
+        for (u32 i = nVertices; i > 0; i--)
+            aAdjOffsets[i] = aAdjOffsets[i - 1];
+        aAdjOffsets[0] = 0;
+
+        u32 nCollapses = 0;
+        for (u32 t = 0; t < nTriangles; t++)
+        {
+            for (u32 k = 0; k < 3; k++)
+            {
+                u32 va = pDest[t*3 + k], vb = pDest[t*3 + (k + 1) % 3];
+                u32 a = aCanon[va], b = aCanon[vb];
+
+                if (canCollapse(a, b))
+                {
+                    Quadric q = aQuadrics[a];
+                    quadricAdd(&q, aQuadrics[b]);
+                    aCollapses[nCollapses++] = {quadricError(q, aPos[b]), a, b, vb};
+                }
+                if (canCollapse(b, a))
+                {
+                    Quadric q = aQuadrics[b];
+                    quadricAdd(&q, aQuadrics[a]);
+                    aCollapses[nCollapses++] = {quadricError(q, aPos[a]), b, a, va};
+                }
+            }
+        }
+
+        qsort(aCollapses, nCollapses, sizeof(Collapse), compareCollapses);
+        memset(aLocked, 0, nVertices);
+
+        /* most collapses remove two triangles, don't overshoot the target by much */
+        u32 nAllowed = (nOut - targetIndexCount) / 6 + 1;
+        u32 nApplied = 0;
+
+        for (u32 i = 0; i < nCollapses && nApplied < nAllowed; i++)
+        {
+            auto& c = aCollapses[i];
+            if (c.cost > maxError2) break;
+            if (aLocked[c.from] || aLocked[c.to]) continue;
+            if (flips(c.from, c.to)) continue;
+
+            aRemap[c.from] = c.toWedge; /* movable vertices have a single wedge which is their canonical index */
+            quadricAdd(&aQuadrics[c.to], aQuadrics[c.from]);
+            aLocked[c.from] = aLocked[c.to] = 1;
+
+            if (c.cost > resultError) resultError = c.cost;
+            nApplied++;
+        }
+
+        if (nApplied == 0)
+            break;
+
+        /* apply and drop degenerate triangles */
+        u32 nWritten = 0;
+        for (u32 t = 0; t < nTriangles; t++)
+        {
+            u32 v0 = aRemap[pDest[t*3 + 0]], v1 = aRemap[pDest[t*3 + 1]], v2 = aRemap[pDest[t*3 + 2]];
+            u32 c0 = aCanon[v0], c1 = aCanon[v1], c2 = aCanon[v2];
+            if (c0 == c1 || c1 == c2 || c2 == c0) continue;
+
+            pDest[nWritten++] = v0;
+            pDest[nWritten++] = v1;
+            pDest[nWritten++] = v2;
+        }
+        nOut = nWritten;
+
+        for (u32 i = 0; i < nVertices; i++)
+            aRemap[i] = i;
+    }
+
+    *pError = sqrtf(resultError) * scale;
+
+    pAlloc->free(aCollapses);
+    pAlloc->free(aAdj);
+    pAlloc->free(aAdjOffsets);
+    pAlloc->free(aLocked);
+    pAlloc->free(aRemap);
+    pAlloc->free(aQuadrics);
+    pAlloc->free(aBorders);
+    pAlloc->free(aKind);
+    pAlloc->free(aPos);
+    pAlloc->free(aWedges);
+    pAlloc->free(aCanon);
+
+    return nOut;
+}
+
+static u16
+f32ToHalf(f32 f)
+{
+    u32 x;
+    memcpy(&x, &f, sizeof(x));
+
+    u32 sign = (x >> 16) & 0x8000;
+    s32 exp = s32((x >> 23) & 0xff) - 127 + 15;
+    u32 mant = x & 0x7fffff;
+
+    if ((x & 0x7fffffff) > 0x7f800000) return u16(sign | 0x7e00); /* nan */
+    if (exp >= 31) return u16(sign | 0x7c00); /* overflow to inf */
+
+    if (exp <= 0)
+    {
+        /* denormal or zero */
+        if (exp < -10) return u16(sign);
+        mant |= 0x800000;
+        u32 shift = u32(14 - exp);
+        u32 h = mant >> shift;
+        if ((mant >> (shift - 1)) & 1) h++;
+        return u16(sign | h);
+    }
+
+    u32 h = sign | (u32(exp) << 10) | (mant >> 13);
+    if (mant & 0x1000) h++; /* round, carry into exponent is fine */
+
+    return u16(h);
+}
+
+static s16
+snorm16(f32 f)
+{
+    f = f < -1.0f ? -1.0f : (f > 1.0f ? 1.0f : f);
+    return s16(roundf(f * 32767.0f));
+}
+
+static u16
+unorm16(f32 f)
+{
+    f = f < 0.0f ? 0.0f : (f > 1.0f ? 1.0f : f);
+    return u16(roundf(f * 65535.0f));
+}
+
+/* unit vector onto the octahedron, lower hemisphere folded over the diagonals */
+static void
+octEncode(v3 n, s16* pDest)
+{
+    f32 l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if (l1 <= 0.0f)
+    {
+        pDest[0] = pDest[1] = 0;
+        return;
+    }
+
+    f32 x = n.x / l1, y = n.y / l1;
+    if (n.z < 0.0f)
+    {
+        f32 ox = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        f32 oy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = ox, y = oy;
+    }
+
+    pDest[0] = snorm16(x);
+    pDest[1] = snorm16(y);
+}
+
+m4
+quantize(const Vertex* pVertices, u32 nVertices, PackedVertex* pDest)
+{
+    v3 min {FLT_MAX, FLT_MAX, FLT_MAX}, max {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (u32 i = 0; i < nVertices; i++)
+    {
+        const v3& p = pVertices[i].pos;
+        for (u32 j = 0; j < 3; j++)
+        {
+            if (p.e[j] < min.e[j]) min.e[j] = p.e[j];
+            if (p.e[j] > max.e[j]) max.e[j] = p.e[j];
+        }
+    }
+    if (nVertices == 0) min = max = {};
+
+    v3 extent = max - min;
+    for (u32 j = 0; j < 3; j++)
+        if (extent.e[j] <= 0.0f) extent.e[j] = 1.0f;
+
+    for (u32 i = 0; i < nVertices; i++)
+    {
+        const Vertex& v = pVertices[i];
+        PackedVertex& p = pDest[i];
+
+        for (u32 j = 0; j < 3; j++)
+            p.pos[j] = unorm16((v.pos.e[j] - min.e[j]) / extent.e[j]);
+        p.pos[3] = v.tan.w < 0.0f ? 0 : 0xffff;
+
+        p.tex[0] = f32ToHalf(v.tex.x);
+        p.tex[1] = f32ToHalf(v.tex.y);
+
+        octEncode(v.norm, p.norm);
+        octEncode(v3(v.tan), p.tan);
+    }
+
+    m4 dequant = m4Iden();
+    dequant.e[0][0] = extent.x;
+    dequant.e[1][1] = extent.y;
+    dequant.e[2][2] = extent.z;
+    dequant.e[3][0] = min.x;
+    dequant.e[3][1] = min.y;
+    dequant.e[3][2] = min.z;
+
+    return dequant;
+}
+
+static void
+clusterBounds(Cluster* pCluster, const u32* pIndices, const Vertex* pVertices)
+{
+    auto& c = *pCluster;
+    const u32* idx = pIndices + c.firstIndex;
+
+    v3 min {FLT_MAX, FLT_MAX, FLT_MAX};
+    v3 max {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (u32 i = 0; i < c.nIndices; i++)
+    {
+        const v3& p = pVertices[idx[i]].pos;
+        for (u32 j = 0; j < 3; j++)
+        {
+            min.e[j] = fminf(min.e[j], p.e[j]);
+            max.e[j] = fmaxf(max.e[j], p.e[j]);
+        }
+    }
+
+    c.center = (min + max) * 0.5f;
+    c.radius = 0.0f;
+    for (u32 i = 0; i < c.nIndices; i++)
+        c.radius = fmaxf(c.radius, v3Dist(c.center, pVertices[idx[i]].pos));
+
+    /* unit face normals, area weighting would let a few big faces hide the spread */
+    v3 sum {0, 0, 0};
+    for (u32 i = 0; i < c.nIndices; i += 3)
+    {
+        const v3& p0 = pVertices[idx[i + 0]].pos;
+        v3 n = v3Cross(pVertices[idx[i + 1]].pos - p0, pVertices[idx[i + 2]].pos - p0);
+        f32 len = v3Length(n);
+        if (len > 0.0f)
+            sum = sum + n * (1.0f / len);
+    }
+
+    f32 sumLen = v3Length(sum);
+    c.coneAxis = sumLen > 0.0f ? sum * (1.0f / sumLen) : v3 {0, 0, 0};
+
+    f32 minDot = 1.0f;
+    for (u32 i = 0; i < c.nIndices; i += 3)
+    {
+        const v3& p0 = pVertices[idx[i + 0]].pos;
+        v3 n = v3Cross(pVertices[idx[i + 1]].pos - p0, pVertices[idx[i + 2]].pos - p0);
+        f32 len = v3Length(n);
+        if (len > 0.0f)
+            minDot = fminf(minDot, v3Dot(n, c.coneAxis) / len);
+    }
+
+    /* sine of the spread, wider than a hemisphere can't be culled */
+    c.coneCutoff = sumLen > 0.0f && minDot > 0.0f ? sqrtf(1.0f - minDot*minDot) : 1.0f;
+}
+
+/* projects v onto the plane of unit n, zero if v is (nearly) parallel to it */
+static v3
+projectNormalize(const v3& v, const v3& n)
+{
+    v3 p = v - n * v3Dot(n, v);
+    f32 len = v3Length(p);
+    return len > 1e-12f ? p * (1.0f / len) : v3 {};
+}
+
+void
+generateTangents(adt::Allocator* pAlloc, Vertex* pVertices, u32 nVertices, const u32* pIndices, u32 nIndices)
+{
+    /* angle weighted sums of the face tangent and bitangent per vertex */
+    v3* aTan = (v3*)pAlloc->alloc(nVertices, sizeof(v3));
+    v3* aBitan = (v3*)pAlloc->alloc(nVertices, sizeof(v3));
+    memset(aTan, 0, sizeof(v3) * nVertices);
+    memset(aBitan, 0, sizeof(v3) * nVertices);
+
+    for (u32 i = 0; i + 2 < nIndices; i += 3)
+    {
+        const u32 aIdx[3] {pIndices[i], pIndices[i + 1], pIndices[i + 2]};
+        const Vertex& v0 = pVertices[aIdx[0]];
+        const Vertex& v1 = pVertices[aIdx[1]];
+        const Vertex& v2 = pVertices[aIdx[2]];
+
+        v3 e1 = v1.pos - v0.pos, e2 = v2.pos - v0.pos;
+        f32 du1 = v1.tex.x - v0.tex.x, dv1 = v1.tex.y - v0.tex.y;
+        f32 du2 = v2.tex.x - v0.tex.x, dv2 = v2.tex.y - v0.tex.y;
+
+        /* only the uv orientation matters, the magnitude is normalized away per vertex */
+        f32 r = du1*dv2 - du2*dv1;
+        if (r == 0.0f)
+            continue;
+
+        f32 sign = r > 0.0f ? 1.0f : -1.0f;
+        v3 faceTan = (e1 * dv2 - e2 * dv1) * sign;
+        v3 faceBitan = (e2 * du1 - e1 * du2) * sign;
+
+        for (u32 c = 0; c < 3; c++)
+        {
+            const Vertex& v = pVertices[aIdx[c]];
+            v3 a = pVertices[aIdx[(c + 1) % 3]].pos - v.pos;
+            v3 b = pVertices[aIdx[(c + 2) % 3]].pos - v.pos;
+
+            f32 la = v3Length(a), lb = v3Length(b);
+            if (la <= 0.0f || lb <= 0.0f)
+                continue;
+
+            f32 cosAngle = v3Dot(a, b) / (la * lb);
+            f32 angle = acosf(cosAngle < -1.0f ? -1.0f : (cosAngle > 1.0f ? 1.0f : cosAngle));
+
+            aTan[aIdx[c]] += projectNormalize(faceTan, v.norm) * angle;
+            aBitan[aIdx[c]] += projectNormalize(faceBitan, v.norm) * angle;
+        }
+    }
+
+    for (u32 i = 0; i < nVertices; i++)
+    {
+        Vertex& v = pVertices[i];
+        v3 t = projectNormalize(aTan[i], v.norm);
+
+        /* no usable uvs around this vertex, anything perpendicular to the normal */
+        if (t.x == 0.0f && t.y == 0.0f && t.z == 0.0f)
+            t = projectNormalize(fabsf(v.norm.x) < 0.9f ? v3 {1.0f, 0.0f, 0.0f} : v3 {0.0f, 1.0f, 0.0f}, v.norm);
+
+        f32 w = v3Dot(v3Cross(v.norm, t), aBitan[i]) < 0.0f ? -1.0f : 1.0f;
+        v.tan = {t.x, t.y, t.z, w};
+    }
+
+    pAlloc->free(aTan);
+    pAlloc->free(aBitan);
+}
+
+u32
+buildClusters(adt::Allocator* pAlloc, Cluster* pDest, const u32* pIndices, u32 nIndices, const Vertex* pVertices, u32 nVertices)
+{
+    u32* aMarks = (u32*)pAlloc->alloc(nVertices, sizeof(u32));
+    memset(aMarks, 0xff, sizeof(u32) * nVertices);
+
+    u32 nClusters = 0;
+    u32 nClusterVertices = 0;
+    Cluster* pCurr = nullptr;
+
+    for (u32 i = 0; i < nIndices; i += 3)
+    {
+        u32 nNew = 0;
+        for (u32 j = 0; j < 3; j++)
+            if (aMarks[pIndices[i + j]] != nClusters - 1 || !pCurr)
+                nNew++;
+
+        if (!pCurr || nClusterVertices + nNew > CLUSTER_MAX_VERTICES || pCurr->nIndices / 3 >= CLUSTER_MAX_TRIANGLES)
+        {
+            pCurr = &pDest[nClusters++];
+            *pCurr = {};
+            pCurr->firstIndex = i;
+            nClusterVertices = 0;
+        }
+
+        for (u32 j = 0; j < 3; j++)
+        {
+            u32 v = pIndices[i + j];
+            if (aMarks[v] != nClusters - 1)
+            {
+                aMarks[v] = nClusters - 1;
+                nClusterVertices++;
+            }
+        }
+        pCurr->nIndices += 3;
+    }
+
+    for (u32 i = 0; i < nClusters; i++)
+        clusterBounds(&pDest[i], pIndices, pVertices);
+
+    pAlloc->free(aMarks);
+    return nClusters;
+}
+
+void
+optimize(adt::Allocator* pAlloc, Vertex* pVertices, u32* pNVertices, u32* pIndices, u32 nIndices)
+{
+    u32 nTriangles = nIndices / 3;
+    if (nTriangles == 0)
+        return;
+
+    u32* aTmp = (u32*)pAlloc->alloc(nIndices, sizeof(u32));
+    u32* aClusters = (u32*)pAlloc->alloc(nTriangles, sizeof(u32));
+
+    u32 nClusters = optimizeVertexCache(pAlloc, aTmp, pIndices, nIndices, *pNVertices, aClusters);
+    memcpy(pIndices, aTmp, sizeof(u32) * nIndices);
+
+    optimizeOverdraw(pAlloc, pIndices, nIndices, pVertices, *pNVertices, aClusters, nClusters);
+    *pNVertices = optimizeVertexFetch(pAlloc, pVertices, pIndices, nIndices, *pNVertices);
+
+    pAlloc->free(aClusters);
+    pAlloc->free(aTmp);
+}
+
+} /* namespace meshopt */
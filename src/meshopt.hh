@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Allocator.hh"
+#include "MeshBuffers.hh"
+
+namespace meshopt
+{
+
+/* post transform cache size every reordering and measurement assumes */
+constexpr u32 VCACHE_SIZE = 16;
+
+/* overdraw clusters may raise acmr by this factor at most */
+constexpr f32 OVERDRAW_THRESHOLD = 1.05f;
+
+/* levels including the full detail one */
+constexpr u32 MAX_LODS = 4;
+
+/* collapses may not move the surface further than this fraction of the mesh size */
+constexpr f32 SIMPLIFY_MAX_ERROR = 0.05f;
+
+/* cluster limits, the usual mesh shader sizes */
+constexpr u32 CLUSTER_MAX_VERTICES = 64;
+constexpr u32 CLUSTER_MAX_TRIANGLES = 124;
+
+/* one level of detail is just another index range over the same vertices */
+struct Lod
+{
+    u32 firstIndex; /* relative to the primitive's first index */
+    u32 nIndices;
+    u32 nTransformed; /* simulated vertex shader invocations */
+    f32 error; /* object space distance to the full detail surface */
+};
+
+/* consecutive run of lod 0 triangles with object space bounds */
+struct Cluster
+{
+    v3 center;
+    f32 radius;
+    v3 coneAxis; /* average face normal */
+    f32 coneCutoff; /* every face is backfacing if dot(center - eye, coneAxis) >= coneCutoff * |center - eye| + radius, 1 never culls */
+    u32 firstIndex; /* relative to the primitive's first index */
+    u32 nIndices;
+};
+
+/* simulated fifo post transform cache over one index buffer */
+struct CacheStats
+{
+    u32 nTransformed; /* vertex shader invocations */
+    u32 nTriangles;
+    u32 nVertices;
+};
+
+inline f32 acmr(const CacheStats& s) { return s.nTriangles ? f32(s.nTransformed) / f32(s.nTriangles) : 0.0f; }
+inline f32 atvr(const CacheStats& s) { return s.nVertices ? f32(s.nTransformed) / f32(s.nVertices) : 0.0f; }
+
+CacheStats analyzeVertexCache(adt::Allocator* pAlloc, const u32* pIndices, u32 nIndices, u32 nVertices);
+
+/* Tipsify (Sander et al. 2007), writes the reordered triangles to `pDest` (may not alias `pIndices`),
+ * returns the number of hard cluster boundaries written to `pClusters` (first triangle of each, sized nIndices/3). */
+u32 optimizeVertexCache(adt::Allocator* pAlloc, u32* pDest, const u32* pIndices, u32 nIndices, u32 nVertices, u32* pClusters);
+
+/* split tipsify clusters where acmr allows it and sort them front facing outwards first, in place */
+void optimizeOverdraw(adt::Allocator* pAlloc, u32* pIndices, u32 nIndices, const Vertex* pVertices, u32 nVertices, const u32* pClusters, u32 nClusters);
+
+/* reorder vertices in first use order, drops unreferenced ones, returns new vertex count */
+u32 optimizeVertexFetch(adt::Allocator* pAlloc, Vertex* pVertices, u32* pIndices, u32 nIndices, u32 nVertices);
+
+/* repack into PackedVertex, returns the matrix that maps unorm positions back into the mesh aabb */
+m4 quantize(const Vertex* pVertices, u32 nVertices, PackedVertex* pDest);
+
+/* Quadric error edge collapse (Garland & Heckbert) onto existing vertices, so the vertex buffer is shared.
+ * Uv/normal seams and non manifold vertices are locked, borders only slide along themselves.
+ * Writes up to nIndices to `pDest`, returns the index count, `pError` gets the object space error. */
+u32 simplify(adt::Allocator* pAlloc, u32* pDest, const u32* pIndices, u32 nIndices, const Vertex* pVertices, u32 nVertices,
+             u32 targetIndexCount, f32 maxError, f32* pError);
+
+/* Per vertex tangent frames from positions, normals and uvs, for primitives exported without TANGENT.
+ * Follows MikkTSpace: face tangents are projected onto each vertex normal plane and weighted by the corner angle,
+ * w is the bitangent sign, cross(norm, tan) * w points along +v. Vertices aren't split where the sign differs. */
+void generateTangents(adt::Allocator* pAlloc, Vertex* pVertices, u32 nVertices, const u32* pIndices, u32 nIndices);
+
+/* split triangles into clusters in index buffer order so the cache order survives,
+ * `pDest` needs room for nIndices / 3 clusters, returns the cluster count */
+u32 buildClusters(adt::Allocator* pAlloc, Cluster* pDest, const u32* pIndices, u32 nIndices, const Vertex* pVertices, u32 nVertices);
+
+/* cache, overdraw and fetch passes in order, triangle lists only */
+void optimize(adt::Allocator* pAlloc, Vertex* pVertices, u32* pNVertices, u32* pIndices, u32 nIndices);
+
+} /* namespace meshopt */
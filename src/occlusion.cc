@@ -0,0 +1,305 @@
+#include "occlusion.hh"
+
+#include <emmintrin.h>
+#include <float.h>
+#include <math.h>
+
+namespace occlusion
+{
+
+struct BandArg
+{
+    DepthBuffer* pSelf;
+    int band;
+};
+
+static BandArg s_aBandArgs[N_BANDS];
+
+static inline v4
+transform(const m4& m, const v3& p)
+{
+    auto e = m.e;
+    return {
+        e[0][0]*p.x + e[1][0]*p.y + e[2][0]*p.z + e[3][0],
+        e[0][1]*p.x + e[1][1]*p.y + e[2][1]*p.z + e[3][1],
+        e[0][2]*p.x + e[1][2]*p.y + e[2][2]*p.z + e[3][2],
+        e[0][3]*p.x + e[1][3]*p.y + e[2][3]*p.z + e[3][3]
+    };
+}
+
+static inline v4
+lerp(const v4& a, const v4& b, f32 t)
+{
+    return {a.x + (b.x - a.x)*t, a.y + (b.y - a.y)*t, a.z + (b.z - a.z)*t, a.w + (b.w - a.w)*t};
+}
+
+DepthBuffer::DepthBuffer(adt::Allocator* p)
+    : _pAlloc(p), _aTriangles(p)
+{
+    _pDepth = (f32*)p->alloc(WIDTH * HEIGHT, sizeof(f32));
+}
+
+void
+DepthBuffer::begin(const m4& viewProj)
+{
+    _viewProj = viewProj;
+    _aTriangles._size = 0;
+}
+
+void
+DepthBuffer::addOccluder(const m4& tm, const Occluder& o)
+{
+    m4 mvp = _viewProj * tm;
+
+    for (u32 i = 0; i < o.nIndices; i += 3)
+    {
+        v4 aIn[3] {
+            transform(mvp, o.pPositions[o.pIndices[i + 0]]),
+            transform(mvp, o.pPositions[o.pIndices[i + 1]]),
+            transform(mvp, o.pPositions[o.pIndices[i + 2]])
+        };
+
+        /* clip against the near plane (z = -w), the other planes are handled by the bounding box clamp */
+        v4 aPoly[4];
+        int nPoly = 0;
+        for (int j = 0; j < 3; j++)
+        {
+            const v4& a = aIn[j];
+            const v4& b = aIn[(j + 1) % 3];
+            f32 da = a.z + a.w, db = b.z + b.w;
+
+            if (da >= 0.0f)
+                aPoly[nPoly++] = a;
+            if ((da >= 0.0f) != (db >= 0.0f))
+                aPoly[nPoly++] = lerp(a, b, da / (da - db));
+        }
+
+        if (nPoly < 3)
+            continue;
+
+        f32 aX[4], aY[4], aZ[4];
+        for (int j = 0; j < nPoly; j++)
+        {
+            f32 w = fmaxf(aPoly[j].w, 1e-6f);
+            aX[j] = (aPoly[j].x / w * 0.5f + 0.5f) * WIDTH;
+            aY[j] = (aPoly[j].y / w * 0.5f + 0.5f) * HEIGHT;
+            aZ[j] = aPoly[j].z / w;
+        }
+
+        for (int j = 1; j + 1 < nPoly; j++)
+        {
+            _aTriangles.push({
+                {aX[0], aX[j], aX[j + 1]},
+                {aY[0], aY[j], aY[j + 1]},
+                {aZ[0], aZ[j], aZ[j + 1]}
+            });
+        }
+    }
+}
+
+void
+DepthBuffer::rasterize(int band)
+{
+    const int yBegin = band * BAND_TILES * TILE_SIZE;
+    const int yEnd = yBegin + BAND_TILES * TILE_SIZE;
+
+    const __m128 one = _mm_set1_ps(1.0f);
+    for (int i = yBegin * WIDTH; i < yEnd * WIDTH; i += 4)
+        _mm_storeu_ps(&_pDepth[i], one);
+
+    const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    const __m128 zero = _mm_setzero_ps();
+
+    for (const Triangle& t : _aTriangles)
+    {
+        f32 minX = fminf(t.x[0], fminf(t.x[1], t.x[2]));
+        f32 maxX = fmaxf(t.x[0], fmaxf(t.x[1], t.x[2]));
+        f32 minY = fminf(t.y[0], fminf(t.y[1], t.y[2]));
+        f32 maxY = fmaxf(t.y[0], fmaxf(t.y[1], t.y[2]));
+
+        if (maxX < 0.0f || minX >= f32(WIDTH) || maxY < f32(yBegin) || minY >= f32(yEnd))
+            continue;
+
+        int x0 = minX < 0.0f ? 0 : int(minX);
+        int x1 = maxX >= f32(WIDTH) ? WIDTH - 1 : int(maxX);
+        int y0 = minY < f32(yBegin) ? yBegin : int(minY);
+        int y1 = maxY >= f32(yEnd) ? yEnd - 1 : int(maxY);
+
+        f32 area = (t.x[1] - t.x[0]) * (t.y[2] - t.y[0]) - (t.x[2] - t.x[0]) * (t.y[1] - t.y[0]);
+        if (fabsf(area) < 1e-6f)
+            continue;
+
+        /* occluders are two sided, wind everything counter clockwise */
+        int i1 = 1, i2 = 2;
+        if (area < 0.0f)
+        {
+            i1 = 2, i2 = 1;
+            area = -area;
+        }
+        const int aIdx[3] {0, i1, i2};
+
+        /* edge j goes from vertex j to j + 1, it's the barycentric weight of the opposite vertex */
+        f32 aA[3], aB[3], aC[3];
+        for (int j = 0; j < 3; j++)
+        {
+            int a = aIdx[j], b = aIdx[(j + 1) % 3];
+            aA[j] = -(t.y[b] - t.y[a]);
+            aB[j] = t.x[b] - t.x[a];
+            aC[j] = -aA[j]*t.x[a] - aB[j]*t.y[a];
+        }
+
+        f32 invArea = 1.0f / area;
+        f32 zA = (aA[1]*t.z[aIdx[0]] + aA[2]*t.z[aIdx[1]] + aA[0]*t.z[aIdx[2]]) * invArea;
+        f32 zB = (aB[1]*t.z[aIdx[0]] + aB[2]*t.z[aIdx[1]] + aB[0]*t.z[aIdx[2]]) * invArea;
+        f32 zC = (aC[1]*t.z[aIdx[0]] + aC[2]*t.z[aIdx[1]] + aC[0]*t.z[aIdx[2]]) * invArea;
+
+        int xStart = x0 & ~3;
+        __m128 xs0 = _mm_add_ps(_mm_set1_ps(f32(xStart)), laneOffsets);
+
+        __m128 aEA[3], aStep[3];
+        for (int j = 0; j < 3; j++)
+        {
+            aEA[j] = _mm_set1_ps(aA[j]);
+            aStep[j] = _mm_set1_ps(aA[j] * 4.0f);
+        }
+        __m128 zAv = _mm_set1_ps(zA);
+        __m128 zStep = _mm_set1_ps(zA * 4.0f);
+
+        for (int y = y0; y <= y1; y++)
+        {
+            f32 cy = f32(y) + 0.5f;
+            __m128 e0 = _mm_add_ps(_mm_mul_ps(aEA[0], xs0), _mm_set1_ps(aB[0]*cy + aC[0]));
+            __m128 e1 = _mm_add_ps(_mm_mul_ps(aEA[1], xs0), _mm_set1_ps(aB[1]*cy + aC[1]));
+            __m128 e2 = _mm_add_ps(_mm_mul_ps(aEA[2], xs0), _mm_set1_ps(aB[2]*cy + aC[2]));
+            __m128 z = _mm_add_ps(_mm_mul_ps(zAv, xs0), _mm_set1_ps(zB*cy + zC));
+
+            f32* pRow = &_pDepth[y * WIDTH];
+            for (int x = xStart; x <= x1; x += 4)
+            {
+                __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+
+                if (_mm_movemask_ps(inside))
+                {
+                    __m128 old = _mm_loadu_ps(&pRow[x]);
+                    __m128 nearer = _mm_min_ps(old, z);
+                    _mm_storeu_ps(&pRow[x], _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+                }
+
+                e0 = _mm_add_ps(e0, aStep[0]);
+                e1 = _mm_add_ps(e1, aStep[1]);
+                e2 = _mm_add_ps(e2, aStep[2]);
+                z = _mm_add_ps(z, zStep);
+            }
+        }
+    }
+
+    for (int ty = band * BAND_TILES; ty < (band + 1) * BAND_TILES; ty++)
+    {
+        for (int tx = 0; tx < TILES_X; tx++)
+        {
+            __m128 m = _mm_setzero_ps();
+            for (int y = ty * TILE_SIZE; y < (ty + 1) * TILE_SIZE; y++)
+            {
+                const f32* p = &_pDepth[y * WIDTH + tx * TILE_SIZE];
+                m = _mm_max_ps(m, _mm_max_ps(_mm_loadu_ps(p), _mm_loadu_ps(p + 4)));
+            }
+
+            m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+            m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+            _aTileMax[ty][tx] = _mm_cvtss_f32(m);
+        }
+    }
+}
+
+static int
+rasterizeBand(void* p)
+{
+    auto& a = *(BandArg*)p;
+    a.pSelf->rasterize(a.band);
+    return 0;
+}
+
+void
+DepthBuffer::submit(adt::ThreadPool* pTp, adt::TaskGroup* pGroup)
+{
+    for (int i = 0; i < N_BANDS; i++)
+    {
+        s_aBandArgs[i] = {this, i};
+        pTp->submit(rasterizeBand, &s_aBandArgs[i], pGroup);
+    }
+}
+
+bool
+DepthBuffer::isOccluded(const v3& min, const v3& max) const
+{
+    f32 minX = FLT_MAX, maxX = -FLT_MAX, minY = FLT_MAX, maxY = -FLT_MAX, minZ = FLT_MAX;
+
+    for (int i = 0; i < 8; i++)
+    {
+        v3 c {i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z};
+        v4 p = transform(_viewProj, c);
+
+        /* crosses the near plane, the camera may be inside */
+        if (p.z < -p.w || p.w <= 0.0f)
+            return false;
+
+        f32 x = (p.x / p.w * 0.5f + 0.5f) * WIDTH;
+        f32 y = (p.y / p.w * 0.5f + 0.5f) * HEIGHT;
+        minX = fminf(minX, x), maxX = fmaxf(maxX, x);
+        minY = fminf(minY, y), maxY = fmaxf(maxY, y);
+        minZ = fminf(minZ, p.z / p.w);
+    }
+
+    /* off screen is frustum culling's business */
+    if (maxX < 0.0f || minX >= f32(WIDTH) || maxY < 0.0f || minY >= f32(HEIGHT))
+        return false;
+
+    int x0 = minX < 0.0f ? 0 : int(minX);
+    int x1 = maxX >= f32(WIDTH) ? WIDTH - 1 : int(maxX);
+    int y0 = minY < 0.0f ? 0 : int(minY);
+    int y1 = maxY >= f32(HEIGHT) ? HEIGHT - 1 : int(maxY);
+
+    const __m128 z = _mm_set1_ps(minZ);
+    const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+
+    for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+    {
+        for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+        {
+            if (minZ > _aTileMax[ty][tx])
+                continue;
+
+            /* some pixel of the tile is farther than the box, check the ones the box covers */
+            int px0 = tx * TILE_SIZE < x0 ? x0 : tx * TILE_SIZE;
+            int px1 = (tx + 1) * TILE_SIZE - 1 > x1 ? x1 : (tx + 1) * TILE_SIZE - 1;
+            int py0 = ty * TILE_SIZE < y0 ? y0 : ty * TILE_SIZE;
+            int py1 = (ty + 1) * TILE_SIZE - 1 > y1 ? y1 : (ty + 1) * TILE_SIZE - 1;
+
+            for (int y = py0; y <= py1; y++)
+            {
+                const f32* pRow = &_pDepth[y * WIDTH];
+                for (int x = px0 & ~3; x <= px1; x += 4)
+                {
+                    __m128i idx = _mm_add_epi32(_mm_set1_epi32(x), lanes);
+                    __m128i inRange = _mm_and_si128(_mm_cmpgt_epi32(idx, _mm_set1_epi32(px0 - 1)),
+                                                    _mm_cmplt_epi32(idx, _mm_set1_epi32(px1 + 1)));
+                    __m128 visible = _mm_and_ps(_mm_cmple_ps(z, _mm_loadu_ps(&pRow[x])), _mm_castsi128_ps(inRange));
+
+                    if (_mm_movemask_ps(visible))
+                        return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+void
+DepthBuffer::destroy()
+{
+    _pAlloc->free(_pDepth);
+    _aTriangles.destroy();
+}
+
+} /* namespace occlusion */
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "Array.hh"
+#include "ThreadPool.hh"
+#include "math.hh"
+
+namespace occlusion
+{
+
+/* low resolution depth target, both multiples of the tile size */
+constexpr int WIDTH = 320;
+constexpr int HEIGHT = 192;
+constexpr int TILE_SIZE = 8;
+constexpr int TILES_X = WIDTH / TILE_SIZE;
+constexpr int TILES_Y = HEIGHT / TILE_SIZE;
+
+/* rows of tiles rasterized by one job */
+constexpr int N_BANDS = 8;
+constexpr int BAND_TILES = TILES_Y / N_BANDS;
+
+/* primitives smaller than this (world space aabb diagonal) or heavier than this at full detail don't occlude */
+constexpr f32 OCCLUDER_MIN_SIZE = 2.0f;
+constexpr u32 OCCLUDER_MAX_TRIANGLES = 16384;
+
+/* cpu copy of the full detail positions, no attributes */
+struct Occluder
+{
+    v3* pPositions;
+    u32* pIndices;
+    u32 nVertices;
+    u32 nIndices;
+};
+
+/* screen space, z is ndc depth */
+struct Triangle
+{
+    f32 x[3];
+    f32 y[3];
+    f32 z[3];
+};
+
+/* Occluders are set up on one thread, then each band is rasterized by its own job and reduced into
+ * the per tile max depth, which lets most tests finish without touching pixels. */
+struct DepthBuffer
+{
+    adt::Allocator* _pAlloc {};
+    f32* _pDepth {}; /* WIDTH * HEIGHT, 1.0 is empty */
+    f32 _aTileMax[TILES_Y][TILES_X] {}; /* farthest depth inside each tile */
+    adt::Array<Triangle> _aTriangles;
+    m4 _viewProj {};
+
+    DepthBuffer() = default;
+    DepthBuffer(adt::Allocator* p);
+
+    void begin(const m4& viewProj);
+    void addOccluder(const m4& tm, const Occluder& o); /* transform, clip against the near plane and queue triangles */
+    void rasterize(int band); /* bands don't share memory so they can run in parallel */
+    void submit(adt::ThreadPool* pTp, adt::TaskGroup* pGroup); /* one job per band, caller waits on the group */
+    bool isOccluded(const v3& min, const v3& max) const; /* world space aabb, must be called after rasterization */
+    void destroy();
+};
+
+} /* namespace occlusion */
@@ -0,0 +1,232 @@
+#include <new>
+
+#include "DefaultAllocator.hh"
+#include "bench.hh"
+#include "occlusion.hh"
+#include "packet.hh"
+#include "scene.hh"
+
+namespace frame
+{
+
+/* max projected simplification error in pixels of the lit pass */
+constexpr f32 LOD_THRESHOLD = 1.0f;
+
+/* sponza occluders are rasterized here while the shadow pass is being submitted, clusters are culled here too */
+static occlusion::DepthBuffer s_occlusion(&adt::StdAllocator);
+
+/* unshadowed point lights bobbing around the sponza floor, every frame packet animates its own copy */
+static lights::PointLight s_aPointLights[MAX_POINT_LIGHTS]; /* at rest */
+static v4 s_aPointLightBases[MAX_POINT_LIGHTS]; /* rest position, phase */
+
+/* what the lit pass records with */
+static BatchProgram s_progLit;
+static BatchProgram s_progLitAlphaTest;
+static BatchProgram s_progPrepass;
+static BatchProgram s_progPrepassAlphaTest;
+
+static void
+initPointLights()
+{
+    u32 rng = 0x1234567u;
+    for (u32 i = 0; i < MAX_POINT_LIGHTS; i++)
+    {
+        s_aPointLightBases[i] = {
+            bench::randomF(&rng, -13.0f, 13.0f), bench::randomF(&rng, 0.3f, 8.0f), bench::randomF(&rng, -5.5f, 5.5f),
+            bench::randomF(&rng, 0.0f, 2.0f * f32(PI))
+        };
+
+        /* saturated hue */
+        f32 hue = bench::randomF(&rng, 0.0f, 2.0f * f32(PI));
+        v3 color {
+            0.5f + 0.5f * cosf(hue),
+            0.5f + 0.5f * cosf(hue - 2.0f * f32(PI) / 3.0f),
+            0.5f + 0.5f * cosf(hue + 2.0f * f32(PI) / 3.0f)
+        };
+
+        s_aPointLights[i].radius = bench::randomF(&rng, 1.0f, 2.5f);
+        s_aPointLights[i].shadow = -1.0f;
+        s_aPointLights[i].color = color * 0.6f;
+    }
+}
+
+void
+initFrameBuilds(const Shader* pLit, const Shader* pLitAlphaTest, const Shader* pPrepass, const Shader* pPrepassAlphaTest)
+{
+    s_progLit = batchProgram(pLit);
+    s_progLitAlphaTest = batchProgram(pLitAlphaTest);
+    s_progPrepass = batchProgram(pPrepass);
+    s_progPrepassAlphaTest = batchProgram(pPrepassAlphaTest);
+
+    initPointLights();
+}
+
+static void
+updatePointLights(lights::PointLight* aOut, u32 nLights, f64 time)
+{
+    f32 t = f32(time);
+    for (u32 i = 0; i < nLights; i++)
+    {
+        const v4& b = s_aPointLightBases[i];
+        aOut[i] = s_aPointLights[i];
+        aOut[i].pos = {b.x + sinf(t * 0.7f + b.w) * 0.5f, b.y + sinf(t * 1.3f + b.w) * 0.3f, b.z};
+    }
+}
+
+/* importance is the projected radius, tiles get about as many texels as the light covers on screen */
+static void
+selectPointLightShadows(FramePacket* p)
+{
+    shadows::AtlasRequest* aReqs = p->aShadowReqs;
+    f32 aImportance[shadows::ATLAS_MAX_LIGHTS];
+    u32 nReqs = 0;
+
+    for (u32 i = 0; i < p->nPointLights; i++)
+    {
+        const lights::PointLight& l = p->aPointLights[i];
+
+        v3 ext {l.radius, l.radius, l.radius};
+        if (!p->bPointLightShadows || !frustumAABB(p->frustum, l.pos - ext, l.pos + ext))
+            continue;
+
+        f32 importance = l.radius / fmaxf(v3Dist(l.pos, p->pos), 0.01f);
+        if (nReqs == shadows::ATLAS_MAX_LIGHTS && importance <= aImportance[nReqs - 1])
+            continue;
+
+        /* insertion into the sorted top list */
+        u32 at = nReqs < shadows::ATLAS_MAX_LIGHTS ? nReqs++ : nReqs - 1;
+        while (at > 0 && aImportance[at - 1] < importance)
+        {
+            aImportance[at] = aImportance[at - 1];
+            aReqs[at] = aReqs[at - 1];
+            at--;
+        }
+
+        f32 screenRadius = importance * p->projScale;
+        u32 tileSize = screenRadius > 384.0f ? 512 : screenRadius > 160.0f ? 256 : 128;
+        aImportance[at] = importance;
+        aReqs[at] = {i, l.pos, l.radius, tileSize};
+    }
+
+    p->nShadowReqs = nReqs;
+}
+
+static void
+collectStressScene(InstanceBatch* pBatch, f32 angle, const Frustum* pFrustum, const LodSelect* pLod, const occlusion::DepthBuffer* pOcclusion)
+{
+    for (int r = 0; r < STRESS_ROWS; r++)
+    {
+        for (int c = 0; c < STRESS_COLS; c++)
+        {
+            v3 pos {
+                (c - STRESS_COLS/2) * STRESS_SPACING,
+                0.3f,
+                (r - STRESS_ROWS/2) * STRESS_SPACING
+            };
+            g_mBackpack.collectGraph(pBatch, backpackTransform(pos, angle + r + c), pFrustum, pLod, pOcclusion);
+        }
+    }
+}
+
+/* runs on g_tp, queues the band jobs into its own group once the triangles are set up */
+static int
+OcclusionSubmit(void* pArg)
+{
+    g_mSponza.collectOccluders(&s_occlusion, m4Iden());
+    s_occlusion.submit(&g_tp, (adt::TaskGroup*)pArg);
+
+    return 0;
+}
+
+/* With the pre-pass the shading pass only runs for visible fragments: depth is laid down first (alpha tested
+ * primitives discard there, with a cheap shader), then everything shades with GL_EQUAL and no discard.
+ * The build recorded the passes the packet asked for, the render thread only replays them. */
+static void
+recordLitBatch(FramePacket* p)
+{
+    InstanceBatch* pBatch = p->pLitBatch;
+    pBatch->sort();
+
+    if (p->bPrepass)
+    {
+        pBatch->record(&g_tp, &p->aLitCmds[0], s_progPrepass, p->bInstancing, &s_progPrepassAlphaTest);
+        pBatch->record(&g_tp, &p->aLitCmds[1], s_progLit, p->bInstancing);
+    }
+    else pBatch->record(&g_tp, &p->aLitCmds[0], s_progLit, p->bInstancing, &s_progLitAlphaTest);
+}
+
+/* Runs on g_tp, or on whichever thread helps the pool while waiting for it, the render thread included,
+ * so the stats of whatever that thread was doing are put aside. No gl in here. */
+static int
+FramePacketBuild(void* pArg)
+{
+    auto* p = (FramePacket*)pArg;
+    f64 t0 = adt::timeNowMS();
+    DrawStats saved = g_drawStats;
+    g_drawStats = {};
+    p->arena.reset();
+    for (auto& cmds : p->aLitCmds)
+        cmds = CmdBuffer(&p->arena, adt::SIZE_1K);
+
+    /* occluders and cluster assignment run next to each other, collection needs the occluders */
+    adt::TaskGroup jobs;
+    if (p->bOcclusion)
+    {
+        s_occlusion.begin(p->proj * p->view);
+        g_tp.submit(OcclusionSubmit, &jobs, &jobs);
+    }
+
+    updatePointLights(p->aPointLights, p->nPointLights, p->lightTime);
+    p->grid.submit(&g_tp, &jobs, p->proj, p->view, 100.0f, p->aPointLights, p->nPointLights);
+    selectPointLightShadows(p);
+
+    g_tp.wait(&jobs);
+    p->grid.compact();
+
+    LodSelect lod {
+        .eye = p->pos,
+        .projScale = p->projScale,
+        .threshold = LOD_THRESHOLD
+    };
+    const LodSelect* pLod = p->bLods ? &lod : nullptr;
+    const occlusion::DepthBuffer* pOcclusion = p->bOcclusion ? &s_occlusion : nullptr;
+
+    adt::Array<u32> aIds(&p->arena, g_aEntries._size);
+    g_bvh.queryFrustum(p->frustum, &aIds);
+
+    p->pLitBatch = (InstanceBatch*)p->arena.alloc(1, sizeof(InstanceBatch));
+    new (p->pLitBatch) InstanceBatch(&p->arena, DRAW::DIFF | DRAW::APPLY_NM | (p->bNormalMapping ? DRAW::NORM : DRAW::NONE));
+    collectScene(p->pLitBatch, aIds, pLod, pOcclusion, shadows::CASTERS::ALL);
+    if (p->bStressScene)
+        collectStressScene(p->pLitBatch, p->backpackAngle, &p->frustum, pLod, pOcclusion);
+
+    if (p->bClusters)
+        p->pLitBatch->cullClusters(&g_tp, {p->pos, p->frustum});
+
+    recordLitBatch(p);
+
+    p->stats = g_drawStats;
+    g_drawStats = saved;
+    p->buildMs = adt::timeNowMS() - t0;
+
+    return 0;
+}
+
+/* main thread, between builds: the camera is copied too and the build goes to the pool */
+void
+submitFramePacket(App* pApp, FramePacket* p)
+{
+    p->proj = g_player._proj;
+    p->view = g_player._view;
+    p->pos = g_player._pos;
+    p->front = g_player._front;
+    p->frustum = frustumMake(p->proj * p->view);
+    p->width = pApp->_wWidth;
+    p->height = pApp->_wHeight;
+    p->projScale = f32(p->height) / (2.0f * tanf(toRad(g_fov) / 2.0f));
+    p->lightPos = {cosf((f32)p->lightTime) * 6.0f, 3.0f, sinf((f32)p->lightTime) * 1.1f};
+
+    g_tp.submit(FramePacketBuild, p, &p->group);
+}
+
+} /* namespace frame */
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ArenaAllocator.hh"
+#include "Model.hh"
+#include "frame.hh"
+#include "lights.hh"
+#include "shadows.hh"
+
+namespace frame
+{
+
+constexpr u32 MAX_POINT_LIGHTS = 4096;
+constexpr u32 FRAME_PACKETS = 2;
+
+/* grid of backpacks over the sponza floor, lit pass only so shadows don't dominate the comparison */
+constexpr int STRESS_ROWS = 16;
+constexpr int STRESS_COLS = 64;
+constexpr f32 STRESS_SPACING = 0.35f;
+
+/* What the render thread needs to draw one frame. The main thread snapshots camera, animation and toggles into one,
+ * the pool builds the light assignment and the lit pass draw list, and it's drawn on the next frame while the
+ * following packet is being built. Shared scene state (bvh, entries, models) only changes between builds. */
+struct FramePacket
+{
+    adt::ArenaAllocator arena; /* draw list and scratch of the build, reset by the next one */
+    adt::TaskGroup group; /* the build */
+
+    /* snapshot, proj and view go into the ubo in one go */
+    m4 proj;
+    m4 view;
+    v3 pos;
+    v3 front;
+    Frustum frustum;
+    f32 projScale;
+    int width;
+    int height;
+    f64 lightTime;
+    v3 lightPos;
+    f32 backpackAngle;
+    u32 nPointLights;
+    bool bOcclusion;
+    bool bClusters;
+    bool bLods;
+    bool bStressScene;
+    bool bNormalMapping;
+    bool bNormalMapBench; /* bNormalMapping was picked by the benchmark */
+    bool bPointLightShadows;
+    bool bInstancing;
+    bool bPrepass;
+    bool bPrepassBench; /* bPrepass was picked by the benchmark */
+
+    /* built */
+    lights::PointLight aPointLights[MAX_POINT_LIGHTS]; /* shadow slots are filled in when it's drawn */
+    lights::ClusterGrid grid;
+    shadows::AtlasRequest aShadowReqs[shadows::ATLAS_MAX_LIGHTS];
+    u32 nShadowReqs;
+    InstanceBatch* pLitBatch; /* sorted, upload() before replaying */
+    CmdBuffer aLitCmds[2]; /* forward pass, or depth pre-pass and shading pass */
+    DrawStats stats; /* of the build, added to the render thread's when drawn */
+    f64 buildMs;
+};
+
+void initFrameBuilds(const Shader* pLit, const Shader* pLitAlphaTest, const Shader* pPrepass, const Shader* pPrepassAlphaTest); /* gl thread, once the shaders are in */
+void submitFramePacket(App* pApp, FramePacket* p); /* main thread, toggles and animation are already in p */
+
+} /* namespace frame */
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Bvh.hh"
+#include "Model.hh"
+#include "shadows.hh"
+
+/* the loaded scene, owned by frame.cc, only written between frame packet builds */
+namespace frame
+{
+
+extern Model g_mSponza;
+extern Model g_mBackpack;
+
+/* every sponza primitive followed by the backpack ones, bvh ids index into this.
+ * The stress grid isn't in here, it goes through collectGraph() */
+extern adt::Array<SceneEntry> g_aEntries;
+extern u32 g_nStaticEntries;
+extern Bvh g_bvh;
+
+m4 backpackTransform(v3 pos, f32 angle);
+void collectScene(InstanceBatch* pBatch, const adt::Array<u32>& aIds, const LodSelect* pLod, const occlusion::DepthBuffer* pOcclusion, enum shadows::CASTERS eCasters); /* aIds from a g_bvh query */
+
+} /* namespace frame */
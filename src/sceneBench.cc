@@ -0,0 +1,273 @@
+#include <float.h>
+#include <math.h>
+
+#include "Bvh.hh"
+#include "DefaultAllocator.hh"
+#include "bench.hh"
+#include "frame.hh"
+#include "logs.hh"
+#include "math.hh"
+#include "scene.hh"
+
+namespace bench
+{
+
+/* rays, frustums and spheres per query type of the bvh benchmark, the synthetic scene is a soup of this many triangles */
+constexpr u32 BVH_BENCH_QUERIES = 100000;
+constexpr u32 BVH_BENCH_FRUSTUMS = 1000;
+constexpr u32 BVH_BENCH_TRIANGLES = 1000000;
+
+/* fly through the atrium and both ground floor arcades and log what the lit pass culling removed */
+struct CameraWaypoint
+{
+    v3 pos;
+    v3 target;
+};
+
+static const CameraWaypoint s_aCameraPath[] {
+    {{-11.0f, 1.5f,  0.0f}, { 0.0f, 1.5f,  0.0f}},
+    {{ 11.0f, 1.5f,  0.0f}, {20.0f, 1.5f,  0.0f}},
+    {{ 11.0f, 1.5f, -5.5f}, { 0.0f, 1.5f, -5.5f}},
+    {{-11.0f, 1.5f, -5.5f}, {-20.0f, 1.5f, -5.5f}},
+    {{-11.0f, 1.5f,  5.5f}, { 0.0f, 1.5f,  5.5f}},
+    {{ 11.0f, 1.5f,  5.5f}, {20.0f, 1.5f,  5.5f}},
+};
+constexpr u32 CAMERA_PATH_LEG_FRAMES = 240;
+
+static struct {
+    u32 nFrames;
+    u64 nTests; /* primitives that passed frustum culling */
+    u64 nOccluded;
+    f32 minRatio; /* occluded share of one frame */
+    f32 maxRatio;
+    u64 nClusters;
+    u64 nClustersFrustumCulled;
+    u64 nClustersBackfaceCulled;
+    u64 nTriangles; /* lit pass, submitted */
+    u64 nTrianglesFull; /* lit pass, what whole lod 0 primitives would have submitted */
+    bool bRunning;
+} s_pathBench {};
+
+struct BenchTriangle
+{
+    v3 a, b, c;
+};
+
+/* Möller–Trumbore */
+static f32
+intersectBenchTriangle(void* pCtx, u32 id, const v3& origin, const v3& dir, f32 tMax)
+{
+    const BenchTriangle& tri = ((const BenchTriangle*)pCtx)[id];
+    v3 e1 = tri.b - tri.a;
+    v3 e2 = tri.c - tri.a;
+    v3 p = v3Cross(dir, e2);
+    f32 det = v3Dot(e1, p);
+    if (fabsf(det) < 1e-12f)
+        return tMax;
+
+    f32 invDet = 1.0f / det;
+    v3 s = origin - tri.a;
+    f32 u = v3Dot(s, p) * invDet;
+    if (u < 0.0f || u > 1.0f)
+        return tMax;
+
+    v3 q = v3Cross(s, e1);
+    f32 v = v3Dot(dir, q) * invDet;
+    if (v < 0.0f || u + v > 1.0f)
+        return tMax;
+
+    f32 t = v3Dot(e2, q) * invDet;
+    return t > 0.0f && t < tMax ? t : tMax;
+}
+
+/* build, refit and query timings over items spread inside min..max */
+static void
+benchmarkBvh(const char* ntsName, const BvhItem* pItems, u32 nItems, const v3& min, const v3& max, PfnBvhIntersect pfn, void* pCtx)
+{
+    Bvh bvh(&adt::StdAllocator);
+    u32 rng = 0x9e3779b9;
+
+    f64 t0 = adt::timeNowMS();
+    bvh.build(pItems, nItems, nullptr);
+    f64 buildSerial = adt::timeNowMS() - t0;
+
+    t0 = adt::timeNowMS();
+    bvh.build(pItems, nItems, &frame::g_tp);
+    f64 buildPool = adt::timeNowMS() - t0;
+
+    t0 = adt::timeNowMS();
+    bvh.refit();
+    f64 refit = adt::timeNowMS() - t0;
+
+    auto randomPoint = [&] {
+        return v3 {randomF(&rng, min.x, max.x), randomF(&rng, min.y, max.y), randomF(&rng, min.z, max.z)};
+    };
+    auto randomDir = [&] {
+        return v3Norm({randomF(&rng, -1.0f, 1.0f), randomF(&rng, -1.0f, 1.0f), randomF(&rng, -1.0f, 1.0f)});
+    };
+
+    u32 nHits = 0;
+    t0 = adt::timeNowMS();
+    for (u32 i = 0; i < BVH_BENCH_QUERIES; i++)
+        nHits += bvh.raycast(randomPoint(), randomDir(), 1000.0f, pfn, pCtx).id != adt::NPOS;
+    f64 rays = adt::timeNowMS() - t0;
+
+    adt::Array<u32> aIds(&adt::StdAllocator, nItems);
+    m4 proj = m4Pers(toRad(frame::g_fov), 16.0f / 9.0f, 0.01f, 100.0f);
+    u64 nFrustumIds = 0;
+    t0 = adt::timeNowMS();
+    for (u32 i = 0; i < BVH_BENCH_FRUSTUMS; i++)
+    {
+        v3 eye = randomPoint();
+        aIds._size = 0;
+        bvh.queryFrustum(frustumMake(proj * m4LookAt(eye, eye + randomDir(), {0.0f, 1.0f, 0.0f})), &aIds);
+        nFrustumIds += aIds._size;
+    }
+    f64 frustums = adt::timeNowMS() - t0;
+
+    f32 radius = v3Length(max - min) * 0.02f;
+    u64 nSphereIds = 0;
+    t0 = adt::timeNowMS();
+    for (u32 i = 0; i < BVH_BENCH_QUERIES; i++)
+    {
+        aIds._size = 0;
+        bvh.querySphere(randomPoint(), radius, &aIds);
+        nSphereIds += aIds._size;
+    }
+    f64 spheres = adt::timeNowMS() - t0;
+
+    LOG_OK("bvh benchmark '%s': %u items, %u nodes\n"
+           "    build: %.3f ms serial, %.3f ms with %u workers, refit: %.3f ms\n"
+           "    rays: %.2f Mrays/s (%u of %u hit)\n"
+           "    frustums: %.3f ms per query (%.1f ids avg)\n"
+           "    spheres (r = %.2f): %.2f Mqueries/s (%.1f ids avg)\n",
+           ntsName, nItems, bvh._aNodes._size,
+           buildSerial, buildPool, frame::g_tp._threadCount, refit,
+           f64(BVH_BENCH_QUERIES) / rays / 1000.0, nHits, BVH_BENCH_QUERIES,
+           frustums / BVH_BENCH_FRUSTUMS, f64(nFrustumIds) / BVH_BENCH_FRUSTUMS,
+           radius, f64(BVH_BENCH_QUERIES) / spheres / 1000.0, f64(nSphereIds) / BVH_BENCH_QUERIES);
+
+    aIds.destroy();
+    bvh.destroy();
+}
+
+void
+runBvhBenchmark()
+{
+    /* the scene entries, queried with their aabbs */
+    {
+        adt::Array<BvhItem> aItems(&adt::StdAllocator, frame::g_aEntries._size + 1);
+        v3 min {FLT_MAX, FLT_MAX, FLT_MAX}, max {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+        for (auto& en : frame::g_aEntries)
+        {
+            aItems.push({en.min, en.max});
+            for (u32 i = 0; i < 3; i++)
+            {
+                min.e[i] = fminf(min.e[i], en.min.e[i]);
+                max.e[i] = fmaxf(max.e[i], en.max.e[i]);
+            }
+        }
+
+        if (aItems._size > 0)
+            benchmarkBvh("scene", aItems.data(), aItems._size, min, max, nullptr, nullptr);
+
+        aItems.destroy();
+    }
+
+    /* small triangles scattered through a sponza sized box, rays test the triangles themselves */
+    {
+        const v3 min {-15.0f, -1.0f, -10.0f}, max {15.0f, 12.0f, 10.0f};
+        auto* aTriangles = (BenchTriangle*)adt::StdAllocator.alloc(BVH_BENCH_TRIANGLES, sizeof(BenchTriangle));
+        auto* aItems = (BvhItem*)adt::StdAllocator.alloc(BVH_BENCH_TRIANGLES, sizeof(BvhItem));
+
+        u32 rng = 1;
+        for (u32 i = 0; i < BVH_BENCH_TRIANGLES; i++)
+        {
+            v3 c {randomF(&rng, min.x, max.x), randomF(&rng, min.y, max.y), randomF(&rng, min.z, max.z)};
+            auto corner = [&] {
+                return c + v3 {randomF(&rng, -0.05f, 0.05f), randomF(&rng, -0.05f, 0.05f), randomF(&rng, -0.05f, 0.05f)};
+            };
+            BenchTriangle& t = aTriangles[i];
+            t.a = corner(), t.b = corner(), t.c = corner();
+
+            for (u32 j = 0; j < 3; j++)
+            {
+                aItems[i].min.e[j] = fminf(fminf(t.a.e[j], t.b.e[j]), t.c.e[j]);
+                aItems[i].max.e[j] = fmaxf(fmaxf(t.a.e[j], t.b.e[j]), t.c.e[j]);
+            }
+        }
+
+        benchmarkBvh("synthetic triangles", aItems, BVH_BENCH_TRIANGLES, min, max, intersectBenchTriangle, aTriangles);
+
+        adt::StdAllocator.free(aItems);
+        adt::StdAllocator.free(aTriangles);
+    }
+}
+
+void
+startPathBenchmark()
+{
+    s_pathBench = {};
+    s_pathBench.minRatio = 1.0f;
+    s_pathBench.bRunning = true;
+}
+
+void
+updatePathBenchmark()
+{
+    if (!s_pathBench.bRunning)
+        return;
+
+    constexpr u32 nLegs = adt::size(s_aCameraPath) - 1;
+    u32 leg = s_pathBench.nFrames / CAMERA_PATH_LEG_FRAMES;
+
+    if (leg >= nLegs)
+    {
+        auto percent = [](u64 part, u64 whole) { return whole ? 100.0 * f64(part) / f64(whole) : 0.0; };
+        auto& b = s_pathBench;
+
+        b.bRunning = false;
+        LOG_OK("camera path benchmark (%u frames):\n"
+               "    occlusion: %llu of %llu primitives in the frustum occluded (%.1f%%), per frame %.1f%% .. %.1f%%\n"
+               "    clusters: %llu tested, %.1f%% outside the frustum, %.1f%% backfacing\n"
+               "    lit triangles: %llu submitted of %llu for whole primitives (%.1f%%)\n",
+               b.nFrames,
+               (unsigned long long)b.nOccluded, (unsigned long long)b.nTests, percent(b.nOccluded, b.nTests),
+               100.0f * b.minRatio, 100.0f * b.maxRatio,
+               (unsigned long long)b.nClusters, percent(b.nClustersFrustumCulled, b.nClusters), percent(b.nClustersBackfaceCulled, b.nClusters),
+               (unsigned long long)b.nTriangles, (unsigned long long)b.nTrianglesFull, percent(b.nTriangles, b.nTrianglesFull));
+        return;
+    }
+
+    f32 t = f32(s_pathBench.nFrames % CAMERA_PATH_LEG_FRAMES) / f32(CAMERA_PATH_LEG_FRAMES);
+    auto& a = s_aCameraPath[leg];
+    auto& b = s_aCameraPath[leg + 1];
+    v3 pos = a.pos + (b.pos - a.pos) * t;
+    v3 target = a.target + (b.target - a.target) * t;
+
+    frame::g_player._pos = pos;
+    frame::g_player._front = v3Norm(target - pos);
+    s_pathBench.nFrames++;
+}
+
+void
+accumulatePathBenchmark(const frame::DrawStats& s, const frame::DrawStats& shadow)
+{
+    if (!s_pathBench.bRunning)
+        return;
+
+    s_pathBench.nTests += s.nOcclusionTests;
+    s_pathBench.nOccluded += s.nOccluded;
+
+    f32 ratio = s.nOcclusionTests ? f32(s.nOccluded) / f32(s.nOcclusionTests) : 0.0f;
+    s_pathBench.minRatio = fminf(s_pathBench.minRatio, ratio);
+    s_pathBench.maxRatio = fmaxf(s_pathBench.maxRatio, ratio);
+
+    s_pathBench.nClusters += s.nClusters;
+    s_pathBench.nClustersFrustumCulled += s.nClustersFrustumCulled;
+    s_pathBench.nClustersBackfaceCulled += s.nClustersBackfaceCulled;
+    s_pathBench.nTriangles += s.nTriangles - shadow.nTriangles;
+    s_pathBench.nTrianglesFull += s.nTrianglesFull - shadow.nTrianglesFull;
+}
+
+} /* namespace bench */
@@ -0,0 +1,581 @@
+#include "shadows.hh"
+#include "logs.hh"
+
+namespace shadows
+{
+
+/* frames measured per path, glFinish() is only called while benchmark is running */
+constexpr u32 BENCH_FRAMES = 120;
+
+/* light movements shorter than this are reprojected: lit pass keeps sampling the
+ * cached maps from the old light position instead of redrawing them */
+constexpr f32 REPROJECT_DIST = 0.15f;
+/* while reprojecting, refresh at most every Nth frame */
+constexpr u32 MAX_STALE_FRAMES = 4;
+
+static GLenum
+depthInternalFormat(enum DEPTH_FORMAT e)
+{
+    return e == DEPTH_FORMAT::U16 ? GL_DEPTH_COMPONENT16 : GL_DEPTH_COMPONENT32F;
+}
+
+static DepthCube
+makeDepthCube(int width, int height, enum DEPTH_FORMAT eFormat)
+{
+    DepthCube dc {};
+    dc.cubeMap = makeCubeShadowMap(width, height, depthInternalFormat(eFormat));
+
+    /* one fbo per face for the per face path */
+    glGenFramebuffers(6, dc.aFaceFbos);
+    for (u32 i = 0; i < 6; i++)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, dc.aFaceFbos[i]);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, dc.cubeMap.tex, 0);
+        GLenum none = GL_NONE;
+        glDrawBuffers(1, &none);
+        glReadBuffer(GL_NONE);
+
+        if (GL_FRAMEBUFFER_COMPLETE != glCheckFramebufferStatus(GL_FRAMEBUFFER))
+            LOG_FATAL("glCheckFramebufferStatus != GL_FRAMEBUFFER_COMPLETE\n");
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    return dc;
+}
+
+static void
+destroyDepthCube(DepthCube* pDc)
+{
+    glDeleteFramebuffers(6, pDc->aFaceFbos);
+    glDeleteFramebuffers(1, &pDc->cubeMap.fbo);
+    glDeleteTextures(1, &pDc->cubeMap.tex);
+    *pDc = {};
+}
+
+void
+OmniDir::init(int width, int height)
+{
+    _shGeom.loadShaders("shaders/shadows/cubeMap/cubeMapDepth.vert", "shaders/shadows/cubeMap/cubeMapDepth.geom", "shaders/shadows/cubeMap/cubeMapDepth.frag");
+    _shFace.loadShaders("shaders/shadows/cubeMap/cubeMapDepthFace.vert", "shaders/shadows/cubeMap/cubeMapDepth.frag");
+
+    _static = makeDepthCube(width, height, _eDepthFormat);
+    _final = makeDepthCube(width, height, _eDepthFormat);
+    _cache.bStaticDirty = true;
+}
+
+void
+OmniDir::renderCasters(adt::Allocator* pAlloc,
+                       DepthCube* pTarget,
+                       enum PATH ePath,
+                       bool bClear,
+                       enum CASTERS eCasters,
+                       f32 nearPlane,
+                       f32 farPlane,
+                       PfnRenderCasters pfnRender)
+{
+    const v3& lightPos = _cache.lightPos;
+    f32 aspect = f32(pTarget->cubeMap.width) / f32(pTarget->cubeMap.height);
+    m4 proj = m4Pers(toRad(90), aspect, nearPlane, farPlane);
+    CubeMapProjections tms(proj, lightPos);
+
+    switch (ePath)
+    {
+        default:
+        case PATH::GEOMETRY_SHADER:
+            glBindFramebuffer(GL_FRAMEBUFFER, pTarget->cubeMap.fbo);
+            if (bClear) glClear(GL_DEPTH_BUFFER_BIT);
+
+            _shGeom.use();
+            for (u32 i = 0; i < adt::size(tms._tms); i++)
+            {
+                char buff[30] {};
+                snprintf(buff, sizeof(buff), "uShadowMatrices[%d]", i);
+                _shGeom.setM4(buff, tms[i]);
+            }
+            _shGeom.setV3("uLightPos", lightPos);
+            _shGeom.setF("uFarPlane", farPlane);
+
+            pfnRender(pAlloc, &_shGeom, nullptr, eCasters);
+            break;
+
+        case PATH::PER_FACE:
+            _shFace.use();
+            _shFace.setV3("uLightPos", lightPos);
+            _shFace.setF("uFarPlane", farPlane);
+
+            for (u32 i = 0; i < adt::size(tms._tms); i++)
+            {
+                glBindFramebuffer(GL_FRAMEBUFFER, pTarget->aFaceFbos[i]);
+                if (bClear) glClear(GL_DEPTH_BUFFER_BIT);
+
+                _shFace.setM4("uShadowMatrix", tms[i]);
+                Frustum fr = frustumMake(tms[i]);
+                pfnRender(pAlloc, &_shFace, &fr, eCasters);
+            }
+            break;
+    }
+}
+
+void
+OmniDir::render(adt::Allocator* pAlloc, const v3& lightPos, f32 nearPlane, f32 farPlane, PfnRenderCasters pfnRender)
+{
+    enum PATH ePath = _ePath;
+    f64 t0 = 0.0;
+    if (_bench.bRunning)
+    {
+        ePath = PATH(_bench.nFrames % u32(PATH::ESIZE));
+        _cache.bStaticDirty = true; /* measure full passes */
+        glFinish(); /* don't measure previous work */
+        t0 = adt::timeNowMS();
+    }
+
+    f32 moved = v3Dist(lightPos, _cache.lightPos);
+    bool bRefreshStatic = _cache.bStaticDirty;
+    if (!bRefreshStatic && moved > 0.0f)
+    {
+        if (moved > REPROJECT_DIST || _cache.nStaleFrames >= MAX_STALE_FRAMES)
+            bRefreshStatic = true;
+        else
+            _cache.nStaleFrames++;
+    }
+
+    if (!bRefreshStatic && !_cache.bDynamicDirty)
+    {
+        _cache.eLastUpdate = UPDATE::NONE;
+        return;
+    }
+
+    glViewport(0, 0, _final.cubeMap.width, _final.cubeMap.height);
+    glCullFace(GL_FRONT);
+
+    if (bRefreshStatic)
+    {
+        _cache.lightPos = lightPos;
+        _cache.nStaleFrames = 0;
+        _cache.bStaticDirty = false;
+        renderCasters(pAlloc, &_static, ePath, true, CASTERS::STATIC, nearPlane, farPlane, pfnRender);
+    }
+
+    /* composite: start from static depth, dynamic casters depth test against it */
+    glCopyImageSubData(_static.cubeMap.tex, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0,
+                       _final.cubeMap.tex, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0,
+                       _final.cubeMap.width, _final.cubeMap.height, 6);
+    renderCasters(pAlloc, &_final, ePath, false, CASTERS::DYNAMIC, nearPlane, farPlane, pfnRender);
+    _cache.bDynamicDirty = false;
+    _cache.eLastUpdate = bRefreshStatic ? UPDATE::FULL : UPDATE::DYNAMIC;
+
+    glCullFace(GL_BACK);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (_bench.bRunning)
+    {
+        glFinish();
+        _bench.aTimes[int(ePath)] += adt::timeNowMS() - t0;
+
+        if (++_bench.nFrames >= BENCH_FRAMES * u32(PATH::ESIZE))
+        {
+            _bench.bRunning = false;
+
+            f64 geom = _bench.aTimes[int(PATH::GEOMETRY_SHADER)] / BENCH_FRAMES;
+            f64 face = _bench.aTimes[int(PATH::PER_FACE)] / BENCH_FRAMES;
+            _ePath = face < geom ? PATH::PER_FACE : PATH::GEOMETRY_SHADER;
+
+            adt::String s = pathToString(_ePath);
+            LOG_OK("shadow pass: geometry shader: %.3f ms, per face: %.3f ms, using '%.*s'\n", geom, face, (int)s._size, s._pData);
+        }
+    }
+}
+
+void
+OmniDir::startBenchmark()
+{
+    _bench = {};
+    _bench.bRunning = true;
+}
+
+void
+OmniDir::togglePath()
+{
+    _bench.bRunning = false;
+    _ePath = PATH((int(_ePath) + 1) % int(PATH::ESIZE));
+    _cache.bStaticDirty = true;
+}
+
+void
+OmniDir::cycleFilter()
+{
+    _eFilter = FILTER((int(_eFilter) + 1) % int(FILTER::ESIZE));
+}
+
+void
+OmniDir::toggleDepthFormat()
+{
+    int width = _final.cubeMap.width, height = _final.cubeMap.height;
+    _eDepthFormat = DEPTH_FORMAT((int(_eDepthFormat) + 1) % int(DEPTH_FORMAT::ESIZE));
+
+    destroyDepthCube(&_static);
+    destroyDepthCube(&_final);
+    _static = makeDepthCube(width, height, _eDepthFormat);
+    _final = makeDepthCube(width, height, _eDepthFormat);
+    _cache.bStaticDirty = true;
+}
+
+u32
+OmniDir::memoryUsage() const
+{
+    u32 texelSize = _eDepthFormat == DEPTH_FORMAT::U16 ? 2 : 4;
+    return 2 * 6 * u32(_final.cubeMap.width) * u32(_final.cubeMap.height) * texelSize;
+}
+
+/* near plane of the atlas faces */
+constexpr f32 ATLAS_NEAR_PLANE = 0.02f;
+
+static u32
+tileLevel(u32 size)
+{
+    u32 level = 0;
+    for (u32 s = ATLAS_MAX_TILE; s > size; s /= 2)
+        level++;
+
+    return level;
+}
+
+Atlas::Atlas(adt::Allocator* p)
+{
+    for (auto& a : _aFree)
+        a = adt::Array<AtlasTile>(p, (ATLAS_SIZE / ATLAS_MIN_TILE) * (ATLAS_SIZE / ATLAS_MIN_TILE));
+}
+
+void
+Atlas::init()
+{
+    _shFace.loadShaders("shaders/shadows/cubeMap/cubeMapDepthFace.vert", "shaders/shadows/cubeMap/cubeMapDepth.frag");
+    _map = makeShadowMap(ATLAS_SIZE, ATLAS_SIZE);
+    repack(nullptr, 0);
+}
+
+static bool
+allocTile(adt::Array<AtlasTile>* aFree, u32 level, AtlasTile* pTile)
+{
+    if (!aFree[level].empty())
+    {
+        *pTile = *aFree[level].pop();
+        return true;
+    }
+
+    /* split a bigger one */
+    AtlasTile big;
+    if (level == 0 || !allocTile(aFree, level - 1, &big))
+        return false;
+
+    u16 half = big.size / 2;
+    aFree[level].push({u16(big.x + half), big.y, half});
+    aFree[level].push({big.x, u16(big.y + half), half});
+    aFree[level].push({u16(big.x + half), u16(big.y + half), half});
+    *pTile = {big.x, big.y, half};
+
+    return true;
+}
+
+static AtlasLight
+makeSlot(const AtlasRequest& r)
+{
+    AtlasLight sl {};
+    sl.id = r.id;
+    sl.pos = r.pos;
+    sl.targetPos = r.pos;
+    sl.farPlane = r.radius;
+    sl.tileSize = r.tileSize;
+
+    return sl;
+}
+
+bool
+Atlas::allocSlot(AtlasLight* pSlot, u32 tileSize)
+{
+    /* smaller tiles if the atlas can't fit this size anymore */
+    for (u32 size = tileSize; size >= ATLAS_MIN_TILE; size /= 2)
+    {
+        u32 level = tileLevel(size);
+        u32 nFaces = 0;
+        while (nFaces < 6 && allocTile(_aFree, level, &pSlot->aFaces[nFaces]))
+            nFaces++;
+
+        if (nFaces == 6)
+            return true;
+
+        for (u32 i = 0; i < nFaces; i++)
+            _aFree[level].push(pSlot->aFaces[i]);
+    }
+
+    return false;
+}
+
+void
+Atlas::freeSlot(AtlasLight* pSlot)
+{
+    for (const AtlasTile& t : pSlot->aFaces)
+        _aFree[tileLevel(t.size)].push(t);
+
+    *pSlot = {};
+}
+
+void
+Atlas::repack(const AtlasRequest* pReqs, u32 nReqs)
+{
+    for (auto& a : _aFree)
+        a._size = 0;
+
+    for (u16 y = 0; y < ATLAS_SIZE; y += ATLAS_MAX_TILE)
+        for (u16 x = 0; x < ATLAS_SIZE; x += ATLAS_MAX_TILE)
+            _aFree[0].push({x, y, u16(ATLAS_MAX_TILE)});
+
+    /* tiles move, so everything gets redrawn, most important first */
+    for (u32 i = 0; i < ATLAS_MAX_LIGHTS; i++)
+    {
+        AtlasLight& sl = _aSlots[i];
+        sl = {};
+        if (i >= nReqs)
+            continue;
+
+        const AtlasRequest& r = pReqs[i];
+        sl = makeSlot(r);
+        sl.bUsed = allocSlot(&sl, r.tileSize);
+        if (!sl.bUsed)
+            sl = {};
+    }
+}
+
+void
+Atlas::renderSlot(adt::Allocator* pAlloc, AtlasLight* pSlot, PfnRenderCasters pfnRender)
+{
+    pSlot->pos = pSlot->targetPos;
+    pSlot->lastUpdate = _frame;
+    _pRendering = pSlot;
+
+    CubeMapProjections tms(m4Pers(toRad(90), 1.0f, ATLAS_NEAR_PLANE, pSlot->farPlane), pSlot->pos);
+    _shFace.setV3("uLightPos", pSlot->pos);
+    _shFace.setF("uFarPlane", pSlot->farPlane);
+
+    for (u32 i = 0; i < 6; i++)
+    {
+        const AtlasTile& t = pSlot->aFaces[i];
+        glViewport(t.x, t.y, t.size, t.size);
+        glScissor(t.x, t.y, t.size, t.size);
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+        _shFace.setM4("uShadowMatrix", tms[i]);
+        Frustum fr = frustumMake(tms[i]);
+        pfnRender(pAlloc, &_shFace, &fr, CASTERS::ALL);
+    }
+
+    _pRendering = nullptr;
+}
+
+void
+Atlas::update(adt::Allocator* pAlloc, const AtlasRequest* pReqs, u32 nReqs, PfnRenderCasters pfnRender)
+{
+    _frame++;
+    _nFacesUpdated = 0;
+
+    auto findRequest = [&](u32 id) -> const AtlasRequest* {
+        for (u32 i = 0; i < nReqs; i++)
+            if (pReqs[i].id == id)
+                return &pReqs[i];
+
+        return nullptr;
+    };
+
+    /* drop lights that left the set or want another size */
+    for (AtlasLight& sl : _aSlots)
+    {
+        if (!sl.bUsed)
+            continue;
+
+        const AtlasRequest* pReq = findRequest(sl.id);
+        if (!pReq || pReq->tileSize != sl.tileSize)
+        {
+            freeSlot(&sl);
+            continue;
+        }
+
+        sl.targetPos = pReq->pos;
+        sl.farPlane = pReq->radius;
+    }
+
+    for (u32 i = 0; i < nReqs; i++)
+    {
+        const AtlasRequest& r = pReqs[i];
+        if (slotIndex(r.id, false) != -1)
+            continue;
+
+        AtlasLight* pFree = nullptr;
+        for (AtlasLight& sl : _aSlots)
+        {
+            if (!sl.bUsed)
+            {
+                pFree = &sl;
+                break;
+            }
+        }
+
+        *pFree = makeSlot(r);
+        pFree->bUsed = allocSlot(pFree, r.tileSize);
+        if (!pFree->bUsed)
+        {
+            *pFree = {};
+            repack(pReqs, nReqs);
+            break;
+        }
+    }
+
+    /* longest waiting first, never drawn ones have lastUpdate 0 */
+    bool bBound = false;
+    while (_nFacesUpdated + 6 <= ATLAS_FACE_BUDGET)
+    {
+        AtlasLight* pOldest = nullptr;
+        for (AtlasLight& sl : _aSlots)
+            if (sl.bUsed && sl.lastUpdate != _frame && (!pOldest || sl.lastUpdate < pOldest->lastUpdate))
+                pOldest = &sl;
+
+        if (!pOldest)
+            break;
+
+        if (!bBound)
+        {
+            bBound = true;
+            glBindFramebuffer(GL_FRAMEBUFFER, _map.fbo);
+            glEnable(GL_SCISSOR_TEST);
+            glCullFace(GL_FRONT);
+            _shFace.use();
+        }
+
+        renderSlot(pAlloc, pOldest, pfnRender);
+        _nFacesUpdated += 6;
+    }
+
+    if (bBound)
+    {
+        glCullFace(GL_BACK);
+        glDisable(GL_SCISSOR_TEST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+}
+
+int
+Atlas::slotIndex(u32 id, bool bRendered) const
+{
+    for (u32 i = 0; i < ATLAS_MAX_LIGHTS; i++)
+    {
+        const AtlasLight& sl = _aSlots[i];
+        if (sl.bUsed && sl.id == id && (!bRendered || sl.lastUpdate > 0))
+            return i;
+    }
+
+    return -1;
+}
+
+void
+Atlas::bind(GLenum unit) const
+{
+    glActiveTexture(unit);
+    glBindTexture(GL_TEXTURE_2D, _map.tex);
+}
+
+void
+Atlas::setUniforms(Shader* sh) const
+{
+    v4 aLights[ATLAS_MAX_LIGHTS] {};
+    v4 aRects[ATLAS_MAX_LIGHTS * 6] {};
+
+    for (u32 i = 0; i < ATLAS_MAX_LIGHTS; i++)
+    {
+        const AtlasLight& sl = _aSlots[i];
+        if (!sl.bUsed)
+            continue;
+
+        aLights[i] = {sl.pos.x, sl.pos.y, sl.pos.z, sl.farPlane};
+        for (u32 f = 0; f < 6; f++)
+        {
+            const AtlasTile& t = sl.aFaces[f];
+            aRects[i*6 + f] = {f32(t.x) / ATLAS_SIZE, f32(t.y) / ATLAS_SIZE, f32(t.size) / ATLAS_SIZE, 0.0f};
+        }
+    }
+
+    sh->setV4Array("uAtlasLights", aLights, ATLAS_MAX_LIGHTS);
+    sh->setV4Array("uAtlasRects", aRects, ATLAS_MAX_LIGHTS * 6);
+}
+
+u32
+Atlas::nShadowed() const
+{
+    u32 n = 0;
+    for (const AtlasLight& sl : _aSlots)
+        n += sl.bUsed && sl.lastUpdate > 0;
+
+    return n;
+}
+
+u32
+Atlas::memoryUsage() const
+{
+    return ATLAS_SIZE * ATLAS_SIZE * 2; /* GL_DEPTH_COMPONENT16 */
+}
+
+void
+Atlas::destroy()
+{
+    glDeleteFramebuffers(1, &_map.fbo);
+    glDeleteTextures(1, &_map.tex);
+    for (auto& a : _aFree)
+        a.destroy();
+}
+
+u32
+filterTaps(enum FILTER e)
+{
+    const u32 taps[] {1, 4, 8, 16};
+    return taps[int(e)];
+}
+
+adt::String
+pathToString(enum PATH e)
+{
+    const char* ss[] {
+        "geometry shader", "per face"
+    };
+
+    return ss[int(e)];
+}
+
+adt::String
+filterToString(enum FILTER e)
+{
+    const char* ss[] {
+        "hardware 2x2", "poisson 4", "poisson 8", "poisson 16"
+    };
+
+    return ss[int(e)];
+}
+
+adt::String
+depthFormatToString(enum DEPTH_FORMAT e)
+{
+    const char* ss[] {
+        "32f", "16"
+    };
+
+    return ss[int(e)];
+}
+
+adt::String
+updateToString(enum UPDATE e)
+{
+    const char* ss[] {
+        "cached", "dynamic", "full"
+    };
+
+    return ss[int(e)];
+}
+
+} /* namespace shadows */
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "Array.hh"
+#include "Shader.hh"
+#include "Texture.hh"
+
+namespace shadows
+{
+
+enum class PATH : int
+{
+    GEOMETRY_SHADER, /* one pass, geometry shader amplifies each triangle to all 6 layers */
+    PER_FACE, /* 6 passes, casters are culled against each face frustum on the cpu */
+    ESIZE
+};
+
+/* lit pass filtering, every tap is a hardware compared samplerCubeShadow lookup (2x2 pcf with GL_LINEAR) */
+enum class FILTER : int
+{
+    HARDWARE, /* single lookup */
+    POISSON_4,
+    POISSON_8,
+    POISSON_16,
+    ESIZE
+};
+
+enum class DEPTH_FORMAT : int
+{
+    F32,
+    U16, /* half the memory and copy bandwidth, plenty for distance / farPlane at this range */
+    ESIZE
+};
+
+enum class CASTERS : int
+{
+    STATIC = 1,
+    DYNAMIC = 1 << 1,
+    ALL = STATIC | DYNAMIC
+};
+
+inline bool
+operator&(enum CASTERS l, enum CASTERS r)
+{
+    return int(l) & int(r);
+}
+
+/* what the last `render()` call had to redraw */
+enum class UPDATE : int
+{
+    NONE, /* cached map was reused */
+    DYNAMIC, /* static map copied, dynamic casters drawn on top */
+    FULL /* static casters redrawn */
+};
+
+/* draw `eCasters` with `sh`, cull against `pFrustum` unless it's nullptr */
+using PfnRenderCasters = void (*)(adt::Allocator* pAlloc, Shader* sh, const Frustum* pFrustum, enum CASTERS eCasters);
+
+struct DepthCube
+{
+    CubeMap cubeMap; /* cubeMap.fbo is layered */
+    GLuint aFaceFbos[6];
+};
+
+struct OmniDir
+{
+    DepthCube _static {}; /* static casters only, reused until the light moves or statics change */
+    DepthCube _final {}; /* copy of _static with dynamic casters on top, sampled by the lit pass */
+    Shader _shGeom;
+    Shader _shFace;
+    enum PATH _ePath = PATH::GEOMETRY_SHADER;
+    enum FILTER _eFilter = FILTER::POISSON_8;
+    enum DEPTH_FORMAT _eDepthFormat = DEPTH_FORMAT::U16;
+
+    /* alternate paths each frame and keep the faster one */
+    struct {
+        f64 aTimes[int(PATH::ESIZE)];
+        u32 nFrames;
+        bool bRunning;
+    } _bench {};
+
+    struct {
+        v3 lightPos; /* position both maps were rendered from */
+        u32 nStaleFrames; /* frames reprojected since light moved */
+        bool bStaticDirty;
+        bool bDynamicDirty;
+        enum UPDATE eLastUpdate;
+    } _cache {};
+
+    void init(int width, int height);
+    void render(adt::Allocator* pAlloc, const v3& lightPos, f32 nearPlane, f32 farPlane, PfnRenderCasters pfnRender);
+    void invalidateStatic() { _cache.bStaticDirty = true; }
+    void invalidateDynamic() { _cache.bDynamicDirty = true; }
+    const v3& shadowLightPos() const { return _cache.lightPos; }
+    GLuint tex() const { return _final.cubeMap.tex; }
+    void startBenchmark();
+    void togglePath();
+    void cycleFilter();
+    void toggleDepthFormat(); /* recreates both maps */
+    u32 memoryUsage() const; /* bytes of both maps */
+
+private:
+    void renderCasters(adt::Allocator* pAlloc, DepthCube* pTarget, enum PATH ePath, bool bClear, enum CASTERS eCasters, f32 nearPlane, f32 farPlane, PfnRenderCasters pfnRender);
+};
+
+/* one depth texture shared by the shadowed point lights, the lit shaders hardcode the size and light count */
+constexpr u32 ATLAS_SIZE = 4096;
+constexpr u32 ATLAS_MAX_LIGHTS = 16;
+constexpr u32 ATLAS_MAX_TILE = 512;
+constexpr u32 ATLAS_MIN_TILE = 128;
+constexpr u32 ATLAS_TILE_SIZES = 3; /* 512, 256, 128 */
+constexpr u32 ATLAS_FACE_BUDGET = 24; /* faces redrawn per frame, whole lights at a time */
+
+struct AtlasTile
+{
+    u16 x;
+    u16 y;
+    u16 size;
+};
+
+/* what the caller wants shadowed this frame, most important first */
+struct AtlasRequest
+{
+    u32 id; /* caller's light index */
+    v3 pos;
+    f32 radius; /* far plane of the faces */
+    u32 tileSize; /* power of two in [ATLAS_MIN_TILE, ATLAS_MAX_TILE] */
+};
+
+struct AtlasLight
+{
+    u32 id;
+    v3 pos; /* the faces were rendered from here */
+    v3 targetPos; /* latest requested position */
+    f32 farPlane;
+    u32 tileSize; /* requested, the tiles are smaller when the atlas ran out of this size */
+    AtlasTile aFaces[6];
+    u64 lastUpdate; /* frame of the last redraw, 0 if the tiles hold nothing yet */
+    bool bUsed;
+};
+
+/* Tiles are cut from the texture on demand: bigger free tiles are split into 4 when a size runs out.
+ * Freed tiles aren't merged back, instead everything is repacked once the allocator runs dry.
+ * Each frame the lights that waited longest are redrawn until ATLAS_FACE_BUDGET is spent, new ones first. */
+struct Atlas
+{
+    ShadowMap _map {};
+    Shader _shFace;
+    adt::Array<AtlasTile> _aFree[ATLAS_TILE_SIZES]; /* by size, largest first */
+    AtlasLight _aSlots[ATLAS_MAX_LIGHTS] {};
+    const AtlasLight* _pRendering {}; /* slot being drawn, for the caster callback */
+    u64 _frame = 0;
+    u32 _nFacesUpdated = 0; /* last update() */
+
+    Atlas() = default;
+    Atlas(adt::Allocator* p);
+
+    void init();
+    void update(adt::Allocator* pAlloc, const AtlasRequest* pReqs, u32 nReqs, PfnRenderCasters pfnRender); /* nReqs <= ATLAS_MAX_LIGHTS */
+    int slotIndex(u32 id, bool bRendered = true) const; /* -1 if id has no slot, or no rendered tiles with bRendered */
+    void bind(GLenum unit) const;
+    void setUniforms(Shader* sh) const;
+    u32 nShadowed() const;
+    u32 memoryUsage() const; /* bytes */
+    void destroy();
+
+private:
+    bool allocSlot(AtlasLight* pSlot, u32 tileSize);
+    void freeSlot(AtlasLight* pSlot);
+    void repack(const AtlasRequest* pReqs, u32 nReqs);
+    void renderSlot(adt::Allocator* pAlloc, AtlasLight* pSlot, PfnRenderCasters pfnRender);
+};
+
+u32 filterTaps(enum FILTER e); /* uShadowTaps of the lit shaders */
+adt::String pathToString(enum PATH e);
+adt::String filterToString(enum FILTER e);
+adt::String depthFormatToString(enum DEPTH_FORMAT e);
+adt::String updateToString(enum UPDATE e);
+
+} /* namespace shadows */
@@ -0,0 +1,313 @@
+#include "occlusion.hh"
+#include "DefaultAllocator.hh"
+#include "logs.hh"
+
+#include <math.h>
+#include <string.h>
+
+/* The depth buffer on its own, no gl. viewProj is the identity unless a test says otherwise, so occluder positions are
+ * clip space with w = 1 and x, y map straight to the screen: ndc -1..1 is pixels 0..WIDTH and 0..HEIGHT. */
+
+using namespace occlusion;
+
+static int s_nFailed = 0;
+
+#define CHECK(COND)                                                                                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(COND))                                                                                                   \
+        {                                                                                                              \
+            LOG_WARN("%s: CHECK(%s) failed\n", __func__, #COND);                                                      \
+            s_nFailed++;                                                                                               \
+        }                                                                                                              \
+    } while (0)
+
+/* indices into a local vertex array */
+struct TestOccluder
+{
+    v3 aPositions[8];
+    u32 aIndices[12];
+    Occluder o;
+};
+
+static Occluder
+makeTriangle(TestOccluder* p, v3 a, v3 b, v3 c)
+{
+    *p = {{a, b, c}, {0, 1, 2}, {}};
+    p->o = {p->aPositions, p->aIndices, 3, 3};
+    return p->o;
+}
+
+static Occluder
+makeQuad(TestOccluder* p, v3 a, v3 b, v3 c, v3 d)
+{
+    *p = {{a, b, c, d}, {0, 1, 2, 0, 2, 3}, {}};
+    p->o = {p->aPositions, p->aIndices, 4, 6};
+    return p->o;
+}
+
+static void
+rasterizeAll(DepthBuffer* pDepth)
+{
+    for (int band = 0; band < N_BANDS; band++)
+        pDepth->rasterize(band);
+}
+
+static f32
+depthAt(const DepthBuffer& depth, int x, int y)
+{
+    return depth._pDepth[y * WIDTH + x];
+}
+
+/* pixel centers in ndc */
+static f32 ndcX(int x) { return (f32(x) + 0.5f) / WIDTH * 2.0f - 1.0f; }
+static f32 ndcY(int y) { return (f32(y) + 0.5f) / HEIGHT * 2.0f - 1.0f; }
+
+static void
+testEmpty(DepthBuffer* pDepth)
+{
+    pDepth->begin(m4Iden());
+    rasterizeAll(pDepth);
+
+    bool bAllEmpty = true;
+    for (int i = 0; i < WIDTH * HEIGHT; i++)
+        bAllEmpty &= pDepth->_pDepth[i] == 1.0f;
+    CHECK(bAllEmpty);
+
+    bool bTilesEmpty = true;
+    for (int ty = 0; ty < TILES_Y; ty++)
+        for (int tx = 0; tx < TILES_X; tx++)
+            bTilesEmpty &= pDepth->_aTileMax[ty][tx] == 1.0f;
+    CHECK(bTilesEmpty);
+}
+
+/* the lower left half of the screen, every pixel center clearly inside is written at the triangle's depth,
+ * every one clearly outside is left alone, whichever way it's wound */
+static void
+testTriangleCoverage(DepthBuffer* pDepth)
+{
+    for (int winding = 0; winding < 2; winding++)
+    {
+        TestOccluder t;
+        Occluder o = winding == 0 ?
+            makeTriangle(&t, {-1.0f, -1.0f, 0.25f}, {1.0f, -1.0f, 0.25f}, {-1.0f, 1.0f, 0.25f}) :
+            makeTriangle(&t, {-1.0f, -1.0f, 0.25f}, {-1.0f, 1.0f, 0.25f}, {1.0f, -1.0f, 0.25f});
+
+        pDepth->begin(m4Iden());
+        pDepth->addOccluder(m4Iden(), o);
+        CHECK(pDepth->_aTriangles._size == 1);
+        rasterizeAll(pDepth);
+
+        int nWrongInside = 0, nWrongOutside = 0;
+        for (int y = 0; y < HEIGHT; y++)
+        {
+            for (int x = 0; x < WIDTH; x++)
+            {
+                f32 d = ndcX(x) + ndcY(y); /* the hypotenuse is x + y = 0 */
+                f32 z = depthAt(*pDepth, x, y);
+                if (d < -0.02f && fabsf(z - 0.25f) > 1e-5f)
+                    nWrongInside++;
+                else if (d > 0.02f && z != 1.0f)
+                    nWrongOutside++;
+            }
+        }
+
+        CHECK(nWrongInside == 0);
+        CHECK(nWrongOutside == 0);
+    }
+}
+
+/* depth is interpolated across the triangle and the nearer of two overlapping occluders wins */
+static void
+testDepthInterpolation(DepthBuffer* pDepth)
+{
+    TestOccluder ramp, flat;
+
+    pDepth->begin(m4Iden());
+    /* z goes from -0.5 on the left edge to 0.5 on the right one */
+    pDepth->addOccluder(m4Iden(), makeQuad(&ramp, {-1.0f, -1.0f, -0.5f}, {1.0f, -1.0f, 0.5f}, {1.0f, 1.0f, 0.5f}, {-1.0f, 1.0f, -0.5f}));
+    pDepth->addOccluder(m4Iden(), makeQuad(&flat, {-1.0f, -1.0f, 0.0f}, {1.0f, -1.0f, 0.0f}, {1.0f, 1.0f, 0.0f}, {-1.0f, 1.0f, 0.0f}));
+    rasterizeAll(pDepth);
+
+    int nWrong = 0;
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        for (int x = 0; x < WIDTH; x++)
+        {
+            f32 expected = fminf(ndcX(x) * 0.5f, 0.0f);
+            if (fabsf(depthAt(*pDepth, x, y) - expected) > 1e-4f)
+                nWrong++;
+        }
+    }
+
+    CHECK(nWrong == 0);
+}
+
+/* the left half of the quad is behind the near plane (z < -w), only the right half may be drawn */
+static void
+testNearClip(DepthBuffer* pDepth)
+{
+    TestOccluder t;
+
+    /* z = 2x - 1, so it crosses z = -1 at x = 0 */
+    pDepth->begin(m4Iden());
+    pDepth->addOccluder(m4Iden(), makeQuad(&t, {-1.0f, -1.0f, -3.0f}, {1.0f, -1.0f, 1.0f}, {1.0f, 1.0f, 1.0f}, {-1.0f, 1.0f, -3.0f}));
+    rasterizeAll(pDepth);
+
+    int nWrongClipped = 0, nWrongKept = 0;
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        for (int x = 0; x < WIDTH; x++)
+        {
+            f32 ndc = ndcX(x);
+            f32 z = depthAt(*pDepth, x, y);
+            if (ndc < -0.01f && z != 1.0f)
+                nWrongClipped++;
+            else if (ndc > 0.01f && fabsf(z - (2.0f * ndc - 1.0f)) > 1e-4f)
+                nWrongKept++;
+        }
+    }
+
+    CHECK(nWrongClipped == 0);
+    CHECK(nWrongKept == 0);
+
+    /* all three behind, nothing is queued */
+    pDepth->begin(m4Iden());
+    pDepth->addOccluder(m4Iden(), makeTriangle(&t, {-1.0f, -1.0f, -2.0f}, {1.0f, -1.0f, -2.0f}, {0.0f, 1.0f, -2.0f}));
+    CHECK(pDepth->_aTriangles._size == 0);
+
+    /* one behind, the rest of the triangle becomes a quad */
+    pDepth->begin(m4Iden());
+    pDepth->addOccluder(m4Iden(), makeTriangle(&t, {-1.0f, -1.0f, -3.0f}, {1.0f, -1.0f, 0.0f}, {1.0f, 1.0f, 0.0f}));
+    CHECK(pDepth->_aTriangles._size == 2);
+}
+
+/* every tile holds the farthest depth of its pixels, empty pixels count as 1.0 */
+static void
+testTileMax(DepthBuffer* pDepth)
+{
+    TestOccluder a, b, c;
+
+    pDepth->begin(m4Iden());
+    pDepth->addOccluder(m4Iden(), makeQuad(&a, {-1.0f, -1.0f, 0.2f}, {0.0f, -1.0f, 0.2f}, {0.0f, 1.0f, 0.2f}, {-1.0f, 1.0f, 0.2f}));
+    pDepth->addOccluder(m4Iden(), makeQuad(&b, {0.0f, -1.0f, 0.6f}, {1.0f, -1.0f, 0.6f}, {1.0f, 0.5f, 0.6f}, {0.0f, 0.5f, 0.6f}));
+    pDepth->addOccluder(m4Iden(), makeTriangle(&c, {-0.7f, -0.9f, -0.3f}, {0.3f, 0.8f, 0.1f}, {0.9f, -0.4f, 0.4f}));
+    rasterizeAll(pDepth);
+
+    int nWrong = 0;
+    for (int ty = 0; ty < TILES_Y; ty++)
+    {
+        for (int tx = 0; tx < TILES_X; tx++)
+        {
+            f32 max = 0.0f;
+            for (int y = ty * TILE_SIZE; y < (ty + 1) * TILE_SIZE; y++)
+                for (int x = tx * TILE_SIZE; x < (tx + 1) * TILE_SIZE; x++)
+                    max = fmaxf(max, depthAt(*pDepth, x, y));
+
+            nWrong += pDepth->_aTileMax[ty][tx] != max;
+        }
+    }
+
+    CHECK(nWrong == 0);
+
+    /* covered tiles on the left and bottom right, the uncovered strip at the top right stays empty */
+    CHECK(fabsf(pDepth->_aTileMax[TILES_Y / 2][0] - 0.2f) < 1e-5f);
+    CHECK(fabsf(pDepth->_aTileMax[0][TILES_X - 1] - 0.6f) < 1e-5f);
+    CHECK(pDepth->_aTileMax[TILES_Y - 1][TILES_X - 1] == 1.0f);
+}
+
+/* a wall at z = 0 over the right half of the screen */
+static void
+testAabb(DepthBuffer* pDepth)
+{
+    TestOccluder t;
+
+    pDepth->begin(m4Iden());
+    pDepth->addOccluder(m4Iden(), makeQuad(&t, {0.0f, -1.0f, 0.0f}, {1.0f, -1.0f, 0.0f}, {1.0f, 1.0f, 0.0f}, {0.0f, 1.0f, 0.0f}));
+    rasterizeAll(pDepth);
+
+    /* behind the wall */
+    CHECK(pDepth->isOccluded({0.2f, -0.5f, 0.3f}, {0.8f, 0.5f, 0.9f}));
+    /* in front of it */
+    CHECK(!pDepth->isOccluded({0.2f, -0.5f, -0.6f}, {0.8f, 0.5f, -0.2f}));
+    /* straddles it */
+    CHECK(!pDepth->isOccluded({0.2f, -0.5f, -0.1f}, {0.8f, 0.5f, 0.4f}));
+    /* behind, but sticks out past its left edge */
+    CHECK(!pDepth->isOccluded({-0.2f, -0.5f, 0.3f}, {0.8f, 0.5f, 0.9f}));
+    /* behind the empty left half */
+    CHECK(!pDepth->isOccluded({-0.8f, -0.5f, 0.3f}, {-0.2f, 0.5f, 0.9f}));
+    /* crosses the near plane */
+    CHECK(!pDepth->isOccluded({0.2f, -0.5f, -2.0f}, {0.8f, 0.5f, 0.9f}));
+    /* off screen */
+    CHECK(!pDepth->isOccluded({2.0f, 2.0f, 0.3f}, {3.0f, 3.0f, 0.9f}));
+}
+
+/* the same through a perspective camera: a 10x10 wall 5 units ahead hides a box behind it, not one beside it */
+static void
+testAabbPerspective(DepthBuffer* pDepth)
+{
+    TestOccluder t;
+    m4 viewProj = m4Pers(toRad(90.0f), f32(WIDTH) / f32(HEIGHT), 0.1f, 100.0f) * m4LookAt({0, 0, 0}, {0, 0, -1}, {0, 1, 0});
+
+    pDepth->begin(viewProj);
+    pDepth->addOccluder(m4Iden(), makeQuad(&t, {-5.0f, -5.0f, -5.0f}, {5.0f, -5.0f, -5.0f}, {5.0f, 5.0f, -5.0f}, {-5.0f, 5.0f, -5.0f}));
+    rasterizeAll(pDepth);
+
+    CHECK(pDepth->isOccluded({-1.0f, -1.0f, -12.0f}, {1.0f, 1.0f, -10.0f}));
+    CHECK(!pDepth->isOccluded({-1.0f, -1.0f, -4.0f}, {1.0f, 1.0f, -2.0f}));
+    CHECK(!pDepth->isOccluded({20.0f, -1.0f, -12.0f}, {22.0f, 1.0f, -10.0f}));
+    /* the camera is inside it */
+    CHECK(!pDepth->isOccluded({-1.0f, -1.0f, -12.0f}, {1.0f, 1.0f, 1.0f}));
+}
+
+/* bands on the pool give the same buffer as one after another */
+static void
+testSubmit(DepthBuffer* pDepth)
+{
+    TestOccluder t;
+    adt::ThreadPool tp(&adt::StdAllocator, 4);
+    tp.start();
+
+    pDepth->begin(m4Iden());
+    pDepth->addOccluder(m4Iden(), makeTriangle(&t, {-0.9f, -0.8f, 0.1f}, {0.7f, 0.9f, 0.5f}, {0.8f, -0.6f, -0.2f}));
+    rasterizeAll(pDepth);
+
+    f32* pSerial = (f32*)adt::StdAllocator.alloc(WIDTH * HEIGHT, sizeof(f32));
+    memcpy(pSerial, pDepth->_pDepth, sizeof(f32) * WIDTH * HEIGHT);
+
+    adt::TaskGroup group;
+    pDepth->submit(&tp, &group);
+    tp.wait(&group);
+
+    CHECK(memcmp(pSerial, pDepth->_pDepth, sizeof(f32) * WIDTH * HEIGHT) == 0);
+
+    adt::StdAllocator.free(pSerial);
+    tp.wait();
+    tp.destroy();
+}
+
+int
+main()
+{
+    DepthBuffer depth(&adt::StdAllocator);
+
+    testEmpty(&depth);
+    testTriangleCoverage(&depth);
+    testDepthInterpolation(&depth);
+    testNearClip(&depth);
+    testTileMax(&depth);
+    testAabb(&depth);
+    testAabbPerspective(&depth);
+    testSubmit(&depth);
+
+    depth.destroy();
+
+    if (s_nFailed > 0)
+    {
+        LOG_WARN("occlusion: %d checks failed\n", s_nFailed);
+        return 1;
+    }
+
+    LOG_OK("occlusion: all checks passed\n");
+    return 0;
+}
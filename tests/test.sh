@@ -0,0 +1,14 @@
+#!/bin/bash
+# cpu only tests, built straight with the compiler so they don't need gl or the platform libraries
+set -e
+
+cd $(dirname $0)/..
+
+CXX=${CXX:-c++}
+FLAGS="-std=c++20 -O1 -g -Wall -Wextra -fms-extensions -Isrc/adt -Isrc -fsanitize=undefined -fsanitize=address"
+OUT=build/tests
+
+mkdir -p $OUT
+
+$CXX $FLAGS tests/occlusion.cc src/occlusion.cc src/math.cc -lpthread -o $OUT/occlusion
+./$OUT/occlusion